@@ -54,7 +54,11 @@ public:
 private:
     struct SpiHandler;
     
-    static const int SpiMaxCommands = max(6, 5 * MaxCommands);
+    // Restarting a multi-block read takes 6 commands, and each block 3.
+    // Reads of unrelated blocks may be interleaved, so any read may restart.
+    // A write is alone in the queue and takes at most 15 commands at once.
+    static_assert(MaxCommands >= 2, "");
+    static const int SpiMaxCommands = 9 * MaxCommands;
     static const int SpiCommandBits = BitsInInt<SpiMaxCommands>::value;
     using TheSpi = typename Params::template Spi<Context, Object, SpiHandler, SpiCommandBits>;
     using SpiCommandSizeType = typename TheSpi::CommandSizeType;
@@ -117,6 +121,13 @@ public:
         return o->m_capacity_blocks;
     }
     
+    /**
+     * Queues reading of a block. Blocks are read with READ_MULTIPLE_BLOCK,
+     * and the card is left sending data after each block, so reading the
+     * following block is only a matter of receiving it. A block other than
+     * the next one first stops the transmission and starts a new one.
+     * When a read fails, any reads queued after it must be discarded.
+     */
     static void queueReadBlock (Context c, uint32_t block, uint8_t *data, ReadState *state)
     {
         auto *o = Object::self(c);
@@ -124,8 +135,17 @@ public:
         AMBRO_ASSERT(o->m_state == STATE_RUNNING)
         AMBRO_ASSERT(block < o->m_capacity_blocks)
         
-        uint32_t addr = o->m_sdhc ? block : (block * 512);
-        sd_command(c, CMD_READ_SINGLE_BLOCK, addr, true, state->buf, state->buf);
+        if (!o->m_streaming || block != o->m_stream_block) {
+            if (o->m_streaming) {
+                sd_stop_transmission(c);
+            }
+            uint32_t addr = o->m_sdhc ? block : (block * 512);
+            sd_command(c, CMD_READ_MULTIPLE_BLOCK, addr, true, state->buf, state->buf);
+            o->m_streaming = true;
+        } else {
+            state->buf[0] = 0;
+        }
+        o->m_stream_block = block + 1;
         TheSpi::cmdReadUntilDifferent(c, 0xff, 255, 0xff, state->buf + 1);
         TheSpi::cmdReadBuffer(c, data, 512, 0xff);
         TheSpi::cmdWriteByte(c, 0xff, 2 - 1);
@@ -142,6 +162,63 @@ public:
             return false;
         }
         *out_error = (state->buf[0] != 0 || state->buf[1] != 0xfe);
+        if (*out_error) {
+            // Force the next read to restart the transmission.
+            o->m_stream_block = o->m_capacity_blocks;
+        }
+        return true;
+    }
+    
+    /**
+     * Starts writing count consecutive blocks. A single block is written
+     * with WRITE_BLOCK; more are pre-erased with SET_WR_BLK_ERASE_COUNT and
+     * written with WRITE_MULTIPLE_BLOCK. The card is busy for a while after
+     * each block, so the write proceeds from the command handler. No reads
+     * may be in flight, and nothing else may be queued until checkWrite()
+     * reports completion.
+     */
+    static void queueWrite (Context c, uint32_t block, uint8_t const *data, uint32_t count)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(o->m_state == STATE_RUNNING)
+        AMBRO_ASSERT(o->m_write_phase == WRITE_IDLE)
+        AMBRO_ASSERT(TheSpi::endReached(c))
+        AMBRO_ASSERT(count > 0)
+        AMBRO_ASSERT(block < o->m_capacity_blocks)
+        AMBRO_ASSERT(count <= o->m_capacity_blocks - block)
+        
+        if (o->m_streaming) {
+            sd_stop_transmission(c);
+            o->m_streaming = false;
+        }
+        uint32_t addr = o->m_sdhc ? block : (block * 512);
+        if (count > 1) {
+            sd_command(c, CMD_APP_CMD, 0, true, o->m_write_app_buf, o->m_write_app_buf);
+            sd_command(c, ACMD_SET_WR_BLK_ERASE_COUNT, count, true, o->m_write_erase_buf, o->m_write_erase_buf);
+            sd_command(c, CMD_WRITE_MULTIPLE_BLOCK, addr, true, o->m_write_buf, o->m_write_buf);
+        } else {
+            sd_command(c, CMD_WRITE_BLOCK, addr, true, o->m_write_buf, o->m_write_buf);
+        }
+        o->m_write_phase = WRITE_COMMAND;
+        o->m_write_data = data;
+        o->m_write_count = count;
+        o->m_write_multiple = (count > 1);
+        o->m_write_error = false;
+    }
+    
+    static bool checkWrite (Context c, bool *out_error)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(o->m_state == STATE_RUNNING)
+        AMBRO_ASSERT(o->m_write_phase != WRITE_IDLE)
+        
+        if (o->m_write_phase != WRITE_DONE) {
+            return false;
+        }
+        o->m_write_phase = WRITE_IDLE;
+        *out_error = o->m_write_error;
         return true;
     }
     
@@ -161,6 +238,8 @@ public:
 private:
     using SsPin = typename Params::SsPin;
     
+    enum {WRITE_IDLE, WRITE_DONE, WRITE_COMMAND, WRITE_DATA, WRITE_STOP};
+    
     enum {
         STATE_INACTIVE,
         STATE_INIT1,
@@ -178,10 +257,22 @@ private:
     static const uint8_t CMD_SEND_IF_COND = 8;
     static const uint8_t CMD_SEND_CSD = 9;
     static const uint8_t CMD_SET_BLOCKLEN = 16;
-    static const uint8_t CMD_READ_SINGLE_BLOCK = 17;
+    static const uint8_t CMD_STOP_TRANSMISSION = 12;
+    static const uint8_t CMD_READ_MULTIPLE_BLOCK = 18;
+    static const uint8_t CMD_WRITE_BLOCK = 24;
+    static const uint8_t CMD_WRITE_MULTIPLE_BLOCK = 25;
     static const uint8_t CMD_APP_CMD = 55;
     static const uint8_t CMD_READ_OCR = 58;
+    static const uint8_t ACMD_SET_WR_BLK_ERASE_COUNT = 23;
     static const uint8_t ACMD_SD_SEND_OP_COND = 41;
+    static const uint8_t TOKEN_START_BLOCK = 0xfe;
+    static const uint8_t TOKEN_START_MULTIPLE = 0xfc;
+    static const uint8_t TOKEN_STOP_TRAN = 0xfd;
+    static const uint8_t DATA_RESPONSE_MASK = 0x1f;
+    static const uint8_t DATA_RESPONSE_ACCEPTED = 0x05;
+    // A card that stays busy is given up on after at least half a second,
+    // at any SPI clock up to 80MHz.
+    static const uint16_t MaxBusyPolls = 20000;
     static const uint8_t R1_IN_IDLE_STATE = (1 << 0);
     static const uint32_t OCR_CCS = (UINT32_C(1) << 30);
     static const uint32_t OCR_CPUS = (UINT32_C(1) << 31);
@@ -201,10 +292,8 @@ private:
         return (crc & 0x7f);
     }
     
-    static void sd_command (Context c, uint8_t cmd, uint32_t param, bool checksum, uint8_t *request_buf, uint8_t *response_buf)
+    static void sd_send_command (Context c, uint8_t cmd, uint32_t param, bool checksum, uint8_t *request_buf)
     {
-        auto *o = Object::self(c);
-        
         request_buf[0] = cmd | 0x40;
         request_buf[1] = param >> 24;
         request_buf[2] = param >> 16;
@@ -215,9 +304,23 @@ private:
             request_buf[5] |= crc7(request_buf, 5, 0) << 1;
         }
         TheSpi::cmdWriteBuffer(c, 0xff, request_buf, 6);
+    }
+    
+    static void sd_command (Context c, uint8_t cmd, uint32_t param, bool checksum, uint8_t *request_buf, uint8_t *response_buf)
+    {
+        sd_send_command(c, cmd, param, checksum, request_buf);
         TheSpi::cmdReadUntilDifferent(c, 0xff, 255, 0xff, response_buf);
     }
     
+    static void sd_stop_transmission (Context c)
+    {
+        auto *o = Object::self(c);
+        sd_send_command(c, CMD_STOP_TRANSMISSION, 0, true, o->m_stop_buf);
+        TheSpi::cmdWriteByte(c, 0xff, 1 - 1);
+        TheSpi::cmdReadUntilDifferent(c, 0xff, 255, 0xff, &o->m_stop_response);
+        TheSpi::cmdReadUntilDifferent(c, 0x00, 255, 0xff, &o->m_stop_response);
+    }
+    
     static void sd_send_csd (Context c)
     {
         auto *o = Object::self(c);
@@ -228,6 +331,86 @@ private:
         TheSpi::cmdWriteByte(c, 0xff, 7 - 1);
     }
     
+    static void sd_write_data (Context c)
+    {
+        auto *o = Object::self(c);
+        uint8_t token = o->m_write_multiple ? TOKEN_START_MULTIPLE : TOKEN_START_BLOCK;
+        TheSpi::cmdWriteByte(c, 0xff, 1 - 1);
+        TheSpi::cmdWriteBuffer(c, token, o->m_write_data, 512);
+        TheSpi::cmdWriteByte(c, 0xff, 2 - 1);
+        TheSpi::cmdReadBuffer(c, &o->m_write_response, 1, 0xff);
+        sd_poll_busy(c, true);
+    }
+    
+    static void sd_poll_busy (Context c, bool first)
+    {
+        auto *o = Object::self(c);
+        if (first) {
+            o->m_busy_polls = 0;
+        }
+        o->m_busy_polls++;
+        TheSpi::cmdReadUntilDifferent(c, 0x00, 255, 0xff, &o->m_busy);
+    }
+    
+    static void sd_stop_write (Context c)
+    {
+        TheSpi::cmdWriteByte(c, TOKEN_STOP_TRAN, 1 - 1);
+        TheSpi::cmdWriteByte(c, 0xff, 1 - 1);
+        sd_poll_busy(c, true);
+    }
+    
+    static void write_continue (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        switch (o->m_write_phase) {
+            case WRITE_COMMAND: {
+                // The pre-erase is only a hint, so its failure does not matter.
+                if (o->m_write_buf[0] != 0) {
+                    o->m_write_error = true;
+                    o->m_write_phase = WRITE_DONE;
+                    return;
+                }
+                sd_write_data(c);
+                o->m_write_phase = WRITE_DATA;
+            } break;
+            
+            case WRITE_DATA: {
+                if ((o->m_write_response & DATA_RESPONSE_MASK) != DATA_RESPONSE_ACCEPTED) {
+                    o->m_write_error = true;
+                } else if (o->m_busy == 0x00 && o->m_busy_polls < MaxBusyPolls) {
+                    return sd_poll_busy(c, false);
+                } else if (o->m_busy == 0x00) {
+                    o->m_write_error = true;
+                } else {
+                    o->m_write_data += 512;
+                    o->m_write_count--;
+                    if (o->m_write_count > 0) {
+                        return sd_write_data(c);
+                    }
+                }
+                if (!o->m_write_multiple) {
+                    o->m_write_phase = WRITE_DONE;
+                    return;
+                }
+                sd_stop_write(c);
+                o->m_write_phase = WRITE_STOP;
+            } break;
+            
+            case WRITE_STOP: {
+                if (o->m_busy == 0x00) {
+                    if (o->m_busy_polls < MaxBusyPolls) {
+                        return sd_poll_busy(c, false);
+                    }
+                    o->m_write_error = true;
+                }
+                o->m_write_phase = WRITE_DONE;
+            } break;
+            
+            default: AMBRO_ASSERT(0);
+        }
+    }
+    
     static void spi_handler (Context c)
     {
         auto *o = Object::self(c);
@@ -235,6 +418,9 @@ private:
         AMBRO_ASSERT(o->m_state != STATE_INACTIVE)
         
         if (AMBRO_LIKELY(o->m_state == STATE_RUNNING)) {
+            if (o->m_write_phase >= WRITE_COMMAND && TheSpi::endReached(c)) {
+                write_continue(c);
+            }
             return CommandHandler::call(c);
         }
         if (!TheSpi::endReached(c)) {
@@ -243,6 +429,9 @@ private:
         switch (o->m_state) {
             case STATE_INIT1: {
                 Context::Pins::template set<SsPin>(c, false);
+                // The card may have been deactivated in the middle of a multi-block
+                // read, when it does not listen to anything else.
+                sd_stop_transmission(c);
                 sd_command(c, CMD_GO_IDLE_STATE, 0, true, o->m_buf1, o->m_buf1);
                 o->m_state = STATE_INIT2;
                 o->m_count = 255;
@@ -326,6 +515,8 @@ private:
                     o->m_capacity_blocks = blocknr * (block_len / 512);
                 }
                 o->m_state = STATE_RUNNING;
+                o->m_streaming = false;
+                o->m_write_phase = WRITE_IDLE;
                 return InitHandler::call(c, 0);
             } break;
         }
@@ -366,6 +557,21 @@ public:
             };
             uint32_t m_capacity_blocks;
         };
+        bool m_streaming;
+        uint32_t m_stream_block;
+        uint8_t m_stop_buf[6];
+        uint8_t m_stop_response;
+        uint8_t m_write_phase;
+        bool m_write_multiple;
+        bool m_write_error;
+        uint8_t m_write_response;
+        uint8_t m_busy;
+        uint16_t m_busy_polls;
+        uint32_t m_write_count;
+        uint8_t const *m_write_data;
+        uint8_t m_write_buf[6];
+        uint8_t m_write_app_buf[6];
+        uint8_t m_write_erase_buf[6];
     };
 };
 
@@ -0,0 +1,948 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_FAT_FS_H
+#define AMBROLIB_FAT_FS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <aprinter/meta/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/**
+ * FAT32 file system on top of a block device with the read and write
+ * interface of SpiSdCard. The file system is taken from the first FAT32 partition in the
+ * MBR, or from block 0 if the card has no partition table. Only files in
+ * the root directory can be found, by their 8.3 names. Besides reading
+ * files, new files can be created, written sequentially and closed, one
+ * file at a time; existing files cannot be modified or deleted.
+ * 
+ * Metadata (the MBR, the boot sector, directory and FAT blocks) is read
+ * into an internal buffer, one block at a time. The buffer also caches
+ * the last FAT block, so following the cluster chain of a file only needs
+ * a read every 128 clusters.
+ * 
+ * File data is not read here. getNextBlock() maps the file to blocks of
+ * the device, which the user reads itself. The mapping comes from a small
+ * table of extents (runs of consecutive clusters), which is filled by
+ * following the cluster chain ahead of the read head. The chain is followed
+ * as far as the table allows when the file is opened, so a file with no
+ * more fragments than NumExtents is read without any FAT lookups. Otherwise
+ * the lookups resume as soon as the read head leaves an extent.
+ * 
+ * startCreateFile() creates an empty file in the root directory, failing
+ * with WRITE_EXISTS if the name is taken. The directory is not extended,
+ * the file takes the first free entry in it, or fails with WRITE_DIR_FULL.
+ * The free cluster count in the FSInfo block is marked as unknown when a
+ * file is created, rather than kept up to date. getWriteBlocks() then
+ * gives the blocks to write the file to, in order, allocating clusters as
+ * needed, one at a time (WRITE_DISK_FULL when none is left); all copies
+ * of the FAT are written right away. startCloseFile() records the size
+ * (under 4 GiB) and the first cluster in the directory entry; until then,
+ * the file looks empty. The user writes the data itself, like it reads
+ * it. Writes must not overlap with any read, so metadata operations are
+ * only started from startCreateFile(), getWriteBlocks() and
+ * startCloseFile(), and the user must not start one while any of its own
+ * reads or writes is in flight.
+ * 
+ * The user must check for completion of the metadata read from the command
+ * handler of the block device, using checkRead() and finishRead(). Since
+ * the reads queued after a failed one are worthless, the user must also
+ * call discardRead() when any of its own reads fails.
+ */
+template <
+    int TNumExtents
+>
+struct FatFsParams {
+    static int const NumExtents = TNumExtents;
+};
+
+template <typename Context, typename ParentObject, typename TheBlockDevice, typename Params, typename Handler>
+class FatFs {
+public:
+    struct Object;
+    
+    static size_t const BlockSize = 512;
+    static int const MaxNameLength = 12;
+    static int const NumExtents = Params::NumExtents;
+    static_assert(NumExtents >= 1, "");
+    static_assert(NumExtents <= 255, "");
+    
+    enum {EVENT_MOUNTED, EVENT_DIR_ENTRY, EVENT_DIR_END, EVENT_OPENED, EVENT_CREATED, EVENT_CLOSED};
+    enum {NEXT_BLOCK, NEXT_WAIT, NEXT_END, NEXT_ERROR};
+    enum {WRITE_OK, WRITE_EXISTS, WRITE_DIR_FULL, WRITE_DISK_FULL, WRITE_IO_ERROR};
+    
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_op = OP_NONE;
+        o->m_mounted = false;
+        o->m_opening = false;
+        o->m_writing = false;
+        o->debugInit(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugDeinit(c);
+    }
+    
+    /**
+     * Looks for the file system, reporting EVENT_MOUNTED when done.
+     * The block device must have just been activated, and any read
+     * from before that is forgotten.
+     */
+    static void startMount (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        o->m_mounted = false;
+        o->m_opening = false;
+        o->m_writing = false;
+        read_block(c, 0, OP_MOUNT_MBR);
+    }
+    
+    static bool isMounted (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return o->m_mounted;
+    }
+    
+    /**
+     * Goes through the root directory, reporting EVENT_DIR_ENTRY for each
+     * file and then EVENT_DIR_END. The entry can be examined from the
+     * handler with the getEntry functions.
+     */
+    static void startDirScan (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(o->m_mounted)
+        AMBRO_ASSERT(o->m_op == OP_NONE)
+        
+        o->m_dir_create = false;
+        start_dir(c);
+    }
+    
+    /**
+     * Writes the name of the entry, in the form NAME.EXT, to a buffer of
+     * at least MaxNameLength + 1 bytes.
+     */
+    static void getEntryName (Context c, char *out)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        uint8_t const *e = o->m_buffer + o->m_dir_entry * DirEntrySize;
+        int len = 0;
+        for (int i = 0; i < 8 && e[i] != ' '; i++) {
+            out[len++] = (i == 0 && e[i] == 0x05) ? 0xE5 : e[i];
+        }
+        if (e[8] != ' ') {
+            out[len++] = '.';
+            for (int i = 8; i < 11 && e[i] != ' '; i++) {
+                out[len++] = e[i];
+            }
+        }
+        out[len] = '\0';
+    }
+    
+    static uint32_t getEntrySize (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return read_le32(o->m_buffer + o->m_dir_entry * DirEntrySize + 28);
+    }
+    
+    static uint32_t getEntryCluster (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        uint8_t const *e = o->m_buffer + o->m_dir_entry * DirEntrySize;
+        return ((uint32_t)read_le16(e + 20) << 16) | read_le16(e + 26);
+    }
+    
+    /**
+     * Positions the read head at the start of a file, as found in the
+     * directory, and starts filling the extent table. If this leaves a
+     * read pending, EVENT_OPENED is reported once the table is full or
+     * the whole chain is known.
+     */
+    static void openFile (Context c, uint32_t first_cluster, uint32_t size)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(o->m_mounted)
+        AMBRO_ASSERT(o->m_op == OP_NONE)
+        
+        uint32_t blocks = size / BlockSize + (size % BlockSize != 0);
+        uint32_t clusters = blocks / o->m_blocks_per_cluster + (blocks % o->m_blocks_per_cluster != 0);
+        o->m_file_blocks_left = blocks;
+        o->m_extent_first = 0;
+        o->m_extent_count = 0;
+        o->m_extent_offset = 0;
+        o->m_walk_cluster = first_cluster;
+        o->m_walk_clusters_left = 0;
+        o->m_walk_error = false;
+        if (clusters > 0) {
+            if (!cluster_valid(c, first_cluster)) {
+                o->m_walk_error = true;
+            } else {
+                add_extent(c, first_cluster);
+                o->m_walk_clusters_left = clusters - 1;
+            }
+        }
+        walk_chain(c);
+        o->m_opening = (o->m_op != OP_NONE);
+    }
+    
+    /**
+     * Returns the device block holding the next block of the file and
+     * advances the read head. NEXT_WAIT means that the cluster chain is
+     * being looked up; try again after the next metadata read.
+     */
+    static uint8_t getNextBlock (Context c, uint32_t *out_block)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(o->m_mounted)
+        
+        if (o->m_file_blocks_left == 0) {
+            return NEXT_END;
+        }
+        if (o->m_extent_count == 0) {
+            return o->m_walk_error ? NEXT_ERROR : NEXT_WAIT;
+        }
+        Extent *e = &o->m_extents[o->m_extent_first];
+        *out_block = e->block + o->m_extent_offset;
+        o->m_extent_offset++;
+        o->m_file_blocks_left--;
+        if (o->m_extent_offset == e->length) {
+            o->m_extent_first = (o->m_extent_first + 1) % NumExtents;
+            o->m_extent_count--;
+            o->m_extent_offset = 0;
+            walk_chain(c);
+        }
+        return NEXT_BLOCK;
+    }
+    
+    /**
+     * Creates an empty file in the root directory, reporting EVENT_CREATED
+     * when done, with the result in getWriteStatus(). Returns false without
+     * doing anything if the name is not a valid 8.3 name.
+     */
+    static bool startCreateFile (Context c, char const *name)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(o->m_mounted)
+        AMBRO_ASSERT(o->m_op == OP_NONE)
+        AMBRO_ASSERT(!o->m_writing)
+        
+        if (!make_short_name(name, o->m_create_name)) {
+            return false;
+        }
+        o->m_writing = true;
+        o->m_write_status = WRITE_OK;
+        o->m_wfile_dir_block = 0;
+        o->m_wfile_first = 0;
+        o->m_wfile_cluster = 0;
+        o->m_wfile_cluster_block = 0;
+        o->m_dir_create = true;
+        start_dir(c);
+        return true;
+    }
+    
+    static uint8_t getWriteStatus (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return o->m_write_status;
+    }
+    
+    /**
+     * Returns the device block where the next block of the file being written
+     * goes, and the number of consecutive blocks from there, at most the
+     * number passed in. NEXT_WAIT means that a cluster is being allocated;
+     * try again after the next metadata operation.
+     */
+    static uint8_t getWriteBlocks (Context c, uint32_t *out_block, uint32_t *inout_count)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(o->m_writing)
+        AMBRO_ASSERT(*inout_count > 0)
+        
+        if (o->m_wfile_cluster == 0 || o->m_wfile_cluster_block == o->m_blocks_per_cluster) {
+            if (o->m_write_status == WRITE_OK && o->m_op == OP_NONE) {
+                o->m_alloc_left = o->m_max_cluster - 1;
+                alloc_cluster(c);
+            }
+            return (o->m_write_status != WRITE_OK) ? NEXT_ERROR : NEXT_WAIT;
+        }
+        uint32_t avail = o->m_blocks_per_cluster - o->m_wfile_cluster_block;
+        if (*inout_count > avail) {
+            *inout_count = avail;
+        }
+        *out_block = cluster_block(c, o->m_wfile_cluster) + o->m_wfile_cluster_block;
+        o->m_wfile_cluster_block += *inout_count;
+        return NEXT_BLOCK;
+    }
+    
+    /**
+     * Records the size and the first cluster of the file in its directory
+     * entry, reporting EVENT_CLOSED when done. getWriteStatus() then tells
+     * whether anything went wrong with the file.
+     */
+    static void startCloseFile (Context c, uint32_t size)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(o->m_writing)
+        AMBRO_ASSERT(o->m_op == OP_NONE)
+        AMBRO_ASSERT(o->m_wfile_dir_block != 0)
+        
+        o->m_wfile_size = size;
+        read_block(c, o->m_wfile_dir_block, OP_CLOSE_READ);
+    }
+    
+    static bool readPending (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return (o->m_op != OP_NONE);
+    }
+    
+    /**
+     * Checks whether the metadata read is complete. If so, finishRead()
+     * must be called before returning from the command handler.
+     */
+    static bool checkRead (Context c, bool *out_error)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        if (o->m_op == OP_NONE) {
+            return false;
+        }
+        if (is_write_op(o->m_op)) {
+            // A failed write is the business of the operation, not the user's.
+            bool error;
+            if (!TheBlockDevice::checkWrite(c, &error)) {
+                return false;
+            }
+            o->m_write_failed = error;
+            *out_error = false;
+            return true;
+        }
+        if (!TheBlockDevice::checkReadBlock(c, &o->m_read_state, out_error)) {
+            return false;
+        }
+        if (*out_error) {
+            o->m_discard = true;
+        }
+        return true;
+    }
+    
+    /**
+     * Tells that a read queued before the metadata read, if any, failed.
+     */
+    static void discardRead (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        if (o->m_op != OP_NONE && !is_write_op(o->m_op)) {
+            o->m_discard = true;
+        }
+    }
+    
+    static void finishRead (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(o->m_op != OP_NONE)
+        
+        uint8_t op = o->m_op;
+        if (o->m_discard) {
+            return read_block(c, o->m_read_block, op);
+        }
+        o->m_op = OP_NONE;
+        if (is_write_op(op)) {
+            if (o->m_write_failed) {
+                // The buffer no longer matches the card.
+                o->m_buffer_block = 0;
+                return write_failed(c, op);
+            }
+        } else {
+            o->m_buffer_block = o->m_read_block;
+        }
+        switch (op) {
+            case OP_MOUNT_MBR: {
+                if (try_mount(c, 0)) {
+                    return Handler::call(c, EVENT_MOUNTED);
+                }
+                if (read_le16(o->m_buffer + 510) == 0xAA55) {
+                    for (int i = 0; i < 4; i++) {
+                        uint8_t const *p = o->m_buffer + 446 + 16 * i;
+                        uint32_t start = read_le32(p + 8);
+                        if ((p[4] == 0x0B || p[4] == 0x0C) && start > 0 && start < TheBlockDevice::getCapacityBlocks(c)) {
+                            return read_block(c, start, OP_MOUNT_VBR);
+                        }
+                    }
+                }
+                return Handler::call(c, EVENT_MOUNTED);
+            } break;
+            
+            case OP_MOUNT_VBR: {
+                try_mount(c, o->m_read_block);
+                return Handler::call(c, EVENT_MOUNTED);
+            } break;
+            
+            case OP_DIR: {
+                for (; o->m_dir_entry < BlockSize / DirEntrySize; o->m_dir_entry++) {
+                    uint8_t const *e = o->m_buffer + o->m_dir_entry * DirEntrySize;
+                    if (o->m_dir_create) {
+                        if (e[0] == 0 || e[0] == 0xE5) {
+                            if (o->m_wfile_dir_block == 0) {
+                                o->m_wfile_dir_block = o->m_read_block;
+                                o->m_wfile_dir_entry = o->m_dir_entry;
+                            }
+                        } else if (!(e[11] & AttrVolumeId) && !memcmp(e, o->m_create_name, 11)) {
+                            o->m_write_status = WRITE_EXISTS;
+                            return finish_dir(c);
+                        }
+                    }
+                    if (e[0] == 0) {
+                        return finish_dir(c);
+                    }
+                    // Skip deleted entries, long name entries, volume labels and directories.
+                    if (o->m_dir_create || e[0] == 0xE5 || (e[11] & (AttrVolumeId | AttrDirectory))) {
+                        continue;
+                    }
+                    Handler::call(c, EVENT_DIR_ENTRY);
+                }
+                o->m_dir_entry = 0;
+                o->m_dir_block++;
+                if (o->m_dir_block < o->m_blocks_per_cluster) {
+                    return read_block(c, cluster_block(c, o->m_dir_cluster) + o->m_dir_block, OP_DIR);
+                }
+                read_block(c, fat_block(c, o->m_dir_cluster), OP_DIR_FAT);
+            } break;
+            
+            case OP_DIR_FAT: {
+                uint32_t next = fat_entry(c, o->m_dir_cluster);
+                // The count bounds the scan if the chain is corrupt and loops.
+                if (!cluster_valid(c, next) || --o->m_dir_clusters_left == 0) {
+                    return finish_dir(c);
+                }
+                o->m_dir_cluster = next;
+                o->m_dir_block = 0;
+                read_block(c, cluster_block(c, o->m_dir_cluster), OP_DIR);
+            } break;
+            
+            case OP_FILE_FAT: {
+                walk_chain(c);
+            } break;
+            
+            case OP_CREATE_READ: {
+                uint8_t *e = o->m_buffer + o->m_wfile_dir_entry * DirEntrySize;
+                memcpy(e, o->m_create_name, 11);
+                memset(e + 11, 0, DirEntrySize - 11);
+                e[11] = AttrArchive;
+                write_block(c, o->m_wfile_dir_block, OP_CREATE_WRITE);
+            } break;
+            
+            case OP_CREATE_WRITE: {
+                if (o->m_fsinfo_block == 0) {
+                    return Handler::call(c, EVENT_CREATED);
+                }
+                read_block(c, o->m_fsinfo_block, OP_FSINFO_READ);
+            } break;
+            
+            case OP_FSINFO_READ: {
+                // Take the hint where to look for free clusters. The free
+                // cluster count is about to be wrong, so mark it as unknown.
+                if (read_le32(o->m_buffer) != FsInfoSignature1 || read_le32(o->m_buffer + 484) != FsInfoSignature2) {
+                    return Handler::call(c, EVENT_CREATED);
+                }
+                uint32_t next_free = read_le32(o->m_buffer + 492);
+                if (cluster_valid(c, next_free)) {
+                    o->m_alloc_next = next_free;
+                }
+                if (read_le32(o->m_buffer + 488) == UINT32_C(0xFFFFFFFF)) {
+                    return Handler::call(c, EVENT_CREATED);
+                }
+                write_le32(o->m_buffer + 488, UINT32_C(0xFFFFFFFF));
+                write_block(c, o->m_fsinfo_block, OP_FSINFO_WRITE);
+            } break;
+            
+            case OP_FSINFO_WRITE: {
+                return Handler::call(c, EVENT_CREATED);
+            } break;
+            
+            case OP_ALLOC_READ: {
+                alloc_cluster(c);
+            } break;
+            
+            case OP_ALLOC_WRITE:
+            case OP_LINK_WRITE: {
+                o->m_fat_copy++;
+                if (o->m_fat_copy < o->m_num_fats) {
+                    return write_fat(c, op);
+                }
+                if (op == OP_ALLOC_WRITE && o->m_wfile_cluster != 0 && !o->m_alloc_linked) {
+                    return read_block(c, fat_block(c, o->m_wfile_cluster), OP_LINK_READ);
+                }
+                if (o->m_wfile_first == 0) {
+                    o->m_wfile_first = o->m_alloc_cluster;
+                }
+                o->m_wfile_cluster = o->m_alloc_cluster;
+                o->m_wfile_cluster_block = 0;
+            } break;
+            
+            case OP_LINK_READ: {
+                set_fat_entry(c, o->m_wfile_cluster, o->m_alloc_cluster);
+                o->m_fat_copy = 0;
+                write_fat(c, OP_LINK_WRITE);
+            } break;
+            
+            case OP_CLOSE_READ: {
+                uint8_t *e = o->m_buffer + o->m_wfile_dir_entry * DirEntrySize;
+                write_le16(e + 20, o->m_wfile_first >> 16);
+                write_le16(e + 26, o->m_wfile_first);
+                write_le32(e + 28, o->m_wfile_size);
+                write_block(c, o->m_wfile_dir_block, OP_CLOSE_WRITE);
+            } break;
+            
+            case OP_CLOSE_WRITE: {
+                o->m_writing = false;
+                return Handler::call(c, EVENT_CLOSED);
+            } break;
+            
+            default: AMBRO_ASSERT(0);
+        }
+    }
+    
+private:
+    enum {
+        OP_NONE, OP_MOUNT_MBR, OP_MOUNT_VBR, OP_DIR, OP_DIR_FAT, OP_FILE_FAT,
+        OP_CREATE_READ, OP_FSINFO_READ, OP_ALLOC_READ, OP_LINK_READ, OP_CLOSE_READ,
+        OP_CREATE_WRITE, OP_FSINFO_WRITE, OP_ALLOC_WRITE, OP_LINK_WRITE, OP_CLOSE_WRITE
+    };
+    
+    struct Extent {
+        uint32_t block;
+        uint32_t length;
+    };
+    
+    static size_t const DirEntrySize = 32;
+    static uint32_t const FatEntriesPerBlock = BlockSize / 4;
+    static uint32_t const MaxClusters = UINT32_C(0x0FFFFFF5);
+    static uint32_t const EndOfChain = UINT32_C(0x0FFFFFFF);
+    static uint32_t const FsInfoSignature1 = UINT32_C(0x41615252);
+    static uint32_t const FsInfoSignature2 = UINT32_C(0x61417272);
+    static uint8_t const AttrVolumeId = 0x08;
+    static uint8_t const AttrDirectory = 0x10;
+    static uint8_t const AttrArchive = 0x20;
+    
+    static uint16_t read_le16 (uint8_t const *p)
+    {
+        return ((uint16_t)p[0] | ((uint16_t)p[1] << 8));
+    }
+    
+    static uint32_t read_le32 (uint8_t const *p)
+    {
+        return ((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+    }
+    
+    static void write_le16 (uint8_t *p, uint16_t x)
+    {
+        p[0] = x;
+        p[1] = x >> 8;
+    }
+    
+    static void write_le32 (uint8_t *p, uint32_t x)
+    {
+        p[0] = x;
+        p[1] = x >> 8;
+        p[2] = x >> 16;
+        p[3] = x >> 24;
+    }
+    
+    static bool is_write_op (uint8_t op)
+    {
+        return (op >= OP_CREATE_WRITE);
+    }
+    
+    static bool make_short_name (char const *name, uint8_t *out)
+    {
+        memset(out, ' ', 11);
+        int pos = 0;
+        int end = 8;
+        for (; *name; name++) {
+            char ch = *name;
+            if (ch == '.' && end == 8 && pos > 0) {
+                pos = 8;
+                end = 11;
+                continue;
+            }
+            if (pos == end || ch <= ' ' || ch >= 0x7F || strchr("\"*+,./:;<=>?[\\]|", ch)) {
+                return false;
+            }
+            out[pos++] = (ch >= 'a' && ch <= 'z') ? (ch - 'a' + 'A') : ch;
+        }
+        return (pos > 0);
+    }
+    
+    static void start_dir (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_dir_cluster = o->m_root_cluster;
+        o->m_dir_clusters_left = o->m_max_cluster - 1;
+        o->m_dir_block = 0;
+        o->m_dir_entry = 0;
+        read_block(c, cluster_block(c, o->m_dir_cluster), OP_DIR);
+    }
+    
+    static void finish_dir (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        if (!o->m_dir_create) {
+            return Handler::call(c, EVENT_DIR_END);
+        }
+        if (o->m_write_status == WRITE_OK && o->m_wfile_dir_block == 0) {
+            o->m_write_status = WRITE_DIR_FULL;
+        }
+        if (o->m_write_status != WRITE_OK) {
+            o->m_writing = false;
+            return Handler::call(c, EVENT_CREATED);
+        }
+        read_block(c, o->m_wfile_dir_block, OP_CREATE_READ);
+    }
+    
+    static void write_failed (Context c, uint8_t op)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_write_status = WRITE_IO_ERROR;
+        switch (op) {
+            case OP_CREATE_WRITE: {
+                o->m_writing = false;
+                return Handler::call(c, EVENT_CREATED);
+            } break;
+            case OP_FSINFO_WRITE: {
+                // The file is there, only the hint in the FSInfo block is wrong.
+                o->m_write_status = WRITE_OK;
+                return Handler::call(c, EVENT_CREATED);
+            } break;
+            case OP_CLOSE_WRITE: {
+                o->m_writing = false;
+                return Handler::call(c, EVENT_CLOSED);
+            } break;
+        }
+    }
+    
+    static void read_block (Context c, uint32_t block, uint8_t op)
+    {
+        auto *o = Object::self(c);
+        
+        // Block 0 is never a directory or FAT block, so it marks an empty cache.
+        o->m_buffer_block = 0;
+        o->m_read_block = block;
+        o->m_op = op;
+        o->m_discard = false;
+        TheBlockDevice::queueReadBlock(c, block, o->m_buffer, &o->m_read_state);
+    }
+    
+    static void write_block (Context c, uint32_t block, uint8_t op)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_read_block = block;
+        o->m_op = op;
+        o->m_discard = false;
+        TheBlockDevice::queueWrite(c, block, o->m_buffer, 1);
+    }
+    
+    static void write_fat (Context c, uint8_t op)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(o->m_buffer_block >= o->m_fat_start)
+        
+        write_block(c, o->m_buffer_block + o->m_fat_copy * o->m_fat_size, op);
+    }
+    
+    static bool try_mount (Context c, uint32_t base)
+    {
+        auto *o = Object::self(c);
+        uint8_t const *b = o->m_buffer;
+        
+        if ((b[0] != 0xEB && b[0] != 0xE9) || read_le16(b + 510) != 0xAA55) {
+            return false;
+        }
+        uint16_t bytes_per_sector = read_le16(b + 11);
+        uint8_t blocks_per_cluster = b[13];
+        uint16_t reserved_blocks = read_le16(b + 14);
+        uint8_t num_fats = b[16];
+        uint16_t root_entries = read_le16(b + 17);
+        uint16_t total_blocks_16 = read_le16(b + 19);
+        uint16_t fat_size_16 = read_le16(b + 22);
+        uint32_t total_blocks = (total_blocks_16 != 0) ? total_blocks_16 : read_le32(b + 32);
+        uint32_t fat_size = read_le32(b + 36);
+        uint32_t root_cluster = read_le32(b + 44);
+        
+        // Only FAT32 has no fixed root directory and no 16-bit FAT size.
+        if (bytes_per_sector != BlockSize || blocks_per_cluster == 0 || (blocks_per_cluster & (blocks_per_cluster - 1)) ||
+            reserved_blocks == 0 || num_fats == 0 || root_entries != 0 || fat_size_16 != 0 || fat_size == 0
+        ) {
+            return false;
+        }
+        uint32_t capacity = TheBlockDevice::getCapacityBlocks(c);
+        uint32_t fat_start = base + reserved_blocks;
+        if (fat_start >= capacity || fat_size > (capacity - fat_start) / num_fats) {
+            return false;
+        }
+        uint32_t data_start = fat_start + num_fats * fat_size;
+        if (total_blocks <= data_start - base || data_start >= capacity) {
+            return false;
+        }
+        
+        // Ignore any clusters past the end of the device or the FAT.
+        uint32_t num_clusters = (total_blocks - (data_start - base)) / blocks_per_cluster;
+        uint32_t device_clusters = (capacity - data_start) / blocks_per_cluster;
+        if (num_clusters > device_clusters) {
+            num_clusters = device_clusters;
+        }
+        if (fat_size <= (MaxClusters + 2) / FatEntriesPerBlock && num_clusters > fat_size * FatEntriesPerBlock - 2) {
+            num_clusters = fat_size * FatEntriesPerBlock - 2;
+        }
+        if (num_clusters > MaxClusters) {
+            num_clusters = MaxClusters;
+        }
+        if (root_cluster < 2 || root_cluster > num_clusters + 1) {
+            return false;
+        }
+        
+        uint16_t fsinfo_block = read_le16(b + 48);
+        
+        o->m_blocks_per_cluster = blocks_per_cluster;
+        o->m_num_fats = num_fats;
+        o->m_fat_size = fat_size;
+        o->m_fsinfo_block = (fsinfo_block > 0 && fsinfo_block < reserved_blocks) ? (base + fsinfo_block) : 0;
+        o->m_alloc_next = 2;
+        o->m_fat_start = fat_start;
+        o->m_data_start = data_start;
+        o->m_max_cluster = num_clusters + 1;
+        o->m_root_cluster = root_cluster;
+        o->m_mounted = true;
+        return true;
+    }
+    
+    static bool cluster_valid (Context c, uint32_t cluster)
+    {
+        auto *o = Object::self(c);
+        return (cluster >= 2 && cluster <= o->m_max_cluster);
+    }
+    
+    static uint32_t cluster_block (Context c, uint32_t cluster)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(cluster_valid(c, cluster))
+        return o->m_data_start + (cluster - 2) * o->m_blocks_per_cluster;
+    }
+    
+    static uint32_t fat_block (Context c, uint32_t cluster)
+    {
+        auto *o = Object::self(c);
+        return o->m_fat_start + cluster / FatEntriesPerBlock;
+    }
+    
+    static uint32_t fat_entry (Context c, uint32_t cluster)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(o->m_buffer_block == fat_block(c, cluster))
+        return read_le32(o->m_buffer + (cluster % FatEntriesPerBlock) * 4) & UINT32_C(0x0FFFFFFF);
+    }
+    
+    static void set_fat_entry (Context c, uint32_t cluster, uint32_t value)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(o->m_buffer_block == fat_block(c, cluster))
+        
+        uint8_t *p = o->m_buffer + (cluster % FatEntriesPerBlock) * 4;
+        write_le32(p, (read_le32(p) & UINT32_C(0xF0000000)) | value);
+    }
+    
+    /**
+     * Looks for a free cluster, starting after the last one allocated, and
+     * marks it as the end of the chain. If the cluster it follows is in the
+     * same FAT block, it is linked in the same write, else it is linked
+     * after the new cluster is safely marked.
+     */
+    static void alloc_cluster (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        while (o->m_alloc_left > 0) {
+            uint32_t cluster = o->m_alloc_next;
+            if (o->m_buffer_block != fat_block(c, cluster)) {
+                return read_block(c, fat_block(c, cluster), OP_ALLOC_READ);
+            }
+            o->m_alloc_left--;
+            o->m_alloc_next = (cluster == o->m_max_cluster) ? 2 : (cluster + 1);
+            if (fat_entry(c, cluster) == 0) {
+                o->m_alloc_cluster = cluster;
+                set_fat_entry(c, cluster, EndOfChain);
+                o->m_alloc_linked = (o->m_wfile_cluster != 0 && fat_block(c, o->m_wfile_cluster) == o->m_buffer_block);
+                if (o->m_alloc_linked) {
+                    set_fat_entry(c, o->m_wfile_cluster, cluster);
+                }
+                o->m_fat_copy = 0;
+                return write_fat(c, OP_ALLOC_WRITE);
+            }
+        }
+        o->m_write_status = WRITE_DISK_FULL;
+    }
+    
+    static void add_extent (Context c, uint32_t cluster)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(o->m_extent_count < NumExtents)
+        
+        Extent *e = &o->m_extents[(o->m_extent_first + o->m_extent_count) % NumExtents];
+        e->block = cluster_block(c, cluster);
+        e->length = o->m_blocks_per_cluster;
+        o->m_extent_count++;
+    }
+    
+    /**
+     * Follows the cluster chain of the open file for as long as the FAT
+     * block is at hand and there is room in the extent table, and starts
+     * reading the next FAT block if needed.
+     */
+    static void walk_chain (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        while (o->m_walk_clusters_left > 0 && !o->m_walk_error) {
+            if (o->m_buffer_block != fat_block(c, o->m_walk_cluster)) {
+                if (o->m_op == OP_NONE) {
+                    read_block(c, fat_block(c, o->m_walk_cluster), OP_FILE_FAT);
+                }
+                return;
+            }
+            uint32_t next = fat_entry(c, o->m_walk_cluster);
+            if (!cluster_valid(c, next)) {
+                o->m_walk_error = true;
+                break;
+            }
+            // The extent may have been used up already, then it can't grow.
+            if (o->m_extent_count > 0 && next == o->m_walk_cluster + 1) {
+                o->m_extents[(o->m_extent_first + o->m_extent_count - 1) % NumExtents].length += o->m_blocks_per_cluster;
+            } else {
+                if (o->m_extent_count == NumExtents) {
+                    break;
+                }
+                add_extent(c, next);
+            }
+            o->m_walk_cluster = next;
+            o->m_walk_clusters_left--;
+        }
+        if (o->m_opening) {
+            o->m_opening = false;
+            return Handler::call(c, EVENT_OPENED);
+        }
+    }
+    
+public:
+    struct Object : public ObjBase<FatFs, ParentObject, EmptyTypeList>,
+        public DebugObject<Context, void>
+    {
+        typename TheBlockDevice::ReadState m_read_state;
+        uint8_t m_op;
+        bool m_discard;
+        bool m_mounted;
+        uint8_t m_blocks_per_cluster;
+        uint32_t m_read_block;
+        uint32_t m_buffer_block;
+        uint32_t m_fat_start;
+        uint32_t m_data_start;
+        uint32_t m_max_cluster;
+        uint32_t m_root_cluster;
+        uint32_t m_dir_cluster;
+        uint32_t m_dir_clusters_left;
+        uint8_t m_dir_block;
+        uint8_t m_dir_entry;
+        bool m_opening;
+        bool m_writing;
+        bool m_dir_create;
+        bool m_write_failed;
+        bool m_alloc_linked;
+        uint8_t m_write_status;
+        uint8_t m_num_fats;
+        uint8_t m_fat_copy;
+        uint8_t m_wfile_dir_entry;
+        uint8_t m_create_name[11];
+        uint32_t m_fat_size;
+        uint32_t m_fsinfo_block;
+        uint32_t m_alloc_next;
+        uint32_t m_alloc_left;
+        uint32_t m_alloc_cluster;
+        uint32_t m_wfile_dir_block;
+        uint32_t m_wfile_first;
+        uint32_t m_wfile_cluster;
+        uint32_t m_wfile_cluster_block;
+        uint32_t m_wfile_size;
+        bool m_walk_error;
+        uint8_t m_extent_first;
+        uint8_t m_extent_count;
+        uint32_t m_extent_offset;
+        uint32_t m_walk_cluster;
+        uint32_t m_walk_clusters_left;
+        uint32_t m_file_blocks_left;
+        Extent m_extents[NumExtents];
+        uint8_t m_buffer[BlockSize];
+    };
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -216,6 +216,30 @@ T FloatExp (T x)
     return IsFloat<T>::value ? expf(x) : exp(x);
 }
 
+template <typename T>
+T FloatSin (T x)
+{
+    static_assert(IsFpType<T>::value, "");
+    
+    return IsFloat<T>::value ? sinf(x) : sin(x);
+}
+
+template <typename T>
+T FloatCos (T x)
+{
+    static_assert(IsFpType<T>::value, "");
+    
+    return IsFloat<T>::value ? cosf(x) : cos(x);
+}
+
+template <typename T>
+T FloatAtan2 (T y, T x)
+{
+    static_assert(IsFpType<T>::value, "");
+    
+    return IsFloat<T>::value ? atan2f(y, x) : atan2(y, x);
+}
+
 template <typename T1, typename T2>
 using FloatPromote = If<(IsFloat<T1>::value && IsFloat<T2>::value), float, double>;
 
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_INCREMENTAL_QUADRATIC_SQRT_H
+#define AMBROLIB_INCREMENTAL_QUADRATIC_SQRT_H
+
+#include <stdint.h>
+
+#include <aprinter/math/FloatTools.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/**
+ * Evaluates sqrt(a + b*t + c*t^2) at increasing, evenly spaced t, such as
+ * the split points of a straight line. From the third point on, the result
+ * is extrapolated from the previous two and refined by one Newton step,
+ * which costs a division instead of a square root. The Newton step roughly
+ * squares the relative error of the guess, so it is only used when the
+ * square of the guess is within MaxRelMismatch of the value under the root;
+ * otherwise (where the curve bends too fast) the square root is computed
+ * directly.
+ */
+template <typename FpType>
+class IncrementalQuadraticSqrt {
+public:
+    void start (FpType a, FpType b, FpType c)
+    {
+        m_a = a;
+        m_b = b;
+        m_c = c;
+        m_cur = FloatSqrt(a);
+        m_prev = m_cur;
+        m_have_prev = false;
+    }
+    
+    FpType next (FpType t)
+    {
+        FpType value = m_a + t * (m_b + t * m_c);
+        FpType guess = 2.0f * m_cur - m_prev;
+        FpType mismatch = guess * guess - value;
+        FpType res;
+        if (m_have_prev && FloatAbs(mismatch) <= (FpType)MaxRelMismatch * value) {
+            res = guess - mismatch / (2.0f * guess);
+        } else {
+            res = FloatSqrt(value);
+        }
+        m_prev = m_cur;
+        m_cur = res;
+        m_have_prev = true;
+        return res;
+    }
+    
+private:
+    static constexpr double MaxRelMismatch = 0.001;
+    
+    FpType m_a;
+    FpType m_b;
+    FpType m_c;
+    FpType m_cur;
+    FpType m_prev;
+    bool m_have_prev;
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
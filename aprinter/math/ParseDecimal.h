@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_PARSE_DECIMAL_H
+#define AMBROLIB_PARSE_DECIMAL_H
+
+#include <stdint.h>
+
+#include <aprinter/meta/If.h>
+#include <aprinter/math/FloatTools.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/*
+ * Converters for the numbers found in g-code: an optional sign, digits
+ * and an optional fraction, with nothing after. The digits are added up
+ * in an integer, which is then divided by a power of ten from a table.
+ * This is only done while both are exactly representable in T, so that
+ * the one rounding of the division gives the same result as strtod.
+ * Otherwise false is returned and the caller should use the C library.
+ */
+
+template <typename T>
+struct ParseDecimalFpLimits {
+    // 10^10 and 2^24 are exact in a float, 10^22 and 2^53 in a double.
+    static int const MaxFracDigits = IsFloat<T>::value ? 10 : 22;
+    static int const MaxDigits = IsFloat<T>::value ? 9 : 19;
+    using MantissaType = If<IsFloat<T>::value, uint32_t, uint64_t>;
+    static MantissaType const MaxExactMantissa = (MantissaType)1 << (IsFloat<T>::value ? 24 : 53);
+};
+
+template <typename T>
+static T ParseDecimalPowerOfTen (int exp)
+{
+    static T const table[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    return table[exp];
+}
+
+template <typename T>
+static bool ParseDecimalFp (char const *str, T *out)
+{
+    static_assert(IsFpType<T>::value, "");
+    using Limits = ParseDecimalFpLimits<T>;
+    using MantissaType = typename Limits::MantissaType;
+    
+    bool negative = (*str == '-');
+    if (negative || *str == '+') {
+        str++;
+    }
+    
+    MantissaType mantissa = 0;
+    int digits = 0;
+    int frac_digits = -1;
+    while (1) {
+        unsigned char digit = (unsigned char)*str - '0';
+        if (digit < 10) {
+            if (digits == Limits::MaxDigits) {
+                return false;
+            }
+            mantissa = 10 * mantissa + digit;
+            digits++;
+            if (frac_digits >= 0) {
+                frac_digits++;
+            }
+        } else if (*str == '.' && frac_digits < 0) {
+            frac_digits = 0;
+        } else {
+            break;
+        }
+        str++;
+    }
+    
+    if (*str != '\0' || digits == 0 || mantissa > Limits::MaxExactMantissa || frac_digits > Limits::MaxFracDigits) {
+        return false;
+    }
+    
+    T value = mantissa;
+    if (frac_digits > 0) {
+        value /= ParseDecimalPowerOfTen<T>(frac_digits);
+    }
+    *out = negative ? -value : value;
+    return true;
+}
+
+/*
+ * Unsigned integers, digits only, up to nine of them. The caller should
+ * use the C library when false is returned.
+ */
+template <typename T>
+static bool ParseDecimalUint (char const *str, T *out)
+{
+    uint32_t value = 0;
+    int digits = 0;
+    while (1) {
+        unsigned char digit = (unsigned char)*str - '0';
+        if (digit >= 10) {
+            break;
+        }
+        if (digits == 9) {
+            return false;
+        }
+        value = 10 * value + digit;
+        digits++;
+        str++;
+    }
+    
+    if (*str != '\0' || digits == 0 || value > (T)-1) {
+        return false;
+    }
+    *out = value;
+    return true;
+}
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -44,4 +44,11 @@ inline static bool interrupts_enabled (void)
     return !tmp;
 }
 
+// Sleeps until an interrupt is pending. If called with interrupts disabled,
+// the interrupt is only serviced after they are enabled again.
+inline static void wait_for_interrupt (void)
+{
+    asm volatile ("wfi" : : : "memory");
+}
+
 #endif
@@ -0,0 +1,3 @@
+#include <aprinter/platform/linux/linux_support.h>
+
+bool linux_interrupts_disabled = false;
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_LINUX_SUPPORT_H
+#define AMBROLIB_LINUX_SUPPORT_H
+
+#include <stdint.h>
+
+#define INTERRUPT_PRIORITY 0
+
+// Interrupts are simulated by LinuxClock, which only dispatches
+// timer interrupts while this flag is clear.
+extern bool linux_interrupts_disabled;
+
+inline static void sei (void)
+{
+    asm volatile ("" : : : "memory");
+    linux_interrupts_disabled = false;
+}
+
+inline static void cli (void)
+{
+    linux_interrupts_disabled = true;
+    asm volatile ("" : : : "memory");
+}
+
+inline static bool interrupts_enabled (void)
+{
+    return !linux_interrupts_disabled;
+}
+
+// Simulated interrupts only happen when the clock is read, so there is
+// nothing to wait for; a sleeping event loop just keeps polling.
+inline static void wait_for_interrupt (void)
+{
+}
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_ARC_SPLITTER_H
+#define AMBROLIB_ARC_SPLITTER_H
+
+#include <stdint.h>
+
+#include <aprinter/math/FloatTools.h>
+#include <aprinter/meta/PowerOfTwo.h>
+
+#include <aprinter/BeginNamespace.h>
+
+template <typename TChordTolerance, typename TMinSegmentLength, int TCorrectionInterval = 16>
+struct ArcSplitterParams {
+    using ChordTolerance = TChordTolerance;
+    using MinSegmentLength = TMinSegmentLength;
+    static int const CorrectionInterval = TCorrectionInterval;
+};
+
+/**
+ * Splits a circular arc into chords, one per pull, like DistanceSplitter
+ * does for straight lines. The chords are as long as the chord tolerance
+ * (the largest distance of a chord from the arc) allows, but there are no
+ * more of them than MinSegmentLength allows. Points are relative to the center of the arc.
+ * 
+ * The points are found by rotating the previous point by the chord angle,
+ * whose sine and cosine are computed once per arc. Every CorrectionInterval
+ * points, the point is computed exactly from the start point instead, so
+ * that rounding errors do not accumulate over long arcs.
+ */
+template <typename Params, typename FpType>
+class ArcSplitter {
+    static_assert(Params::CorrectionInterval > 0 && Params::CorrectionInterval <= 65535, "");
+    
+public:
+    void start (FpType x, FpType y, FpType angle)
+    {
+        // A chord spanning the angle a is r*a^2/8 away from the arc.
+        FpType radius = FloatSqrt(x * x + y * y);
+        FpType abs_angle = FloatAbs(angle);
+        FpType fpcount = FloatMin(
+            abs_angle * FloatSqrt(radius * (FpType)(1.0 / (8.0 * Params::ChordTolerance::value()))),
+            abs_angle * radius * (FpType)(1.0 / Params::MinSegmentLength::value())
+        );
+        if (!(fpcount < FloatLdexp<FpType>(1.0f, 31))) {
+            m_count = PowerOfTwo<uint32_t, 31>::value;
+        } else {
+            m_count = 1 + (uint32_t)fpcount;
+        }
+        m_pos = 1;
+        m_correction_counter = Params::CorrectionInterval;
+        m_x = x;
+        m_y = y;
+        m_cur_x = x;
+        m_cur_y = y;
+        m_step_angle = angle / m_count;
+        m_step_cos = FloatCos(m_step_angle);
+        m_step_sin = FloatSin(m_step_angle);
+    }
+    
+    bool pull (FpType *out_frac, FpType *out_x, FpType *out_y)
+    {
+        if (m_pos == m_count) {
+            return false;
+        }
+        if (--m_correction_counter == 0) {
+            m_correction_counter = Params::CorrectionInterval;
+            FpType a = m_pos * m_step_angle;
+            FpType cos_a = FloatCos(a);
+            FpType sin_a = FloatSin(a);
+            m_cur_x = m_x * cos_a - m_y * sin_a;
+            m_cur_y = m_x * sin_a + m_y * cos_a;
+        } else {
+            FpType x = m_cur_x;
+            m_cur_x = x * m_step_cos - m_cur_y * m_step_sin;
+            m_cur_y = x * m_step_sin + m_cur_y * m_step_cos;
+        }
+        *out_frac = (FpType)m_pos / m_count;
+        *out_x = m_cur_x;
+        *out_y = m_cur_y;
+        m_pos++;
+        return true;
+    }
+    
+private:
+    uint32_t m_count;
+    uint32_t m_pos;
+    uint16_t m_correction_counter;
+    FpType m_x;
+    FpType m_y;
+    FpType m_cur_x;
+    FpType m_cur_y;
+    FpType m_step_angle;
+    FpType m_step_cos;
+    FpType m_step_sin;
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
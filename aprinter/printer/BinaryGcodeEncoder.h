@@ -0,0 +1,570 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_BINARY_GCODE_ENCODER_H
+#define AMBROLIB_BINARY_GCODE_ENCODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <aprinter/printer/BinaryGcodeFormat.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/**
+ * Encodes text g-code into the packed format read by BinaryGcodeParser.
+ * This is for host-side tools. The output is byte-identical to that of
+ * aprinter_encode.py, including its choices of parameter types and the
+ * numeric syntax accepted by Python's int() and float().
+ */
+class BinaryGcodeEncoder {
+    using Format = BinaryGcodeFormat;
+    friend class BinaryGcodeDeltaEncoder;
+    
+public:
+    /**
+     * Encodes one line, which may include a comment and line ending,
+     * into out, which must have room for Format::MaxPacketSize bytes.
+     * Returns the packet length (zero for a blank line), or -1 on error,
+     * with the reason stored to *out_error.
+     */
+    static int encodeLine (char const *line, size_t length, uint8_t *out, char const **out_error)
+    {
+        char const *semicolon = (char const *)memchr(line, ';', length);
+        char const *end = semicolon ? semicolon : line + length;
+        char const *pos = skip_space(line, end);
+        if (pos == end) {
+            return 0;
+        }
+        
+        char const *word_end = find_space(pos, end);
+        char cmd_letter = *pos;
+        if (cmd_letter == 'E') {
+            out[0] = Format::EofPacket;
+            return 1;
+        }
+        if (!letter_ok(cmd_letter)) {
+            *out_error = "invalid command letter";
+            return -1;
+        }
+        uint64_t cmd_number;
+        bool cmd_negative;
+        if (!parse_integer(pos + 1, word_end, &cmd_number, &cmd_negative) ||
+            (cmd_negative && cmd_number != 0) || cmd_number > Format::MaxCmdNumber
+        ) {
+            *out_error = "invalid command number";
+            return -1;
+        }
+        
+        int num_params = 0;
+        for (char const *p = skip_space(word_end, end); p != end; p = skip_space(find_space(p, end), end)) {
+            num_params++;
+        }
+        if (num_params > Format::MaxParts) {
+            *out_error = "too many parameters";
+            return -1;
+        }
+        
+        int cmd_type = small_command_type(cmd_letter, cmd_number);
+        int header_size = (cmd_type == Format::CMD_TYPE_LONG) ? 3 : 1;
+        out[0] = (cmd_type << 4) | num_params;
+        if (cmd_type == Format::CMD_TYPE_LONG) {
+            out[1] = ((cmd_letter - 'A') << 3) | (cmd_number >> 8);
+            out[2] = cmd_number & 0xFF;
+        }
+        
+        uint8_t *index = out + header_size;
+        uint8_t *payload = index + num_params;
+        for (pos = skip_space(word_end, end); pos != end; pos = skip_space(word_end, end)) {
+            word_end = find_space(pos, end);
+            char param_letter = *pos;
+            if (!letter_ok(param_letter)) {
+                *out_error = "invalid parameter letter";
+                return -1;
+            }
+            int type_code;
+            uint64_t int_value;
+            bool int_negative;
+            if (pos + 1 == word_end) {
+                type_code = Format::DATA_TYPE_VOID;
+            } else if (parse_integer(pos + 1, word_end, &int_value, &int_negative) && !(int_negative && int_value != 0)) {
+                if (int_value <= UINT32_MAX) {
+                    type_code = Format::DATA_TYPE_UINT32;
+                    payload = write_le(payload, int_value, 4);
+                } else {
+                    type_code = Format::DATA_TYPE_UINT64;
+                    payload = write_le(payload, int_value, 8);
+                }
+            } else {
+                uint32_t float_bits;
+                if (!parse_float(pos + 1, word_end, &float_bits, out_error)) {
+                    return -1;
+                }
+                type_code = Format::DATA_TYPE_FLOAT;
+                payload = write_le(payload, float_bits, 4);
+            }
+            *index++ = (type_code << 5) | (param_letter - 'A');
+        }
+        
+        return payload - out;
+    }
+    
+private:
+    static bool is_space (char ch)
+    {
+        return (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == '\v' || ch == '\f');
+    }
+    
+    static char const * skip_space (char const *pos, char const *end)
+    {
+        while (pos != end && is_space(*pos)) {
+            pos++;
+        }
+        return pos;
+    }
+    
+    static char const * find_space (char const *pos, char const *end)
+    {
+        while (pos != end && !is_space(*pos)) {
+            pos++;
+        }
+        return pos;
+    }
+    
+    static bool letter_ok (char ch)
+    {
+        return (ch >= 'A' && ch <= 'Z');
+    }
+    
+    static bool is_digit (char ch)
+    {
+        return (ch >= '0' && ch <= '9');
+    }
+    
+    static int small_command_type (char letter, uint64_t number)
+    {
+        if (letter == 'G') {
+            switch (number) {
+                case 0: return Format::CMD_TYPE_G0;
+                case 1: return Format::CMD_TYPE_G1;
+                case 92: return Format::CMD_TYPE_G92;
+            }
+        }
+        return Format::CMD_TYPE_LONG;
+    }
+    
+    static uint8_t * write_le (uint8_t *out, uint64_t value, int size)
+    {
+        for (int i = 0; i < size; i++) {
+            *out++ = value >> (8 * i);
+        }
+        return out;
+    }
+    
+    static bool match_word (char const *pos, char const *end, char const *word)
+    {
+        for (; *word; word++, pos++) {
+            if (pos == end || (*pos | 0x20) != *word) {
+                return false;
+            }
+        }
+        return (pos == end);
+    }
+    
+    // Python's int(): optional sign and decimal digits. Fails if the
+    // magnitude does not fit into 64 bits, in which case Python's range
+    // check fails too.
+    static bool parse_integer (char const *pos, char const *end, uint64_t *out_value, bool *out_negative)
+    {
+        *out_negative = false;
+        if (pos != end && (*pos == '+' || *pos == '-')) {
+            *out_negative = (*pos == '-');
+            pos++;
+        }
+        if (pos == end) {
+            return false;
+        }
+        uint64_t value = 0;
+        for (; pos != end; pos++) {
+            if (!is_digit(*pos)) {
+                return false;
+            }
+            uint64_t digit = *pos - '0';
+            if (value > (UINT64_MAX - digit) / 10) {
+                return false;
+            }
+            value = 10 * value + digit;
+        }
+        *out_value = value;
+        return true;
+    }
+    
+    // Python's float() followed by struct.pack('<f').
+    static bool parse_float (char const *pos, char const *end, uint32_t *out_bits, char const **out_error)
+    {
+        char const *start = pos;
+        bool negative = false;
+        if (pos != end && (*pos == '+' || *pos == '-')) {
+            negative = (*pos == '-');
+            pos++;
+        }
+        if (match_word(pos, end, "inf") || match_word(pos, end, "infinity")) {
+            *out_bits = negative ? UINT32_C(0xFF800000) : UINT32_C(0x7F800000);
+            return true;
+        }
+        if (match_word(pos, end, "nan")) {
+            // Python's NaN constant has the sign bit set, so negating it clears it.
+            *out_bits = negative ? UINT32_C(0x7FC00000) : UINT32_C(0xFFC00000);
+            return true;
+        }
+        
+        int mantissa_digits = 0;
+        while (pos != end && is_digit(*pos)) {
+            pos++;
+            mantissa_digits++;
+        }
+        if (pos != end && *pos == '.') {
+            pos++;
+            while (pos != end && is_digit(*pos)) {
+                pos++;
+                mantissa_digits++;
+            }
+        }
+        if (mantissa_digits == 0) {
+            goto invalid;
+        }
+        if (pos != end && (*pos == 'e' || *pos == 'E')) {
+            pos++;
+            if (pos != end && (*pos == '+' || *pos == '-')) {
+                pos++;
+            }
+            if (pos == end || !is_digit(*pos)) {
+                goto invalid;
+            }
+            while (pos != end && is_digit(*pos)) {
+                pos++;
+            }
+        }
+        if (pos != end) {
+            goto invalid;
+        }
+        
+        {
+            char buf[64];
+            char *heap_buf = NULL;
+            size_t length = end - start;
+            char *str = buf;
+            if (length >= sizeof(buf)) {
+                heap_buf = (char *)malloc(length + 1);
+                if (!heap_buf) {
+                    *out_error = "out of memory";
+                    return false;
+                }
+                str = heap_buf;
+            }
+            memcpy(str, start, length);
+            str[length] = '\0';
+            double value = strtod(str, NULL);
+            free(heap_buf);
+            
+            float float_value = value;
+            if (isinf(float_value) && !isinf(value)) {
+                *out_error = "float too large to pack with f format";
+                return false;
+            }
+            memcpy(out_bits, &float_value, sizeof(float_value));
+            return true;
+        }
+        
+    invalid:
+        *out_error = "invalid command argument";
+        return false;
+    }
+};
+
+/**
+ * Encodes text g-code like BinaryGcodeEncoder, except that G1 commands
+ * are written as delta packets where possible. A delta packet stores each
+ * coordinate as the difference from its previous value, in fixed-point
+ * units of the resolution configured for its letter, as a varint.
+ * An F equal to the current feedrate is left out.
+ * The output is byte-identical to that of aprinter_encode.py --delta.
+ */
+class BinaryGcodeDeltaEncoder {
+    using Format = BinaryGcodeFormat;
+    using Encoder = BinaryGcodeEncoder;
+    
+public:
+    // X, Y and Z in micrometers, E in 0.1 micrometers, F in mm/min.
+    static constexpr char const *DefaultResolution = "X3,Y3,Z3,E4,F0";
+    
+    /**
+     * Sets up the encoder with a resolution specification, which is a
+     * comma-separated list of up to Format::DeltaMaxSlots letters, each
+     * followed by the number of decimal digits kept after the point.
+     * Returns false on error, with the reason stored to *out_error.
+     */
+    bool init (char const *resolution, char const **out_error)
+    {
+        m_num_slots = 0;
+        m_config_written = false;
+        m_have_feedrate = false;
+        
+        char const *pos = resolution;
+        while (*pos) {
+            if (m_num_slots == Format::DeltaMaxSlots) {
+                *out_error = "too many resolution letters";
+                return false;
+            }
+            char letter = pos[0];
+            if (!Encoder::letter_ok(letter) || find_slot(letter) >= 0) {
+                *out_error = "invalid resolution letter";
+                return false;
+            }
+            if (!(pos[1] >= '0' && pos[1] <= '0' + Format::DeltaMaxDigits) || (pos[2] != ',' && pos[2] != '\0')) {
+                *out_error = "invalid resolution digits";
+                return false;
+            }
+            m_slots[m_num_slots].letter = letter;
+            m_slots[m_num_slots].digits = pos[1] - '0';
+            m_slots[m_num_slots].value = 0;
+            m_num_slots++;
+            pos += (pos[2] == ',') ? 3 : 2;
+        }
+        return true;
+    }
+    
+    /**
+     * Like BinaryGcodeEncoder::encodeLine. The first delta packet is
+     * preceded by the configuration packet.
+     */
+    int encodeLine (char const *line, size_t length, uint8_t *out, char const **out_error)
+    {
+        char const *semicolon = (char const *)memchr(line, ';', length);
+        char const *end = semicolon ? semicolon : line + length;
+        char const *pos = Encoder::skip_space(line, end);
+        if (pos == end) {
+            return 0;
+        }
+        
+        char const *word_end = Encoder::find_space(pos, end);
+        uint64_t cmd_number;
+        bool cmd_negative;
+        bool is_move = (*pos == 'G' && Encoder::parse_integer(pos + 1, word_end, &cmd_number, &cmd_negative) &&
+                        !(cmd_negative && cmd_number != 0) && (cmd_number == 0 || cmd_number == 1));
+        if (!is_move) {
+            return Encoder::encodeLine(line, length, out, out_error);
+        }
+        
+        int32_t values[Format::DeltaMaxSlots];
+        uint8_t mask = 0;
+        bool delta_ok = (cmd_number == 1);
+        bool have_feedrate_param = false;
+        for (pos = Encoder::skip_space(word_end, end); pos != end; pos = Encoder::skip_space(word_end, end)) {
+            word_end = Encoder::find_space(pos, end);
+            have_feedrate_param |= (*pos == 'F');
+            int slot = find_slot(*pos);
+            if (slot < 0 || (mask & (1 << slot)) || !quantize(pos + 1, word_end, m_slots[slot].digits, &values[slot])) {
+                delta_ok = false;
+            }
+            if (slot >= 0) {
+                mask |= 1 << slot;
+            }
+        }
+        if (!delta_ok) {
+            if (have_feedrate_param) {
+                m_have_feedrate = false;
+            }
+            return Encoder::encodeLine(line, length, out, out_error);
+        }
+        
+        uint8_t *ptr = out;
+        if (!m_config_written) {
+            *ptr++ = (Format::CMD_TYPE_DELTA_CONFIG << 4) | m_num_slots;
+            for (int i = 0; i < m_num_slots; i++) {
+                *ptr++ = (m_slots[i].digits << 5) | (m_slots[i].letter - 'A');
+            }
+            m_config_written = true;
+        }
+        int feedrate_slot = find_slot('F');
+        if (feedrate_slot >= 0 && (mask & (1 << feedrate_slot))) {
+            if (m_have_feedrate && values[feedrate_slot] == m_feedrate) {
+                mask &= ~(1 << feedrate_slot);
+            }
+            m_have_feedrate = true;
+            m_feedrate = values[feedrate_slot];
+        }
+        *ptr++ = Format::DeltaHeaderTag | mask;
+        for (int i = 0; i < m_num_slots; i++) {
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+            int32_t delta = (uint32_t)values[i] - (uint32_t)m_slots[i].value;
+            uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+            while (zigzag >= 0x80) {
+                *ptr++ = zigzag | 0x80;
+                zigzag >>= 7;
+            }
+            *ptr++ = zigzag;
+            m_slots[i].value = values[i];
+        }
+        return ptr - out;
+    }
+    
+    /**
+     * Returns whether the two encoders, set up with the same resolution,
+     * would encode any further lines the same.
+     */
+    bool sameState (BinaryGcodeDeltaEncoder const &other) const
+    {
+        if (m_config_written != other.m_config_written || m_have_feedrate != other.m_have_feedrate ||
+            (m_have_feedrate && m_feedrate != other.m_feedrate)) {
+            return false;
+        }
+        for (int i = 0; i < m_num_slots; i++) {
+            if (m_slots[i].value != other.m_slots[i].value) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+private:
+    int find_slot (char letter)
+    {
+        for (int i = 0; i < m_num_slots; i++) {
+            if (m_slots[i].letter == letter) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    
+    // Decimal number (the finite syntax of Python's float()) times 10^digits,
+    // rounded half away from zero, exactly as Python's decimal module does.
+    // Fails if the result is outside of +-(2^31-1).
+    static bool quantize (char const *pos, char const *end, int digits, int32_t *out_value)
+    {
+        bool negative = false;
+        if (pos != end && (*pos == '+' || *pos == '-')) {
+            negative = (*pos == '-');
+            pos++;
+        }
+        char const *mantissa = pos;
+        int num_digits = 0;
+        int frac_digits = 0;
+        while (pos != end && Encoder::is_digit(*pos)) {
+            pos++;
+            num_digits++;
+        }
+        char const *point = pos;
+        if (pos != end && *pos == '.') {
+            pos++;
+            while (pos != end && Encoder::is_digit(*pos)) {
+                pos++;
+                num_digits++;
+                frac_digits++;
+            }
+        }
+        char const *mantissa_end = pos;
+        if (num_digits == 0) {
+            return false;
+        }
+        long exponent = 0;
+        if (pos != end && (*pos == 'e' || *pos == 'E')) {
+            pos++;
+            bool exp_negative = false;
+            if (pos != end && (*pos == '+' || *pos == '-')) {
+                exp_negative = (*pos == '-');
+                pos++;
+            }
+            if (pos == end || !Encoder::is_digit(*pos)) {
+                return false;
+            }
+            while (pos != end && Encoder::is_digit(*pos)) {
+                if (exponent < 100000) {
+                    exponent = 10 * exponent + (*pos - '0');
+                }
+                pos++;
+            }
+            if (exp_negative) {
+                exponent = -exponent;
+            }
+        }
+        if (pos != end) {
+            return false;
+        }
+        
+        // Digits of the mantissa which end up before the point.
+        long keep = num_digits + exponent - frac_digits + digits;
+        uint64_t value = 0;
+        bool round_up = false;
+        long index = 0;
+        for (char const *p = mantissa; p != mantissa_end; p++) {
+            if (p == point) {
+                continue;
+            }
+            if (index < keep) {
+                value = 10 * value + (*p - '0');
+                if (value > INT32_MAX) {
+                    return false;
+                }
+            } else if (index == keep) {
+                round_up = (*p >= '5');
+            }
+            index++;
+        }
+        for (; index < keep && value != 0; index++) {
+            value *= 10;
+            if (value > INT32_MAX) {
+                return false;
+            }
+        }
+        value += round_up;
+        if (value > INT32_MAX) {
+            return false;
+        }
+        *out_value = negative ? -(int32_t)value : (int32_t)value;
+        return true;
+    }
+    
+    struct Slot {
+        char letter;
+        uint8_t digits;
+        int32_t value;
+    };
+    
+    int m_num_slots;
+    bool m_config_written;
+    bool m_have_feedrate;
+    int32_t m_feedrate;
+    Slot m_slots[Format::DeltaMaxSlots];
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_BINARY_GCODE_FORMAT_H
+#define AMBROLIB_BINARY_GCODE_FORMAT_H
+
+#include <stdint.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/**
+ * Constants of the packed g-code format (see encoding.txt), shared by
+ * BinaryGcodeParser and BinaryGcodeEncoder.
+ */
+struct BinaryGcodeFormat {
+    enum {
+        CMD_TYPE_G0 = 1,
+        CMD_TYPE_G1 = 2,
+        CMD_TYPE_G92 = 3,
+        CMD_TYPE_DELTA_G1 = 4, // also 5 to 7, see DeltaHeaderMask
+        CMD_TYPE_DELTA_CONFIG = 8,
+        CMD_TYPE_EOF = 14,
+        CMD_TYPE_LONG = 15,
+    };
+    
+    enum {
+        DATA_TYPE_FLOAT = 1,
+        DATA_TYPE_DOUBLE = 2,
+        DATA_TYPE_UINT32 = 3,
+        DATA_TYPE_UINT64 = 4,
+        DATA_TYPE_VOID = 5
+    };
+    
+    static int const MaxParts = 14;
+    static int const MaxCmdNumber = 2047;
+    static int const MaxPacketSize = 3 + MaxParts * (1 + 8);
+    
+    static uint8_t const EofPacket = CMD_TYPE_EOF << 4;
+    
+    // A delta G1 header has the top bits 01, and the other six bits are
+    // the mask of delta slots present in the packet.
+    static uint8_t const DeltaHeaderMask = 0xC0;
+    static uint8_t const DeltaHeaderTag = CMD_TYPE_DELTA_G1 << 4;
+    static int const DeltaMaxSlots = 6;
+    static int const DeltaMaxDigits = 7;
+    static int const DeltaMaxVarintSize = 5;
+    static int const DeltaMaxPacketSize = 1 + DeltaMaxSlots * DeltaMaxVarintSize;
+    static int const DeltaConfigMaxSize = 1 + DeltaMaxSlots;
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -36,6 +36,8 @@
 #include <aprinter/base/DebugObject.h>
 #include <aprinter/base/Assert.h>
 #include <aprinter/base/Likely.h>
+#include <aprinter/system/Profiler.h>
+#include <aprinter/printer/BinaryGcodeFormat.h>
 
 #include <aprinter/BeginNamespace.h>
 
@@ -46,23 +48,9 @@ struct BinaryGcodeParserParams {
 
 template <typename Context, typename ParentObject, typename Params, typename TBufferSizeType>
 class BinaryGcodeParser {
-    static_assert(Params::MaxParts <= 14, "");
+    static_assert(Params::MaxParts <= BinaryGcodeFormat::MaxParts, "");
     
-    enum {
-        CMD_TYPE_G0 = 1,
-        CMD_TYPE_G1 = 2,
-        CMD_TYPE_G92 = 3,
-        CMD_TYPE_EOF = 14,
-        CMD_TYPE_LONG = 15,
-    };
-    
-    enum {
-        DATA_TYPE_FLOAT = 1,
-        DATA_TYPE_DOUBLE = 2,
-        DATA_TYPE_UINT32 = 3,
-        DATA_TYPE_UINT64 = 4,
-        DATA_TYPE_VOID = 5
-    };
+    using Format = BinaryGcodeFormat;
     
 public:
     struct Object;
@@ -70,11 +58,19 @@ public:
     using PartsSizeType = typename ChooseInt<BitsInInt<Params::MaxParts>::value, true>::Type;
     
 private:
+    // For delta parts, data_size holds the slot index instead. The data is
+    // found at data_offset from the start of the buffer.
     struct Part {
         uint8_t data_type;
         char code;
         uint8_t data_size;
-        uint8_t *data;
+        BufferSizeType data_offset;
+    };
+    
+    struct DeltaSlot {
+        int32_t value;
+        char code;
+        uint8_t digits;
     };
     
 public:
@@ -93,6 +89,7 @@ public:
     {
         auto *o = Object::self(c);
         o->m_state = STATE_NOCMD;
+        o->m_delta_num_slots = 0;
         
         o->debugInit(c);
     }
@@ -112,26 +109,42 @@ public:
     }
     
     static void startCommand (Context c, char *buffer, int8_t assume_error)
+    {
+        startCommand(c, buffer, assume_error, (BufferSizeType)-1, NULL);
+    }
+    
+    /**
+     * Starts a command whose data is in two segments, as in a ring buffer:
+     * the first first_length bytes are at buffer and the rest continues
+     * at wrap_buffer.
+     */
+    static void startCommand (Context c, char *buffer, int8_t assume_error, BufferSizeType first_length, char *wrap_buffer)
     {
         auto *o = Object::self(c);
         o->debugAccess(c);
         AMBRO_ASSERT(o->m_state == STATE_NOCMD)
         AMBRO_ASSERT(buffer)
         AMBRO_ASSERT(assume_error <= 0)
+        AMBRO_ASSERT(first_length > 0)
         
         o->m_state = STATE_HEADER;
         o->m_buffer = (uint8_t *)buffer;
+        o->m_wrap_buffer = (uint8_t *)wrap_buffer;
+        o->m_first_length = first_length;
+        o->m_skipped = 0;
         o->m_length = 0;
         o->m_num_parts = assume_error;
     }
     
     static bool extendCommand (Context c, BufferSizeType avail)
     {
+        AMBRO_PROFILE_SCOPE(c, PROFILE_GCODE_EXTEND);
         auto *o = Object::self(c);
         o->debugAccess(c);
         AMBRO_ASSERT(o->m_state != STATE_NOCMD)
-        AMBRO_ASSERT(avail >= o->m_length)
+        AMBRO_ASSERT(avail >= o->m_skipped + o->m_length)
         
+        avail -= o->m_skipped;
         while (1) {
             switch (o->m_state) {
                 case STATE_HEADER: {
@@ -143,30 +156,40 @@ public:
                         return false;
                     }
                     o->m_length = 1;
-                    o->m_num_parts = o->m_buffer[0] & 0x0f;
+                    if ((cmd_byte(o, 0) & Format::DeltaHeaderMask) == Format::DeltaHeaderTag) {
+                        o->m_cmd_code = 'G';
+                        o->m_cmd_num = 1;
+                        o->m_state = STATE_DELTA;
+                        break;
+                    }
+                    if ((cmd_byte(o, 0) >> 4) == Format::CMD_TYPE_DELTA_CONFIG) {
+                        o->m_state = STATE_DELTA_CONFIG;
+                        break;
+                    }
+                    o->m_num_parts = cmd_byte(o, 0) & 0x0f;
                     if (o->m_num_parts > Params::MaxParts) {
                         o->m_num_parts = ERROR_TOO_MANY_PARTS;
                         goto finish;
                     }
                     o->m_state = STATE_INDEX;
-                    switch (o->m_buffer[0] >> 4) {
-                        case CMD_TYPE_G0: {
+                    switch (cmd_byte(o, 0) >> 4) {
+                        case Format::CMD_TYPE_G0: {
                             o->m_cmd_code = 'G';
                             o->m_cmd_num = 0;
                         } break;
-                        case CMD_TYPE_G1: {
+                        case Format::CMD_TYPE_G1: {
                             o->m_cmd_code = 'G';
                             o->m_cmd_num = 1;
                         } break;
-                        case CMD_TYPE_G92: {
+                        case Format::CMD_TYPE_G92: {
                             o->m_cmd_code = 'G';
                             o->m_cmd_num = 92;
                         } break;
-                        case CMD_TYPE_EOF: {
+                        case Format::CMD_TYPE_EOF: {
                             o->m_num_parts = ERROR_EOF;
                             goto finish;
                         } break;
-                        case CMD_TYPE_LONG: {
+                        case Format::CMD_TYPE_LONG: {
                             o->m_state = STATE_HEADER_LONG;
                         } break;
                     }
@@ -178,11 +201,93 @@ public:
                         return false;
                     }
                     o->m_length = 3;
-                    o->m_cmd_code = 'A' + (o->m_buffer[1] >> 3);
-                    o->m_cmd_num = ((uint16_t)(o->m_buffer[1] & 0x7) << 8) | o->m_buffer[2];
+                    o->m_cmd_code = 'A' + (cmd_byte(o, 1) >> 3);
+                    o->m_cmd_num = ((uint16_t)(cmd_byte(o, 1) & 0x7) << 8) | cmd_byte(o, 2);
                     o->m_state = STATE_INDEX;
                 } break;
                 
+                case STATE_DELTA_CONFIG: {
+                    AMBRO_ASSERT(o->m_length == 1)
+                    uint8_t num_slots = cmd_byte(o, 0) & 0x0f;
+                    if (num_slots > Format::DeltaMaxSlots) {
+                        o->m_num_parts = ERROR_TOO_MANY_PARTS;
+                        goto finish;
+                    }
+                    if (avail < 1 + num_slots) {
+                        return false;
+                    }
+                    // The configuration is not a command by itself, so it is
+                    // consumed here and the following packet is parsed as if
+                    // it started the command.
+                    for (uint8_t i = 0; i < num_slots; i++) {
+                        uint8_t slot_byte = cmd_byte(o, 1 + i);
+                        o->m_delta_slots[i].value = 0;
+                        o->m_delta_slots[i].code = 'A' + (slot_byte & 0x1f);
+                        o->m_delta_slots[i].digits = slot_byte >> 5;
+                    }
+                    o->m_delta_num_slots = num_slots;
+                    o->m_skipped += 1 + num_slots;
+                    avail -= 1 + num_slots;
+                    o->m_length = 0;
+                    o->m_state = STATE_HEADER;
+                } break;
+                
+                case STATE_DELTA: {
+                    AMBRO_ASSERT(o->m_length == 1)
+                    uint8_t mask = cmd_byte(o, 0) & ~Format::DeltaHeaderMask;
+                    PartsSizeType num_values = 0;
+                    for (uint8_t slot = 0; slot < Format::DeltaMaxSlots; slot++) {
+                        num_values += (mask >> slot) & 1;
+                    }
+                    BufferSizeType offset = 1;
+                    uint8_t varint_size = 0;
+                    for (PartsSizeType found = 0; found < num_values;) {
+                        if (offset == avail) {
+                            return false;
+                        }
+                        varint_size++;
+                        if (!(cmd_byte(o, offset++) & 0x80)) {
+                            found++;
+                            varint_size = 0;
+                        } else if (varint_size == Format::DeltaMaxVarintSize) {
+                            o->m_num_parts = ERROR_INVALID_PART;
+                            goto finish;
+                        }
+                    }
+                    o->m_length = offset;
+                    if ((mask >> o->m_delta_num_slots) != 0) {
+                        o->m_num_parts = ERROR_INVALID_PART;
+                        goto finish;
+                    }
+                    if (num_values > Params::MaxParts) {
+                        o->m_num_parts = ERROR_TOO_MANY_PARTS;
+                        goto finish;
+                    }
+                    offset = 1;
+                    o->m_num_parts = 0;
+                    for (uint8_t slot = 0; slot < o->m_delta_num_slots; slot++) {
+                        if (!(mask & (1 << slot))) {
+                            continue;
+                        }
+                        uint32_t zigzag = 0;
+                        uint8_t shift = 0;
+                        uint8_t byte;
+                        do {
+                            byte = cmd_byte(o, offset++);
+                            zigzag |= (uint32_t)(byte & 0x7f) << shift;
+                            shift += 7;
+                        } while (byte & 0x80);
+                        uint32_t delta = (zigzag >> 1) ^ -(zigzag & 1);
+                        DeltaSlot *ds = &o->m_delta_slots[slot];
+                        ds->value = (uint32_t)ds->value + delta;
+                        Part *part = &o->m_parts[o->m_num_parts++];
+                        part->data_type = PART_TYPE_DELTA;
+                        part->code = ds->code;
+                        part->data_size = slot;
+                    }
+                    goto finish;
+                } break;
+                
                 case STATE_INDEX: {
                     AMBRO_ASSERT(o->m_length == 1 || o->m_length == 3)
                     if (avail - o->m_length < o->m_num_parts) {
@@ -192,14 +297,14 @@ public:
                     o->m_length += o->m_num_parts;
                     o->m_total_size = o->m_length;
                     for (PartsSizeType i = 0; i < o->m_num_parts; i++) {
-                        uint8_t index_byte = o->m_buffer[index_offset + i];
+                        uint8_t index_byte = cmd_byte(o, index_offset + i);
                         BufferSizeType data_size;
                         switch (index_byte >> 5) {
-                            case DATA_TYPE_FLOAT:
-                            case DATA_TYPE_UINT32:
+                            case Format::DATA_TYPE_FLOAT:
+                            case Format::DATA_TYPE_UINT32:
                                 data_size = 4;
                                 break;
-                            case DATA_TYPE_VOID:
+                            case Format::DATA_TYPE_VOID:
                                 data_size = 0;
                                 break;
                             default:
@@ -220,7 +325,7 @@ public:
                     }
                     BufferSizeType offset = o->m_length;
                     for (PartsSizeType i = 0; i < o->m_num_parts; i++) {
-                        o->m_parts[i].data = o->m_buffer + offset;
+                        o->m_parts[i].data_offset = o->m_skipped + offset;
                         offset += o->m_parts[i].data_size;
                     }
                     o->m_length = o->m_total_size;
@@ -249,7 +354,7 @@ public:
         o->debugAccess(c);
         AMBRO_ASSERT(o->m_state == STATE_NOCMD)
         
-        return o->m_length;
+        return o->m_skipped + o->m_length;
     }
     
     static PartsSizeType getNumParts (Context c)
@@ -311,23 +416,26 @@ public:
         AMBRO_ASSERT(o->m_state == STATE_NOCMD)
         AMBRO_ASSERT(o->m_num_parts >= 0)
         
-        switch (part->data_type) {
-            case DATA_TYPE_FLOAT: {
-                float val;
-                static_assert(sizeof(val) == 4, "");
-                memcpy(&val, part->data, sizeof(val));
-                return val;
-            } break;
-            
-            case DATA_TYPE_UINT32: {
-                uint32_t val;
-                static_assert(sizeof(val) == 4, "");
-                memcpy(&val, part->data, sizeof(val));
-                return val;
-            } break;
-            
-            default:
-                return 0.0f;
+        return part_fp_value<FpType>(o, part);
+    }
+    
+    /**
+     * Calls handler(code, value) for each parameter in turn, with the value
+     * as getPartFpValue would return it. This is for commands whose
+     * parameters all have real semantics, like G0 and G1, and saves looking
+     * up each parameter through getPart.
+     */
+    template <typename FpType, typename Handler>
+    static void forEachPartFp (Context c, Handler handler)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(o->m_state == STATE_NOCMD)
+        AMBRO_ASSERT(o->m_num_parts >= 0)
+        
+        for (PartsSizeType i = 0; i < o->m_num_parts; i++) {
+            Part *part = &o->m_parts[i];
+            handler(part->code, part_fp_value<FpType>(o, part));
         }
     }
     
@@ -339,10 +447,10 @@ public:
         AMBRO_ASSERT(o->m_num_parts >= 0)
         
         switch (part->data_type) {
-            case DATA_TYPE_UINT32: {
+            case Format::DATA_TYPE_UINT32: {
                 uint32_t val;
                 static_assert(sizeof(val) == 4, "");
-                memcpy(&val, part->data, sizeof(val));
+                read_data(o, part, &val);
                 return val;
             } break;
             
@@ -352,7 +460,68 @@ public:
     }
     
 private:
-    enum {STATE_NOCMD, STATE_HEADER, STATE_HEADER_LONG, STATE_INDEX, STATE_PAYLOAD};
+    enum {STATE_NOCMD, STATE_HEADER, STATE_HEADER_LONG, STATE_INDEX, STATE_PAYLOAD, STATE_DELTA_CONFIG, STATE_DELTA};
+    
+    // Outside of the range of the 3-bit DATA_TYPE_* field.
+    static uint8_t const PART_TYPE_DELTA = 8;
+    
+    template <typename FpType>
+    static FpType part_fp_value (Object *o, Part *part)
+    {
+        switch (part->data_type) {
+            case Format::DATA_TYPE_FLOAT: {
+                float val;
+                static_assert(sizeof(val) == 4, "");
+                read_data(o, part, &val);
+                return val;
+            } break;
+            
+            case Format::DATA_TYPE_UINT32: {
+                uint32_t val;
+                static_assert(sizeof(val) == 4, "");
+                read_data(o, part, &val);
+                return val;
+            } break;
+            
+            case PART_TYPE_DELTA: {
+                DeltaSlot *ds = &o->m_delta_slots[part->data_size];
+                return (FpType)ds->value / power_of_ten<FpType>(ds->digits);
+            } break;
+            
+            default:
+                return 0.0f;
+        }
+    }
+    
+    static uint8_t byte_at (Object *o, BufferSizeType pos)
+    {
+        return AMBRO_LIKELY(pos < o->m_first_length) ? o->m_buffer[pos] : o->m_wrap_buffer[pos - o->m_first_length];
+    }
+    
+    // Bytes of the packet being parsed, after any skipped delta configuration.
+    static uint8_t cmd_byte (Object *o, BufferSizeType pos)
+    {
+        return byte_at(o, o->m_skipped + pos);
+    }
+    
+    static void read_data (Object *o, Part *part, void *dst)
+    {
+        uint8_t bytes[4];
+        for (uint8_t i = 0; i < 4; i++) {
+            bytes[i] = byte_at(o, part->data_offset + i);
+        }
+        memcpy(dst, bytes, sizeof(bytes));
+    }
+    
+    template <typename FpType>
+    static FpType power_of_ten (uint8_t digits)
+    {
+        uint32_t result = 1;
+        while (digits-- > 0) {
+            result *= 10;
+        }
+        return result;
+    }
     
 public:
     struct Object : public ObjBase<BinaryGcodeParser, ParentObject, EmptyTypeList>,
@@ -360,12 +529,17 @@ public:
     {
         uint8_t m_state;
         uint8_t *m_buffer;
+        uint8_t *m_wrap_buffer;
+        BufferSizeType m_first_length;
+        BufferSizeType m_skipped;
         BufferSizeType m_length;
         uint8_t m_cmd_code;
         uint16_t m_cmd_num;
         PartsSizeType m_num_parts;
         BufferSizeType m_total_size;
         Part m_parts[Params::MaxParts];
+        uint8_t m_delta_num_slots;
+        DeltaSlot m_delta_slots[Format::DeltaMaxSlots];
     };
 };
 
@@ -33,15 +33,18 @@
 #include <aprinter/meta/ChooseInt.h>
 #include <aprinter/meta/Object.h>
 #include <aprinter/math/FloatTools.h>
+#include <aprinter/math/ParseDecimal.h>
 #include <aprinter/base/DebugObject.h>
 #include <aprinter/base/Assert.h>
 #include <aprinter/base/Likely.h>
+#include <aprinter/system/Profiler.h>
 
 #include <aprinter/BeginNamespace.h>
 
-template <int TMaxParts>
+template <int TMaxParts, int TMaxPartLength = 31>
 struct GcodeParserParams {
     static const int MaxParts = TMaxParts;
+    static const int MaxPartLength = TMaxPartLength;
 };
 
 struct GcodeParserTypeSerial {};
@@ -50,12 +53,19 @@ struct GcodeParserTypeFile {};
 template <typename Context, typename ParentObject, typename Params, typename TBufferSizeType, typename ParserType>
 class GcodeParser {
     static_assert(Params::MaxParts > 0, "");
+    static_assert(Params::MaxPartLength > 0, "");
     
 public:
     struct Object;
     using BufferSizeType = TBufferSizeType;
     using PartsSizeType = typename ChooseInt<BitsInInt<Params::MaxParts>::value, true>::Type;
     
+    // The longest part value accepted, not counting the code letter. A value
+    // which continues from the end of the first segment into the second one
+    // is put together in a buffer, but the limit is the same for all parts,
+    // so whether a command parses does not depend on where it is.
+    static int const MaxPartLength = Params::MaxPartLength;
+    
     enum {
         ERROR_NO_PARTS = -1, // must be -1
         ERROR_TOO_MANY_PARTS = -2,
@@ -111,15 +121,29 @@ public:
     }
     
     static void startCommand (Context c, char *buffer, int8_t assume_error)
+    {
+        startCommand(c, buffer, assume_error, (BufferSizeType)-1, NULL);
+    }
+    
+    /**
+     * Starts a command whose data is in two segments, as in a ring buffer:
+     * the first first_length bytes are at buffer and the rest continues
+     * at wrap_buffer. Values are parsed in place, except one which crosses
+     * from one segment into the other.
+     */
+    static void startCommand (Context c, char *buffer, int8_t assume_error, BufferSizeType first_length, char *wrap_buffer)
     {
         auto *o = Object::self(c);
         o->debugAccess(c);
         AMBRO_ASSERT(o->m_state == STATE_NOCMD)
         AMBRO_ASSERT(buffer)
         AMBRO_ASSERT(assume_error <= 0)
+        AMBRO_ASSERT(first_length > 0)
         
         o->m_state = STATE_OUTSIDE;
         o->m_buffer = buffer;
+        o->m_first_length = first_length;
+        o->m_wrap_buffer = wrap_buffer;
         o->m_command.length = 0;
         o->m_command.num_parts = assume_error;
         TheTypeHelper::init_command_hook(c);
@@ -127,13 +151,14 @@ public:
     
     static bool extendCommand (Context c, BufferSizeType avail)
     {
+        AMBRO_PROFILE_SCOPE(c, PROFILE_GCODE_EXTEND);
         auto *o = Object::self(c);
         o->debugAccess(c);
         AMBRO_ASSERT(o->m_state != STATE_NOCMD)
         AMBRO_ASSERT(avail >= o->m_command.length)
         
         for (; o->m_command.length < avail; o->m_command.length++) {
-            char ch = o->m_buffer[o->m_command.length];
+            char ch = *buf_ptr(o, o->m_command.length);
             
             if (AMBRO_UNLIKELY(ch == '\n')) {
                 if (o->m_command.num_parts >= 0) {
@@ -145,7 +170,7 @@ public:
                     if (o->m_command.num_parts >= 0) {
                         o->m_command.num_parts--; // becomes ERROR_NO_PARTS if num_parts==0
                         if (o->m_command.num_parts >= 0) {
-                            o->m_command.cmd_number = atoi(o->m_command.parts[0].data);
+                            o->m_command.cmd_number = convertUint<uint16_t>(o->m_command.parts[0].data);
                         }
                     }
                 }
@@ -286,7 +311,7 @@ public:
         AMBRO_ASSERT(o->m_state == STATE_NOCMD)
         AMBRO_ASSERT(o->m_command.num_parts >= 0)
         
-        return StrToFloat<FpType>(part->data, NULL);
+        return convertFp<FpType>(part->data);
     }
     
     static uint32_t getPartUint32Value (Context c, PartRef part)
@@ -296,7 +321,17 @@ public:
         AMBRO_ASSERT(o->m_state == STATE_NOCMD)
         AMBRO_ASSERT(o->m_command.num_parts >= 0)
         
-        return strtoul(part->data, NULL, 10);
+        return convertUint<uint32_t>(part->data);
+    }
+    
+    static char const * getPartStringValue (Context c, PartRef part)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(o->m_state == STATE_NOCMD)
+        AMBRO_ASSERT(o->m_command.num_parts >= 0)
+        
+        return part->data;
     }
     
     static char * getBuffer (Context c)
@@ -317,6 +352,35 @@ public:
         return &o->m_command;
     }
     
+    /**
+     * Converts a part value like getPartFpValue and getPartUint32Value do.
+     * Ordinary numbers go through ParseDecimal, anything else through the
+     * C library.
+     */
+    template <typename FpType>
+    static FpType convertFp (char const *str)
+    {
+#ifndef AMBROLIB_AVR
+        FpType value;
+        if (AMBRO_LIKELY(ParseDecimalFp<FpType>(str, &value))) {
+            return value;
+        }
+#endif
+        return StrToFloat<FpType>(str, NULL);
+    }
+    
+    template <typename T>
+    static T convertUint (char const *str)
+    {
+#ifndef AMBROLIB_AVR
+        T value;
+        if (AMBRO_LIKELY(ParseDecimalUint<T>(str, &value))) {
+            return value;
+        }
+#endif
+        return strtoul(str, NULL, 10);
+    }
+    
 private:
     enum {STATE_NOCMD, STATE_OUTSIDE, STATE_INSIDE, STATE_COMMENT, STATE_CHECKSUM};
     
@@ -336,12 +400,12 @@ private:
             o->m_command.have_line_number = false;
         }
         
-        static bool finish_part_hook (Context c, char code)
+        static bool finish_part_hook (Context c, char code, char *data)
         {
             auto *o = Object::self(c);
             if (AMBRO_UNLIKELY(!o->m_command.have_line_number && o->m_command.num_parts == 0 && code == 'N')) {
                 o->m_command.have_line_number = true;
-                o->m_command.line_number = strtoul(o->m_buffer + (o->m_temp + 1), NULL, 10);
+                o->m_command.line_number = convertUint<uint32_t>(data);
                 return true;
             }
             return false;
@@ -359,10 +423,10 @@ private:
             AMBRO_ASSERT(o->m_command.num_parts >= 0)
             AMBRO_ASSERT(o->m_state == STATE_CHECKSUM)
             
-            char *received = o->m_buffer + (o->m_temp + 1);
-            BufferSizeType received_len = o->m_command.length - (o->m_temp + 1);
+            BufferSizeType received_pos = o->m_temp + 1;
+            BufferSizeType received_len = o->m_command.length - received_pos;
             
-            if (AMBRO_UNLIKELY(!compare_checksum(o->m_checksum, received, received_len))) {
+            if (AMBRO_UNLIKELY(!compare_checksum(o, o->m_checksum, received_pos, received_len))) {
                 o->m_command.num_parts = ERROR_CHECKSUM;
             }
         }
@@ -378,7 +442,7 @@ private:
         {
         }
         
-        static bool finish_part_hook (Context c, char code)
+        static bool finish_part_hook (Context c, char code, char *data)
         {
             return false;
         }
@@ -404,15 +468,20 @@ private:
         return (ch == ' ' || ch == '\t' || ch == '\r');
     }
     
-    static bool compare_checksum (uint8_t expected, char const *received, BufferSizeType received_len)
+    static char * buf_ptr (Object *o, BufferSizeType pos)
     {
-        while (received_len > 0 && is_space(received[received_len - 1])) {
+        return AMBRO_LIKELY(pos < o->m_first_length) ? (o->m_buffer + pos) : (o->m_wrap_buffer + (pos - o->m_first_length));
+    }
+    
+    static bool compare_checksum (Object *o, uint8_t expected, BufferSizeType received_pos, BufferSizeType received_len)
+    {
+        while (received_len > 0 && is_space(*buf_ptr(o, received_pos + received_len - 1))) {
             received_len--;
         }
         
         do {
             char ch = '0' + (expected % 10);
-            if (received_len == 0 || received[received_len - 1] != ch) {
+            if (received_len == 0 || *buf_ptr(o, received_pos + received_len - 1) != ch) {
                 return false;
             }
             expected /= 10;
@@ -427,26 +496,54 @@ private:
         auto *o = Object::self(c);
         AMBRO_ASSERT(o->m_command.num_parts >= 0)
         AMBRO_ASSERT(o->m_state == STATE_INSIDE)
-        AMBRO_ASSERT(is_code(o->m_buffer[o->m_temp]))
+        AMBRO_ASSERT(is_code(*buf_ptr(o, o->m_temp)))
         
         if (AMBRO_UNLIKELY(o->m_command.num_parts == Params::MaxParts)) {
             o->m_command.num_parts = ERROR_TOO_MANY_PARTS;
             return;
         }
         
-        char code = o->m_buffer[o->m_temp];
+        char code = *buf_ptr(o, o->m_temp);
         
-        o->m_buffer[o->m_command.length] = '\0';
+        char *data = finish_part_data(o);
+        if (AMBRO_UNLIKELY(!data)) {
+            o->m_command.num_parts = ERROR_INVALID_PART;
+            return;
+        }
         
-        if (TheTypeHelper::finish_part_hook(c, code)) {
+        if (TheTypeHelper::finish_part_hook(c, code, data)) {
             return;
         }
         
         o->m_command.parts[o->m_command.num_parts].code = code;
-        o->m_command.parts[o->m_command.num_parts].data = o->m_buffer + (o->m_temp + 1);
+        o->m_command.parts[o->m_command.num_parts].data = data;
         o->m_command.num_parts++;
     }
     
+    static char * finish_part_data (Object *o)
+    {
+        BufferSizeType start = o->m_temp + 1;
+        BufferSizeType end = o->m_command.length;
+        BufferSizeType length = end - start;
+        if (AMBRO_UNLIKELY(length > MaxPartLength)) {
+            return NULL;
+        }
+        
+        // The terminator replaces the character after the value, so the value
+        // stays in place unless it or its terminator is past the wrap.
+        if (AMBRO_LIKELY(end < o->m_first_length || start >= o->m_first_length)) {
+            *buf_ptr(o, end) = '\0';
+            return buf_ptr(o, start);
+        }
+        
+        // At most one part can cross, so the buffer is free.
+        for (BufferSizeType i = 0; i < length; i++) {
+            o->m_wrapped_part[i] = *buf_ptr(o, start + i);
+        }
+        o->m_wrapped_part[length] = '\0';
+        return o->m_wrapped_part;
+    }
+    
     template <typename TheParserType, typename Dummy = void>
     struct ExtraMembers {};
     
@@ -462,8 +559,11 @@ public:
     {
         uint8_t m_state;
         char *m_buffer;
+        char *m_wrap_buffer;
+        BufferSizeType m_first_length;
         BufferSizeType m_temp;
         Command m_command;
+        char m_wrapped_part[MaxPartLength + 1];
     };
 };
 
@@ -62,6 +62,11 @@ struct LinearPlanner {
         s->end_v = FloatMin(segment->max_end_v, end_v);
         return s->end_v + segment->a_x;
     }
+    
+    static bool sameState (SegmentState const *s1, SegmentState const *s2)
+    {
+        return (s1->end_v == s2->end_v);
+    }
 
     static FpType pull (SegmentData *segment, SegmentState *s, FpType start_v, SegmentResult *result)
     {
@@ -47,10 +47,12 @@
 #include <aprinter/meta/MakeTypeList.h>
 #include <aprinter/meta/WrapFunction.h>
 #include <aprinter/meta/JoinTypeLists.h>
+#include <aprinter/meta/StructIf.h>
 #include <aprinter/base/Assert.h>
 #include <aprinter/base/Likely.h>
 #include <aprinter/math/FloatTools.h>
 #include <aprinter/system/InterruptLock.h>
+#include <aprinter/system/Profiler.h>
 #include <aprinter/printer/LinearPlanner.h>
 
 #include <aprinter/BeginNamespace.h>
@@ -60,7 +62,8 @@ template <
     int TStepBits,
     typename TDistanceFactor,
     typename TCorneringDistance,
-    typename TPrestepCallback
+    typename TPrestepCallback,
+    typename TAdvanceParams
 >
 struct MotionPlannerAxisSpec {
     using TheAxisStepper = TTheAxisStepper;
@@ -68,6 +71,25 @@ struct MotionPlannerAxisSpec {
     using DistanceFactor = TDistanceFactor;
     using CorneringDistance = TCorneringDistance;
     using PrestepCallback = TPrestepCallback;
+    using AdvanceParams = TAdvanceParams;
+};
+
+struct MotionPlannerNoAdvanceParams {
+    static bool const Enabled = false;
+};
+
+// Pressure advance for an extruder axis: the axis is kept ahead of its
+// nominal position by AdvanceTime (in seconds) times its velocity, so it
+// pushes out more while accelerating and less while decelerating, and
+// may retract at the end of a deceleration. Only segments which move the
+// axis forward together with some other axis are advanced. Each stepper
+// command may then be split in two, and the axis' buffers grow accordingly.
+// The offset never drives the axis past the max_v_rec of its moves; what
+// is left over is made up by later commands, possibly of later moves.
+template <typename TAdvanceTime>
+struct MotionPlannerAdvanceParams {
+    static bool const Enabled = true;
+    using AdvanceTime = TAdvanceTime;
 };
 
 template <
@@ -107,10 +129,8 @@ private:
     using MinTimeTypeHelper = FixedIntersectTypes<typename AxisSpec::TheAxisStepper::TimeFixedType, AccumType>;
     using MinTimeType = TypeListFold<ParamsAxesList, FixedIdentity, MinTimeTypeHelper>;
     using SegmentBufferSizeType = typename ChooseInt<BitsInInt<2 * LookaheadBufferSize>::value, false>::Type; // twice for segments_add()
-    static const size_t StepperCommitBufferSize = 3 * StepperSegmentBufferSize;
-    static const size_t StepperBackupBufferSize = 3 * (LookaheadBufferSize - LookaheadCommitCount);
-    using StepperCommitBufferSizeType = typename ChooseInt<BitsInInt<StepperCommitBufferSize>::value, false>::Type;
-    using StepperBackupBufferSizeType = typename ChooseInt<BitsInInt<2 * StepperBackupBufferSize>::value, false>::Type;
+    
+    static const size_t CommandsPerSegment = 3;
     using StepperFastEvent = typename Context::EventLoop::template FastEventSpec<MotionPlanner>;
     static const int TypeBits = BitsInInt<NumChannels>::value;
     using AxisMaskType = typename ChooseInt<NumAxes + TypeBits, false>::Type;
@@ -133,6 +153,8 @@ private:
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_compute_segment_buffer_cornering_speed, compute_segment_buffer_cornering_speed)
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_have_commit_space, have_commit_space)
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_start_commands, start_commands)
+    AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_moves_besides, moves_besides)
+    AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_save_staging, save_staging)
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_gen_segment_stepper_commands, gen_segment_stepper_commands)
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_do_commit, do_commit)
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_do_commit_cold, do_commit_cold)
@@ -186,8 +208,17 @@ private:
         TimeType time;
     };
     
+    // The speed limit of an advanced axis, which its offset changes obey.
+    template <int AxisIndex, bool Advance = TypeListGet<ParamsAxesList, AxisIndex>::AdvanceParams::Enabled>
+    struct AxisSegmentAdvance {};
+    
+    template <int AxisIndex>
+    struct AxisSegmentAdvance<AxisIndex, true> {
+        FpType max_v_rec;
+    };
+    
     template <int AxisIndex>
-    struct AxisSegment {
+    struct AxisSegment : public AxisSegmentAdvance<AxisIndex> {
         using AxisSpec = TypeListGet<ParamsAxesList, AxisIndex>;
         using TheAxisStepper = typename AxisSpec::TheAxisStepper;
         using StepperStepFixedType = typename TheAxisStepper::StepFixedType;
@@ -207,6 +238,7 @@ private:
     struct Segment {
         AxisMaskType dir_and_type;
         typename TheLinearPlanner::SegmentData lp_seg;
+        typename TheLinearPlanner::SegmentState lp_state;
         union {
             struct {
                 FpType max_accel_rec;
@@ -241,6 +273,149 @@ public:
         using TheAxisSegment = AxisSegment<AxisIndex>;
         static const AxisMaskType TheAxisMask = (AxisMaskType)1 << (AxisIndex + TypeBits);
         
+        AMBRO_STRUCT_IF(AdvanceFeature, AxisSpec::AdvanceParams::Enabled) {
+            struct Object;
+            static int const CommandMultiplier = 2;
+            using StepType = typename ChooseInt<StepperStepFixedType::num_bits + 2, true>::Type;
+            
+            static void init (Context c)
+            {
+                auto *o = Object::self(c);
+                o->m_staging_offset = 0;
+                o->m_end_offset = 0;
+            }
+            
+            static void start_commands (Context c)
+            {
+                auto *o = Object::self(c);
+                o->m_offset = o->m_staging_offset;
+            }
+            
+            static void save_staging (Context c)
+            {
+                auto *o = Object::self(c);
+                o->m_staging_offset = o->m_offset;
+            }
+            
+            static void do_commit (Context c)
+            {
+                auto *o = Object::self(c);
+                o->m_end_offset = o->m_offset;
+            }
+            
+            // The backup commands of the last committed plan have all been done.
+            static void stopped_stepping (Context c)
+            {
+                auto *o = Object::self(c);
+                o->m_staging_offset = o->m_end_offset;
+            }
+            
+            static void reset_aborted (Context c)
+            {
+                auto *o = Object::self(c);
+                o->m_staging_offset = 0;
+            }
+            
+            static void start_segment (Context c, Segment *entry)
+            {
+                auto *o = Object::self(c);
+                TheAxisSegment *axis_entry = TupleGetElem<AxisIndex>(&entry->axes);
+                o->m_max_v = 1.0f / axis_entry->max_v_rec;
+                // Axis steps per unit of segment velocity times the advance time;
+                // x * distance_rec equals 2 * half_accel * max_accel_rec.
+                o->m_factor = 0.0f;
+                if ((entry->dir_and_type & TheAxisMask) && ListForEachForwardAccRes<AxesList>(false, LForeach_moves_besides(), entry, AxisIndex)) {
+                    o->m_factor = (FpType)(2.0 * AxisSpec::AdvanceParams::AdvanceTime::value() * Clock::time_freq) * entry->half_accel[AxisIndex] * entry->max_accel_rec;
+                }
+            }
+            
+            static void write_segment (TheAxisSplitBuffer *axis_split, TheAxisSegment *axis_entry)
+            {
+                axis_entry->max_v_rec = axis_split->max_v_rec;
+            }
+            
+            // The offset at the end of the command is the advance for the segment
+            // velocity v_end there. Its change is spread evenly over the command's
+            // time, which leaves the acceleration alone; commands taking no time
+            // pass it on to the next one. The change is cut short where the axis
+            // would exceed its speed limit at either end of the command, and the
+            // rest is left to the following commands. Positions below are signed,
+            // positive for dir set.
+            static void gen_command (Context c, bool dir, StepperStepFixedType x, StepperTimeFixedType t, StepperAccelFixedType a, FpType v_end)
+            {
+                auto *o = Object::self(c);
+                if (t.bitsValue() == 0) {
+                    write_stepper_command(c, dir, x, t, a);
+                    return;
+                }
+                StepType max_x = StepperStepFixedType::maxValue().bitsValue();
+                StepType target = (StepType)FloatRound(FloatMin(o->m_factor * v_end, (FpType)(max_x / 2)));
+                StepType xs = dir ? (StepType)x.bitsValue() : -(StepType)x.bitsValue();
+                StepType as = dir ? (StepType)a.bitsValue() : -(StepType)a.bitsValue();
+                StepType xn = xs + (target - o->m_offset);
+                // The speed at either end is at most (|xn| + |as|) / t. The nominal
+                // command itself is never cut.
+                StepType limit = (StepType)FloatMax((FpType)((xs >= 0) ? xs : -xs), FloatMin((FpType)max_x, o->m_max_v * t.template fpValue<FpType>() - (FpType)((as >= 0) ? as : -as)));
+                if (xn > limit) {
+                    xn = limit;
+                } else if (xn < -limit) {
+                    xn = -limit;
+                }
+                o->m_offset += xn - xs;
+                
+                // Velocity at the start is proportional to xn - as, at the end to xn + as.
+                if ((xn >= as && xn >= -as) || (xn <= as && xn <= -as)) {
+                    write_signed_command(c, xn, t, (xn >= 0) ? as : -as);
+                    return;
+                }
+                
+                // The velocity crosses zero within the command, so split it there.
+                FpType as_fp = as;
+                FpType s = (as_fp - xn) / (2.0f * as_fp);
+                StepperTimeFixedType t1 = FixedMin(t, StepperTimeFixedType::template importFpSaturatedRound<FpType>(s * t.template fpValue<FpType>()));
+                StepperTimeFixedType t2 = StepperTimeFixedType::importBits(t.bitsValue() - t1.bitsValue());
+                StepType p1 = (StepType)FloatRound(-(xn - as_fp) * (xn - as_fp) / (4.0f * as_fp));
+                StepType p2 = xn - p1;
+                write_signed_command(c, p1, t1, -((p1 >= 0) ? p1 : -p1));
+                write_signed_command(c, p2, t2, (p2 >= 0) ? p2 : -p2);
+            }
+            
+            static void write_signed_command (Context c, StepType xs, StepperTimeFixedType t, StepType a)
+            {
+                bool dir = (xs >= 0);
+                write_stepper_command(c, dir, StepperStepFixedType::importBits(dir ? xs : -xs), t, StepperAccelFixedType::importBits(a));
+            }
+            
+            struct Object : public ObjBase<AdvanceFeature, typename Axis::Object, EmptyTypeList> {
+                FpType m_factor;
+                FpType m_max_v;
+                StepType m_offset;
+                StepType m_staging_offset;
+                StepType m_end_offset;
+            };
+        } AMBRO_STRUCT_ELSE(AdvanceFeature) {
+            static int const CommandMultiplier = 1;
+            static void init (Context c) {}
+            static void start_commands (Context c) {}
+            static void save_staging (Context c) {}
+            static void do_commit (Context c) {}
+            static void stopped_stepping (Context c) {}
+            static void reset_aborted (Context c) {}
+            static void start_segment (Context c, Segment *entry) {}
+            static void write_segment (TheAxisSplitBuffer *axis_split, TheAxisSegment *axis_entry) {}
+            static void gen_command (Context c, bool dir, StepperStepFixedType x, StepperTimeFixedType t, StepperAccelFixedType a, FpType v_end)
+            {
+                write_stepper_command(c, dir, x, t, a);
+            }
+            struct Object {};
+        };
+        
+        static const size_t AxisCommandsPerSegment = AdvanceFeature::CommandMultiplier * CommandsPerSegment;
+        static const size_t StepperCommitBufferSize = AxisCommandsPerSegment * StepperSegmentBufferSize;
+        static const size_t StepperBackupBufferSize = AxisCommandsPerSegment * (LookaheadBufferSize - LookaheadCommitCount);
+        using StepperCommitBufferSizeType = typename ChooseInt<BitsInInt<StepperCommitBufferSize>::value, false>::Type;
+        using StepperBackupBufferSizeType = typename ChooseInt<BitsInInt<2 * StepperBackupBufferSize>::value, false>::Type;
+        
         static void init (Context c, bool prestep_callback_enabled)
         {
             auto *o = Object::self(c);
@@ -249,6 +424,7 @@ public:
             o->m_backup_start = 0;
             o->m_backup_end = 0;
             o->m_busy = false;
+            AdvanceFeature::init(c);
             TheAxisStepper::setPrestepCallbackEnabled(c, prestep_callback_enabled);
         }
         
@@ -309,6 +485,7 @@ public:
             }
             axis_entry->x = StepperStepFixedType::importBits(new_x.bitsValue() - axis_split->x_pos.bitsValue());
             axis_split->x_pos = new_x;
+            AdvanceFeature::write_segment(axis_split, axis_entry);
         }
         
         static FpType compute_segment_buffer_entry_distance (FpType accum, Segment *entry)
@@ -353,7 +530,7 @@ public:
         static bool have_commit_space (bool accum, Context c)
         {
             auto *o = Object::self(c);
-            return (accum && commit_avail(o->m_commit_start, o->m_commit_end) > 3 * LookaheadCommitCount);
+            return (accum && commit_avail(o->m_commit_start, o->m_commit_end) > AxisCommandsPerSegment * LookaheadCommitCount);
         }
         
         static void start_commands (Context c)
@@ -362,11 +539,24 @@ public:
             auto *m = MotionPlanner::Object::self(c);
             o->m_new_commit_end = o->m_commit_end;
             o->m_new_backup_end = m->m_current_backup ? 0 : StepperBackupBufferSize;
+            AdvanceFeature::start_commands(c);
         }
         
-        static void gen_segment_stepper_commands (Context c, Segment *entry, FpType frac_x0, FpType frac_x2, MinTimeType t0, MinTimeType t2, MinTimeType t1, FpType t0_squared, FpType t2_squared)
+        static bool moves_besides (bool accum, Segment *entry, int axis_index)
         {
             TheAxisSegment *axis_entry = TupleGetElem<AxisIndex>(&entry->axes);
+            return (accum || (AxisIndex != axis_index && axis_entry->x.bitsValue() != 0));
+        }
+        
+        static void save_staging (Context c)
+        {
+            AdvanceFeature::save_staging(c);
+        }
+        
+        static void gen_segment_stepper_commands (Context c, Segment *entry, FpType frac_x0, FpType frac_x2, MinTimeType t0, MinTimeType t2, MinTimeType t1, FpType t0_squared, FpType t2_squared, FpType v_const, FpType v_end)
+        {
+            TheAxisSegment *axis_entry = TupleGetElem<AxisIndex>(&entry->axes);
+            AdvanceFeature::start_segment(c, entry);
             
             StepperStepFixedType x1 = axis_entry->x;
             StepperStepFixedType x0 = FixedMin(x1, StepperStepFixedType::template importFpSaturatedRound<FpType>(frac_x0 * axis_entry->x.template fpValue<FpType>()));
@@ -393,17 +583,22 @@ public:
             
             bool dir = entry->dir_and_type & TheAxisMask;
             if (x0.bitsValue() != 0) {
-                gen_stepper_command(c, dir, x0, t0, FixedMin(x0, StepperAccelFixedType::template importFpSaturatedRound<FpType>(entry->half_accel[AxisIndex] * t0_squared)));
+                gen_stepper_command(c, dir, x0, t0, FixedMin(x0, StepperAccelFixedType::template importFpSaturatedRound<FpType>(entry->half_accel[AxisIndex] * t0_squared)), (gen1 || x2.bitsValue() != 0) ? v_const : v_end);
             }
             if (gen1) {
-                gen_stepper_command(c, dir, x1, t1, StepperAccelFixedType::importBits(0));
+                gen_stepper_command(c, dir, x1, t1, StepperAccelFixedType::importBits(0), (x2.bitsValue() != 0) ? v_const : v_end);
             }
             if (x2.bitsValue() != 0) {
-                gen_stepper_command(c, dir, x2, t2, -FixedMin(x2, StepperAccelFixedType::template importFpSaturatedRound<FpType>(entry->half_accel[AxisIndex] * t2_squared)));
+                gen_stepper_command(c, dir, x2, t2, -FixedMin(x2, StepperAccelFixedType::template importFpSaturatedRound<FpType>(entry->half_accel[AxisIndex] * t2_squared)), v_end);
             }
         }
         
-        static void gen_stepper_command (Context c, bool dir, StepperStepFixedType x, StepperTimeFixedType t, StepperAccelFixedType a)
+        static void gen_stepper_command (Context c, bool dir, StepperStepFixedType x, StepperTimeFixedType t, StepperAccelFixedType a, FpType v_end)
+        {
+            AdvanceFeature::gen_command(c, dir, x, t, a, v_end);
+        }
+        
+        static void write_stepper_command (Context c, bool dir, StepperStepFixedType x, StepperTimeFixedType t, StepperAccelFixedType a)
         {
             auto *o = Object::self(c);
             auto *m = MotionPlanner::Object::self(c);
@@ -426,6 +621,7 @@ public:
             o->m_commit_end = o->m_new_commit_end;
             o->m_backup_start = m->m_current_backup ? 0 : StepperBackupBufferSize;
             o->m_backup_end = o->m_new_backup_end;
+            AdvanceFeature::do_commit(c);
         }
         
         static void start_stepping (Context c, TimeType start_time)
@@ -459,6 +655,7 @@ public:
             o->m_commit_start = 0;
             o->m_commit_end = 0;
             o->m_busy = false;
+            AdvanceFeature::reset_aborted(c);
         }
         
         static void stopped_stepping (Context c)
@@ -466,6 +663,7 @@ public:
             auto *o = Object::self(c);
             o->m_backup_start = 0;
             o->m_backup_end = 0;
+            AdvanceFeature::stopped_stepping(c);
         }
         
         static bool stepper_command_callback (StepperCommandCallbackContext c, StepperCommand **cmd)
@@ -571,7 +769,9 @@ public:
             return TupleGetElem<AxisIndex>(&m->m_split_buffer.axes);
         }
         
-        struct Object : public ObjBase<Axis, typename MotionPlanner::Object, EmptyTypeList> {
+        struct Object : public ObjBase<Axis, typename MotionPlanner::Object, MakeTypeList<
+            AdvanceFeature
+        >> {
             StepperCommitBufferSizeType m_commit_start;
             StepperCommitBufferSizeType m_commit_end;
             StepperBackupBufferSizeType m_backup_start;
@@ -806,6 +1006,7 @@ public:
         o->m_segments_start = 0;
         o->m_segments_staging_length = 0;
         o->m_segments_length = 0;
+        o->m_segments_pushed_length = 0;
         o->m_staging_time = 0;
         o->m_staging_v_squared = 0.0f;
         o->m_split_buffer.type = 0xFF;
@@ -816,6 +1017,9 @@ public:
         o->m_current_backup = false;
 #ifdef AMBROLIB_ASSERTIONS
         o->m_pulling = false;
+#endif
+#ifdef MOTIONPLANNER_BENCHMARK
+        resetBench(c);
 #endif
         ListForEachForward<AxesList>(LForeach_init(), c, prestep_callback_enabled);
         ListForEachForward<ChannelsList>(LForeach_init(), c);
@@ -934,6 +1138,43 @@ public:
     template <int ChannelIndex>
     using GetChannelTimer = typename Channel<ChannelIndex>::TheTimer;
     
+    // The number of segments which could be added to the look-ahead buffer.
+    static SegmentBufferSizeType getFreeSegments (Context c)
+    {
+        auto *o = Object::self(c);
+        return (LookaheadBufferSize - o->m_segments_length);
+    }
+    
+#ifdef MOTIONPLANNER_BENCHMARK
+    // Total time spent in plan(), the number of plan() calls, and the
+    // number of segments visited by the backward pass.
+    static void resetBench (Context c)
+    {
+        auto *o = Object::self(c);
+        o->m_bench_time = 0;
+        o->m_bench_plans = 0;
+        o->m_bench_pushes = 0;
+    }
+    
+    static TimeType getBenchTime (Context c)
+    {
+        auto *o = Object::self(c);
+        return o->m_bench_time;
+    }
+    
+    static uint32_t getBenchPlans (Context c)
+    {
+        auto *o = Object::self(c);
+        return o->m_bench_plans;
+    }
+    
+    static uint32_t getBenchPushes (Context c)
+    {
+        auto *o = Object::self(c);
+        return o->m_bench_pushes;
+    }
+#endif
+    
     template <int AxisIndex>
     using TheAxisStepperConsumer = AxisStepperConsumer<
         AMBRO_WFUNC_T(&Axis<AxisIndex>::stepper_command_callback),
@@ -945,22 +1186,30 @@ public:
 private:
     static bool plan (Context c)
     {
+        AMBRO_PROFILE_SCOPE(c, PROFILE_PLANNER_PLAN);
         auto *o = Object::self(c);
         AMBRO_ASSERT(o->m_state != STATE_ABORTED)
         AMBRO_ASSERT(o->m_segments_staging_length != o->m_segments_length)
 #ifdef AMBROLIB_ASSERTIONS
         AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) { AMBRO_ASSERT(planner_have_commit_space(c)) }
 #endif
-        
-        typename TheLinearPlanner::SegmentState state[LookaheadBufferSize];
+        bench_start_measuring(c);
         
         SegmentBufferSizeType i = o->m_segments_length;
         FpType v = 0.0f;
         do {
             i--;
             Segment *entry = &o->m_segments[segments_add(o->m_segments_start, i)];
-            v = TheLinearPlanner::push(&entry->lp_seg, &state[i], v);
+            typename TheLinearPlanner::SegmentState old_state = entry->lp_state;
+            v = TheLinearPlanner::push(&entry->lp_seg, &entry->lp_state, v);
+            bench_count_push(c);
+            // If the state of a segment pushed in a previous plan did not change,
+            // the states of the segments before it did not change either.
+            if (i < o->m_segments_pushed_length && TheLinearPlanner::sameState(&entry->lp_state, &old_state)) {
+                break;
+            }
         } while (i != 0);
+        o->m_segments_pushed_length = o->m_segments_length;
         
         SegmentBufferSizeType commit_count = (o->m_segments_length < LookaheadCommitCount) ? o->m_segments_length : LookaheadCommitCount;
         
@@ -971,11 +1220,12 @@ private:
         TimeType time = o->m_staging_time;
         v = o->m_staging_v_squared;
         FpType v_start = FloatSqrt(v);
+        i = 0;
         
         do {
             Segment *entry = &o->m_segments[segments_add(o->m_segments_start, i)];
             typename TheLinearPlanner::SegmentResult result;
-            v = TheLinearPlanner::pull(&entry->lp_seg, &state[i], v, &result);
+            v = TheLinearPlanner::pull(&entry->lp_seg, &entry->lp_state, v, &result);
             if (AMBRO_LIKELY((entry->dir_and_type & TypeMask) == 0)) {
                 FpType v_end = FloatSqrt(v);
                 FpType v_const = FloatSqrt(result.const_v);
@@ -990,7 +1240,7 @@ private:
                 t1.m_bits.m_int -= t2.bitsValue();
                 ListForEachForward<AxesList>(LForeach_gen_segment_stepper_commands(), c, entry,
                                     result.const_start, result.const_end, t0, t2, t1,
-                                    t0_double * t0_double, t2_double * t2_double);
+                                    t0_double * t0_double, t2_double * t2_double, v_const, v_end);
                 v_start = v_end;
             } else {
                 ListForOneOffset<ChannelsList, 1>((entry->dir_and_type & TypeMask), LForeach_gen_command(), c, entry, time);
@@ -1003,6 +1253,7 @@ private:
                 o->m_new_to_backup = true;
                 o->m_staging_time = time;
                 o->m_staging_v_squared = v;
+                ListForEachForward<AxesList>(LForeach_save_staging(), c);
             }
         } while (i != o->m_segments_length);
         
@@ -1027,10 +1278,37 @@ private:
             o->m_segments_start = segments_add(o->m_segments_start, commit_count);
             o->m_segments_length -= commit_count;
             o->m_segments_staging_length = o->m_segments_length;
+            o->m_segments_pushed_length = o->m_segments_length;
         }
+        bench_stop_measuring(c);
         return ok;
     }
     
+    static void bench_start_measuring (Context c)
+    {
+#ifdef MOTIONPLANNER_BENCHMARK
+        auto *o = Object::self(c);
+        o->m_bench_enter_time = Clock::getTime(c);
+#endif
+    }
+    
+    static void bench_stop_measuring (Context c)
+    {
+#ifdef MOTIONPLANNER_BENCHMARK
+        auto *o = Object::self(c);
+        o->m_bench_time += (TimeType)(Clock::getTime(c) - o->m_bench_enter_time);
+        o->m_bench_plans++;
+#endif
+    }
+    
+    static void bench_count_push (Context c)
+    {
+#ifdef MOTIONPLANNER_BENCHMARK
+        auto *o = Object::self(c);
+        o->m_bench_pushes++;
+#endif
+    }
+    
     static void planner_start_stepping (Context c)
     {
         auto *o = Object::self(c);
@@ -1084,6 +1362,7 @@ private:
     
     static void stepper_event_handler (Context c)
     {
+        AMBRO_PROFILE_SCOPE(c, PROFILE_PLANNER_STEPPER_EVENT);
         auto *o = Object::self(c);
         AMBRO_ASSERT(o->m_state != STATE_ABORTED)
         
@@ -1109,6 +1388,7 @@ private:
                 o->m_state = STATE_BUFFERING;
                 o->m_segments_start = segments_add(o->m_segments_start, o->m_segments_staging_length);
                 o->m_segments_length -= o->m_segments_staging_length;
+                o->m_segments_pushed_length = (o->m_segments_pushed_length > o->m_segments_staging_length) ? (o->m_segments_pushed_length - o->m_segments_staging_length) : 0;
                 o->m_segments_staging_length = 0;
                 o->m_staging_time = 0;
                 o->m_staging_v_squared = 0.0f;
@@ -1192,7 +1472,10 @@ private:
                 for (SegmentBufferSizeType i = o->m_segments_length; i > 0; i--) {
                     Segment *prev_entry = &o->m_segments[segments_add(o->m_segments_start, i - 1)];
                     if (AMBRO_LIKELY((prev_entry->dir_and_type & TypeMask) == 0)) {
-                        prev_entry->lp_seg.max_end_v = ListForEachForwardAccRes<AxesList>(entry->lp_seg.max_end_v, LForeach_compute_segment_buffer_cornering_speed(), c, entry, distance_rec, prev_entry);
+                        if (i - 1 < o->m_segments_pushed_length) {
+                            o->m_segments_pushed_length = i - 1;
+                        }
+                        prev_entry->lp_seg.max_end_v = ListForEachForwardAccRes<AxesList>(FloatMin(prev_entry->lp_seg.max_v, entry->lp_seg.max_end_v), LForeach_compute_segment_buffer_cornering_speed(), c, entry, distance_rec, prev_entry);
                         break;
                     }
                 }
@@ -1235,6 +1518,7 @@ public:
         SegmentBufferSizeType m_segments_start;
         SegmentBufferSizeType m_segments_staging_length;
         SegmentBufferSizeType m_segments_length;
+        SegmentBufferSizeType m_segments_pushed_length;
         TimeType m_staging_time;
         FpType m_staging_v_squared;
         FpType m_last_distance_rec;
@@ -1246,6 +1530,12 @@ public:
         bool m_new_to_backup;
 #ifdef AMBROLIB_ASSERTIONS
         bool m_pulling;
+#endif
+#ifdef MOTIONPLANNER_BENCHMARK
+        TimeType m_bench_time;
+        TimeType m_bench_enter_time;
+        uint32_t m_bench_plans;
+        uint32_t m_bench_pushes;
 #endif
         SplitBuffer m_split_buffer;
         Segment m_segments[LookaheadBufferSize];
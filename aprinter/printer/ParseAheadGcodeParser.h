@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_PARSE_AHEAD_GCODE_PARSER_H
+#define AMBROLIB_PARSE_AHEAD_GCODE_PARSER_H
+
+#include <stdint.h>
+
+#include <aprinter/meta/MakeTypeList.h>
+#include <aprinter/meta/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/printer/GcodeParser.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/**
+ * Serial GcodeParser with a queue of commands which have already been
+ * parsed, with their values converted to FpType. The parsing functions
+ * work as in GcodeParser, each parsing the command after those in the
+ * queue; the command accessors refer to the current command, taken from
+ * the queue with takeCommand.
+ * 
+ * The commands stay in the buffer they were parsed from until they are
+ * finished. Only one part value in a buffer can cross its wraparound, so
+ * GcodeParser's single buffer for such a value is enough.
+ */
+template <typename Context, typename ParentObject, typename ParserParams, typename TBufferSizeType, int NumCommands, typename FpType>
+class ParseAheadGcodeParser {
+    static_assert(NumCommands >= 2, "");
+    static_assert(ParserParams::MaxParts >= 2, "");
+    
+public:
+    struct Object;
+    
+private:
+    using Parser = GcodeParser<Context, Object, ParserParams, TBufferSizeType, GcodeParserTypeSerial>;
+    
+public:
+    using BufferSizeType = TBufferSizeType;
+    using PartsSizeType = typename Parser::PartsSizeType;
+    
+    enum {
+        ERROR_NO_PARTS = Parser::ERROR_NO_PARTS,
+        ERROR_TOO_MANY_PARTS = Parser::ERROR_TOO_MANY_PARTS,
+        ERROR_INVALID_PART = Parser::ERROR_INVALID_PART,
+        ERROR_CHECKSUM = Parser::ERROR_CHECKSUM,
+        ERROR_RECV_OVERRUN = Parser::ERROR_RECV_OVERRUN,
+        ERROR_EOF = Parser::ERROR_EOF
+    };
+    
+    struct CommandPart {
+        char code;
+        char *data;
+        FpType value;
+    };
+    
+    struct Command {
+        BufferSizeType length;
+        PartsSizeType num_parts;
+        char cmd_code;
+        uint16_t cmd_number;
+        bool have_line_number;
+        uint32_t line_number;
+        CommandPart parts[ParserParams::MaxParts - 1];
+    };
+    
+    using PartRef = CommandPart *;
+    
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        Parser::init(c);
+        o->m_start = 0;
+        o->m_count = 0;
+        o->m_have_current = false;
+        o->m_queued_length = 0;
+        
+        o->debugInit(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugDeinit(c);
+        
+        Parser::deinit(c);
+    }
+    
+    // parsing
+    
+    static bool haveCommand (Context c)
+    {
+        return Parser::haveCommand(c);
+    }
+    
+    static bool canParse (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return (o->m_count < NumCommands);
+    }
+    
+    static void startCommand (Context c, char *buffer, int8_t assume_error, BufferSizeType first_length, char *wrap_buffer)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(o->m_count < NumCommands)
+        
+        Parser::startCommand(c, buffer, assume_error, first_length, wrap_buffer);
+    }
+    
+    static bool extendCommand (Context c, BufferSizeType avail)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        if (!Parser::extendCommand(c, avail)) {
+            return false;
+        }
+        
+        auto *pcmd = Parser::getCmd(c);
+        Command *cmd = &o->m_commands[(o->m_start + o->m_count) % NumCommands];
+        cmd->length = pcmd->length;
+        cmd->num_parts = pcmd->num_parts;
+        cmd->have_line_number = pcmd->have_line_number;
+        cmd->line_number = pcmd->line_number;
+        if (cmd->num_parts >= 0) {
+            cmd->cmd_code = pcmd->parts[0].code;
+            cmd->cmd_number = pcmd->cmd_number;
+            for (PartsSizeType i = 0; i < cmd->num_parts; i++) {
+                cmd->parts[i].code = pcmd->parts[1 + i].code;
+                cmd->parts[i].data = pcmd->parts[1 + i].data;
+                cmd->parts[i].value = Parser::template convertFp<FpType>(cmd->parts[i].data);
+            }
+        }
+        o->m_count++;
+        o->m_queued_length += cmd->length;
+        return true;
+    }
+    
+    static void resetCommand (Context c)
+    {
+        Parser::resetCommand(c);
+    }
+    
+    // Total length of the current and queued commands, where parsing continues.
+    static BufferSizeType getQueuedLength (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return o->m_queued_length;
+    }
+    
+    // The command parsed most recently.
+    static Command * getLastCmd (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(o->m_count > 0)
+        
+        return &o->m_commands[(o->m_start + o->m_count - 1) % NumCommands];
+    }
+    
+    // queue
+    
+    static bool haveQueuedCommand (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return (o->m_count > o->m_have_current);
+    }
+    
+    static void takeCommand (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(!o->m_have_current)
+        AMBRO_ASSERT(o->m_count > 0)
+        
+        o->m_have_current = true;
+    }
+    
+    static void finishCommand (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(o->m_have_current)
+        
+        o->m_queued_length -= o->m_commands[o->m_start].length;
+        o->m_start = (o->m_start + 1) % NumCommands;
+        o->m_count--;
+        o->m_have_current = false;
+    }
+    
+    // the current command
+    
+    static BufferSizeType getLength (Context c)
+    {
+        return current(c)->length;
+    }
+    
+    static PartsSizeType getNumParts (Context c)
+    {
+        return current(c)->num_parts;
+    }
+    
+    static char getCmdCode (Context c)
+    {
+        AMBRO_ASSERT(current(c)->num_parts >= 0)
+        
+        return current(c)->cmd_code;
+    }
+    
+    static uint16_t getCmdNumber (Context c)
+    {
+        AMBRO_ASSERT(current(c)->num_parts >= 0)
+        
+        return current(c)->cmd_number;
+    }
+    
+    static PartRef getPart (Context c, PartsSizeType i)
+    {
+        Command *cmd = current(c);
+        AMBRO_ASSERT(cmd->num_parts >= 0)
+        AMBRO_ASSERT(i >= 0)
+        AMBRO_ASSERT(i < cmd->num_parts)
+        
+        return &cmd->parts[i];
+    }
+    
+    static char getPartCode (Context c, PartRef part)
+    {
+        return part->code;
+    }
+    
+    template <typename TheFpType>
+    static TheFpType getPartFpValue (Context c, PartRef part)
+    {
+        return part->value;
+    }
+    
+    static uint32_t getPartUint32Value (Context c, PartRef part)
+    {
+        return Parser::template convertUint<uint32_t>(part->data);
+    }
+    
+    static char const * getPartStringValue (Context c, PartRef part)
+    {
+        return part->data;
+    }
+    
+    static Command * getCmd (Context c)
+    {
+        return current(c);
+    }
+    
+private:
+    static Command * current (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(o->m_have_current)
+        
+        return &o->m_commands[o->m_start];
+    }
+    
+public:
+    struct Object : public ObjBase<ParseAheadGcodeParser, ParentObject, MakeTypeList<
+        Parser
+    >>,
+        public DebugObject<Context, void>
+    {
+        uint8_t m_start;
+        uint8_t m_count;
+        bool m_have_current;
+        BufferSizeType m_queued_length;
+        Command m_commands[NumCommands];
+    };
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
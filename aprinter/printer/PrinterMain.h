@@ -68,6 +68,7 @@
 #include <aprinter/base/Likely.h>
 #include <aprinter/base/ProgramMemory.h>
 #include <aprinter/system/InterruptLock.h>
+#include <aprinter/system/Profiler.h>
 #include <aprinter/math/FloatTools.h>
 #include <aprinter/devices/Blinker.h>
 #include <aprinter/devices/SoftPwm.h>
@@ -75,8 +76,10 @@
 #include <aprinter/stepper/AxisStepper.h>
 #include <aprinter/printer/AxisHomer.h>
 #include <aprinter/printer/GcodeParser.h>
+#include <aprinter/printer/ParseAheadGcodeParser.h>
 #include <aprinter/printer/BinaryGcodeParser.h>
 #include <aprinter/printer/MotionPlanner.h>
+#include <aprinter/printer/ArcSplitter.h>
 #include <aprinter/printer/TemperatureObserver.h>
 
 #include <aprinter/BeginNamespace.h>
@@ -90,7 +93,7 @@ template <
     template <typename, typename, typename> class TEventChannelTimer,
     template <typename, typename, typename> class TWatchdogTemplate, typename TWatchdogParams,
     typename TSdCardParams, typename TProbeParams, typename TCurrentParams,
-    typename TAxesList, typename TTransformParams, typename THeatersList, typename TFansList
+    typename TStepTraceParams, typename TArcParams, typename TAxesList, typename TTransformParams, typename THeatersList, typename TFansList
 >
 struct PrinterMainParams {
     using Serial = TSerial;
@@ -111,6 +114,8 @@ struct PrinterMainParams {
     using SdCardParams = TSdCardParams;
     using ProbeParams = TProbeParams;
     using CurrentParams = TCurrentParams;
+    using StepTraceParams = TStepTraceParams;
+    using ArcParams = TArcParams;
     using AxesList = TAxesList;
     using TransformParams = TTransformParams;
     using HeatersList = THeatersList;
@@ -120,17 +125,35 @@ struct PrinterMainParams {
 template <
     uint32_t TBaud,
     int TRecvBufferSizeExp, int TSendBufferSizeExp,
-    typename TTheGcodeParserParams,
+    typename TTheGcodeParserParams, int TParseAheadCommands,
     template <typename, typename, int, int, typename, typename, typename> class TSerialTemplate,
-    typename TSerialParams
+    typename TSerialParams,
+    typename TFramedParams
 >
 struct PrinterMainSerialParams {
     static uint32_t const Baud = TBaud;
     static int const RecvBufferSizeExp = TRecvBufferSizeExp;
     static int const SendBufferSizeExp = TSendBufferSizeExp;
     using TheGcodeParserParams = TTheGcodeParserParams;
+    static int const ParseAheadCommands = TParseAheadCommands;
     template <typename S, typename X, int Y, int Z, typename W, typename Q, typename R> using SerialTemplate = TSerialTemplate<S, X, Y, Z, W, Q, R>;
     using SerialParams = TSerialParams;
+    using FramedParams = TFramedParams;
+};
+
+struct PrinterMainSerialNoFramedParams {
+    static bool const Enabled = false;
+};
+
+template <
+    int TMaxPayload, int TAckBatch,
+    typename TTheGcodeParserParams
+>
+struct PrinterMainSerialFramedParams {
+    static bool const Enabled = true;
+    static int const MaxPayload = TMaxPayload;
+    static int const AckBatch = TAckBatch;
+    using TheGcodeParserParams = TTheGcodeParserParams;
 };
 
 template <
@@ -140,7 +163,8 @@ template <
     typename TDefaultMaxSpeed, typename TDefaultMaxAccel,
     typename TDefaultDistanceFactor, typename TDefaultCorneringDistance,
     typename THoming, bool TIsCartesian, int TStepBits,
-    typename TTheAxisStepperParams, typename TMicroStep
+    typename TTheAxisStepperParams, typename TMicroStep,
+    typename TAdvanceParams
 >
 struct PrinterMainAxisParams {
     static char const Name = TName;
@@ -160,6 +184,7 @@ struct PrinterMainAxisParams {
     static int const StepBits = TStepBits;
     using TheAxisStepperParams = TTheAxisStepperParams;
     using MicroStep = TMicroStep;
+    using AdvanceParams = TAdvanceParams;
 };
 
 struct PrinterMainNoMicroStepParams {
@@ -219,6 +244,19 @@ struct PrinterMainTransformParams {
     using TransformAlgParams = TTransformAlgParams;
 };
 
+struct PrinterMainNoArcParams {
+    static bool const Enabled = false;
+};
+
+template <
+    typename TChordTolerance, typename TMinSegmentLength
+>
+struct PrinterMainArcParams {
+    static bool const Enabled = true;
+    using ChordTolerance = TChordTolerance;
+    using MinSegmentLength = TMinSegmentLength;
+};
+
 template <
     char TName, typename TMaxSpeed
 >
@@ -282,7 +320,7 @@ template <
     typename TSdCardParams,
     template<typename, typename, typename, typename> class TGcodeParserTemplate,
     typename TTheGcodeParserParams, int TReadBufferBlocks,
-    int TMaxCommandSize
+    int TMaxCommandSize, typename TFsParams
 >
 struct PrinterMainSdCardParams {
     static bool const Enabled = true;
@@ -292,6 +330,22 @@ struct PrinterMainSdCardParams {
     using TheGcodeParserParams = TTheGcodeParserParams;
     static int const ReadBufferBlocks = TReadBufferBlocks;
     static int const MaxCommandSize = TMaxCommandSize;
+    using FsParams = TFsParams;
+};
+
+struct PrinterMainSdCardNoFsParams {
+    static bool const Enabled = false;
+};
+
+template <
+    template<typename, typename, typename, typename, typename> class TFs,
+    typename TFsParams,
+    typename TLogInterval
+>
+struct PrinterMainSdCardFsParams {
+    static bool const Enabled = true;
+    template <typename X, typename Y, typename Z, typename W> using Fs = TFs<X, Y, Z, TFsParams, W>;
+    using LogInterval = TLogInterval;
 };
 
 struct PrinterMainNoProbeParams {
@@ -375,6 +429,12 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_get_final_split, get_final_split)
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_finish_set_position, finish_set_position)
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_finish_init, finish_init)
+    AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_append_dir_entry, append_dir_entry)
+    AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_finish_dir_scan, finish_dir_scan)
+    AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_finish_create, finish_create)
+    AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_finish_close, finish_close)
+    AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_append_log_name, append_log_name)
+    AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_append_log_value, append_log_value)
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_continue_splitclear_helper, continue_splitclear_helper)
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_report_height, report_height)
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_finish_locked_helper, finish_locked_helper)
@@ -401,9 +461,13 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_get_coord, get_coord)
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_append_position, append_position)
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_collect_new_pos, collect_new_pos)
+    AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_collect_new_pos_fp, collect_new_pos_fp)
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_set_relative_positioning, set_relative_positioning)
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_set_position, set_position)
     AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_init_new_pos, init_new_pos)
+    AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_init_arc_pos, init_arc_pos)
+    AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_collect_arc_pos, collect_arc_pos)
+    AMBRO_DECLARE_LIST_FOREACH_HELPER(LForeach_add_arc_pos, add_arc_pos)
     AMBRO_DECLARE_GET_MEMBER_TYPE_FUNC(GetMemberType_ChannelPayload, ChannelPayload)
     AMBRO_DECLARE_GET_MEMBER_TYPE_FUNC(GetMemberType_EventLoopFastEvents, EventLoopFastEvents)
     AMBRO_DECLARE_GET_MEMBER_TYPE_FUNC(GetMemberType_WrappedAxisName, WrappedAxisName)
@@ -427,6 +491,7 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
     using FpType = typename Params::FpType;
     using ParamsAxesList = typename Params::AxesList;
     using TransformParams = typename Params::TransformParams;
+    using ArcParams = typename Params::ArcParams;
     using ParamsHeatersList = typename Params::HeatersList;
     using ParamsFansList = typename Params::FansList;
     static const int NumAxes = TypeListLength<ParamsAxesList>::value;
@@ -444,7 +509,7 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
     using TheWatchdog = typename Params::template WatchdogTemplate<Context, Object, typename Params::WatchdogParams>;
     using TheBlinker = Blinker<Context, Object, typename Params::LedPin, BlinkerHandler>;
     using StepperDefsList = MapTypeList<ParamsAxesList, TemplateFunc<MakeStepperDef>>;
-    using TheSteppers = Steppers<Context, Object, StepperDefsList>;
+    using TheSteppers = Steppers<Context, Object, StepperDefsList, typename Params::StepTraceParams>;
     
     static_assert(Params::LedBlinkInterval::value() < TheWatchdog::WatchdogTime / 2.0, "");
     
@@ -493,6 +558,9 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             if (!Channel::start_command_impl(c)) {
                 return finishCommand(c);
             }
+            if (!SdCardFeature::check_upload_command(c, WrapType<ChannelCommon>())) {
+                return;
+            }
             work_command(c, WrapType<ChannelCommon>());
         }
         
@@ -616,7 +684,7 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             if (!tryLockedCommand(c)) {
                 return false;
             }
-            return TransformFeature::try_splitclear_command(c);
+            return ArcFeature::try_splitclear_command(c) && TransformFeature::try_splitclear_command(c);
         }
         
         static bool find_command_param (Context c, char code, GcodeParserPartRef *out_part)
@@ -758,7 +826,11 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
         using TheSerial = typename Params::Serial::template SerialTemplate<Context, Object, Params::Serial::RecvBufferSizeExp, Params::Serial::SendBufferSizeExp, typename Params::Serial::SerialParams, SerialRecvHandler, SerialSendHandler>;
         using RecvSizeType = typename TheSerial::RecvSizeType;
         using SendSizeType = typename TheSerial::SendSizeType;
-        using TheGcodeParser = GcodeParser<Context, Object, typename Params::Serial::TheGcodeParserParams, typename RecvSizeType::IntType, GcodeParserTypeSerial>;
+        using TheGcodeParser = If<
+            (Params::Serial::ParseAheadCommands > 0),
+            ParseAheadGcodeParser<Context, Object, typename Params::Serial::TheGcodeParserParams, typename RecvSizeType::IntType, Params::Serial::ParseAheadCommands + 1, FpType>,
+            GcodeParser<Context, Object, typename Params::Serial::TheGcodeParserParams, typename RecvSizeType::IntType, GcodeParserTypeSerial>
+        >;
         using TheChannelCommon = ChannelCommon<Object, SerialFeature>;
         
         static void init (Context c)
@@ -767,12 +839,16 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             TheSerial::init(c, Params::Serial::Baud);
             TheGcodeParser::init(c);
             TheChannelCommon::init(c);
+            FramedFeature::init(c);
+            ParseAheadFeature::init(c);
             o->m_recv_next_error = 0;
             o->m_line_number = 1;
+            o->m_credits = false;
         }
         
         static void deinit (Context c)
         {
+            FramedFeature::deinit(c);
             TheGcodeParser::deinit(c);
             TheSerial::deinit(c);
         }
@@ -782,11 +858,17 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             auto *o = Object::self(c);
             auto *cco = TheChannelCommon::Object::self(c);
             
+            if (FramedFeature::recv_handler(c)) {
+                return;
+            }
+            if (ParseAheadFeature::recv_handler(c)) {
+                return;
+            }
             if (cco->m_cmd) {
                 return;
             }
             if (!TheGcodeParser::haveCommand(c)) {
-                TheGcodeParser::startCommand(c, TheSerial::recvGetChunkPtr(c), o->m_recv_next_error);
+                start_parser<TheGcodeParser>(c, o->m_recv_next_error);
                 o->m_recv_next_error = 0;
             }
             bool overrun;
@@ -806,6 +888,26 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
         {
         }
         
+        // The receive buffer is a ring and the parser reads the part of a
+        // command past its end from the start.
+        template <typename Parser>
+        static void start_parser (Context c, int8_t assume_error, typename RecvSizeType::IntType pos = 0)
+        {
+            RecvSizeType first_length = TheSerial::recvGetChunkLen(c, RecvSizeType::maxValue());
+            if (pos < first_length.value()) {
+                Parser::startCommand(c, TheSerial::recvGetChunkPtr(c) + pos, assume_error, first_length.value() - pos, TheSerial::recvGetWrapPtr(c));
+            } else {
+                Parser::startCommand(c, TheSerial::recvGetWrapPtr(c) + (pos - first_length.value()), assume_error, RecvSizeType::maxIntValue(), TheSerial::recvGetWrapPtr(c));
+            }
+        }
+        
+        static uint8_t recv_byte (Context c, typename RecvSizeType::IntType pos)
+        {
+            RecvSizeType first_length = TheSerial::recvGetChunkLen(c, RecvSizeType::maxValue());
+            char *ptr = (pos < first_length.value()) ? (TheSerial::recvGetChunkPtr(c) + pos) : (TheSerial::recvGetWrapPtr(c) + (pos - first_length.value()));
+            return *ptr;
+        }
+        
         static bool start_command_impl (Context c)
         {
             auto *o = Object::self(c);
@@ -836,14 +938,33 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             auto *cco = TheChannelCommon::Object::self(c);
             AMBRO_ASSERT(cco->m_cmd)
             
+            TheSerial::recvConsume(c, RecvSizeType::import(TheGcodeParser::getLength(c)));
+            ParseAheadFeature::finish_command(c);
             if (!no_ok) {
-                TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR("ok\n"));
+                TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR("ok"));
+                if (o->m_credits) {
+                    append_credits(c);
+                }
+                TheChannelCommon::reply_append_ch(c, '\n');
             }
             TheSerial::sendPoke(c);
-            TheSerial::recvConsume(c, RecvSizeType::import(TheGcodeParser::getLength(c)));
             TheSerial::recvForceEvent(c);
         }
         
+        // Appended to "ok" after M941: the free space in the receive buffer
+        // and in the look-ahead buffer of the planner.
+        static void append_credits (Context c)
+        {
+            auto *mob = PrinterMain::Object::self(c);
+            
+            bool overrun;
+            RecvSizeType avail = TheSerial::recvQuery(c, &overrun);
+            TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR(" B:"));
+            TheChannelCommon::reply_append_uint32(c, RecvSizeType::maxIntValue() - avail.value());
+            TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR(" P:"));
+            TheChannelCommon::reply_append_uint32(c, (mob->planner_state == PLANNER_NONE) ? Params::LookaheadBufferSize : ThePlanner::getFreeSegments(c));
+        }
+        
         static void reply_poke_impl (Context c)
         {
             TheSerial::sendPoke(c);
@@ -889,16 +1010,416 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             }
         }
         
+        template <typename CommandChannel>
+        static bool check_command (Context c, WrapType<CommandChannel>)
+        {
+            auto *o = Object::self(c);
+            
+            if (TypesAreEqual<CommandChannel, TheChannelCommon>::value && CommandChannel::TheGcodeParser::getCmdNumber(c) == 941) {
+                o->m_credits = CommandChannel::get_command_param_uint32(c, 'S', 1);
+                if (o->m_credits) {
+                    CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Credits B:"));
+                    CommandChannel::reply_append_uint32(c, RecvSizeType::maxIntValue());
+                    CommandChannel::reply_append_pstr(c, AMBRO_PSTR(" P:"));
+                    CommandChannel::reply_append_uint32(c, Params::LookaheadBufferSize);
+                    CommandChannel::reply_append_ch(c, '\n');
+                }
+                CommandChannel::finishCommand(c);
+                return false;
+            }
+            return FramedFeature::check_command(c, WrapType<CommandChannel>());
+        }
+        
+        /*
+         * Parse-ahead, enabled with ParseAheadCommands > 0. Serial commands
+         * are parsed into a queue while the current one waits.
+         */
+        AMBRO_STRUCT_IF(ParseAheadFeature, (Params::Serial::ParseAheadCommands > 0)) {
+            struct Object;
+            
+            static void init (Context c)
+            {
+                auto *o = Object::self(c);
+                o->m_barrier = false;
+            }
+            
+            // Commands are parsed as they arrive, while the current one waits,
+            // and the next one is started from the queue when it is done.
+            static bool recv_handler (Context c)
+            {
+                auto *cco = TheChannelCommon::Object::self(c);
+                
+                if (!cco->m_cmd && TheGcodeParser::haveQueuedCommand(c)) {
+                    return start_next(c);
+                }
+                while (TheGcodeParser::canParse(c) && parse_next(c)) {
+                    if (!cco->m_cmd) {
+                        return start_next(c);
+                    }
+                }
+                return true;
+            }
+            
+            static void finish_command (Context c)
+            {
+                auto *o = Object::self(c);
+                
+                TheGcodeParser::finishCommand(c);
+                if (TheGcodeParser::getQueuedLength(c) == 0) {
+                    o->m_barrier = false;
+                }
+            }
+            
+            static bool start_next (Context c)
+            {
+                // Parsing continues after the command has had its go.
+                TheGcodeParser::takeCommand(c);
+                TheSerial::recvForceEvent(c);
+                TheChannelCommon::startCommand(c);
+                return true;
+            }
+            
+            static bool parse_next (Context c)
+            {
+                auto *o = Object::self(c);
+                auto *so = SerialFeature::Object::self(c);
+                
+                if (o->m_barrier) {
+                    return false;
+                }
+                bool overrun;
+                RecvSizeType avail = TheSerial::recvQuery(c, &overrun);
+                auto queued_length = TheGcodeParser::getQueuedLength(c);
+                if (!TheGcodeParser::haveCommand(c)) {
+                    if (avail.value() == queued_length) {
+                        return false;
+                    }
+                    start_parser<TheGcodeParser>(c, so->m_recv_next_error, queued_length);
+                    so->m_recv_next_error = 0;
+                }
+                if (TheGcodeParser::extendCommand(c, avail.value() - queued_length)) {
+                    // What follows M940 is not text, leave it alone until then.
+                    auto *cmd = TheGcodeParser::getLastCmd(c);
+                    o->m_barrier = (cmd->num_parts >= 0 && FramedFeature::is_start_command(cmd->cmd_code, cmd->cmd_number));
+                    return true;
+                }
+                // With commands queued, a full buffer is no overrun yet.
+                if (overrun && queued_length == 0) {
+                    TheSerial::recvConsume(c, avail);
+                    TheSerial::recvClearOverrun(c);
+                    TheGcodeParser::resetCommand(c);
+                    so->m_recv_next_error = TheGcodeParser::ERROR_RECV_OVERRUN;
+                }
+                return false;
+            }
+            
+            struct Object : public ObjBase<ParseAheadFeature, typename SerialFeature::Object, EmptyTypeList> {
+                bool m_barrier;
+            };
+        } AMBRO_STRUCT_ELSE(ParseAheadFeature) {
+            static void init (Context c) {}
+            static bool recv_handler (Context c) { return false; }
+            static void finish_command (Context c) {}
+            struct Object {};
+        };
+        
+        /*
+         * Framed mode, entered with M940 and left with an EOF packet. The
+         * host sends packed g-code (see encoding.txt) in frames:
+         *   0xA5, sequence number, payload length, payload, CRC
+         * where the CRC is CRC-16-CCITT (initial value 0xFFFF, little
+         * endian) of the sequence number, the length and the payload.
+         * A packet must not continue into the next frame. Frames are
+         * acknowledged with "ack N" once all their commands are done, which
+         * replaces the "ok" of each command. To save replies, acknowledgements
+         * are held back until AckBatch frames are done or no next frame is
+         * waiting in the buffer. The host may have as many unacknowledged
+         * frames as fit into the receive buffer (the window, reported by
+         * M940). A damaged or missing frame is answered with "rs N", where N
+         * is the expected sequence number, and the host is supposed to send
+         * again from that frame on; later frames are dropped until then.
+         */
+        AMBRO_STRUCT_IF(FramedFeature, Params::Serial::FramedParams::Enabled) {
+            struct Object;
+            using FramedParams = typename Params::Serial::FramedParams;
+            using TheGcodeParser = BinaryGcodeParser<Context, Object, typename FramedParams::TheGcodeParserParams, typename RecvSizeType::IntType>;
+            using TheChannelCommon = ChannelCommon<Object, FramedFeature>;
+            
+            static uint8_t const FrameSync = 0xA5;
+            static int const HeaderSize = 3;
+            static int const CrcSize = 2;
+            static int const MaxFrameSize = HeaderSize + FramedParams::MaxPayload + CrcSize;
+            static int const Window = RecvSizeType::maxIntValue() / MaxFrameSize;
+            static_assert(FramedParams::MaxPayload >= 1 && FramedParams::MaxPayload <= 255, "");
+            static_assert(Window >= 1, "The receive buffer must hold a whole frame.");
+            static_assert(Window < 128, "");
+            static_assert(FramedParams::AckBatch >= 1 && FramedParams::AckBatch <= Window, "");
+            
+            static void init (Context c)
+            {
+                auto *o = Object::self(c);
+                TheGcodeParser::init(c);
+                TheChannelCommon::init(c);
+                o->m_active = false;
+            }
+            
+            static void deinit (Context c)
+            {
+                TheGcodeParser::deinit(c);
+            }
+            
+            static bool is_start_command (char cmd_code, uint16_t cmd_number)
+            {
+                return (cmd_code == 'M' && cmd_number == 940);
+            }
+            
+            template <typename CommandChannel>
+            static bool check_command (Context c, WrapType<CommandChannel>)
+            {
+                auto *o = Object::self(c);
+                
+                if (!TypesAreEqual<CommandChannel, typename SerialFeature::TheChannelCommon>::value || CommandChannel::TheGcodeParser::getCmdNumber(c) != 940) {
+                    return true;
+                }
+                CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Framed W:"));
+                CommandChannel::reply_append_uint8(c, Window);
+                CommandChannel::reply_append_pstr(c, AMBRO_PSTR(" L:"));
+                CommandChannel::reply_append_uint8(c, FramedParams::MaxPayload);
+                CommandChannel::reply_append_ch(c, '\n');
+                CommandChannel::finishCommand(c);
+                // Delta packets start over with each session.
+                TheGcodeParser::deinit(c);
+                TheGcodeParser::init(c);
+                o->m_active = true;
+                o->m_expected_seq = 0;
+                o->m_unacked = 0;
+                o->m_frame_left = 0;
+                o->m_nak_sent = false;
+                return false;
+            }
+            
+            static bool recv_handler (Context c)
+            {
+                auto *o = Object::self(c);
+                auto *fco = TheChannelCommon::Object::self(c);
+                
+                if (!o->m_active) {
+                    return false;
+                }
+                if (fco->m_cmd) {
+                    return true;
+                }
+                if (o->m_frame_left == 0 && !start_frame(c)) {
+                    return true;
+                }
+                // The whole frame is in the buffer, so a packet which is not
+                // complete within it never will be.
+                start_parser<TheGcodeParser>(c, 0);
+                if (!TheGcodeParser::extendCommand(c, o->m_frame_left)) {
+                    TheGcodeParser::resetCommand(c);
+                    TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR("Error:Packet crosses frame\n"));
+                    end_frame(c);
+                    TheSerial::recvForceEvent(c);
+                    return true;
+                }
+                if (TheGcodeParser::getNumParts(c) == TheGcodeParser::ERROR_EOF) {
+                    o->m_active = false;
+                    end_frame(c);
+                    TheSerial::recvForceEvent(c);
+                    return true;
+                }
+                TheChannelCommon::startCommand(c);
+                return true;
+            }
+            
+            static bool start_command_impl (Context c)
+            {
+                return true;
+            }
+            
+            static void finish_command_impl (Context c, bool no_ok)
+            {
+                auto *o = Object::self(c);
+                AMBRO_ASSERT(o->m_frame_left > 0)
+                
+                if (TheGcodeParser::getNumParts(c) < 0) {
+                    // The rest of the frame cannot be trusted to start at a packet.
+                    end_frame(c);
+                } else {
+                    TheSerial::recvConsume(c, RecvSizeType::import(TheGcodeParser::getLength(c)));
+                    o->m_frame_left -= TheGcodeParser::getLength(c);
+                    if (o->m_frame_left == 0) {
+                        end_frame(c);
+                    }
+                }
+                TheSerial::sendPoke(c);
+                TheSerial::recvForceEvent(c);
+            }
+            
+            static void reply_poke_impl (Context c)
+            {
+                SerialFeature::reply_poke_impl(c);
+            }
+            
+            static void reply_append_buffer_impl (Context c, char const *str, uint8_t length)
+            {
+                SerialFeature::reply_append_buffer_impl(c, str, length);
+            }
+            
+            static void reply_append_pbuffer_impl (Context c, AMBRO_PGM_P pstr, uint8_t length)
+            {
+                SerialFeature::reply_append_pbuffer_impl(c, pstr, length);
+            }
+            
+            static void reply_append_ch_impl (Context c, char ch)
+            {
+                SerialFeature::reply_append_ch_impl(c, ch);
+            }
+            
+            // CRC of the sequence number, length and payload of the frame at
+            // the start of the receive buffer.
+            static uint16_t frame_crc (Context c, uint8_t length)
+            {
+                uint16_t crc = 0xFFFF;
+                for (uint16_t a = 1; a < HeaderSize + length; a++) {
+                    crc ^= (uint16_t)recv_byte(c, a) << 8;
+                    for (uint8_t i = 0; i < 8; i++) {
+                        crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+                    }
+                }
+                return crc;
+            }
+            
+            static bool frame_available (Context c)
+            {
+                bool overrun;
+                RecvSizeType avail = TheSerial::recvQuery(c, &overrun);
+                return (avail.value() >= HeaderSize && recv_byte(c, 0) == FrameSync && avail.value() >= HeaderSize + recv_byte(c, 2) + CrcSize);
+            }
+            
+            static bool start_frame (Context c)
+            {
+                auto *o = Object::self(c);
+                
+                while (true) {
+                    bool overrun;
+                    RecvSizeType avail = TheSerial::recvQuery(c, &overrun);
+                    if (overrun) {
+                        // The host did not keep to the window and bytes may have been lost.
+                        TheSerial::recvClearOverrun(c);
+                        TheSerial::recvConsume(c, avail);
+                        o->m_nak_sent = false;
+                        send_nak(c);
+                        return false;
+                    }
+                    if (avail.value() < HeaderSize) {
+                        return false;
+                    }
+                    uint8_t length = recv_byte(c, 2);
+                    if (recv_byte(c, 0) == FrameSync && length >= 1 && length <= FramedParams::MaxPayload) {
+                        if (avail.value() < HeaderSize + length + CrcSize) {
+                            return false;
+                        }
+                        uint16_t crc = recv_byte(c, HeaderSize + length) | ((uint16_t)recv_byte(c, HeaderSize + length + 1) << 8);
+                        if (frame_crc(c, length) == crc) {
+                            uint8_t seq = recv_byte(c, 1);
+                            if (seq == o->m_expected_seq) {
+                                TheSerial::recvConsume(c, RecvSizeType::import(HeaderSize));
+                                o->m_frame_left = length;
+                                o->m_nak_sent = false;
+                                return true;
+                            }
+                            TheSerial::recvConsume(c, RecvSizeType::import(HeaderSize + length + CrcSize));
+                            uint8_t behind = o->m_expected_seq - seq;
+                            if (behind <= Window) {
+                                // Sent again because the acknowledgement was lost.
+                                send_ack(c);
+                            } else {
+                                send_nak(c);
+                            }
+                            continue;
+                        }
+                        send_nak(c);
+                    }
+                    TheSerial::recvConsume(c, RecvSizeType::import(1));
+                }
+            }
+            
+            static void end_frame (Context c)
+            {
+                auto *o = Object::self(c);
+                
+                TheSerial::recvConsume(c, RecvSizeType::import(o->m_frame_left + CrcSize));
+                o->m_frame_left = 0;
+                o->m_expected_seq++;
+                o->m_unacked++;
+                if (o->m_unacked >= FramedParams::AckBatch || !o->m_active || !frame_available(c)) {
+                    send_ack(c);
+                }
+            }
+            
+            static void send_ack (Context c)
+            {
+                auto *o = Object::self(c);
+                
+                o->m_unacked = 0;
+                TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR("ack "));
+                TheChannelCommon::reply_append_uint8(c, (uint8_t)(o->m_expected_seq - 1));
+                TheChannelCommon::reply_append_ch(c, '\n');
+                TheSerial::sendPoke(c);
+            }
+            
+            static void send_nak (Context c)
+            {
+                auto *o = Object::self(c);
+                
+                if (o->m_nak_sent) {
+                    return;
+                }
+                o->m_nak_sent = true;
+                TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR("rs "));
+                TheChannelCommon::reply_append_uint8(c, o->m_expected_seq);
+                TheChannelCommon::reply_append_ch(c, '\n');
+                TheSerial::sendPoke(c);
+            }
+            
+            using FramedChannelCommonList = MakeTypeList<TheChannelCommon>;
+            
+            struct Object : public ObjBase<FramedFeature, typename SerialFeature::Object, MakeTypeList<
+                TheGcodeParser,
+                TheChannelCommon
+            >> {
+                bool m_active;
+                bool m_nak_sent;
+                uint8_t m_expected_seq;
+                uint8_t m_unacked;
+                uint8_t m_frame_left;
+            };
+        } AMBRO_STRUCT_ELSE(FramedFeature) {
+            static void init (Context c) {}
+            static void deinit (Context c) {}
+            template <typename CommandChannel>
+            static bool check_command (Context c, WrapType<CommandChannel>) { return true; }
+            static bool recv_handler (Context c) { return false; }
+            static bool is_start_command (char cmd_code, uint16_t cmd_number) { return false; }
+            using TheChannelCommon = void;
+            using FramedChannelCommonList = EmptyTypeList;
+            struct Object {};
+        };
+        
         struct SerialRecvHandler : public AMBRO_WFUNC_TD(&SerialFeature::serial_recv_handler) {};
         struct SerialSendHandler : public AMBRO_WFUNC_TD(&SerialFeature::serial_send_handler) {};
         
         struct Object : public ObjBase<SerialFeature, typename PrinterMain::Object, MakeTypeList<
             TheSerial,
             TheGcodeParser,
-            TheChannelCommon
+            TheChannelCommon,
+            ParseAheadFeature,
+            FramedFeature
         >> {
             int8_t m_recv_next_error;
             uint32_t m_line_number;
+            bool m_credits;
         };
     };
     
@@ -913,101 +1434,905 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
         static_assert(ReadBufferBlocks >= 2, "");
         static_assert(MaxCommandSize < BlockSize, "");
         static const size_t BufferBaseSize = ReadBufferBlocks * BlockSize;
+        static const int MaxReadsInFlight = 2;
+        static const int MaxSdCommands = MaxReadsInFlight + Params::SdCardParams::FsParams::Enabled;
         using ParserSizeType = typename ChooseInt<BitsInInt<MaxCommandSize>::value, false>::Type;
-        using TheSdCard = typename Params::SdCardParams::template SdCard<Context, Object, typename Params::SdCardParams::SdCardParams, 1, SdCardInitHandler, SdCardCommandHandler>;
+        using TheSdCard = typename Params::SdCardParams::template SdCard<Context, Object, typename Params::SdCardParams::SdCardParams, MaxSdCommands, SdCardInitHandler, SdCardCommandHandler>;
         using TheGcodeParser = typename Params::SdCardParams::template GcodeParserTemplate<Context, Object, typename Params::SdCardParams::TheGcodeParserParams, ParserSizeType>;
         using SdCardReadState = typename TheSdCard::ReadState;
         using TheChannelCommon = ChannelCommon<Object, SdCardFeature>;
-        enum {SDCARD_NONE, SDCARD_INITING, SDCARD_INITED, SDCARD_RUNNING, SDCARD_PAUSING};
-        
-        static void init (Context c)
-        {
-            auto *o = Object::self(c);
-            TheSdCard::init(c);
-            TheChannelCommon::init(c);
-            o->m_next_event.init(c, SdCardFeature::next_event_handler);
-            o->m_state = SDCARD_NONE;
-        }
+        enum {SDCARD_NONE, SDCARD_INITING, SDCARD_MOUNTING, SDCARD_INITED, SDCARD_SCANNING, SDCARD_RUNNING, SDCARD_PAUSING};
+        enum {NEXT_BLOCK, NEXT_WAIT, NEXT_END, NEXT_ERROR};
         
-        static void deinit (Context c)
-        {
-            auto *o = Object::self(c);
-            if (o->m_state != SDCARD_NONE && o->m_state != SDCARD_INITING) {
-                TheGcodeParser::deinit(c);
+        AMBRO_STRUCT_IF(FsFeature, Params::SdCardParams::FsParams::Enabled) {
+            struct Object;
+            struct FsHandler;
+            
+            using TheFs = typename Params::SdCardParams::FsParams::template Fs<Context, Object, TheSdCard, FsHandler>;
+            static_assert(TheFs::BlockSize == BlockSize, "");
+            enum {SCAN_LIST, SCAN_OPEN};
+            enum {WRITE_NONE, WRITE_CREATING, WRITE_UPLOAD, WRITE_LOG, WRITE_FLUSHING, WRITE_CLOSING};
+            static const size_t LogBufferSize = 2 * BlockSize;
+            static const TimeType LogIntervalTicks = (TimeType)(Params::SdCardParams::FsParams::LogInterval::value() * Clock::time_freq);
+            static const int NumLogHeaters = TypeListLength<ParamsHeatersList>::value;
+            static const size_t LogHeaderSize = 8 + NumLogHeaters;
+            static const size_t LogRecordSize = 12 + 8 * NumLogHeaters;
+            static_assert(LogRecordSize <= 255, "");
+            static const uint8_t LogVersion = 1;
+            static const uint8_t LogRecordHeader = 'H';
+            static const uint8_t LogRecordData = 'D';
+            
+            static void init (Context c)
+            {
+                auto *o = Object::self(c);
+                TheFs::init(c);
+                o->m_log_timer.init(c, FsFeature::log_timer_handler);
+                o->m_write_mode = WRITE_NONE;
+                o->m_write_busy = false;
+                o->m_scan_deferred = false;
             }
-            o->m_next_event.deinit(c);
-            TheSdCard::deinit(c);
-        }
-        
-        template <typename CommandChannel>
-        static void finish_init (Context c, WrapType<CommandChannel>, uint8_t error_code)
-        {
-            auto *o = Object::self(c);
             
-            if (error_code) {
-                CommandChannel::reply_append_pstr(c, AMBRO_PSTR("SD error "));
-                CommandChannel::reply_append_uint8(c, error_code);
-            } else {
-                CommandChannel::reply_append_pstr(c, AMBRO_PSTR("SD blocks "));
+            static void deinit (Context c)
+            {
+                auto *o = Object::self(c);
+                o->m_log_timer.deinit(c);
+                TheFs::deinit(c);
+            }
+            
+            static bool start_mount (Context c)
+            {
+                auto *o = Object::self(c);
+                AMBRO_ASSERT(o->m_write_mode == WRITE_NONE)
+                AMBRO_ASSERT(!o->m_write_busy)
+                
+                o->m_file_selected = false;
+                TheFs::startMount(c);
+                return true;
+            }
+            
+            static bool is_writing (Context c)
+            {
+                auto *o = Object::self(c);
+                return (o->m_write_mode != WRITE_NONE);
+            }
+            
+            static bool write_pending (Context c)
+            {
+                auto *o = Object::self(c);
+                return o->m_write_busy;
+            }
+            
+            static bool holds_reads (Context c)
+            {
+                auto *o = Object::self(c);
+                
+                // Writes cannot be in flight together with reads, so while
+                // printing, reads wait whenever the log has a block to write.
+                return (o->m_write_busy || o->m_write_mode >= WRITE_FLUSHING || o->m_write_length >= BlockSize);
+            }
+            
+            static bool is_mounted (Context c)
+            {
+                return TheFs::isMounted(c);
+            }
+            
+            static bool file_selected (Context c)
+            {
+                auto *o = Object::self(c);
+                return o->m_file_selected;
+            }
+            
+            static uint8_t next_block (Context c, uint32_t *out_block)
+            {
+                switch (TheFs::getNextBlock(c, out_block)) {
+                    case TheFs::NEXT_BLOCK: return NEXT_BLOCK;
+                    case TheFs::NEXT_WAIT: return NEXT_WAIT;
+                    case TheFs::NEXT_END: return NEXT_END;
+                    default: return NEXT_ERROR;
+                }
+            }
+            
+            static size_t block_length (Context c, uint32_t index)
+            {
+                auto *o = Object::self(c);
+                AMBRO_ASSERT(index <= (o->m_file_size - 1) / BlockSize)
+                
+                uint32_t rem = o->m_file_size - index * BlockSize;
+                return (rem < BlockSize) ? rem : BlockSize;
+            }
+            
+            static bool read_pending (Context c)
+            {
+                return TheFs::readPending(c);
+            }
+            
+            static bool check_read (Context c, bool *out_error)
+            {
+                return TheFs::checkRead(c, out_error);
+            }
+            
+            static void discard_read (Context c)
+            {
+                TheFs::discardRead(c);
+            }
+            
+            static void finish_read (Context c)
+            {
+                TheFs::finishRead(c);
+            }
+            
+            template <typename CommandChannel>
+            static void append_mount_status (Context c, WrapType<CommandChannel>)
+            {
+                if (TheFs::isMounted(c)) {
+                    CommandChannel::reply_append_pstr(c, AMBRO_PSTR(" FAT32"));
+                }
+            }
+            
+            template <typename CommandChannel>
+            static bool check_command (Context c, WrapType<CommandChannel>)
+            {
+                auto *o = Object::self(c);
+                auto *sd = SdCardFeature::Object::self(c);
+                
+                if (CommandChannel::TheGcodeParser::getCmdNumber(c) == 20 || CommandChannel::TheGcodeParser::getCmdNumber(c) == 23) {
+                    if (!CommandChannel::tryUnplannedCommand(c)) {
+                        return false;
+                    }
+                    if (sd->m_state != SDCARD_INITED || !TheFs::isMounted(c)) {
+                        CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Error:No FAT32 SD card or not paused\n"));
+                        CommandChannel::finishCommand(c);
+                        return false;
+                    }
+                    if (CommandChannel::TheGcodeParser::getCmdNumber(c) == 20) {
+                        CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Begin file list\n"));
+                        o->m_scan_mode = SCAN_LIST;
+                    } else {
+                        if (!get_name_param(c, WrapType<CommandChannel>(), o->m_name)) {
+                            CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Error:Bad file name\n"));
+                            CommandChannel::finishCommand(c);
+                            return false;
+                        }
+                        o->m_scan_mode = SCAN_OPEN;
+                        o->m_found = false;
+                    }
+                    sd->m_state = SDCARD_SCANNING;
+                    // The scan waits for whatever the log writer has started.
+                    o->m_scan_deferred = true;
+                    write_work(c);
+                    return false;
+                }
+                if (CommandChannel::TheGcodeParser::getCmdNumber(c) == 28 || CommandChannel::TheGcodeParser::getCmdNumber(c) == 928) {
+                    if (!CommandChannel::tryUnplannedCommand(c)) {
+                        return false;
+                    }
+                    if (sd->m_state != SDCARD_INITED || !TheFs::isMounted(c) || o->m_write_mode != WRITE_NONE) {
+                        CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Error:No FAT32 SD card, not paused or already writing\n"));
+                        CommandChannel::finishCommand(c);
+                        return false;
+                    }
+                    if (!get_name_param(c, WrapType<CommandChannel>(), o->m_name) || !TheFs::startCreateFile(c, o->m_name)) {
+                        CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Error:Bad file name\n"));
+                        CommandChannel::finishCommand(c);
+                        return false;
+                    }
+                    o->m_logging = (CommandChannel::TheGcodeParser::getCmdNumber(c) == 928);
+                    if (!o->m_logging && o->m_file_selected) {
+                        // The upload goes through the read buffer, so the paused file is dropped.
+                        o->m_file_selected = false;
+                        TheGcodeParser::deinit(c);
+                        TheGcodeParser::init(c);
+                        TheChannelCommon::maybeCancelLockingCommand(c);
+                        start_file(c);
+                    }
+                    o->m_write_mode = WRITE_CREATING;
+                    sd->m_state = SDCARD_SCANNING;
+                    return false;
+                }
+                if (CommandChannel::TheGcodeParser::getCmdNumber(c) == 29) {
+                    // Logging goes on while printing, so do not wait for the motion to stop.
+                    if (!CommandChannel::tryLockedCommand(c)) {
+                        return false;
+                    }
+                    if (o->m_write_mode != WRITE_UPLOAD && o->m_write_mode != WRITE_LOG) {
+                        CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Error:Not writing a file\n"));
+                        CommandChannel::finishCommand(c);
+                        return false;
+                    }
+                    o->m_log_timer.unset(c);
+                    o->m_write_mode = WRITE_FLUSHING;
+                    write_work(c);
+                    return false;
+                }
+                return true;
+            }
+            
+            static bool check_command (Context c, WrapType<TheChannelCommon>)
+            {
+                return true;
+            }
+            
+            template <typename CommandChannel>
+            static bool check_upload_command (Context c, WrapType<CommandChannel>)
+            {
+                auto *o = Object::self(c);
+                
+                if (o->m_write_mode != WRITE_UPLOAD || (CommandChannel::TheGcodeParser::getCmdCode(c) == 'M' && CommandChannel::TheGcodeParser::getCmdNumber(c) == 29)) {
+                    return true;
+                }
+                upload_line(c, WrapType<CommandChannel>());
+                return false;
+            }
+            
+            static bool check_upload_command (Context c, WrapType<TheChannelCommon>)
+            {
+                return true;
+            }
+            
+            // Packed g-code has no string values, so the framed serial mode
+            // can neither name files nor upload them.
+            using FramedChannelCommon = typename SerialFeature::FramedFeature::TheChannelCommon;
+            
+            static bool check_upload_command (Context c, WrapType<FramedChannelCommon>)
+            {
+                return true;
+            }
+            
+            template <typename CommandChannel>
+            static void upload_line (Context c, WrapType<CommandChannel>)
+            {
+                auto *o = Object::self(c);
+                using Parser = typename CommandChannel::TheGcodeParser;
+                
+                // The line is put back together from its parts, which leaves
+                // out the line number, the checksum and any comment.
+                char cmd[7];
+                cmd[0] = Parser::getCmdCode(c);
+#if defined(AMBROLIB_AVR)
+                size_t cmd_len = 1 + AMBRO_PGM_SPRINTF(cmd + 1, AMBRO_PSTR("%" PRIu16), Parser::getCmdNumber(c));
+#else
+                size_t cmd_len = 1 + PrintNonnegativeIntDecimal<uint16_t>(Parser::getCmdNumber(c), cmd + 1);
+#endif
+                auto num_parts = Parser::getNumParts(c);
+                size_t length = cmd_len + 1;
+                for (decltype(num_parts) i = 0; i < num_parts; i++) {
+                    length += 2 + strlen(Parser::getPartStringValue(c, Parser::getPart(c, i)));
+                }
+                if (length > BufferBaseSize && !o->m_write_error) {
+                    write_error(c);
+                }
+                if (!o->m_write_error) {
+                    if (length > BufferBaseSize - o->m_write_length) {
+                        // The command waits until enough of the buffer is written out.
+                        o->m_upload_held = true;
+                        return;
+                    }
+                    write_append(c, cmd, cmd_len);
+                    for (decltype(num_parts) i = 0; i < num_parts; i++) {
+                        auto part = Parser::getPart(c, i);
+                        char code[2] = {' ', Parser::getPartCode(c, part)};
+                        char const *value = Parser::getPartStringValue(c, part);
+                        write_append(c, code, 2);
+                        write_append(c, value, strlen(value));
+                    }
+                    write_append(c, "\n", 1);
+                    write_work(c);
+                }
+                o->m_upload_held = false;
+                CommandChannel::finishCommand(c);
+            }
+            
+            static bool get_name_param (Context c, WrapType<FramedChannelCommon>, char *out)
+            {
+                return false;
+            }
+            
+            template <typename CommandChannel>
+            static bool get_name_param (Context c, WrapType<CommandChannel>, char *out)
+            {
+                if (CommandChannel::TheGcodeParser::getNumParts(c) < 1) {
+                    return false;
+                }
+                auto part = CommandChannel::TheGcodeParser::getPart(c, 0);
+                char const *rest = CommandChannel::TheGcodeParser::getPartStringValue(c, part);
+                size_t rest_len = strlen(rest);
+                if (rest_len >= TheFs::MaxNameLength) {
+                    return false;
+                }
+                out[0] = CommandChannel::TheGcodeParser::getPartCode(c, part);
+                memcpy(out + 1, rest, rest_len + 1);
+                return true;
+            }
+            
+            static bool names_equal (char const *a, char const *b)
+            {
+                while (*a && *b && to_upper(*a) == to_upper(*b)) {
+                    a++;
+                    b++;
+                }
+                return (*a == '\0' && *b == '\0');
+            }
+            
+            static char to_upper (char ch)
+            {
+                return (ch >= 'a' && ch <= 'z') ? (ch - 'a' + 'A') : ch;
+            }
+            
+            template <typename CommandChannel>
+            static void append_dir_entry (Context c, WrapType<CommandChannel>, char const *name)
+            {
+                CommandChannel::reply_append_str(c, name);
+                CommandChannel::reply_append_ch(c, ' ');
+                CommandChannel::reply_append_uint32(c, TheFs::getEntrySize(c));
+                CommandChannel::reply_append_ch(c, '\n');
+            }
+            
+            template <typename CommandChannel>
+            static void finish_dir_scan (Context c, WrapType<CommandChannel>)
+            {
+                auto *o = Object::self(c);
+                
+                if (o->m_scan_mode == SCAN_LIST) {
+                    CommandChannel::reply_append_pstr(c, AMBRO_PSTR("End file list\n"));
+                } else if (o->m_found) {
+                    CommandChannel::reply_append_pstr(c, AMBRO_PSTR("File opened: "));
+                    CommandChannel::reply_append_str(c, o->m_name);
+                    CommandChannel::reply_append_pstr(c, AMBRO_PSTR(" Size: "));
+                    CommandChannel::reply_append_uint32(c, o->m_file_size);
+                    CommandChannel::reply_append_pstr(c, AMBRO_PSTR("\nFile selected\n"));
+                } else {
+                    CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Error:File not found\n"));
+                }
+                CommandChannel::finishCommand(c);
+            }
+            
+            static void fs_handler (Context c, uint8_t event)
+            {
+                auto *o = Object::self(c);
+                auto *sd = SdCardFeature::Object::self(c);
+                
+                switch (event) {
+                    case TheFs::EVENT_MOUNTED: {
+                        AMBRO_ASSERT(sd->m_state == SDCARD_MOUNTING)
+                        finish_mount(c);
+                    } break;
+                    
+                    case TheFs::EVENT_DIR_ENTRY: {
+                        AMBRO_ASSERT(sd->m_state == SDCARD_SCANNING)
+                        char name[TheFs::MaxNameLength + 1];
+                        TheFs::getEntryName(c, name);
+                        if (o->m_scan_mode == SCAN_LIST) {
+                            ListForEachForwardInterruptible<ChannelCommonList>(LForeach_run_for_state_command(), c, COMMAND_LOCKED, WrapType<FsFeature>(), LForeach_append_dir_entry(), name);
+                        } else if (!o->m_found && names_equal(name, o->m_name)) {
+                            o->m_found = true;
+                            memcpy(o->m_name, name, sizeof(name));
+                            o->m_file_size = TheFs::getEntrySize(c);
+                            o->m_file_cluster = TheFs::getEntryCluster(c);
+                        }
+                    } break;
+                    
+                    case TheFs::EVENT_DIR_END: {
+                        AMBRO_ASSERT(sd->m_state == SDCARD_SCANNING)
+                        if (o->m_scan_mode == SCAN_OPEN && o->m_found) {
+                            // Wait until the cluster chain is mapped, so printing can start without FAT reads.
+                            TheFs::openFile(c, o->m_file_cluster, o->m_file_size);
+                            if (TheFs::readPending(c)) {
+                                return;
+                            }
+                        }
+                        finish_scan(c);
+                    } break;
+                    
+                    case TheFs::EVENT_OPENED: {
+                        AMBRO_ASSERT(sd->m_state == SDCARD_SCANNING)
+                        finish_scan(c);
+                    } break;
+                    
+                    case TheFs::EVENT_CREATED: {
+                        AMBRO_ASSERT(sd->m_state == SDCARD_SCANNING)
+                        AMBRO_ASSERT(o->m_write_mode == WRITE_CREATING)
+                        sd->m_state = SDCARD_INITED;
+                        o->m_write_mode = WRITE_NONE;
+                        if (TheFs::getWriteStatus(c) == TheFs::WRITE_OK) {
+                            start_writing(c);
+                        }
+                        ListForEachForwardInterruptible<ChannelCommonList>(LForeach_run_for_state_command(), c, COMMAND_LOCKED, WrapType<FsFeature>(), LForeach_finish_create());
+                    } break;
+                    
+                    case TheFs::EVENT_CLOSED: {
+                        AMBRO_ASSERT(o->m_write_mode == WRITE_CLOSING)
+                        o->m_write_mode = WRITE_NONE;
+                        ListForEachForwardInterruptible<ChannelCommonList>(LForeach_run_for_state_command(), c, COMMAND_LOCKED, WrapType<FsFeature>(), LForeach_finish_close());
+                    } break;
+                }
+            }
+            
+            static void finish_scan (Context c)
+            {
+                auto *o = Object::self(c);
+                auto *sd = SdCardFeature::Object::self(c);
+                
+                sd->m_state = SDCARD_INITED;
+                if (o->m_scan_mode == SCAN_OPEN && o->m_found) {
+                    // Drop whatever was left of the previous file.
+                    o->m_file_selected = true;
+                    TheGcodeParser::deinit(c);
+                    TheGcodeParser::init(c);
+                    TheChannelCommon::maybeCancelLockingCommand(c);
+                    start_file(c);
+                }
+                ListForEachForwardInterruptible<ChannelCommonList>(LForeach_run_for_state_command(), c, COMMAND_LOCKED, WrapType<FsFeature>(), LForeach_finish_dir_scan());
+            }
+            
+            template <typename CommandChannel>
+            static void finish_create (Context c, WrapType<CommandChannel>)
+            {
+                auto *o = Object::self(c);
+                
+                switch (TheFs::getWriteStatus(c)) {
+                    case TheFs::WRITE_OK: {
+                        if (o->m_logging) {
+                            CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Logging to file: "));
+                        } else {
+                            CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Writing to file: "));
+                        }
+                        CommandChannel::reply_append_str(c, o->m_name);
+                        CommandChannel::reply_append_ch(c, '\n');
+                    } break;
+                    case TheFs::WRITE_EXISTS: {
+                        CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Error:File exists\n"));
+                    } break;
+                    case TheFs::WRITE_DIR_FULL: {
+                        CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Error:Directory full\n"));
+                    } break;
+                    default: {
+                        CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Error:SD write error\n"));
+                    } break;
+                }
+                CommandChannel::finishCommand(c);
+            }
+            
+            template <typename CommandChannel>
+            static void finish_close (Context c, WrapType<CommandChannel>)
+            {
+                auto *o = Object::self(c);
+                
+                uint8_t status = TheFs::getWriteStatus(c);
+                if (status == TheFs::WRITE_DISK_FULL) {
+                    CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Error:SD card full\n"));
+                } else if (status != TheFs::WRITE_OK || o->m_write_error) {
+                    CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Error:SD write error\n"));
+                } else {
+                    CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Done saving file.\n"));
+                }
+                CommandChannel::finishCommand(c);
+            }
+            
+            static void start_writing (Context c)
+            {
+                auto *o = Object::self(c);
+                
+                o->m_write_error = false;
+                o->m_upload_held = false;
+                o->m_write_start = 0;
+                o->m_write_length = 0;
+                o->m_write_size = 0;
+                if (!o->m_logging) {
+                    o->m_write_mode = WRITE_UPLOAD;
+                    return;
+                }
+                o->m_write_mode = WRITE_LOG;
+                o->m_log_dropped = 0;
+                uint8_t header[LogHeaderSize];
+                uint8_t *p = header;
+                float time_freq = Clock::time_freq;
+                *p++ = LogRecordHeader;
+                *p++ = LogVersion;
+                *p++ = NumLogHeaters;
+                *p++ = LogRecordSize;
+                memcpy(p, &time_freq, sizeof(time_freq));
+                p += sizeof(time_freq);
+                ListForEachForward<HeatersList>(LForeach_append_log_name(), c, &p);
+                log_append(c, header, LogHeaderSize);
+                o->m_log_timer.appendAt(c, Clock::getTime(c) + LogIntervalTicks);
+            }
+            
+            static void log_timer_handler (typename Loop::QueuedEvent *, Context c)
+            {
+                auto *o = Object::self(c);
+                auto *mob = PrinterMain::Object::self(c);
+                AMBRO_ASSERT(o->m_write_mode == WRITE_LOG)
+                
+                o->m_log_timer.appendAfterPrevious(c, LogIntervalTicks);
+                uint8_t record[LogRecordSize];
+                uint8_t *p = record;
+                uint32_t time = Clock::getTime(c);
+                *p++ = LogRecordData;
+                *p++ = 0;
+                memcpy(p, &o->m_log_dropped, sizeof(o->m_log_dropped));
+                p += sizeof(o->m_log_dropped);
+                memcpy(p, &time, sizeof(time));
+                p += sizeof(time);
+                memcpy(p, &mob->underrun_count, sizeof(mob->underrun_count));
+                p += sizeof(mob->underrun_count);
+                ListForEachForward<HeatersList>(LForeach_append_log_value(), c, &p);
+                if (log_append(c, record, LogRecordSize)) {
+                    o->m_log_dropped = 0;
+                } else if (o->m_log_dropped < UINT16_MAX) {
+                    o->m_log_dropped++;
+                }
+            }
+            
+            static bool log_append (Context c, uint8_t const *data, size_t length)
+            {
+                auto *o = Object::self(c);
+                
+                // Records do not cross blocks, the rest of a block is filled with zeros.
+                size_t room = BlockSize - (o->m_write_start + o->m_write_length) % BlockSize;
+                size_t pad = (room < length) ? room : 0;
+                if (o->m_write_error || pad + length > LogBufferSize - o->m_write_length) {
+                    return false;
+                }
+                write_append(c, NULL, pad);
+                write_append(c, (char const *)data, length);
+                write_work(c);
+                return true;
+            }
+            
+            static uint8_t * write_buffer (Context c)
+            {
+                auto *o = Object::self(c);
+                auto *sd = SdCardFeature::Object::self(c);
+                return o->m_logging ? o->m_log_buffer : sd->m_buffer;
+            }
+            
+            static size_t write_capacity (Context c)
+            {
+                auto *o = Object::self(c);
+                return o->m_logging ? LogBufferSize : BufferBaseSize;
+            }
+            
+            // Without data, appends zeros.
+            static void write_append (Context c, char const *data, size_t length)
+            {
+                auto *o = Object::self(c);
+                AMBRO_ASSERT(length <= write_capacity(c) - o->m_write_length)
+                
+                uint8_t *buffer = write_buffer(c);
+                size_t capacity = write_capacity(c);
+                size_t pos = o->m_write_start + o->m_write_length;
+                if (pos >= capacity) {
+                    pos -= capacity;
+                }
+                o->m_write_length += length;
+                o->m_write_size += length;
+                while (length > 0) {
+                    size_t chunk = (length < capacity - pos) ? length : (capacity - pos);
+                    if (data) {
+                        memcpy(buffer + pos, data, chunk);
+                        data += chunk;
+                    } else {
+                        memset(buffer + pos, 0, chunk);
+                    }
+                    length -= chunk;
+                    pos = 0;
+                }
+            }
+            
+            static void write_work (Context c)
+            {
+                auto *o = Object::self(c);
+                auto *sd = SdCardFeature::Object::self(c);
+                
+                if (o->m_write_busy || sd->m_num_reading > 0 || TheFs::readPending(c)) {
+                    return;
+                }
+                if (sd->m_state == SDCARD_SCANNING) {
+                    if (o->m_scan_deferred) {
+                        o->m_scan_deferred = false;
+                        TheFs::startDirScan(c);
+                    }
+                    return;
+                }
+                if (o->m_write_mode < WRITE_UPLOAD || o->m_write_mode == WRITE_CLOSING) {
+                    return;
+                }
+                // Only full blocks are written, until the file is being closed.
+                size_t length = o->m_write_length;
+                if (o->m_write_mode != WRITE_FLUSHING) {
+                    length -= length % BlockSize;
+                }
+                if (length == 0) {
+                    if (o->m_write_mode == WRITE_FLUSHING) {
+                        o->m_write_mode = WRITE_CLOSING;
+                        TheFs::startCloseFile(c, o->m_write_size);
+                    }
+                    return;
+                }
+                uint8_t *buffer = write_buffer(c) + o->m_write_start;
+                uint32_t count = (length + BlockSize - 1) / BlockSize;
+                uint32_t max_count = (write_capacity(c) - o->m_write_start) / BlockSize;
+                if (count > max_count) {
+                    count = max_count;
+                }
+                uint32_t block;
+                uint8_t res = TheFs::getWriteBlocks(c, &block, &count);
+                if (res == TheFs::NEXT_WAIT) {
+                    return;
+                }
+                if (res != TheFs::NEXT_BLOCK) {
+                    write_error(c);
+                    return write_work(c);
+                }
+                if (o->m_write_length < count * BlockSize) {
+                    memset(buffer + o->m_write_length, 0, count * BlockSize - o->m_write_length);
+                }
+                TheSdCard::queueWrite(c, block, buffer, count);
+                o->m_write_busy = true;
+                o->m_write_count = count;
+            }
+            
+            static void check_write (Context c)
+            {
+                auto *o = Object::self(c);
+                
+                if (!o->m_write_busy) {
+                    return;
+                }
+                bool error;
+                if (!TheSdCard::checkWrite(c, &error)) {
+                    return;
+                }
+                o->m_write_busy = false;
+                if (error) {
+                    return write_error(c);
+                }
+                size_t written = (size_t)o->m_write_count * BlockSize;
+                o->m_write_start += written;
+                if (o->m_write_start == write_capacity(c)) {
+                    o->m_write_start = 0;
+                }
+                o->m_write_length -= (written < o->m_write_length) ? written : o->m_write_length;
+                if (o->m_upload_held) {
+                    upload_line(c, WrapType<typename SerialFeature::TheChannelCommon>());
+                }
+            }
+            
+            static void write_error (Context c)
+            {
+                auto *o = Object::self(c);
+                
+                // Nothing more goes to the file, it is closed with what made it to the card.
+                SerialFeature::TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR("//SdWrEr\n"));
+                SerialFeature::TheChannelCommon::reply_poke(c);
+                o->m_write_error = true;
+                o->m_write_size -= o->m_write_length;
+                o->m_write_start = 0;
+                o->m_write_length = 0;
+                if (o->m_upload_held) {
+                    upload_line(c, WrapType<typename SerialFeature::TheChannelCommon>());
+                }
+            }
+            
+            struct FsHandler : public AMBRO_WFUNC_TD(&FsFeature::fs_handler) {};
+            
+            struct Object : public ObjBase<FsFeature, typename SdCardFeature::Object, MakeTypeList<
+                TheFs
+            >> {
+                typename Loop::QueuedEvent m_log_timer;
+                bool m_file_selected;
+                bool m_found;
+                bool m_scan_deferred;
+                bool m_logging;
+                bool m_write_busy;
+                bool m_write_error;
+                bool m_upload_held;
+                uint8_t m_scan_mode;
+                uint8_t m_write_mode;
+                uint8_t m_write_count;
+                uint16_t m_log_dropped;
+                uint32_t m_file_size;
+                uint32_t m_file_cluster;
+                uint32_t m_write_size;
+                size_t m_write_start;
+                size_t m_write_length;
+                char m_name[TheFs::MaxNameLength + 1];
+                uint8_t m_log_buffer[LogBufferSize];
+            };
+        } AMBRO_STRUCT_ELSE(FsFeature) {
+            static void init (Context c) {}
+            static void deinit (Context c) {}
+            static bool start_mount (Context c) { return false; }
+            static bool is_mounted (Context c) { return false; }
+            static bool file_selected (Context c) { return false; }
+            static uint8_t next_block (Context c, uint32_t *out_block) { return NEXT_END; }
+            static size_t block_length (Context c, uint32_t index) { return BlockSize; }
+            static bool read_pending (Context c) { return false; }
+            static bool check_read (Context c, bool *out_error) { return false; }
+            static void discard_read (Context c) {}
+            static void finish_read (Context c) {}
+            static bool is_writing (Context c) { return false; }
+            static bool write_pending (Context c) { return false; }
+            static bool holds_reads (Context c) { return false; }
+            static void write_work (Context c) {}
+            static void check_write (Context c) {}
+            template <typename CommandChannel>
+            static void append_mount_status (Context c, WrapType<CommandChannel>) {}
+            template <typename CommandChannel>
+            static bool check_command (Context c, WrapType<CommandChannel>) { return true; }
+            template <typename CommandChannel>
+            static bool check_upload_command (Context c, WrapType<CommandChannel>) { return true; }
+            struct Object {};
+        };
+        
+        static void init (Context c)
+        {
+            auto *o = Object::self(c);
+            TheSdCard::init(c);
+            FsFeature::init(c);
+            TheChannelCommon::init(c);
+            o->m_next_event.init(c, SdCardFeature::next_event_handler);
+            o->m_state = SDCARD_NONE;
+        }
+        
+        static void deinit (Context c)
+        {
+            auto *o = Object::self(c);
+            if (o->m_state != SDCARD_NONE && o->m_state != SDCARD_INITING) {
+                TheGcodeParser::deinit(c);
+            }
+            o->m_next_event.deinit(c);
+            FsFeature::deinit(c);
+            TheSdCard::deinit(c);
+        }
+        
+        template <typename CommandChannel>
+        static void finish_init (Context c, WrapType<CommandChannel>, uint8_t error_code)
+        {
+            auto *o = Object::self(c);
+            
+            if (error_code) {
+                CommandChannel::reply_append_pstr(c, AMBRO_PSTR("SD error "));
+                CommandChannel::reply_append_uint8(c, error_code);
+            } else {
+                CommandChannel::reply_append_pstr(c, AMBRO_PSTR("SD blocks "));
                 CommandChannel::reply_append_uint32(c, TheSdCard::getCapacityBlocks(c));
+                FsFeature::append_mount_status(c, WrapType<CommandChannel>());
             }
             CommandChannel::reply_append_ch(c, '\n');
             CommandChannel::finishCommand(c);
         }
         
-        static void sd_card_init_handler (Context c, uint8_t error_code)
+        static void sd_card_init_handler (Context c, uint8_t error_code)
+        {
+            auto *o = Object::self(c);
+            AMBRO_ASSERT(o->m_state == SDCARD_INITING)
+            
+            if (error_code) {
+                o->m_state = SDCARD_NONE;
+                return report_init(c, error_code);
+            }
+            TheGcodeParser::init(c);
+            start_file(c);
+            o->m_state = SDCARD_MOUNTING;
+            if (!FsFeature::start_mount(c)) {
+                finish_mount(c);
+            }
+        }
+        
+        static void finish_mount (Context c)
+        {
+            auto *o = Object::self(c);
+            AMBRO_ASSERT(o->m_state == SDCARD_MOUNTING)
+            
+            o->m_state = SDCARD_INITED;
+            report_init(c, 0);
+        }
+        
+        static void report_init (Context c, uint8_t error_code)
+        {
+            ListForEachForwardInterruptible<ChannelCommonList>(LForeach_run_for_state_command(), c, COMMAND_LOCKED, WrapType<SdCardFeature>(), LForeach_finish_init(), error_code);
+        }
+        
+        static void start_file (Context c)
         {
             auto *o = Object::self(c);
-            AMBRO_ASSERT(o->m_state == SDCARD_INITING)
             
-            if (error_code) {
-                o->m_state = SDCARD_NONE;
-            } else {
-                o->m_state = SDCARD_INITED;
-                TheGcodeParser::init(c);
-                o->m_start = 0;
-                o->m_length = 0;
-                o->m_cmd_offset = 0;
-                o->m_sd_block = 0;
-            }
-            ListForEachForwardInterruptible<ChannelCommonList>(LForeach_run_for_state_command(), c, COMMAND_LOCKED, WrapType<SdCardFeature>(), LForeach_finish_init(), error_code);
+            o->m_start = 0;
+            o->m_length = 0;
+            o->m_cmd_offset = 0;
+            o->m_sd_block = 0;
+            o->m_read_index = 0;
+            o->m_num_assigned = 0;
+            o->m_num_reading = 0;
+            o->m_num_discarding = 0;
+            o->m_check_offset = 0;
+            o->m_read_end = NEXT_BLOCK;
         }
         
         static void sd_card_command_handler (Context c)
         {
+            AMBRO_PROFILE_SCOPE(c, PROFILE_SDCARD_READ);
             auto *o = Object::self(c);
             auto *co = TheChannelCommon::Object::self(c);
-            AMBRO_ASSERT(o->m_state == SDCARD_RUNNING || o->m_state == SDCARD_PAUSING)
-            AMBRO_ASSERT(o->m_length < BufferBaseSize)
-            AMBRO_ASSERT(o->m_sd_block < TheSdCard::getCapacityBlocks(c))
+            AMBRO_ASSERT(o->m_state == SDCARD_MOUNTING || o->m_state == SDCARD_INITED || o->m_state == SDCARD_SCANNING ||
+                         o->m_state == SDCARD_RUNNING || o->m_state == SDCARD_PAUSING)
+            AMBRO_ASSERT(o->m_num_reading > 0 || FsFeature::read_pending(c) || FsFeature::write_pending(c))
             
-            bool error;
-            if (!TheSdCard::checkReadBlock(c, &o->m_read_state, &error)) {
-                return;
+            // If the file system read is complete, so are the reads queued
+            // before it. It is finished last, when it is known whether any
+            // of those failed.
+            bool fs_error;
+            bool fs_done = FsFeature::check_read(c, &fs_error);
+            if (fs_done && fs_error) {
+                read_error(c);
+            }
+            
+            bool got_block = false;
+            while (o->m_num_reading > 0) {
+                int index = (o->m_read_index + o->m_check_offset) % MaxReadsInFlight;
+                bool error;
+                if (!TheSdCard::checkReadBlock(c, &o->m_read_state[index], &error)) {
+                    break;
+                }
+                o->m_num_reading--;
+                if (o->m_num_discarding > 0 || error) {
+                    // The block stays assigned and is read again.
+                    o->m_check_offset++;
+                    if (o->m_num_discarding > 0) {
+                        o->m_num_discarding--;
+                    } else {
+                        read_error(c);
+                    }
+                    continue;
+                }
+                AMBRO_ASSERT(o->m_check_offset == 0)
+                AMBRO_ASSERT(o->m_length < BufferBaseSize)
+                o->m_read_index = (o->m_read_index + 1) % MaxReadsInFlight;
+                o->m_num_assigned--;
+                o->m_length += FsFeature::is_mounted(c) ? FsFeature::block_length(c, o->m_sd_block) : BlockSize;
+                o->m_sd_block++;
+                got_block = true;
             }
-            TheSdCard::unsetEvent(c);
-            if (o->m_state == SDCARD_PAUSING) {
-                o->m_state = SDCARD_INITED;
-                return finish_locked(c);
+            if (o->m_num_reading == 0) {
+                o->m_check_offset = 0;
             }
-            if (error) {
-                SerialFeature::TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR("//SdRdEr\n"));
-                SerialFeature::TheChannelCommon::reply_poke(c);
-                return start_read(c);
+            if (fs_done) {
+                FsFeature::finish_read(c);
             }
-            o->m_sd_block++;
-            if (o->m_length == BufferBaseSize - o->m_start) {
-                memcpy(o->m_buffer + BufferBaseSize, o->m_buffer, MaxCommandSize - 1);
+            FsFeature::check_write(c);
+            FsFeature::write_work(c);
+            
+            // A read still in flight may already have set the event again.
+            if (o->m_num_reading == 0 && !FsFeature::read_pending(c)) {
+                if (!FsFeature::write_pending(c)) {
+                    TheSdCard::unsetEvent(c);
+                }
+                if (o->m_state == SDCARD_PAUSING) {
+                    o->m_state = SDCARD_INITED;
+                    return finish_locked(c);
+                }
             }
-            o->m_length += BlockSize;
-            if (o->m_length < BufferBaseSize && o->m_sd_block < TheSdCard::getCapacityBlocks(c)) {
-                start_read(c);
+            if (o->m_state != SDCARD_RUNNING) {
+                return;
             }
-            if (!co->m_cmd && !o->m_eof) {
+            start_reads(c);
+            if (got_block && !co->m_cmd && !o->m_eof) {
                 o->m_next_event.prependNowNotAlready(c);
             }
         }
         
+        static void read_error (Context c)
+        {
+            auto *o = Object::self(c);
+            
+            // The reads queued after the failed one are worthless, wait them out.
+            SerialFeature::TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR("//SdRdEr\n"));
+            SerialFeature::TheChannelCommon::reply_poke(c);
+            o->m_num_discarding = o->m_num_reading;
+            FsFeature::discard_read(c);
+        }
+        
         static void next_event_handler (typename Loop::QueuedEvent *, Context c)
         {
             auto *o = Object::self(c);
@@ -1018,7 +2343,13 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             
             AMBRO_PGM_P eof_str;
             if (!TheGcodeParser::haveCommand(c)) {
-                TheGcodeParser::startCommand(c, (char *)buf_get(c, o->m_start, o->m_cmd_offset), 0);
+                // A command at the end of the buffer continues at its start.
+                uint8_t *cmd = buf_get(c, o->m_start, o->m_cmd_offset);
+                size_t first_length = (o->m_buffer + BufferBaseSize) - cmd;
+                if (first_length > MaxCommandSize) {
+                    first_length = MaxCommandSize;
+                }
+                TheGcodeParser::startCommand(c, (char *)cmd, 0, first_length, (char *)o->m_buffer);
             }
             ParserSizeType avail = (o->m_length - o->m_cmd_offset > MaxCommandSize) ? MaxCommandSize : (o->m_length - o->m_cmd_offset);
             if (TheGcodeParser::extendCommand(c, avail)) {
@@ -1032,8 +2363,8 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
                 eof_str = AMBRO_PSTR("//SdLnEr\n");
                 goto eof;
             }
-            if (o->m_sd_block == TheSdCard::getCapacityBlocks(c)) {
-                eof_str = AMBRO_PSTR("//SdEnd\n");
+            if (o->m_read_end != NEXT_BLOCK && o->m_num_assigned == 0) {
+                eof_str = (o->m_read_end == NEXT_ERROR) ? AMBRO_PSTR("//SdFsEr\n") : AMBRO_PSTR("//SdEnd\n");
                 goto eof;
             }
             return;
@@ -1067,8 +2398,15 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
                 if (!CommandChannel::tryUnplannedCommand(c)) {
                     return false;
                 }
+                if (FsFeature::is_writing(c)) {
+                    CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Error:Writing a file, use M29 first\n"));
+                    CommandChannel::finishCommand(c);
+                    return false;
+                }
                 CommandChannel::finishCommand(c);
                 AMBRO_ASSERT(o->m_state != SDCARD_INITING)
+                AMBRO_ASSERT(o->m_state != SDCARD_MOUNTING)
+                AMBRO_ASSERT(o->m_state != SDCARD_SCANNING)
                 AMBRO_ASSERT(o->m_state != SDCARD_PAUSING)
                 if (o->m_state == SDCARD_NONE) {
                     return false;
@@ -1084,15 +2422,16 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
                 if (!CommandChannel::tryUnplannedCommand(c)) {
                     return false;
                 }
+                if (o->m_state == SDCARD_INITED && FsFeature::is_mounted(c) && !FsFeature::file_selected(c)) {
+                    CommandChannel::reply_append_pstr(c, AMBRO_PSTR("Error:No file selected\n"));
+                }
                 CommandChannel::finishCommand(c);
-                if (o->m_state != SDCARD_INITED) {
+                if (o->m_state != SDCARD_INITED || (FsFeature::is_mounted(c) && !FsFeature::file_selected(c))) {
                     return false;
                 }
                 o->m_state = SDCARD_RUNNING;
                 o->m_eof = false;
-                if (o->m_length < BufferBaseSize && o->m_sd_block < TheSdCard::getCapacityBlocks(c)) {
-                    start_read(c);
-                }
+                start_reads(c);
                 if (!TheChannelCommon::maybeResumeLockingCommand(c)) {
                     o->m_next_event.prependNowNotAlready(c);
                 }
@@ -1108,7 +2447,7 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
                 }
                 o->m_next_event.unset(c);
                 TheChannelCommon::maybePauseLockingCommand(c);
-                if (o->m_length < BufferBaseSize && o->m_sd_block < TheSdCard::getCapacityBlocks(c)) {
+                if (o->m_num_reading > 0 || FsFeature::read_pending(c)) {
                     o->m_state = SDCARD_PAUSING;
                 } else {
                     o->m_state = SDCARD_INITED;
@@ -1116,7 +2455,13 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
                 }
                 return false;
             }
-            return true;
+            return FsFeature::check_command(c, WrapType<CommandChannel>());
+        }
+        
+        template <typename CommandChannel>
+        static bool check_upload_command (Context c, WrapType<CommandChannel>)
+        {
+            return FsFeature::check_upload_command(c, WrapType<CommandChannel>());
         }
         
         static bool start_command_impl (Context c)
@@ -1142,9 +2487,7 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
                 }
                 o->m_length -= BlockSize;
                 o->m_cmd_offset -= BlockSize;
-                if (o->m_length == BufferBaseSize - BlockSize && o->m_sd_block < TheSdCard::getCapacityBlocks(c)) {
-                    start_read(c);
-                }
+                start_reads(c);
             }
         }
         
@@ -1176,13 +2519,43 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             return o->m_buffer + x;
         }
         
-        static void start_read (Context c)
+        static uint8_t next_block (Context c, uint32_t *out_block)
+        {
+            auto *o = Object::self(c);
+            
+            if (FsFeature::is_mounted(c)) {
+                return FsFeature::next_block(c, out_block);
+            }
+            // Without a file system, the card is read from the start.
+            *out_block = o->m_sd_block + o->m_num_assigned;
+            return (*out_block < TheSdCard::getCapacityBlocks(c)) ? NEXT_BLOCK : NEXT_END;
+        }
+        
+        static void start_reads (Context c)
         {
             auto *o = Object::self(c);
-            AMBRO_ASSERT(o->m_length < BufferBaseSize)
-            AMBRO_ASSERT(o->m_sd_block < TheSdCard::getCapacityBlocks(c))
+            AMBRO_ASSERT(o->m_state == SDCARD_RUNNING)
             
-            TheSdCard::queueReadBlock(c, o->m_sd_block, buf_get(c, o->m_start, o->m_length), &o->m_read_state);
+            if (o->m_num_discarding > 0 || FsFeature::holds_reads(c)) {
+                return;
+            }
+            while (o->m_num_reading < MaxReadsInFlight &&
+                   o->m_length + (o->m_num_reading + 1) * BlockSize <= BufferBaseSize
+            ) {
+                int index = (o->m_read_index + o->m_num_reading) % MaxReadsInFlight;
+                if (o->m_num_reading == o->m_num_assigned) {
+                    uint8_t res = next_block(c, &o->m_read_block[index]);
+                    if (res != NEXT_BLOCK) {
+                        if (res != NEXT_WAIT) {
+                            o->m_read_end = res;
+                        }
+                        break;
+                    }
+                    o->m_num_assigned++;
+                }
+                TheSdCard::queueReadBlock(c, o->m_read_block[index], buf_get(c, o->m_start, o->m_length + o->m_num_reading * BlockSize), &o->m_read_state[index]);
+                o->m_num_reading++;
+            }
         }
         
         struct SdCardInitHandler : public AMBRO_WFUNC_TD(&SdCardFeature::sd_card_init_handler) {};
@@ -1193,24 +2566,34 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
         
         struct Object : public ObjBase<SdCardFeature, typename PrinterMain::Object, MakeTypeList<
             TheSdCard,
+            FsFeature,
             TheChannelCommon,
             TheGcodeParser
         >> {
             typename Loop::QueuedEvent m_next_event;
             uint8_t m_state;
-            SdCardReadState m_read_state;
+            SdCardReadState m_read_state[MaxReadsInFlight];
+            uint32_t m_read_block[MaxReadsInFlight];
+            uint8_t m_read_index;
+            uint8_t m_num_assigned;
+            uint8_t m_num_reading;
+            uint8_t m_num_discarding;
+            uint8_t m_check_offset;
+            uint8_t m_read_end;
             size_t m_start;
             size_t m_length;
             size_t m_cmd_offset;
             bool m_eof;
             uint32_t m_sd_block;
-            uint8_t m_buffer[BufferBaseSize + (MaxCommandSize - 1)];
+            uint8_t m_buffer[BufferBaseSize];
         };
     } AMBRO_STRUCT_ELSE(SdCardFeature) {
         static void init (Context c) {}
         static void deinit (Context c) {}
         template <typename TheChannelCommon>
         static bool check_command (Context c, WrapType<TheChannelCommon>) { return true; }
+        template <typename TheChannelCommon>
+        static bool check_upload_command (Context c, WrapType<TheChannelCommon>) { return true; }
         using EventLoopFastEvents = EmptyTypeList;
         using SdChannelCommonList = EmptyTypeList;
         struct Object {};
@@ -1218,6 +2601,7 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
     
     using ChannelCommonList = JoinTypeLists<
         MakeTypeList<typename SerialFeature::TheChannelCommon>,
+        typename SerialFeature::FramedFeature::FramedChannelCommonList,
         typename SdCardFeature::SdChannelCommonList
     >;
     
@@ -1468,6 +2852,10 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             mycmd->dir = dir;
             mycmd->x = move;
             mycmd->max_v_rec = 1.0f / speed_from_real((FpType)AxisSpec::DefaultMaxSpeed::value());
+            if (AxisSpec::AdvanceParams::Enabled) {
+                // The advance may step the axis faster than the move, so hold it to MaxStepsPerCycle on its own.
+                mycmd->max_v_rec = FloatMax(mycmd->max_v_rec, (FpType)(1.0 / (Params::MaxStepsPerCycle::value() * F_CPU * Clock::time_unit)));
+            }
             mycmd->max_a_rec = 1.0f / accel_from_real((FpType)AxisSpec::DefaultMaxAccel::value());
             o->m_end_pos = new_end_pos;
         }
@@ -1515,7 +2903,10 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             Stepper::emergency();
         }
         
-        using EventLoopFastEvents = typename HomingFeature::EventLoopFastEvents;
+        using EventLoopFastEvents = JoinTypeLists<
+            typename TheAxisStepper::EventLoopFastEvents,
+            typename HomingFeature::EventLoopFastEvents
+        >;
         
         struct Object : public ObjBase<Axis, typename PrinterMain::Object, MakeTypeList<
             TheAxisStepper,
@@ -1547,7 +2938,8 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
         TheAxis::AxisSpec::StepBits,
         typename TheAxis::AxisSpec::DefaultDistanceFactor,
         typename TheAxis::AxisSpec::DefaultCorneringDistance,
-        PlannerPrestepCallback<TheAxis::AxisIndex>
+        PlannerPrestepCallback<TheAxis::AxisIndex>,
+        typename TheAxis::AxisSpec::AdvanceParams
     >;
     
     AMBRO_STRUCT_IF(TransformFeature, TransformParams::Enabled) {
@@ -1584,6 +2976,18 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             void set (FpType x) { VirtAxis<Index>::Object::self(m_c)->m_req_pos = x; }
         };
         
+        struct VirtOldPosSrc {
+            Context m_c;
+            template <int Index>
+            FpType get () { return VirtAxis<Index>::Object::self(m_c)->m_old_pos; }
+        };
+        
+        struct VirtDeltaSrc {
+            Context m_c;
+            template <int Index>
+            FpType get () { return VirtAxis<Index>::Object::self(m_c)->m_delta; }
+        };
+        
         struct ArraySrc {
             FpType const *m_arr;
             template <int Index>
@@ -1615,7 +3019,7 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
         {
             auto *o = Object::self(c);
             auto *mob = PrinterMain::Object::self(c);
-            AMBRO_ASSERT(mob->planner_state == PLANNER_RUNNING || mob->planner_state == PLANNER_PROBE)
+            AMBRO_ASSERT(mob->planner_state != PLANNER_NONE)
             AMBRO_ASSERT(mob->m_planning_pull_pending)
             AMBRO_ASSERT(o->splitting)
             AMBRO_ASSERT(FloatIsPosOrPosZero(time_freq_by_max_speed))
@@ -1631,6 +3035,7 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             FpType base_max_v_rec = ListForEachForwardAccRes<VirtAxesList>(distance * time_freq_by_max_speed, LForeach_limit_virt_axis_speed(), c);
             FpType min_segments_by_distance = (FpType)(TransformParams::SegmentsPerSecond::value() * Clock::time_unit) * time_freq_by_max_speed;
             o->splitter.start(distance, base_max_v_rec, min_segments_by_distance);
+            o->line.start(VirtOldPosSrc{c}, VirtDeltaSrc{c});
             do_split(c);
         }
         
@@ -1702,9 +3107,7 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
                 FpType frac;
                 FpType move_pos[NumAxes];
                 if (o->splitter.pull(&rel_max_v_rec, &frac)) {
-                    FpType virt_pos[NumVirtAxes];
-                    ListForEachForward<VirtAxesList>(LForeach_compute_split(), c, frac, virt_pos);
-                    TheTransformAlg::virtToPhys(ArraySrc{virt_pos}, PhysArrayDst{move_pos});
+                    o->line.evaluate(frac, PhysArrayDst{move_pos});
                     ListForEachForward<VirtAxesList>(LForeach_clamp_move_phys(), c, move_pos);
                     ListForEachForward<SecondaryAxesList>(LForeach_compute_split(), c, frac, move_pos);
                 } else {
@@ -1801,13 +3204,6 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
                 *distance_squared += o->m_delta * o->m_delta;
             }
             
-            static void compute_split (Context c, FpType frac, FpType *virt_pos)
-            {
-                auto *o = Object::self(c);
-                auto *t = TransformFeature::Object::self(c);
-                virt_pos[VirtAxisIndex] = o->m_old_pos + (frac * o->m_delta);
-            }
-            
             static void get_final_split (Context c, FpType *move_pos)
             {
                 auto *axis = ThePhysAxis::Object::self(c);
@@ -1902,6 +3298,7 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             bool splitclear_pending;
             bool splitting;
             TheSplitter splitter;
+            typename TheTransformAlg::LineEvaluator line;
         };
     } AMBRO_STRUCT_ELSE(TransformFeature) {
         static int const NumVirtAxes = 0;
@@ -1948,21 +3345,70 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             TheAxis::update_new_pos(c, s, req);
         }
         
+        // The target for a requested position, following G90/G91 and M82/M83.
+        static FpType absolute_new_pos (Context c, FpType from, FpType req)
+        {
+            auto *axis = TheAxis::Object::self(c);
+            if (axis->m_relative_positioning) {
+                req += from;
+            }
+            return req;
+        }
+        
+        // Shared by text and packed g-code, so both follow G90/G91 and M82/M83 alike.
+        static void apply_new_pos (Context c, MoveBuildState *s, FpType req)
+        {
+            auto *axis = TheAxis::Object::self(c);
+            update_new_pos(c, s, absolute_new_pos(c, axis->m_old_pos, req));
+        }
+        
         template <typename TheChannelCommon>
         static bool collect_new_pos (Context c, WrapType<TheChannelCommon>, MoveBuildState *s, typename TheChannelCommon::GcodeParserPartRef part)
+        {
+            if (AMBRO_UNLIKELY(TheChannelCommon::TheGcodeParser::getPartCode(c, part) == TheAxis::AxisName)) {
+                apply_new_pos(c, s, TheChannelCommon::TheGcodeParser::template getPartFpValue<FpType>(c, part));
+                return false;
+            }
+            return true;
+        }
+        
+        static bool collect_new_pos_fp (Context c, MoveBuildState *s, char code, FpType req)
+        {
+            if (AMBRO_UNLIKELY(code == TheAxis::AxisName)) {
+                apply_new_pos(c, s, req);
+                return false;
+            }
+            return true;
+        }
+        
+        static void init_arc_pos (Context c, FpType *start_pos, FpType *end_pos)
+        {
+            auto *axis = TheAxis::Object::self(c);
+            start_pos[PhysVirtAxisIndex] = axis->m_req_pos;
+            end_pos[PhysVirtAxisIndex] = axis->m_req_pos;
+        }
+        
+        template <typename TheChannelCommon>
+        static bool collect_arc_pos (Context c, WrapType<TheChannelCommon>, typename TheChannelCommon::GcodeParserPartRef part, FpType *end_pos)
         {
             auto *axis = TheAxis::Object::self(c);
             if (AMBRO_UNLIKELY(TheChannelCommon::TheGcodeParser::getPartCode(c, part) == TheAxis::AxisName)) {
                 FpType req = TheChannelCommon::TheGcodeParser::template getPartFpValue<FpType>(c, part);
-                if (axis->m_relative_positioning) {
-                    req += axis->m_old_pos;
-                }
-                update_new_pos(c, s, req);
+                end_pos[PhysVirtAxisIndex] = absolute_new_pos(c, axis->m_req_pos, req);
                 return false;
             }
             return true;
         }
         
+        static void add_arc_pos (Context c, MoveBuildState *s, FpType frac, FpType const *start_pos, FpType const *end_pos)
+        {
+            FpType start = start_pos[PhysVirtAxisIndex];
+            FpType end = end_pos[PhysVirtAxisIndex];
+            if (end != start) {
+                update_new_pos(c, s, start + frac * (end - start));
+            }
+        }
+        
         static void set_relative_positioning (Context c, bool relative)
         {
             auto *axis = TheAxis::Object::self(c);
@@ -1975,7 +3421,7 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             auto *axis = TheAxis::Object::self(c);
             TheChannelCommon::reply_append_ch(c, TheAxis::AxisName);
             TheChannelCommon::reply_append_ch(c, ':');
-            TheChannelCommon::reply_append_fp(c, axis->m_req_pos);
+            TheChannelCommon::reply_append_fp(c, ArcFeature::template reported_pos<PhysVirtAxisIndex>(c, axis->m_req_pos));
         }
         
         template <typename TheChannelCommon>
@@ -1999,6 +3445,194 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
         >
     >;
     
+    AMBRO_STRUCT_IF(ArcFeature, ArcParams::Enabled) {
+        struct Object;
+        static bool const Enabled = true;
+        static int const ArcXAxisIndex = FindPhysVirtAxis<'X'>::value;
+        static int const ArcYAxisIndex = FindPhysVirtAxis<'Y'>::value;
+        static_assert(ArcXAxisIndex >= 0 && ArcYAxisIndex >= 0, "Arcs need X and Y axes");
+        using TheArcSplitter = ArcSplitter<ArcSplitterParams<typename ArcParams::ChordTolerance, typename ArcParams::MinSegmentLength>, FpType>;
+        
+        static void init (Context c)
+        {
+            auto *o = Object::self(c);
+            o->arcing = false;
+            o->splitclear_pending = false;
+        }
+        
+        template <typename TheChannelCommon>
+        static void handle_arc_command (Context c, WrapType<TheChannelCommon> cc, bool clockwise)
+        {
+            auto *o = Object::self(c);
+            
+            if (!TheChannelCommon::tryPlannedCommand(c)) {
+                return;
+            }
+            AMBRO_ASSERT(!o->arcing)
+            ListForEachForward<PhysVirtAxisHelperList>(LForeach_init_arc_pos(), c, o->start_pos, o->end_pos);
+            bool have_center = false;
+            bool have_radius = false;
+            FpType i = 0.0f;
+            FpType j = 0.0f;
+            FpType r = 0.0f;
+            auto num_parts = TheChannelCommon::TheGcodeParser::getNumParts(c);
+            for (typename TheChannelCommon::GcodePartsSizeType k = 0; k < num_parts; k++) {
+                typename TheChannelCommon::GcodeParserPartRef part = TheChannelCommon::TheGcodeParser::getPart(c, k);
+                if (ListForEachForwardInterruptible<PhysVirtAxisHelperList>(LForeach_collect_arc_pos(), c, cc, part, o->end_pos)) {
+                    FpType value = TheChannelCommon::TheGcodeParser::template getPartFpValue<FpType>(c, part);
+                    switch (TheChannelCommon::TheGcodeParser::getPartCode(c, part)) {
+                        case 'F': move_set_max_speed(c, value); break;
+                        case 'I': i = value; have_center = true; break;
+                        case 'J': j = value; have_center = true; break;
+                        case 'R': r = value; have_radius = true; break;
+                    }
+                }
+            }
+            FpType x0 = o->start_pos[ArcXAxisIndex];
+            FpType y0 = o->start_pos[ArcYAxisIndex];
+            FpType dx = o->end_pos[ArcXAxisIndex] - x0;
+            FpType dy = o->end_pos[ArcYAxisIndex] - y0;
+            if (have_radius) {
+                // The center is on the perpendicular bisector of the chord, on the
+                // side which gives the requested direction; a negative R picks the
+                // longer of the two arcs.
+                FpType d2 = dx * dx + dy * dy;
+                if (!(d2 > 0.0f)) {
+                    goto error;
+                }
+                FpType h = FloatSqrt(FloatMakePosOrPosZero(4.0f * r * r / d2 - 1.0f));
+                if (clockwise != (r < 0.0f)) {
+                    h = -h;
+                }
+                i = 0.5f * (dx - dy * h);
+                j = 0.5f * (dy + dx * h);
+            } else if (!have_center) {
+                goto error;
+            }
+            if (!(i != 0.0f || j != 0.0f)) {
+                goto error;
+            }
+            {
+                FpType ex = dx - i;
+                FpType ey = dy - j;
+                FpType angle = FloatAtan2<FpType>(j * ex - i * ey, -i * ex - j * ey);
+                // Equal start and end points make a full circle.
+                if (clockwise) {
+                    if (angle >= (FpType)-AngleEpsilon) {
+                        angle -= (FpType)(2.0 * M_PI);
+                    }
+                } else {
+                    if (angle <= (FpType)AngleEpsilon) {
+                        angle += (FpType)(2.0 * M_PI);
+                    }
+                }
+                o->center_x = x0 + i;
+                o->center_y = y0 + j;
+                o->splitter.start(-i, -j, angle);
+                o->arcing = true;
+            }
+            TheChannelCommon::finishCommand(c);
+            arc_next(c);
+            return;
+        error:
+            TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR("Error:Bad arc\n"));
+            TheChannelCommon::finishCommand(c);
+        }
+        
+        static bool is_arcing (Context c)
+        {
+            auto *o = Object::self(c);
+            return o->arcing;
+        }
+        
+        // While an arc is being split, report where it ends.
+        template <int PhysVirtAxisIndex>
+        static FpType reported_pos (Context c, FpType req_pos)
+        {
+            auto *o = Object::self(c);
+            return o->arcing ? o->end_pos[PhysVirtAxisIndex] : req_pos;
+        }
+        
+        static void arc_next (Context c)
+        {
+            auto *o = Object::self(c);
+            auto *mob = PrinterMain::Object::self(c);
+            AMBRO_ASSERT(o->arcing)
+            AMBRO_ASSERT(mob->planner_state != PLANNER_NONE)
+            AMBRO_ASSERT(mob->m_planning_pull_pending)
+            
+            MoveBuildState s;
+            move_begin(c, &s);
+            FpType frac;
+            FpType x;
+            FpType y;
+            if (o->splitter.pull(&frac, &x, &y)) {
+                ListForEachForward<PhysVirtAxisHelperList>(LForeach_add_arc_pos(), c, &s, frac, o->start_pos, o->end_pos);
+                move_add_axis<ArcXAxisIndex>(c, &s, o->center_x + x);
+                move_add_axis<ArcYAxisIndex>(c, &s, o->center_y + y);
+            } else {
+                o->arcing = false;
+                ListForEachForward<PhysVirtAxisHelperList>(LForeach_add_arc_pos(), c, &s, 1.0f, o->start_pos, o->end_pos);
+                move_add_axis<ArcXAxisIndex>(c, &s, o->end_pos[ArcXAxisIndex]);
+                move_add_axis<ArcYAxisIndex>(c, &s, o->end_pos[ArcYAxisIndex]);
+            }
+            move_end(c, &s, mob->time_freq_by_max_speed);
+            if (!o->arcing && o->splitclear_pending) {
+                AMBRO_ASSERT(mob->locked)
+                o->splitclear_pending = false;
+                ListForEachForwardInterruptible<ChannelCommonList>(LForeach_run_for_state_command(), c, COMMAND_LOCKED, WrapType<ArcFeature>(), LForeach_continue_splitclear_helper());
+            }
+        }
+        
+        static bool try_splitclear_command (Context c)
+        {
+            auto *o = Object::self(c);
+            auto *mob = PrinterMain::Object::self(c);
+            AMBRO_ASSERT(mob->locked)
+            AMBRO_ASSERT(!o->splitclear_pending)
+            
+            if (!o->arcing) {
+                return true;
+            }
+            o->splitclear_pending = true;
+            return false;
+        }
+        
+        template <typename TheChannelCommon>
+        static void continue_splitclear_helper (Context c, WrapType<TheChannelCommon>)
+        {
+            auto *o = Object::self(c);
+            auto *cco = TheChannelCommon::Object::self(c);
+            AMBRO_ASSERT(cco->m_state == COMMAND_LOCKED)
+            AMBRO_ASSERT(!o->arcing)
+            
+            work_command(c, WrapType<TheChannelCommon>());
+        }
+        
+        static constexpr double AngleEpsilon = 5e-7;
+        
+        struct Object : public ObjBase<ArcFeature, typename PrinterMain::Object, EmptyTypeList> {
+            bool arcing;
+            bool splitclear_pending;
+            FpType center_x;
+            FpType center_y;
+            FpType start_pos[NumPhysVirtAxes];
+            FpType end_pos[NumPhysVirtAxes];
+            TheArcSplitter splitter;
+        };
+    } AMBRO_STRUCT_ELSE(ArcFeature) {
+        static bool const Enabled = false;
+        static void init (Context c) {}
+        template <typename TheChannelCommon>
+        static void handle_arc_command (Context c, WrapType<TheChannelCommon> cc, bool clockwise) {}
+        static bool is_arcing (Context c) { return false; }
+        template <int PhysVirtAxisIndex>
+        static FpType reported_pos (Context c, FpType req_pos) { return req_pos; }
+        static void arc_next (Context c) {}
+        static bool try_splitclear_command (Context c) { return true; }
+        struct Object {};
+    };
+    
     template <int HeaterIndex>
     struct Heater {
         struct Object;
@@ -2090,6 +3724,27 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
             TheChannelCommon::reply_append_fp(c, adc_value.template fpValue<FpType>());
         }
         
+        static void append_log_name (Context c, uint8_t **out)
+        {
+            *(*out)++ = HeaterSpec::Name;
+        }
+        
+        static void append_log_value (Context c, uint8_t **out)
+        {
+            auto *o = Object::self(c);
+            
+            float values[2];
+            values[0] = get_temp(c);
+            values[1] = 0.0f;
+            AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+                if (o->m_enabled) {
+                    values[1] = o->m_target;
+                }
+            }
+            memcpy(*out, values, sizeof(values));
+            *out += sizeof(values);
+        }
+        
         template <typename ThisContext>
         static void set (ThisContext c, FpType target)
         {
@@ -2221,6 +3876,7 @@ public: // private, workaround gcc bug, http://stackoverflow.com/questions/22083
         
         static void control_event_handler (typename Loop::QueuedEvent *, Context c)
         {
+            AMBRO_PROFILE_SCOPE(c, PROFILE_HEATER_CONTROL);
             auto *o = Object::self(c);
             
             o->m_control_event.appendAfterPrevious(c, ControlIntervalTicks);
@@ -2635,6 +4291,9 @@ public:
     {
         auto *ob = Object::self(c);
         
+#ifdef APRINTER_PROFILING
+        Profiler::init();
+#endif
         ob->unlocked_timer.init(c, PrinterMain::unlocked_timer_handler);
         ob->disable_timer.init(c, PrinterMain::disable_timer_handler);
         ob->force_timer.init(c, PrinterMain::force_timer_handler);
@@ -2645,6 +4304,7 @@ public:
         SdCardFeature::init(c);
         ListForEachForward<AxesList>(LForeach_init(), c);
         TransformFeature::init(c);
+        ArcFeature::init(c);
         ListForEachForward<HeatersList>(LForeach_init(), c);
         ListForEachForward<FansList>(LForeach_init(), c);
         ProbeFeature::init(c);
@@ -2755,6 +4415,7 @@ public: // private, see comment on top
             case 'M': switch (TheChannelCommon::TheGcodeParser::getCmdNumber(c)) {
                 default:
                     if (
+                        SerialFeature::check_command(c, cc) &&
                         ListForEachForwardInterruptible<HeatersList>(LForeach_check_command(), c, cc) &&
                         ListForEachForwardInterruptible<FansList>(LForeach_check_command(), c, cc) &&
                         SdCardFeature::check_command(c, cc) &&
@@ -2811,8 +4472,8 @@ public: // private, see comment on top
                 case 119: {
                     TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR("endstops:"));
                     ListForEachForward<AxesList>(LForeach_append_endstop(), c, cc);
-                    TheChannelCommon::reply_append_ch(c, '\n');                    
-                    return TheChannelCommon::finishCommand(c, true);
+                    TheChannelCommon::reply_append_ch(c, '\n');
+                    return TheChannelCommon::finishCommand(c);
                 } break;
                 
                 case 136: { // print heater config
@@ -2839,6 +4500,30 @@ public: // private, see comment on top
                 } break;
 #endif
                 
+#ifdef APRINTER_PROFILING
+                case 918: { // reset profiling statistics
+                    Profiler::reset(c);
+                    return TheChannelCommon::finishCommand(c);
+                } break;
+                
+                case 919: { // print profiling statistics
+                    for (uint8_t i = 0; i < PROFILE_NUM_POINTS; i++) {
+                        ProfileStats st = Profiler::getStats(c, i);
+                        TheChannelCommon::reply_append_pstr(c, Profiler::getName(i));
+                        TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR(" n"));
+                        TheChannelCommon::reply_append_uint32(c, st.count);
+                        TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR(" min"));
+                        TheChannelCommon::reply_append_uint32(c, st.min);
+                        TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR(" avg"));
+                        TheChannelCommon::reply_append_uint32(c, (st.count == 0) ? 0 : (uint32_t)(st.total / st.count));
+                        TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR(" max"));
+                        TheChannelCommon::reply_append_uint32(c, st.max);
+                        TheChannelCommon::reply_append_ch(c, '\n');
+                    }
+                    return TheChannelCommon::finishCommand(c);
+                } break;
+#endif
+                
                 case 920: { // get underrun count
                     TheChannelCommon::reply_append_uint32(c, ob->underrun_count);
                     TheChannelCommon::reply_append_ch(c, '\n');
@@ -2851,6 +4536,26 @@ public: // private, see comment on top
                     TheChannelCommon::reply_append_ch(c, '\n');
                     return TheChannelCommon::finishCommand(c, true);
                 } break;
+                
+#ifdef EVENTLOOP_CPU_LOAD
+                case 922: { // reset CPU load measurement
+                    Context::EventLoop::resetLoadTimes(c);
+                    return TheChannelCommon::finishCommand(c);
+                } break;
+                
+                case 923: { // print CPU load
+                    uint64_t busy_time;
+                    uint64_t idle_time;
+                    Context::EventLoop::getLoadTimes(c, &busy_time, &idle_time);
+                    uint64_t total_time = busy_time + idle_time;
+                    TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR("load "));
+                    TheChannelCommon::reply_append_fp(c, (FpType)(total_time ? 100.0 * busy_time / total_time : 0.0));
+                    TheChannelCommon::reply_append_pstr(c, AMBRO_PSTR("% time "));
+                    TheChannelCommon::reply_append_fp(c, (FpType)(total_time * Clock::time_unit));
+                    TheChannelCommon::reply_append_ch(c, '\n');
+                    return TheChannelCommon::finishCommand(c);
+                } break;
+#endif
             } break;
             
             case 'G': switch (TheChannelCommon::TheGcodeParser::getCmdNumber(c)) {
@@ -2864,19 +4569,19 @@ public: // private, see comment on top
                     }
                     MoveBuildState s;
                     move_begin(c, &s);
-                    auto num_parts = TheChannelCommon::TheGcodeParser::getNumParts(c);
-                    for (typename TheChannelCommon::GcodePartsSizeType i = 0; i < num_parts; i++) {
-                        typename TheChannelCommon::GcodeParserPartRef part = TheChannelCommon::TheGcodeParser::getPart(c, i);
-                        if (ListForEachForwardInterruptible<PhysVirtAxisHelperList>(LForeach_collect_new_pos(), c, cc, &s, part)) {
-                            if (TheChannelCommon::TheGcodeParser::getPartCode(c, part) == 'F') {
-                                ob->time_freq_by_max_speed = (FpType)(Clock::time_freq / Params::SpeedLimitMultiply::value()) / FloatMakePosOrPosZero(TheChannelCommon::TheGcodeParser::template getPartFpValue<FpType>(c, part));
-                            }
-                        }
-                    }
+                    move_collect_params(c, cc, &s, WrapBool<IsBinaryGcodeParser<typename TheChannelCommon::TheGcodeParser>::value>());
                     TheChannelCommon::finishCommand(c);
                     move_end(c, &s, ob->time_freq_by_max_speed);
                 } break;
                 
+                case 2:
+                case 3: { // arc move
+                    if (!ArcFeature::Enabled) {
+                        goto unknown_command;
+                    }
+                    ArcFeature::handle_arc_command(c, cc, TheChannelCommon::TheGcodeParser::getCmdNumber(c) == 2);
+                } break;
+                
                 case 21: // set units to millimeters
                     return TheChannelCommon::finishCommand(c);
                 
@@ -3053,6 +4758,10 @@ public: // private, see comment on top
             TransformFeature::split_more(c);
             return;
         }
+        if (ArcFeature::is_arcing(c)) {
+            ArcFeature::arc_next(c);
+            return;
+        }
         if (ob->planner_state == PLANNER_STOPPING) {
             ThePlanner::waitFinished(c);
         } else if (ob->planner_state == PLANNER_WAITING) {
@@ -3138,6 +4847,57 @@ public: // private, see comment on top
         bool seen_cartesian;
     };
     
+    template <typename TheGcodeParser>
+    struct IsBinaryGcodeParser {
+        static bool const value = false;
+    };
+    
+    template <typename ParserContext, typename ParserParentObject, typename ParserParams, typename ParserSizeType>
+    struct IsBinaryGcodeParser<BinaryGcodeParser<ParserContext, ParserParentObject, ParserParams, ParserSizeType>> {
+        static bool const value = true;
+    };
+    
+    static void move_set_max_speed (Context c, FpType max_speed)
+    {
+        auto *ob = Object::self(c);
+        ob->time_freq_by_max_speed = (FpType)(Clock::time_freq / Params::SpeedLimitMultiply::value()) / FloatMakePosOrPosZero(max_speed);
+    }
+    
+    template <typename TheChannelCommon>
+    static void move_collect_params (Context c, WrapType<TheChannelCommon> cc, MoveBuildState *s, WrapBool<false>)
+    {
+        auto num_parts = TheChannelCommon::TheGcodeParser::getNumParts(c);
+        for (typename TheChannelCommon::GcodePartsSizeType i = 0; i < num_parts; i++) {
+            typename TheChannelCommon::GcodeParserPartRef part = TheChannelCommon::TheGcodeParser::getPart(c, i);
+            if (ListForEachForwardInterruptible<PhysVirtAxisHelperList>(LForeach_collect_new_pos(), c, cc, s, part)) {
+                if (TheChannelCommon::TheGcodeParser::getPartCode(c, part) == 'F') {
+                    move_set_max_speed(c, TheChannelCommon::TheGcodeParser::template getPartFpValue<FpType>(c, part));
+                }
+            }
+        }
+    }
+    
+    struct MoveParamHandler {
+        Context m_c;
+        MoveBuildState *m_s;
+        
+        void operator() (char code, FpType value)
+        {
+            if (ListForEachForwardInterruptible<PhysVirtAxisHelperList>(LForeach_collect_new_pos_fp(), m_c, m_s, code, value)) {
+                if (code == 'F') {
+                    move_set_max_speed(m_c, value);
+                }
+            }
+        }
+    };
+    
+    // The binary parser hands over each parameter with its value in one go.
+    template <typename TheChannelCommon>
+    static void move_collect_params (Context c, WrapType<TheChannelCommon> cc, MoveBuildState *s, WrapBool<true>)
+    {
+        TheChannelCommon::TheGcodeParser::template forEachPartFp<FpType>(c, MoveParamHandler{c, s});
+    }
+    
     static void move_begin (Context c, MoveBuildState *s)
     {
         ListForEachForward<PhysVirtAxisHelperList>(LForeach_init_new_pos(), c);
@@ -3159,7 +4919,7 @@ public: // private, see comment on top
     static void move_end (Context c, MoveBuildState *s, FpType time_freq_by_max_speed)
     {
         auto *ob = Object::self(c);
-        AMBRO_ASSERT(ob->planner_state == PLANNER_RUNNING || ob->planner_state == PLANNER_PROBE)
+        AMBRO_ASSERT(ob->planner_state != PLANNER_NONE)
         AMBRO_ASSERT(ob->m_planning_pull_pending)
         AMBRO_ASSERT(FloatIsPosOrPosZero(time_freq_by_max_speed))
         
@@ -3273,6 +5033,7 @@ public:
             SerialFeature,
             SdCardFeature,
             TransformFeature,
+            ArcFeature,
             ProbeFeature,
             CurrentFeature,
             PlannerUnion
@@ -61,7 +61,12 @@ using DefaultInactiveTime = AMBRO_WRAP_DOUBLE(60.0);
 using SpeedLimitMultiply = AMBRO_WRAP_DOUBLE(1.0 / 60.0);
 using MaxStepsPerCycle = AMBRO_WRAP_DOUBLE(0.0017);
 using ForceTimeout = AMBRO_WRAP_DOUBLE(0.1);
+using ArcChordTolerance = AMBRO_WRAP_DOUBLE(0.01);
+using ArcMinSegmentLength = AMBRO_WRAP_DOUBLE(0.2);
 using TheAxisStepperPrecisionParams = AxisStepperDuePrecisionParams;
+using StepperMinPulseWidth = AMBRO_WRAP_DOUBLE(2e-6);
+using TheAxisStepperPrecomputeParams = AxisStepperNoPrecomputeParams;
+//using TheAxisStepperPrecomputeParams = AxisStepperPrecomputeParams<32, StepperMinPulseWidth>;
 
 using XDefaultStepsPerUnit = AMBRO_WRAP_DOUBLE(80.0);
 using XDefaultMin = AMBRO_WRAP_DOUBLE(-53.0);
@@ -213,8 +218,14 @@ using PrinterParams = PrinterMainParams<
         8, // RecvBufferSizeExp
         9, // SendBufferSizeExp
         GcodeParserParams<16>, // ReceiveBufferSizeExp
+        4, // ParseAheadCommands
         AsfUsbSerial,
-        AsfUsbSerialParams
+        AsfUsbSerialParams,
+        PrinterMainSerialFramedParams<
+            64, // MaxPayload
+            2, // AckBatch
+            BinaryGcodeParserParams<8>
+        >
     >,
     At91Sam3uPin<At91Sam3uPioC, 22>, // LedPin
     LedBlinkInterval, // LedBlinkInterval
@@ -265,6 +276,8 @@ using PrinterParams = PrinterMainParams<
             At91Sam3uSpi // SpiTemplate
         >
     >,
+    SteppersNoTraceParams,
+    PrinterMainArcParams<ArcChordTolerance, ArcMinSegmentLength>, // ArcParams. No arcs: PrinterMainNoArcParams
     
     /*
      * Axes.
@@ -299,7 +312,8 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 At91Sam3uClockInterruptTimer_TC1A, // StepperTimer,
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
             PrinterMainMicroStepParams<
                 A4982MicroStep, // MicroStepTemplate
@@ -308,7 +322,8 @@ using PrinterParams = PrinterMainParams<
                     At91Sam3uPin<At91Sam3uPioC, 29> // Ms2Pin
                 >,
                 16 // MicroSteps
-            >
+            >,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'Y', // Name
@@ -339,7 +354,8 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 At91Sam3uClockInterruptTimer_TC2A, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
             PrinterMainMicroStepParams<
                 A4982MicroStep, // MicroStepTemplate
@@ -348,7 +364,8 @@ using PrinterParams = PrinterMainParams<
                     At91Sam3uPin<At91Sam3uPioC, 10> // Ms2Pin
                 >,
                 16 // MicroSteps
-            >
+            >,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'Z', // Name
@@ -379,7 +396,8 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 At91Sam3uClockInterruptTimer_TC0B, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
             PrinterMainMicroStepParams<
                 A4982MicroStep, // MicroStepTemplate
@@ -388,7 +406,8 @@ using PrinterParams = PrinterMainParams<
                     At91Sam3uPin<At91Sam3uPioB, 5> // Ms2Pin
                 >,
                 16 // MicroSteps
-            >
+            >,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'E', // Name
@@ -408,7 +427,8 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 At91Sam3uClockInterruptTimer_TC1B, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
             PrinterMainMicroStepParams<
                 A4982MicroStep, // MicroStepTemplate
@@ -417,7 +437,8 @@ using PrinterParams = PrinterMainParams<
                     At91Sam3uPin<At91Sam3uPioB, 11> // Ms2Pin
                 >,
                 16 // MicroSteps
-            >
+            >,
+            MotionPlannerNoAdvanceParams // AdvanceParams. Pressure advance: MotionPlannerAdvanceParams<AdvanceTime>
         >/*,
         PrinterMainAxisParams<
             'U', // Name
@@ -437,7 +458,8 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 NONE, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
             PrinterMainMicroStepParams<
                 A4982MicroStep, // MicroStepTemplate
@@ -446,7 +468,8 @@ using PrinterParams = PrinterMainParams<
                     At91Sam3uPin<At91Sam3uPioC, 24> // Ms2Pin
                 >,
                 16 // MicroSteps
-            >
+            >,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >*/
     >,
     
@@ -0,0 +1,590 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <aprinter/platform/linux/linux_support.h>
+
+static void emergency (void);
+
+#define AMBROLIB_EMERGENCY_ACTION { cli(); emergency(); }
+#define AMBROLIB_ABORT_ACTION { ::abort(); }
+#define AMBROLIB_SUPPORT_QUIT
+
+#include <aprinter/meta/MakeTypeList.h>
+#include <aprinter/meta/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/system/BusyEventLoop.h>
+#include <aprinter/system/HeapEventLoop.h>
+#include <aprinter/system/LinuxClock.h>
+#include <aprinter/system/LinuxPins.h>
+#include <aprinter/system/InterruptLock.h>
+#include <aprinter/system/LinuxAdc.h>
+#include <aprinter/system/LinuxWatchdog.h>
+#include <aprinter/system/LinuxStdioSerial.h>
+#include <aprinter/system/LinuxSpi.h>
+#include <aprinter/system/LinuxSdCard.h>
+#include <aprinter/devices/SpiSdCard.h>
+#include <aprinter/fs/FatFs.h>
+#include <aprinter/printer/PrinterMain.h>
+#include <aprinter/printer/thermistor/GenericThermistor.h>
+#include <aprinter/printer/temp_control/PidControl.h>
+
+using namespace APrinter;
+
+/*
+ * Host simulation of a cartesian printer. G-code is read from stdin and
+ * replies go to stdout. Arguments:
+ *   [simulated seconds [pin trace file [step trace file [SD card image]]]]
+ * Without a time limit the simulation runs until killed. The step trace
+ * is meant for host_stuff/step_trace_analyze.py. Without an image, the
+ * simulated SD card slot is empty.
+ */
+
+using ClockCpuSlowdown = AMBRO_WRAP_DOUBLE(0.0);
+using AdcInitialValue = AMBRO_WRAP_DOUBLE(0.95);
+
+using LedBlinkInterval = AMBRO_WRAP_DOUBLE(0.5);
+using DefaultInactiveTime = AMBRO_WRAP_DOUBLE(60.0);
+using SpeedLimitMultiply = AMBRO_WRAP_DOUBLE(1.0 / 60.0);
+using SdLogInterval = AMBRO_WRAP_DOUBLE(1.0);
+using MaxStepsPerCycle = AMBRO_WRAP_DOUBLE(0.0017);
+using ForceTimeout = AMBRO_WRAP_DOUBLE(0.1);
+using ArcChordTolerance = AMBRO_WRAP_DOUBLE(0.01);
+using ArcMinSegmentLength = AMBRO_WRAP_DOUBLE(0.2);
+using TheAxisStepperPrecisionParams = AxisStepperDuePrecisionParams;
+using StepperMinPulseWidth = AMBRO_WRAP_DOUBLE(2e-6);
+using TheAxisStepperPrecomputeParams = AxisStepperPrecomputeParams<32, StepperMinPulseWidth>;
+
+using XDefaultStepsPerUnit = AMBRO_WRAP_DOUBLE(80.0);
+using XDefaultMin = AMBRO_WRAP_DOUBLE(-53.0);
+using XDefaultMax = AMBRO_WRAP_DOUBLE(210.0);
+using XDefaultMaxSpeed = AMBRO_WRAP_DOUBLE(300.0);
+using XDefaultMaxAccel = AMBRO_WRAP_DOUBLE(1500.0);
+using XDefaultDistanceFactor = AMBRO_WRAP_DOUBLE(1.0);
+using XDefaultCorneringDistance = AMBRO_WRAP_DOUBLE(40.0);
+using XDefaultHomeFastMaxDist = AMBRO_WRAP_DOUBLE(280.0);
+using XDefaultHomeRetractDist = AMBRO_WRAP_DOUBLE(3.0);
+using XDefaultHomeSlowMaxDist = AMBRO_WRAP_DOUBLE(5.0);
+using XDefaultHomeFastSpeed = AMBRO_WRAP_DOUBLE(40.0);
+using XDefaultHomeRetractSpeed = AMBRO_WRAP_DOUBLE(50.0);
+using XDefaultHomeSlowSpeed = AMBRO_WRAP_DOUBLE(5.0);
+
+using YDefaultStepsPerUnit = AMBRO_WRAP_DOUBLE(80.0);
+using YDefaultMin = AMBRO_WRAP_DOUBLE(0.0);
+using YDefaultMax = AMBRO_WRAP_DOUBLE(155.0);
+using YDefaultMaxSpeed = AMBRO_WRAP_DOUBLE(300.0);
+using YDefaultMaxAccel = AMBRO_WRAP_DOUBLE(650.0);
+using YDefaultDistanceFactor = AMBRO_WRAP_DOUBLE(1.0);
+using YDefaultCorneringDistance = AMBRO_WRAP_DOUBLE(40.0);
+using YDefaultHomeFastMaxDist = AMBRO_WRAP_DOUBLE(200.0);
+using YDefaultHomeRetractDist = AMBRO_WRAP_DOUBLE(3.0);
+using YDefaultHomeSlowMaxDist = AMBRO_WRAP_DOUBLE(5.0);
+using YDefaultHomeFastSpeed = AMBRO_WRAP_DOUBLE(40.0);
+using YDefaultHomeRetractSpeed = AMBRO_WRAP_DOUBLE(50.0);
+using YDefaultHomeSlowSpeed = AMBRO_WRAP_DOUBLE(5.0);
+
+using ZDefaultStepsPerUnit = AMBRO_WRAP_DOUBLE(4000.0);
+using ZDefaultMin = AMBRO_WRAP_DOUBLE(0.0);
+using ZDefaultMax = AMBRO_WRAP_DOUBLE(100.0);
+using ZDefaultMaxSpeed = AMBRO_WRAP_DOUBLE(3.0);
+using ZDefaultMaxAccel = AMBRO_WRAP_DOUBLE(30.0);
+using ZDefaultDistanceFactor = AMBRO_WRAP_DOUBLE(1.0);
+using ZDefaultCorneringDistance = AMBRO_WRAP_DOUBLE(40.0);
+using ZDefaultHomeFastMaxDist = AMBRO_WRAP_DOUBLE(101.0);
+using ZDefaultHomeRetractDist = AMBRO_WRAP_DOUBLE(0.8);
+using ZDefaultHomeSlowMaxDist = AMBRO_WRAP_DOUBLE(1.2);
+using ZDefaultHomeFastSpeed = AMBRO_WRAP_DOUBLE(2.0);
+using ZDefaultHomeRetractSpeed = AMBRO_WRAP_DOUBLE(2.0);
+using ZDefaultHomeSlowSpeed = AMBRO_WRAP_DOUBLE(0.6);
+
+using EDefaultStepsPerUnit = AMBRO_WRAP_DOUBLE(928.0);
+using EDefaultMin = AMBRO_WRAP_DOUBLE(-40000.0);
+using EDefaultMax = AMBRO_WRAP_DOUBLE(40000.0);
+using EDefaultMaxSpeed = AMBRO_WRAP_DOUBLE(45.0);
+using EDefaultMaxAccel = AMBRO_WRAP_DOUBLE(250.0);
+using EDefaultDistanceFactor = AMBRO_WRAP_DOUBLE(1.0);
+using EDefaultCorneringDistance = AMBRO_WRAP_DOUBLE(40.0);
+
+using ExtruderHeaterThermistorResistorR = AMBRO_WRAP_DOUBLE(4700.0);
+using ExtruderHeaterThermistorR0 = AMBRO_WRAP_DOUBLE(100000.0);
+using ExtruderHeaterThermistorBeta = AMBRO_WRAP_DOUBLE(3960.0);
+using ExtruderHeaterThermistorMinTemp = AMBRO_WRAP_DOUBLE(10.0);
+using ExtruderHeaterThermistorMaxTemp = AMBRO_WRAP_DOUBLE(300.0);
+using ExtruderHeaterMinSafeTemp = AMBRO_WRAP_DOUBLE(20.0);
+using ExtruderHeaterMaxSafeTemp = AMBRO_WRAP_DOUBLE(280.0);
+using ExtruderHeaterPulseInterval = AMBRO_WRAP_DOUBLE(0.2);
+using ExtruderHeaterControlInterval = ExtruderHeaterPulseInterval;
+using ExtruderHeaterPidP = AMBRO_WRAP_DOUBLE(0.047);
+using ExtruderHeaterPidI = AMBRO_WRAP_DOUBLE(0.0006);
+using ExtruderHeaterPidD = AMBRO_WRAP_DOUBLE(0.17);
+using ExtruderHeaterPidIStateMin = AMBRO_WRAP_DOUBLE(0.0);
+using ExtruderHeaterPidIStateMax = AMBRO_WRAP_DOUBLE(0.4);
+using ExtruderHeaterPidDHistory = AMBRO_WRAP_DOUBLE(0.7);
+using ExtruderHeaterObserverInterval = AMBRO_WRAP_DOUBLE(0.5);
+using ExtruderHeaterObserverTolerance = AMBRO_WRAP_DOUBLE(3.0);
+using ExtruderHeaterObserverMinTime = AMBRO_WRAP_DOUBLE(3.0);
+
+using FanSpeedMultiply = AMBRO_WRAP_DOUBLE(1.0 / 255.0);
+using FanPulseInterval = AMBRO_WRAP_DOUBLE(0.04);
+
+using HostLedPin = LinuxPin<0>;
+using HostXDirPin = LinuxPin<1>;
+using HostXStepPin = LinuxPin<2>;
+using HostXEnablePin = LinuxPin<3>;
+using HostXEndPin = LinuxPin<4>;
+using HostYDirPin = LinuxPin<5>;
+using HostYStepPin = LinuxPin<6>;
+using HostYEnablePin = LinuxPin<7>;
+using HostYEndPin = LinuxPin<8>;
+using HostZDirPin = LinuxPin<9>;
+using HostZStepPin = LinuxPin<10>;
+using HostZEnablePin = LinuxPin<11>;
+using HostZEndPin = LinuxPin<12>;
+using HostEDirPin = LinuxPin<13>;
+using HostEStepPin = LinuxPin<14>;
+using HostEEnablePin = LinuxPin<15>;
+using HostHeaterPin = LinuxPin<16>;
+using HostFanPin = LinuxPin<17>;
+using HostHeaterAdcPin = LinuxPin<18>;
+using HostSdSsPin = LinuxPin<19>;
+
+struct MyContext;
+struct Program;
+
+// 4MHz SPI clock, with up to 20us of extra latency on each SPI command.
+using SpiByteTime = AMBRO_WRAP_DOUBLE(2e-6);
+using SpiMaxLatency = AMBRO_WRAP_DOUBLE(20e-6);
+using MySdCard = LinuxSdCard<MyContext, Program>;
+
+template <typename Context, typename ParentObject, typename Handler, int CommandBufferBits>
+using HostSpi = LinuxSpi<Context, ParentObject, Handler, CommandBufferBits, LinuxSpiParams<SpiByteTime, SpiMaxLatency, MySdCard>>;
+
+using PrinterParams = PrinterMainParams<
+    /*
+     * Common parameters.
+     */
+    PrinterMainSerialParams<
+        UINT32_C(0), // BaudRate,
+        8, // RecvBufferSizeExp
+        9, // SendBufferSizeExp
+        GcodeParserParams<16>, // ReceiveBufferSizeExp
+        4, // ParseAheadCommands
+        LinuxStdioSerial,
+        LinuxStdioSerialParams,
+        PrinterMainSerialFramedParams<
+            64, // MaxPayload
+            2, // AckBatch
+            BinaryGcodeParserParams<8>
+        >
+    >,
+    HostLedPin, // LedPin
+    LedBlinkInterval, // LedBlinkInterval
+    DefaultInactiveTime, // DefaultInactiveTime
+    SpeedLimitMultiply, // SpeedLimitMultiply
+    MaxStepsPerCycle, // MaxStepsPerCycle
+    32, // StepperSegmentBufferSize
+    32, // EventChannelBufferSize
+    28, // LookaheadBufferSize
+    10, // LookaheadCommitCount
+    ForceTimeout, // ForceTimeout
+    double, // FpType
+    LinuxClockInterruptTimer, // EventChannelTimer
+    LinuxWatchdog,
+    LinuxWatchdogParams<2000>,
+    PrinterMainSdCardParams<
+        SpiSdCard,
+        SpiSdCardParams<
+            HostSdSsPin, // SsPin
+            HostSpi
+        >,
+        FileGcodeParser, // BINARY: BinaryGcodeParser
+        GcodeParserParams<8>, // BINARY: BinaryGcodeParserParams<8>
+        2, // BufferBlocks
+        256, // MaxCommandSize. BINARY: 43
+        PrinterMainSdCardFsParams<FatFs, FatFsParams<4>, SdLogInterval> // FsParams. Raw blocks: PrinterMainSdCardNoFsParams
+    >,
+    PrinterMainNoProbeParams,
+    PrinterMainNoCurrentParams,
+    SteppersTraceParams<12>,
+    PrinterMainArcParams<ArcChordTolerance, ArcMinSegmentLength>, // ArcParams. No arcs: PrinterMainNoArcParams
+    
+    /*
+     * Axes.
+     */
+    MakeTypeList<
+        PrinterMainAxisParams<
+            'X', // Name
+            HostXDirPin, // DirPin
+            HostXStepPin, // StepPin
+            HostXEnablePin, // EnablePin
+            true, // InvertDir
+            XDefaultStepsPerUnit, // StepsPerUnit
+            XDefaultMin, // Min
+            XDefaultMax, // Max
+            XDefaultMaxSpeed, // MaxSpeed
+            XDefaultMaxAccel, // MaxAccel
+            XDefaultDistanceFactor, // DistanceFactor
+            XDefaultCorneringDistance, // CorneringDistance
+            PrinterMainHomingParams<
+                HostXEndPin, // HomeEndPin
+                LinuxPinInputModeNormal, // HomeEndPinInputMode
+                false, // HomeEndInvert
+                false, // HomeDir
+                XDefaultHomeFastMaxDist, // HomeFastMaxDist
+                XDefaultHomeRetractDist, // HomeRetractDist
+                XDefaultHomeSlowMaxDist, // HomeSlowMaxDist
+                XDefaultHomeFastSpeed, // HomeFastSpeed
+                XDefaultHomeRetractSpeed, // HomeRetractSpeed
+                XDefaultHomeSlowSpeed // HomeSlowSpeed
+            >,
+            true, // EnableCartesianSpeedLimit
+            32, // StepBits
+            AxisStepperParams<
+                LinuxClockInterruptTimer, // StepperTimer,
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
+            >,
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
+        >,
+        PrinterMainAxisParams<
+            'Y', // Name
+            HostYDirPin, // DirPin
+            HostYStepPin, // StepPin
+            HostYEnablePin, // EnablePin
+            true, // InvertDir
+            YDefaultStepsPerUnit, // StepsPerUnit
+            YDefaultMin, // Min
+            YDefaultMax, // Max
+            YDefaultMaxSpeed, // MaxSpeed
+            YDefaultMaxAccel, // MaxAccel
+            YDefaultDistanceFactor, // DistanceFactor
+            YDefaultCorneringDistance, // CorneringDistance
+            PrinterMainHomingParams<
+                HostYEndPin, // HomeEndPin
+                LinuxPinInputModeNormal, // HomeEndPinInputMode
+                false, // HomeEndInvert
+                false, // HomeDir
+                YDefaultHomeFastMaxDist, // HomeFastMaxDist
+                YDefaultHomeRetractDist, // HomeRetractDist
+                YDefaultHomeSlowMaxDist, // HomeSlowMaxDist
+                YDefaultHomeFastSpeed, // HomeFastSpeed
+                YDefaultHomeRetractSpeed, // HomeRetractSpeed
+                YDefaultHomeSlowSpeed // HomeSlowSpeed
+            >,
+            true, // EnableCartesianSpeedLimit
+            32, // StepBits
+            AxisStepperParams<
+                LinuxClockInterruptTimer, // StepperTimer
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
+            >,
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
+        >,
+        PrinterMainAxisParams<
+            'Z', // Name
+            HostZDirPin, // DirPin
+            HostZStepPin, // StepPin
+            HostZEnablePin, // EnablePin
+            false, // InvertDir
+            ZDefaultStepsPerUnit, // StepsPerUnit
+            ZDefaultMin, // Min
+            ZDefaultMax, // Max
+            ZDefaultMaxSpeed, // MaxSpeed
+            ZDefaultMaxAccel, // MaxAccel
+            ZDefaultDistanceFactor, // DistanceFactor
+            ZDefaultCorneringDistance, // CorneringDistance
+            PrinterMainHomingParams<
+                HostZEndPin, // HomeEndPin
+                LinuxPinInputModeNormal, // HomeEndPinInputMode
+                false, // HomeEndInvert
+                false, // HomeDir
+                ZDefaultHomeFastMaxDist, // HomeFastMaxDist
+                ZDefaultHomeRetractDist, // HomeRetractDist
+                ZDefaultHomeSlowMaxDist, // HomeSlowMaxDist
+                ZDefaultHomeFastSpeed, // HomeFastSpeed
+                ZDefaultHomeRetractSpeed, // HomeRetractSpeed
+                ZDefaultHomeSlowSpeed // HomeSlowSpeed
+            >,
+            true, // EnableCartesianSpeedLimit
+            32, // StepBits
+            AxisStepperParams<
+                LinuxClockInterruptTimer, // StepperTimer
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
+            >,
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
+        >,
+        PrinterMainAxisParams<
+            'E', // Name
+            HostEDirPin, // DirPin
+            HostEStepPin, // StepPin
+            HostEEnablePin, // EnablePin
+            true, // InvertDir
+            EDefaultStepsPerUnit, // StepsPerUnit
+            EDefaultMin, // Min
+            EDefaultMax, // Max
+            EDefaultMaxSpeed, // MaxSpeed
+            EDefaultMaxAccel, // MaxAccel
+            EDefaultDistanceFactor, // DistanceFactor
+            EDefaultCorneringDistance, // CorneringDistance
+            PrinterMainNoHomingParams,
+            false, // EnableCartesianSpeedLimit
+            32, // StepBits
+            AxisStepperParams<
+                LinuxClockInterruptTimer, // StepperTimer
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
+            >,
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams. Pressure advance: MotionPlannerAdvanceParams<AdvanceTime>
+        >
+    >,
+    
+    /*
+     * Transform and virtual axes.
+     */
+    PrinterMainNoTransformParams,
+    
+    /*
+     * Heaters.
+     */
+    MakeTypeList<
+        PrinterMainHeaterParams<
+            'T', // Name
+            104, // SetMCommand
+            109, // WaitMCommand
+            301, // SetConfigMCommand
+            HostHeaterAdcPin, // AdcPin
+            HostHeaterPin, // OutputPin
+            false, // OutputInvert
+            GenericThermistor< // Thermistor
+                ExtruderHeaterThermistorResistorR,
+                ExtruderHeaterThermistorR0,
+                ExtruderHeaterThermistorBeta,
+                ExtruderHeaterThermistorMinTemp,
+                ExtruderHeaterThermistorMaxTemp
+            >,
+            ExtruderHeaterMinSafeTemp, // MinSafeTemp
+            ExtruderHeaterMaxSafeTemp, // MaxSafeTemp
+            ExtruderHeaterPulseInterval, // PulseInterval
+            ExtruderHeaterControlInterval, // ControlInterval
+            PidControl, // Control
+            PidControlParams<
+                ExtruderHeaterPidP, // PidP
+                ExtruderHeaterPidI, // PidI
+                ExtruderHeaterPidD, // PidD
+                ExtruderHeaterPidIStateMin, // PidIStateMin
+                ExtruderHeaterPidIStateMax, // PidIStateMax
+                ExtruderHeaterPidDHistory // PidDHistory
+            >,
+            TemperatureObserverParams<
+                ExtruderHeaterObserverInterval, // ObserverInterval
+                ExtruderHeaterObserverTolerance, // ObserverTolerance
+                ExtruderHeaterObserverMinTime // ObserverMinTime
+            >,
+            LinuxClockInterruptTimer // TimerTemplate
+        >
+    >,
+    
+    /*
+     * Fans.
+     */
+    MakeTypeList<
+        PrinterMainFanParams<
+            106, // SetMCommand
+            107, // OffMCommand
+            HostFanPin, // OutputPin
+            false, // OutputInvert
+            FanPulseInterval, // PulseInterval
+            FanSpeedMultiply, // SpeedMultiply
+            LinuxClockInterruptTimer // TimerTemplate
+        >
+    >
+>;
+
+// need to list all used ADC pins here
+using AdcPins = MakeTypeList<HostHeaterAdcPin>;
+
+// 3 MHz clock at F_CPU=96MHz; each clock poll from the main loop costs 10us
+using ClockParams = LinuxClockParams<32, 30, ClockCpuSlowdown>;
+
+struct MyLoopExtraDelay;
+
+using MyDebugObjectGroup = DebugObjectGroup<MyContext, Program>;
+using MyClock = LinuxClock<MyContext, Program, ClockParams>;
+using MyLoop = HeapEventLoop<MyContext, Program, MyLoopExtraDelay, HeapEventLoopSleepParams<LinuxClockInterruptTimer>>;
+using MyPins = LinuxPins<MyContext, Program>;
+using MyAdc = LinuxAdc<MyContext, Program, AdcPins, AdcInitialValue>;
+using MyPrinter = PrinterMain<MyContext, Program, PrinterParams>;
+
+struct MyContext {
+    using DebugGroup = MyDebugObjectGroup;
+    using Clock = MyClock;
+    using EventLoop = MyLoop;
+    using Pins = MyPins;
+    using Adc = MyAdc;
+    
+    void check () const;
+};
+
+using MyLoopExtra = BusyEventLoopExtra<Program, MyLoop, typename MyPrinter::EventLoopFastEvents>;
+struct MyLoopExtraDelay : public WrapType<MyLoopExtra> {};
+
+struct Program : public ObjBase<void, void, MakeTypeList<
+    MyDebugObjectGroup,
+    MyClock,
+    MyLoop,
+    MyPins,
+    MyAdc,
+    MySdCard,
+    MyPrinter,
+    MyLoopExtra
+>> {
+    static Program * self (MyContext c);
+};
+
+Program p;
+
+Program * Program::self (MyContext c) { return &p; }
+void MyContext::check () const {}
+
+static void emergency (void)
+{
+    MyPrinter::emergency();
+}
+
+// The simulated time limit may exceed the range of TimeType, so the quit
+// event is rescheduled in chunks until the whole interval has passed.
+static MyClock::TimeType const quit_chunk = UINT32_C(0x40000000);
+static MyLoop::QueuedEvent quit_event;
+static uint64_t quit_remaining;
+
+static void quit_event_handler (MyLoop::QueuedEvent *, MyContext c)
+{
+    if (quit_remaining > 0) {
+        MyClock::TimeType chunk = (quit_remaining > quit_chunk) ? quit_chunk : quit_remaining;
+        quit_remaining -= chunk;
+        quit_event.appendAfterPrevious(c, chunk);
+        return;
+    }
+    MyLoop::quit(c);
+}
+
+// Steps are recorded by the Steppers into a ring buffer from the stepper
+// interrupts, and drained into the step trace file from here.
+using MyStepTrace = MyPrinter::TheSteppers::Trace;
+static MyClock::TimeType const step_trace_interval = MyClock::time_freq / 1000.0;
+static MyLoop::QueuedEvent step_trace_event;
+static FILE *step_trace_file;
+
+static void step_trace_drain (MyContext c)
+{
+    MyStepTrace::Entry entry;
+    while (MyStepTrace::read(c, &entry)) {
+        fprintf(step_trace_file, "%lu %d %d\n", (unsigned long)entry.time, (int)(entry.stepper_dir & 0x7F), (int)(entry.stepper_dir >> 7));
+    }
+}
+
+static void step_trace_event_handler (MyLoop::QueuedEvent *, MyContext c)
+{
+    step_trace_drain(c);
+    step_trace_event.appendAfterPrevious(c, step_trace_interval);
+}
+
+int main (int argc, char *argv[])
+{
+    double sim_time = (argc > 1) ? atof(argv[1]) : 0.0;
+    FILE *trace_file = NULL;
+    if (argc > 2) {
+        trace_file = fopen(argv[2], "w");
+        if (!trace_file) {
+            perror("fopen");
+            return 1;
+        }
+    }
+    if (argc > 3) {
+        step_trace_file = fopen(argv[3], "w");
+        if (!step_trace_file) {
+            perror("fopen");
+            return 1;
+        }
+        fprintf(step_trace_file, "# freq %f\n", (double)MyClock::time_freq);
+        fprintf(step_trace_file, "# axis 0 X %f\n", XDefaultStepsPerUnit::value());
+        fprintf(step_trace_file, "# axis 1 Y %f\n", YDefaultStepsPerUnit::value());
+        fprintf(step_trace_file, "# axis 2 Z %f\n", ZDefaultStepsPerUnit::value());
+        fprintf(step_trace_file, "# axis 3 E %f\n", EDefaultStepsPerUnit::value());
+    }
+    
+    MyContext c;
+    
+    MyDebugObjectGroup::init(c);
+    MyClock::init(c);
+    MyLoop::init(c);
+    MyPins::init(c);
+    MyPins::setTraceFile(c, trace_file);
+    MyAdc::init(c);
+    MySdCard::init(c);
+    if (argc > 4 && !MySdCard::openImage(c, argv[4])) {
+        fprintf(stderr, "cannot use SD card image %s\n", argv[4]);
+        return 1;
+    }
+    MyPrinter::init(c);
+    
+    if (sim_time > 0.0) {
+        quit_remaining = sim_time * MyClock::time_freq;
+        quit_event.init(c, quit_event_handler);
+        quit_event.appendAt(c, MyClock::getTime(c));
+    }
+    if (step_trace_file) {
+        step_trace_event.init(c, step_trace_event_handler);
+        step_trace_event.appendAt(c, MyClock::getTime(c) + step_trace_interval);
+    }
+    
+    MyLoop::run(c);
+    
+    fprintf(stderr, "time=%f underruns=%lu watchdog=%lu steps X=%lu Y=%lu Z=%lu E=%lu\n",
+        sim_time,
+        (unsigned long)MyPrinter::Object::self(c)->underrun_count,
+        (unsigned long)MyPrinter::GetWatchdog::getExpiredCount(c),
+        (unsigned long)MyPins::getRisingEdges<HostXStepPin>(c),
+        (unsigned long)MyPins::getRisingEdges<HostYStepPin>(c),
+        (unsigned long)MyPins::getRisingEdges<HostZStepPin>(c),
+        (unsigned long)MyPins::getRisingEdges<HostEStepPin>(c));
+    
+    if (trace_file) {
+        fclose(trace_file);
+    }
+    if (step_trace_file) {
+        step_trace_drain(c);
+        fprintf(step_trace_file, "# overruns %lu\n", (unsigned long)MyStepTrace::getOverruns(c));
+        fclose(step_trace_file);
+    }
+    return 0;
+}
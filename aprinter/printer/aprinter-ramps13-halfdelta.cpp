@@ -46,6 +46,7 @@ static void emergency (void);
 #include <aprinter/system/AvrSerial.h>
 #include <aprinter/system/AvrSpi.h>
 #include <aprinter/devices/SpiSdCard.h>
+#include <aprinter/fs/FatFs.h>
 #include <aprinter/printer/PrinterMain.h>
 #include <aprinter/printer/thermistor/GenericThermistor.h>
 #include <aprinter/printer/temp_control/PidControl.h>
@@ -58,9 +59,13 @@ using namespace APrinter;
 using LedBlinkInterval = AMBRO_WRAP_DOUBLE(0.5);
 using DefaultInactiveTime = AMBRO_WRAP_DOUBLE(60.0);
 using SpeedLimitMultiply = AMBRO_WRAP_DOUBLE(1.0 / 60.0);
+using SdLogInterval = AMBRO_WRAP_DOUBLE(1.0);
 using MaxStepsPerCycle = AMBRO_WRAP_DOUBLE(0.00137); // max stepping frequency relative to F_CPU
 using ForceTimeout = AMBRO_WRAP_DOUBLE(0.1);
+using ArcChordTolerance = AMBRO_WRAP_DOUBLE(0.01);
+using ArcMinSegmentLength = AMBRO_WRAP_DOUBLE(0.2);
 using TheAxisStepperPrecisionParams = AxisStepperAvrPrecisionParams;
+using TheAxisStepperPrecomputeParams = AxisStepperNoPrecomputeParams;
 
 using ABDefaultStepsPerUnit = AMBRO_WRAP_DOUBLE(60.0);
 using ABDefaultMin = AMBRO_WRAP_DOUBLE(10.0);
@@ -159,8 +164,10 @@ using PrinterParams = PrinterMainParams<
         7, // RecvBufferSizeExp
         7, // SendBufferSizeExp
         GcodeParserParams<8>, // ReceiveBufferSizeExp
+        0, // ParseAheadCommands
         AvrSerial,
-        AvrSerialParams<true>
+        AvrSerialParams<true>,
+        PrinterMainSerialNoFramedParams
     >,
     MegaPin13, // LedPin
     LedBlinkInterval, // LedBlinkInterval
@@ -187,10 +194,13 @@ using PrinterParams = PrinterMainParams<
         BinaryGcodeParser, // BINARY: BinaryGcodeParser
         BinaryGcodeParserParams<8>, // BINARY: BinaryGcodeParserParams<8>
         2, // BufferBlocks
-        43 // MaxCommandSize. BINARY: 43
+        43, // MaxCommandSize. BINARY: 43
+        PrinterMainSdCardNoFsParams // FsParams. FAT32 (1.7 KB more RAM): PrinterMainSdCardFsParams<FatFs, FatFsParams<2>, SdLogInterval>
     >,
     PrinterMainNoProbeParams,
     PrinterMainNoCurrentParams,
+    SteppersNoTraceParams,
+    PrinterMainArcParams<ArcChordTolerance, ArcMinSegmentLength>, // ArcParams. No arcs: PrinterMainNoArcParams
     
     /*
      * Axes.
@@ -225,9 +235,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 AvrClockInterruptTimer_TC3_OCA, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'B', // Name
@@ -258,9 +270,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 AvrClockInterruptTimer_TC3_OCB, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'Y', // Name
@@ -291,9 +305,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 AvrClockInterruptTimer_TC3_OCC, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'E', // Name
@@ -313,9 +329,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 AvrClockInterruptTimer_TC4_OCA, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams. Pressure advance: MotionPlannerAdvanceParams<AdvanceTime>
         >
     >,
     
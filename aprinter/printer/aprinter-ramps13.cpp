@@ -46,6 +46,7 @@ static void emergency (void);
 #include <aprinter/system/AvrSerial.h>
 #include <aprinter/system/AvrSpi.h>
 #include <aprinter/devices/SpiSdCard.h>
+#include <aprinter/fs/FatFs.h>
 #include <aprinter/printer/PrinterMain.h>
 #include <aprinter/printer/thermistor/GenericThermistor.h>
 #include <aprinter/printer/temp_control/PidControl.h>
@@ -57,9 +58,13 @@ using namespace APrinter;
 using LedBlinkInterval = AMBRO_WRAP_DOUBLE(0.5);
 using DefaultInactiveTime = AMBRO_WRAP_DOUBLE(60.0);
 using SpeedLimitMultiply = AMBRO_WRAP_DOUBLE(1.0 / 60.0);
+using SdLogInterval = AMBRO_WRAP_DOUBLE(1.0);
 using MaxStepsPerCycle = AMBRO_WRAP_DOUBLE(0.00137); // max stepping frequency relative to F_CPU
 using ForceTimeout = AMBRO_WRAP_DOUBLE(0.1);
+using ArcChordTolerance = AMBRO_WRAP_DOUBLE(0.01);
+using ArcMinSegmentLength = AMBRO_WRAP_DOUBLE(0.2);
 using TheAxisStepperPrecisionParams = AxisStepperAvrPrecisionParams;
+using TheAxisStepperPrecomputeParams = AxisStepperNoPrecomputeParams;
 
 using XDefaultStepsPerUnit = AMBRO_WRAP_DOUBLE(80.0);
 using XDefaultMin = AMBRO_WRAP_DOUBLE(-53.0);
@@ -209,8 +214,10 @@ using PrinterParams = PrinterMainParams<
         7, // RecvBufferSizeExp
         7, // SendBufferSizeExp
         GcodeParserParams<8>, // ReceiveBufferSizeExp
+        0, // ParseAheadCommands
         AvrSerial,
-        AvrSerialParams<true>
+        AvrSerialParams<true>,
+        PrinterMainSerialNoFramedParams
     >,
     MegaPin13, // LedPin
     LedBlinkInterval, // LedBlinkInterval
@@ -237,7 +244,8 @@ using PrinterParams = PrinterMainParams<
         FileGcodeParser, // BINARY: BinaryGcodeParser
         GcodeParserParams<8>, // BINARY: BinaryGcodeParserParams<8>
         2, // BufferBlocks
-        100 // MaxCommandSize. BINARY: 43
+        100, // MaxCommandSize. BINARY: 43
+        PrinterMainSdCardNoFsParams // FsParams. FAT32 (1.7 KB more RAM): PrinterMainSdCardFsParams<FatFs, FatFsParams<2>, SdLogInterval>
     >,
     PrinterMainProbeParams<
         MakeTypeList<WrapInt<'X'>, WrapInt<'Y'>>, // PlatformAxesList
@@ -260,6 +268,8 @@ using PrinterParams = PrinterMainParams<
         >
     >,
     PrinterMainNoCurrentParams,
+    SteppersNoTraceParams,
+    PrinterMainArcParams<ArcChordTolerance, ArcMinSegmentLength>, // ArcParams. No arcs: PrinterMainNoArcParams
     
     /*
      * Axes.
@@ -294,9 +304,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 AvrClockInterruptTimer_TC3_OCA, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'Y', // Name
@@ -327,9 +339,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 AvrClockInterruptTimer_TC3_OCB, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'Z', // Name
@@ -360,9 +374,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 AvrClockInterruptTimer_TC3_OCC, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'E', // Name
@@ -382,9 +398,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 AvrClockInterruptTimer_TC4_OCA, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams. Pressure advance: MotionPlannerAdvanceParams<AdvanceTime>
         >,
         PrinterMainAxisParams<
             'U', // Name
@@ -404,9 +422,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 AvrClockInterruptTimer_TC4_OCB, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >
     >,
     
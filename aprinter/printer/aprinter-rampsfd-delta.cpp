@@ -45,6 +45,7 @@ static void emergency (void);
 #include <aprinter/system/At91Sam3xSpi.h>
 #include <aprinter/system/AsfUsbSerial.h>
 #include <aprinter/devices/SpiSdCard.h>
+#include <aprinter/fs/FatFs.h>
 #include <aprinter/printer/PrinterMain.h>
 #include <aprinter/printer/thermistor/GenericThermistor.h>
 #include <aprinter/printer/temp_control/PidControl.h>
@@ -61,9 +62,15 @@ static uint16_t const AdcSmoothing = 0.95 * 65536.0;
 using LedBlinkInterval = AMBRO_WRAP_DOUBLE(0.5);
 using DefaultInactiveTime = AMBRO_WRAP_DOUBLE(60.0);
 using SpeedLimitMultiply = AMBRO_WRAP_DOUBLE(1.0 / 60.0);
+using SdLogInterval = AMBRO_WRAP_DOUBLE(1.0);
 using MaxStepsPerCycle = AMBRO_WRAP_DOUBLE(0.0017);
 using ForceTimeout = AMBRO_WRAP_DOUBLE(0.1);
+using ArcChordTolerance = AMBRO_WRAP_DOUBLE(0.01);
+using ArcMinSegmentLength = AMBRO_WRAP_DOUBLE(0.2);
 using TheAxisStepperPrecisionParams = AxisStepperDuePrecisionParams;
+using StepperMinPulseWidth = AMBRO_WRAP_DOUBLE(2e-6);
+using TheAxisStepperPrecomputeParams = AxisStepperNoPrecomputeParams;
+//using TheAxisStepperPrecomputeParams = AxisStepperPrecomputeParams<32, StepperMinPulseWidth>;
 
 using ABCDefaultStepsPerUnit = AMBRO_WRAP_DOUBLE(100.0);
 using ABCDefaultMin = AMBRO_WRAP_DOUBLE(0.0);
@@ -173,13 +180,19 @@ using PrinterParams = PrinterMainParams<
         8, // RecvBufferSizeExp
         9, // SendBufferSizeExp
         GcodeParserParams<16>, // ReceiveBufferSizeExp
+        4, // ParseAheadCommands
 #ifdef USB_SERIAL
         AsfUsbSerial,
-        AsfUsbSerialParams
+        AsfUsbSerialParams,
 #else
         At91Sam3xSerial,
-        At91Sam3xSerialParams
+        At91Sam3xSerialParams,
 #endif
+        PrinterMainSerialFramedParams<
+            64, // MaxPayload
+            2, // AckBatch
+            BinaryGcodeParserParams<8>
+        >
     >,
     DuePin13, // LedPin
     LedBlinkInterval, // LedBlinkInterval
@@ -204,7 +217,8 @@ using PrinterParams = PrinterMainParams<
         FileGcodeParser, // BINARY: BinaryGcodeParser
         GcodeParserParams<8>, // BINARY: BinaryGcodeParserParams<8>
         2, // BufferBlocks
-        256 // MaxCommandSize. BINARY: 43
+        256, // MaxCommandSize. BINARY: 43
+        PrinterMainSdCardFsParams<FatFs, FatFsParams<4>, SdLogInterval> // FsParams. Raw blocks: PrinterMainSdCardNoFsParams
     >,
     PrinterMainProbeParams<
         MakeTypeList<WrapInt<'X'>, WrapInt<'Y'>>, // PlatformAxesList
@@ -227,6 +241,8 @@ using PrinterParams = PrinterMainParams<
         >
     >,
     PrinterMainNoCurrentParams,
+    SteppersNoTraceParams,
+    PrinterMainArcParams<ArcChordTolerance, ArcMinSegmentLength>, // ArcParams. No arcs: PrinterMainNoArcParams
     
     /*
      * Axes.
@@ -261,9 +277,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 At91Sam3xClockInterruptTimer_TC1A, // StepperTimer,
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'B', // Name
@@ -294,9 +312,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 At91Sam3xClockInterruptTimer_TC2A, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'C', // Name
@@ -327,9 +347,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 At91Sam3xClockInterruptTimer_TC3A, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'E', // Name
@@ -349,9 +371,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 At91Sam3xClockInterruptTimer_TC4A, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams. Pressure advance: MotionPlannerAdvanceParams<AdvanceTime>
         >
     >,
     
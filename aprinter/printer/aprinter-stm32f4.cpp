@@ -45,6 +45,7 @@ static void emergency (void);
 //#include <aprinter/system/At91Sam3xSpi.h>
 //#include <aprinter/system/AsfUsbSerial.h>
 //#include <aprinter/devices/SpiSdCard.h>
+//#include <aprinter/fs/FatFs.h>
 #include <aprinter/usb/Stm32f4Usb.h>
 #include <aprinter/printer/PrinterMain.h>
 #include <aprinter/printer/temp_control/PidControl.h>
@@ -62,9 +63,13 @@ static uint16_t const AdcSmoothing = 0.95 * 65536.0;
 using LedBlinkInterval = AMBRO_WRAP_DOUBLE(0.5);
 using DefaultInactiveTime = AMBRO_WRAP_DOUBLE(60.0);
 using SpeedLimitMultiply = AMBRO_WRAP_DOUBLE(1.0 / 60.0);
+using SdLogInterval = AMBRO_WRAP_DOUBLE(1.0);
 using MaxStepsPerCycle = AMBRO_WRAP_DOUBLE(0.0017);
 using ForceTimeout = AMBRO_WRAP_DOUBLE(0.1);
+using ArcChordTolerance = AMBRO_WRAP_DOUBLE(0.01);
+using ArcMinSegmentLength = AMBRO_WRAP_DOUBLE(0.2);
 //using TheAxisStepperPrecisionParams = AxisStepperDuePrecisionParams;
+//using TheAxisStepperPrecomputeParams = AxisStepperNoPrecomputeParams;
 
 using XDefaultStepsPerUnit = AMBRO_WRAP_DOUBLE(80.0);
 using XDefaultMin = AMBRO_WRAP_DOUBLE(-53.0);
@@ -194,13 +199,19 @@ using PrinterParams = PrinterMainParams<
         8, // RecvBufferSizeExp
         9, // SendBufferSizeExp
         GcodeParserParams<16>, // ReceiveBufferSizeExp
+        4, // ParseAheadCommands
 #ifdef USB_SERIAL
         AsfUsbSerial,
-        AsfUsbSerialParams
+        AsfUsbSerialParams,
 #else
         At91Sam3xSerial,
-        At91Sam3xSerialParams
+        At91Sam3xSerialParams,
 #endif
+        PrinterMainSerialFramedParams<
+            64, // MaxPayload
+            2, // AckBatch
+            BinaryGcodeParserParams<8>
+        >
     >,
     DuePin13, // LedPin
     LedBlinkInterval, // LedBlinkInterval
@@ -225,7 +236,8 @@ using PrinterParams = PrinterMainParams<
         BinaryGcodeParser, // BINARY: BinaryGcodeParser
         BinaryGcodeParserParams<8>, // BINARY: BinaryGcodeParserParams<8>
         2, // BufferBlocks
-        43 // MaxCommandSize. BINARY: 43
+        43, // MaxCommandSize. BINARY: 43
+        PrinterMainSdCardFsParams<FatFs, FatFsParams<4>, SdLogInterval> // FsParams. Raw blocks: PrinterMainSdCardNoFsParams
     >,
     PrinterMainProbeParams<
         MakeTypeList<WrapInt<'X'>, WrapInt<'Y'>>, // PlatformAxesList
@@ -248,6 +260,8 @@ using PrinterParams = PrinterMainParams<
         >
     >,
     PrinterMainNoCurrentParams,
+    SteppersNoTraceParams,
+    PrinterMainArcParams<ArcChordTolerance, ArcMinSegmentLength>, // ArcParams. No arcs: PrinterMainNoArcParams
     
     /*
      * Axes.
@@ -282,9 +296,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 At91Sam3xClockInterruptTimer_TC1A, // StepperTimer,
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'Y', // Name
@@ -315,9 +331,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 At91Sam3xClockInterruptTimer_TC2A, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'Z', // Name
@@ -348,9 +366,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 At91Sam3xClockInterruptTimer_TC3A, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'E', // Name
@@ -370,9 +390,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 At91Sam3xClockInterruptTimer_TC4A, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams. Pressure advance: MotionPlannerAdvanceParams<AdvanceTime>
         >,
         PrinterMainAxisParams<
             'U', // Name
@@ -392,9 +414,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 At91Sam3xClockInterruptTimer_TC8A, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >
     >,
     
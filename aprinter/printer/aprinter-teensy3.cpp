@@ -36,6 +36,7 @@ static void emergency (void);
 #include <aprinter/meta/Object.h>
 #include <aprinter/base/DebugObject.h>
 #include <aprinter/system/BusyEventLoop.h>
+#include <aprinter/system/HeapEventLoop.h>
 #include <aprinter/system/Mk20Clock.h>
 #include <aprinter/system/Mk20Pins.h>
 #include <aprinter/system/InterruptLock.h>
@@ -59,7 +60,12 @@ using DefaultInactiveTime = AMBRO_WRAP_DOUBLE(60.0);
 using SpeedLimitMultiply = AMBRO_WRAP_DOUBLE(1.0 / 60.0);
 using MaxStepsPerCycle = AMBRO_WRAP_DOUBLE(0.0017);
 using ForceTimeout = AMBRO_WRAP_DOUBLE(0.1);
+using ArcChordTolerance = AMBRO_WRAP_DOUBLE(0.01);
+using ArcMinSegmentLength = AMBRO_WRAP_DOUBLE(0.2);
 using TheAxisStepperPrecisionParams = AxisStepperDuePrecisionParams;
+using StepperMinPulseWidth = AMBRO_WRAP_DOUBLE(2e-6);
+using TheAxisStepperPrecomputeParams = AxisStepperNoPrecomputeParams;
+//using TheAxisStepperPrecomputeParams = AxisStepperPrecomputeParams<32, StepperMinPulseWidth>;
 
 using ABCDefaultStepsPerUnit = AMBRO_WRAP_DOUBLE(100.0);
 using ABCDefaultMin = AMBRO_WRAP_DOUBLE(0.0);
@@ -152,8 +158,14 @@ using PrinterParams = PrinterMainParams<
         8, // RecvBufferSizeExp
         8, // SendBufferSizeExp
         GcodeParserParams<16>, // ReceiveBufferSizeExp
+        4, // ParseAheadCommands
         TeensyUsbSerial,
-        TeensyUsbSerialParams
+        TeensyUsbSerialParams,
+        PrinterMainSerialFramedParams<
+            64, // MaxPayload
+            2, // AckBatch
+            BinaryGcodeParserParams<8>
+        >
     >,
     TeensyPin13, // LedPin
     LedBlinkInterval, // LedBlinkInterval
@@ -172,6 +184,8 @@ using PrinterParams = PrinterMainParams<
     PrinterMainNoSdCardParams,
     PrinterMainNoProbeParams,
     PrinterMainNoCurrentParams,
+    SteppersNoTraceParams,
+    PrinterMainArcParams<ArcChordTolerance, ArcMinSegmentLength>, // ArcParams. No arcs: PrinterMainNoArcParams
     
     /*
      * Axes.
@@ -206,9 +220,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 Mk20ClockInterruptTimer_Ftm0_Ch1, // StepperTimer,
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'B', // Name
@@ -239,9 +255,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 Mk20ClockInterruptTimer_Ftm0_Ch2, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'C', // Name
@@ -272,9 +290,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 Mk20ClockInterruptTimer_Ftm0_Ch3, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams
         >,
         PrinterMainAxisParams<
             'E', // Name
@@ -294,9 +314,11 @@ using PrinterParams = PrinterMainParams<
             32, // StepBits
             AxisStepperParams<
                 Mk20ClockInterruptTimer_Ftm0_Ch4, // StepperTimer
-                TheAxisStepperPrecisionParams // PrecisionParams
+                TheAxisStepperPrecisionParams, // PrecisionParams
+                TheAxisStepperPrecomputeParams // PrecomputeParams
             >,
-            PrinterMainNoMicroStepParams
+            PrinterMainNoMicroStepParams,
+            MotionPlannerNoAdvanceParams // AdvanceParams. Pressure advance: MotionPlannerAdvanceParams<AdvanceTime>
         >
     >,
     
@@ -439,7 +461,7 @@ struct Program;
 
 using MyDebugObjectGroup = DebugObjectGroup<MyContext, Program>;
 using MyClock = Mk20Clock<MyContext, Program, clock_timer_prescaler, ClockFtmsList>;
-using MyLoop = BusyEventLoop<MyContext, Program, MyLoopExtraDelay>;
+using MyLoop = HeapEventLoop<MyContext, Program, MyLoopExtraDelay, HeapEventLoopSleepParams<Mk20ClockInterruptTimer_Ftm1_Ch0>>;
 using MyPins = Mk20Pins<MyContext, Program>;
 using MyAdc = Mk20Adc<MyContext, Program, AdcPins, AdcADiv>;
 using MyPrinter = PrinterMain<MyContext, Program, PrinterParams>;
@@ -487,6 +509,7 @@ AMBRO_MK20_CLOCK_INTERRUPT_TIMER_FTM0_CH4_GLOBAL(MyPrinter::GetAxisTimer<3>, MyC
 AMBRO_MK20_CLOCK_INTERRUPT_TIMER_FTM0_CH5_GLOBAL(MyPrinter::GetHeaterTimer<0>, MyContext())
 //AMBRO_MK20_CLOCK_INTERRUPT_TIMER_FTM0_CH6_GLOBAL(MyPrinter::GetHeaterTimer<1>, MyContext())
 AMBRO_MK20_CLOCK_INTERRUPT_TIMER_FTM0_CH7_GLOBAL(MyPrinter::GetFanTimer<0>, MyContext())
+AMBRO_MK20_CLOCK_INTERRUPT_TIMER_FTM1_CH0_GLOBAL(MyLoop::GetWakeupTimer, MyContext())
 
 static void emergency (void)
 {
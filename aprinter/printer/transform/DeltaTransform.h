@@ -30,6 +30,7 @@
 #include <aprinter/meta/WrapDouble.h>
 #include <aprinter/math/Vector3.h>
 #include <aprinter/math/FloatTools.h>
+#include <aprinter/math/IncrementalQuadraticSqrt.h>
 #include <aprinter/printer/DistanceSplitter.h>
 
 #include <aprinter/BeginNamespace.h>
@@ -98,6 +99,46 @@ public:
         out_virt.template set<2>(ps.m_v[2]);
     }
     
+    // Gives the physical positions at the split points of a straight line in
+    // virtual space, which must be evaluated in order at evenly spaced fractions.
+    // The height of a carriage above the effector is the square root of a
+    // quadratic in the fraction, see IncrementalQuadraticSqrt.
+    class LineEvaluator {
+    public:
+        template <typename OldSrc, typename DeltaSrc>
+        void start (OldSrc old_virt, DeltaSrc delta_virt)
+        {
+            FpType x = old_virt.template get<0>();
+            FpType y = old_virt.template get<1>();
+            FpType dx = delta_virt.template get<0>();
+            FpType dy = delta_virt.template get<1>();
+            start_tower(&m_towers[0], (FpType)Params::Tower1X::value() - x, (FpType)Params::Tower1Y::value() - y, dx, dy);
+            start_tower(&m_towers[1], (FpType)Params::Tower2X::value() - x, (FpType)Params::Tower2Y::value() - y, dx, dy);
+            start_tower(&m_towers[2], (FpType)Params::Tower3X::value() - x, (FpType)Params::Tower3Y::value() - y, dx, dy);
+            m_z = old_virt.template get<2>();
+            m_dz = delta_virt.template get<2>();
+        }
+        
+        template <typename Dst>
+        void evaluate (FpType frac, Dst out_phys)
+        {
+            FpType z = m_z + frac * m_dz;
+            out_phys.template set<0>(m_towers[0].next(frac) + z);
+            out_phys.template set<1>(m_towers[1].next(frac) + z);
+            out_phys.template set<2>(m_towers[2].next(frac) + z);
+        }
+        
+    private:
+        static void start_tower (IncrementalQuadraticSqrt<FpType> *tower, FpType u, FpType v, FpType dx, FpType dy)
+        {
+            tower->start((FpType)DiagonalRod2::value() - square(u) - square(v), 2.0f * (u * dx + v * dy), -(square(dx) + square(dy)));
+        }
+        
+        IncrementalQuadraticSqrt<FpType> m_towers[3];
+        FpType m_z;
+        FpType m_dz;
+    };
+    
     using Splitter = DistanceSplitter<typename Params::SplitterParams, FpType>;
 };
 
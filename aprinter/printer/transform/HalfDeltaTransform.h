@@ -29,6 +29,7 @@
 
 #include <aprinter/meta/WrapDouble.h>
 #include <aprinter/math/Vector3.h>
+#include <aprinter/math/IncrementalQuadraticSqrt.h>
 #include <aprinter/printer/DistanceSplitter.h>
 
 #include <aprinter/BeginNamespace.h>
@@ -81,6 +82,41 @@ public:
         out_virt.template set<1>(ps.m_v[1]);
     }
     
+    // Gives the physical positions at the split points of a straight line in
+    // virtual space, evaluated in order at evenly spaced fractions, like
+    // DeltaTransform::LineEvaluator.
+    class LineEvaluator {
+    public:
+        template <typename OldSrc, typename DeltaSrc>
+        void start (OldSrc old_virt, DeltaSrc delta_virt)
+        {
+            FpType x = old_virt.template get<0>();
+            FpType dx = delta_virt.template get<0>();
+            start_tower(&m_towers[0], (FpType)Params::Tower1X::value() - x, dx);
+            start_tower(&m_towers[1], (FpType)Params::Tower2X::value() - x, dx);
+            m_z = old_virt.template get<1>();
+            m_dz = delta_virt.template get<1>();
+        }
+        
+        template <typename Dst>
+        void evaluate (FpType frac, Dst out_phys)
+        {
+            FpType z = m_z + frac * m_dz;
+            out_phys.template set<0>(m_towers[0].next(frac) + z);
+            out_phys.template set<1>(m_towers[1].next(frac) + z);
+        }
+        
+    private:
+        static void start_tower (IncrementalQuadraticSqrt<FpType> *tower, FpType u, FpType dx)
+        {
+            tower->start((FpType)DiagonalRod2::value() - square(u), 2.0f * u * dx, -square(dx));
+        }
+        
+        IncrementalQuadraticSqrt<FpType> m_towers[2];
+        FpType m_z;
+        FpType m_dz;
+    };
+    
     using Splitter = DistanceSplitter<typename Params::SplitterParams, FpType>;
 };
 
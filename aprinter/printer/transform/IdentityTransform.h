@@ -41,6 +41,8 @@ struct IdentityTransformParams {
 template <typename Params, typename FpType>
 class IdentityTransform {
     AMBRO_DECLARE_TUPLE_FOREACH_HELPER(Foreach_copy_coords, copy_coords)
+    AMBRO_DECLARE_TUPLE_FOREACH_HELPER(Foreach_start_line, start_line)
+    AMBRO_DECLARE_TUPLE_FOREACH_HELPER(Foreach_evaluate_line, evaluate_line)
     
 public:
     static int const NumAxes = Params::NumAxes;
@@ -59,6 +61,27 @@ public:
         TupleForEachForward(&dummy, Foreach_copy_coords(), phys, out_virt);
     }
     
+    class LineEvaluator {
+    public:
+        template <typename OldSrc, typename DeltaSrc>
+        void start (OldSrc old_virt, DeltaSrc delta_virt)
+        {
+            HelperTuple dummy;
+            TupleForEachForward(&dummy, Foreach_start_line(), old_virt, delta_virt, m_old, m_delta);
+        }
+        
+        template <typename Dst>
+        void evaluate (FpType frac, Dst out_phys)
+        {
+            HelperTuple dummy;
+            TupleForEachForward(&dummy, Foreach_evaluate_line(), frac, m_old, m_delta, out_phys);
+        }
+        
+    private:
+        FpType m_old[NumAxes];
+        FpType m_delta[NumAxes];
+    };
+    
     using Splitter = DistanceSplitter<typename Params::SplitterParams, FpType>;
     
 private:
@@ -69,6 +92,19 @@ private:
         {
             dst.template set<AxisIndex>(src.template get<AxisIndex>());
         }
+        
+        template <typename OldSrc, typename DeltaSrc>
+        static void start_line (OldSrc old_virt, DeltaSrc delta_virt, FpType *old_pos, FpType *delta)
+        {
+            old_pos[AxisIndex] = old_virt.template get<AxisIndex>();
+            delta[AxisIndex] = delta_virt.template get<AxisIndex>();
+        }
+        
+        template <typename Dst>
+        static void evaluate_line (FpType frac, FpType const *old_pos, FpType const *delta, Dst out_phys)
+        {
+            out_phys.template set<AxisIndex>(old_pos[AxisIndex] + frac * delta[AxisIndex]);
+        }
     };
     
     using HelperTuple = Tuple<IndexElemListCount<NumAxes, Helper>>;
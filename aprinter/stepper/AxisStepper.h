@@ -36,10 +36,16 @@
 #include <aprinter/meta/TupleForEach.h>
 #include <aprinter/meta/IndexElemTuple.h>
 #include <aprinter/meta/Object.h>
+#include <aprinter/meta/StructIf.h>
+#include <aprinter/meta/TypeList.h>
 #include <aprinter/math/StoredNumber.h>
 #include <aprinter/base/DebugObject.h>
 #include <aprinter/base/Assert.h>
 #include <aprinter/base/Inline.h>
+#include <aprinter/base/Lock.h>
+#include <aprinter/base/Likely.h>
+#include <aprinter/system/InterruptLock.h>
+#include <aprinter/system/Profiler.h>
 
 #include <aprinter/BeginNamespace.h>
 
@@ -57,11 +63,13 @@
 
 template <
     template<typename, typename, typename> class TTimer,
-    typename TPrecisionParams
+    typename TPrecisionParams,
+    typename TPrecomputeParams
 >
 struct AxisStepperParams {
     template<typename X, typename Y, typename Z> using Timer = TTimer<X, Y, Z>;
     using PrecisionParams = TPrecisionParams;
+    using PrecomputeParams = TPrecomputeParams;
 };
 
 template <typename TCommandCallback, typename TPrestepCallback>
@@ -85,6 +93,26 @@ struct AxisStepperPrecisionParams {
 using AxisStepperAvrPrecisionParams = AxisStepperPrecisionParams<11, 22, 16, 24, 1>;
 using AxisStepperDuePrecisionParams = AxisStepperPrecisionParams<11, 26, 16, 26, 1>;
 
+struct AxisStepperNoPrecomputeParams {
+    static bool const Enabled = false;
+};
+
+// Step times are computed in the main loop, ChunkSize steps at a time,
+// into two alternating chunks, and the interrupt only reads them.
+// Meant for 32-bit targets with RAM to spare. Since the interrupt then
+// does little between raising and lowering STEP, the pulse can be held for
+// MinPulseWidth seconds (e.g. 1e-6 for A4988, 1.9e-6 for DRV8825 drivers):
+// the interrupt leaves STEP high and sets the timer to lower it once that
+// has passed, before the timer goes on to the next step. This takes one
+// more short interrupt per step but no waiting. With zero, STEP is lowered
+// right away.
+template <int TChunkSize, typename TMinPulseWidth>
+struct AxisStepperPrecomputeParams {
+    static bool const Enabled = true;
+    static int const ChunkSize = TChunkSize;
+    using MinPulseWidth = TMinPulseWidth;
+};
+
 template <typename Context, typename ParentObject, typename Params, typename Stepper, typename ConsumersList>
 class AxisStepper {
 private:
@@ -136,11 +164,301 @@ public:
         cmd->a_mul = AXIS_STEPPER_AMUL_EXPR(x, t, a);
     }
     
+private:
+    using AMulType = decltype(AXIS_STEPPER_AMUL_EXPR_HELPER(AXIS_STEPPER_DUMMY_VARS));
+    using DiscriminantType = decltype(AXIS_STEPPER_DISCRIMINANT_EXPR_HELPER(AXIS_STEPPER_DUMMY_VARS));
+    using V0Type = decltype(AXIS_STEPPER_V0_EXPR_HELPER(AXIS_STEPPER_DUMMY_VARS));
+    
+    AMBRO_STRUCT_IF(PrecomputeFeature, Params::PrecomputeParams::Enabled) {
+        struct Object;
+        static int const ChunkSize = Params::PrecomputeParams::ChunkSize;
+        static_assert(ChunkSize > 0 && ChunkSize <= 255, "");
+        static_assert(Params::PrecomputeParams::MinPulseWidth::value() >= 0.0, "");
+        
+        // The clock is read after raising STEP, so the pulse may have started
+        // up to a tick earlier; one more tick covers that.
+        static TimeType const PulseTicks = (Params::PrecomputeParams::MinPulseWidth::value() > 0.0) ?
+            ((TimeType)(Params::PrecomputeParams::MinPulseWidth::value() * Clock::time_freq) + 2) : 0;
+        using FastEvent = typename Context::EventLoop::template FastEventSpec<PrecomputeFeature>;
+        using EventLoopFastEvents = MakeTypeList<FastEvent>;
+        
+        // A chunk is owned by the interrupt while ready is set, and by the
+        // main loop otherwise. It covers consecutive steps of the current
+        // command, starting with the step at position start_pos.
+        struct Chunk {
+            bool ready;
+            bool ends_command;
+            uint8_t length;
+            StepFixedType start_pos;
+            StepFixedType end_pos;
+            DiscriminantType end_discriminant;
+            TimeType times[ChunkSize];
+        };
+        
+        static void init (Context c)
+        {
+            auto *o = Object::self(c);
+            Context::EventLoop::template initFastEvent<FastEvent>(c, PrecomputeFeature::event_handler);
+            o->m_chunk_ptr = nullptr;
+            o->m_read_index = 0;
+            o->m_chunks[0].ready = false;
+            o->m_chunks[1].ready = false;
+            o->m_pulse_high = false;
+        }
+        
+        static void stop (Context c)
+        {
+            auto *o = Object::self(c);
+            Context::EventLoop::template resetFastEvent<FastEvent>(c);
+            if (o->m_pulse_high) {
+                o->m_pulse_high = false;
+                Stepper::stepOff(c);
+            }
+        }
+        
+        // Called whenever the interrupt moves to a new command; any chunks
+        // belong to the previous command.
+        template <typename ThisContext>
+        static void command_loaded (ThisContext c)
+        {
+            auto *o = Object::self(c);
+            o->m_chunk_ptr = nullptr;
+            o->m_chunks[0].ready = false;
+            o->m_chunks[1].ready = false;
+            o->m_restart = true;
+            Context::EventLoop::template triggerFastEvent<FastEvent>(c);
+        }
+        
+        AMBRO_ALWAYS_INLINE static bool next_step_time (typename TimerInstance::HandlerContext c, TimeType *next_time)
+        {
+            auto *o = Object::self(c);
+            if (AMBRO_UNLIKELY(!o->m_chunk_ptr) && !enter_chunk(c)) {
+                return false;
+            }
+            *next_time = *o->m_chunk_ptr++;
+            if (AMBRO_UNLIKELY(o->m_chunk_ptr == o->m_chunk_end)) {
+                finish_chunk(c);
+            }
+            return true;
+        }
+        
+        AMBRO_ALWAYS_INLINE static TimeType pulse_start (typename TimerInstance::HandlerContext c)
+        {
+            return (PulseTicks > 0) ? Clock::getTime(c) : 0;
+        }
+        
+        // Lowers STEP if the pulse is not timed.
+        AMBRO_ALWAYS_INLINE static void step_off (typename TimerInstance::HandlerContext c)
+        {
+            if (PulseTicks == 0) {
+                Stepper::stepOff(c);
+            }
+        }
+        
+        // Sets the timer for the next step, or first for the end of the pulse.
+        AMBRO_ALWAYS_INLINE static void set_next (typename TimerInstance::HandlerContext c, TimeType start_time, TimeType next_time)
+        {
+            auto *o = Object::self(c);
+            if (PulseTicks > 0) {
+                o->m_pulse_high = true;
+                o->m_next_time = next_time;
+                next_time = start_time + PulseTicks;
+            }
+            TimerInstance::setNext(c, next_time);
+        }
+        
+        // Called first in the interrupt; returns true if it only ended the pulse.
+        AMBRO_ALWAYS_INLINE static bool pulse_end (typename TimerInstance::HandlerContext c)
+        {
+            auto *o = Object::self(c);
+            if (PulseTicks == 0 || !o->m_pulse_high) {
+                return false;
+            }
+            o->m_pulse_high = false;
+            Stepper::stepOff(c);
+            TimerInstance::setNext(c, o->m_next_time);
+            return true;
+        }
+        
+        // The position is not updated while stepping from a chunk.
+        static void sync_pos (Context c)
+        {
+            auto *o = Object::self(c);
+            auto *so = AxisStepper::Object::self(c);
+            if (o->m_chunk_ptr) {
+                Chunk *chunk = &o->m_chunks[o->m_read_index];
+                typename StepFixedType::IntType done = o->m_chunk_ptr - chunk->times;
+                so->m_pos = StepFixedType::importBits(so->m_notdecel ? (chunk->start_pos.bitsValue() - done) : (chunk->start_pos.bitsValue() + done));
+            }
+        }
+        
+        static bool enter_chunk (typename TimerInstance::HandlerContext c)
+        {
+            auto *o = Object::self(c);
+            auto *so = AxisStepper::Object::self(c);
+            Chunk *chunk = &o->m_chunks[o->m_read_index];
+            if (!chunk->ready) {
+                return false;
+            }
+            // The chunk may have been computed from an earlier position
+            // while we kept stepping, then we join it in the middle.
+            typename StepFixedType::IntType offset = so->m_notdecel ?
+                (chunk->start_pos.bitsValue() - so->m_pos.bitsValue()) :
+                (so->m_pos.bitsValue() - chunk->start_pos.bitsValue());
+            if (offset >= chunk->length) {
+                chunk->ready = false;
+                o->m_read_index ^= 1;
+                Context::EventLoop::template triggerFastEvent<FastEvent>(c);
+                return false;
+            }
+            o->m_chunk_ptr = chunk->times + offset;
+            o->m_chunk_end = chunk->times + chunk->length;
+            return true;
+        }
+        
+        static void finish_chunk (typename TimerInstance::HandlerContext c)
+        {
+            auto *o = Object::self(c);
+            auto *so = AxisStepper::Object::self(c);
+            Chunk *chunk = &o->m_chunks[o->m_read_index];
+            so->m_pos = chunk->end_pos;
+            so->m_discriminant = chunk->end_discriminant;
+            if (chunk->ends_command) {
+                so->m_notend = false;
+                so->m_time = chunk->times[chunk->length - 1];
+            }
+            chunk->ready = false;
+            o->m_read_index ^= 1;
+            o->m_chunk_ptr = nullptr;
+            Context::EventLoop::template triggerFastEvent<FastEvent>(c);
+        }
+        
+        static void event_handler (Context c)
+        {
+            auto *o = Object::self(c);
+            auto *so = AxisStepper::Object::self(c);
+            
+            bool fill;
+            AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+                // Continue after the last chunk unless the interrupt has
+                // moved on to a new command or is stepping on its own.
+                if (o->m_restart || (!o->m_chunk_ptr && !o->m_chunks[0].ready && !o->m_chunks[1].ready)) {
+                    o->m_restart = false;
+                    o->m_fill_index = o->m_read_index;
+                    o->m_cur_end = !so->m_notend;
+                    o->m_cur_notdecel = so->m_notdecel;
+                    o->m_cur_x = so->m_x;
+                    o->m_cur_pos = so->m_pos;
+                    o->m_cur_discriminant = so->m_discriminant;
+                    o->m_cur_v0 = so->m_v0;
+                    o->m_cur_time = so->m_time;
+                    o->m_cur_a_mul = so->m_current_command->a_mul;
+                    o->m_cur_t_mul = TimeMulFixedType::importBits(TMulStored::retrieve(so->m_current_command->t_mul_stored));
+                }
+                fill = !o->m_cur_end && !o->m_chunks[o->m_fill_index].ready;
+            }
+            
+            if (!fill) {
+                return;
+            }
+            
+            Chunk *chunk = &o->m_chunks[o->m_fill_index];
+            fill_chunk(c, chunk);
+            
+            AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+                if (!o->m_restart) {
+                    chunk->ready = true;
+                }
+            }
+            o->m_fill_index ^= 1;
+            Context::EventLoop::template triggerFastEvent<FastEvent>(c);
+        }
+        
+        // Same computation as in timer_handler.
+        static void fill_chunk (Context c, Chunk *chunk)
+        {
+            auto *o = Object::self(c);
+            
+            StepFixedType pos = o->m_cur_pos;
+            DiscriminantType discriminant = o->m_cur_discriminant;
+            bool ends_command = false;
+            uint8_t length = 0;
+            chunk->start_pos = pos;
+            do {
+                discriminant.m_bits.m_int += o->m_cur_a_mul.m_bits.m_int;
+                auto q = (o->m_cur_v0 + FixedSquareRoot<true>(discriminant, OptionForceInline())).template shift<-1>();
+                auto t_frac = FixedFracDivide(pos, q, OptionForceInline());
+                TimeFixedType t = FixedResMultiply(o->m_cur_t_mul, t_frac);
+                if (!o->m_cur_notdecel) {
+                    if (pos == o->m_cur_x) {
+                        chunk->times[length++] = o->m_cur_time + o->m_cur_t_mul.template bitsTo<time_bits>().bitsValue();
+                        ends_command = true;
+                        break;
+                    }
+                    pos.m_bits.m_int++;
+                    chunk->times[length++] = o->m_cur_time + t.bitsValue();
+                } else {
+                    chunk->times[length++] = o->m_cur_time - t.bitsValue();
+                    if (pos.bitsValue() == 0) {
+                        ends_command = true;
+                        break;
+                    }
+                    pos.m_bits.m_int--;
+                }
+            } while (length < ChunkSize);
+            chunk->length = length;
+            chunk->ends_command = ends_command;
+            chunk->end_pos = pos;
+            chunk->end_discriminant = discriminant;
+            
+            o->m_cur_pos = pos;
+            o->m_cur_discriminant = discriminant;
+            o->m_cur_end = ends_command;
+        }
+        
+        struct Object : public ObjBase<PrecomputeFeature, typename AxisStepper::Object, EmptyTypeList> {
+            TimeType const *m_chunk_ptr;
+            TimeType const *m_chunk_end;
+            uint8_t m_read_index;
+            uint8_t m_fill_index;
+            bool m_restart;
+            bool m_pulse_high;
+            TimeType m_next_time;
+            bool m_cur_end;
+            bool m_cur_notdecel;
+            StepFixedType m_cur_x;
+            StepFixedType m_cur_pos;
+            DiscriminantType m_cur_discriminant;
+            V0Type m_cur_v0;
+            TimeType m_cur_time;
+            AMulType m_cur_a_mul;
+            TimeMulFixedType m_cur_t_mul;
+            Chunk m_chunks[2];
+        };
+    } AMBRO_STRUCT_ELSE(PrecomputeFeature) {
+        using EventLoopFastEvents = EmptyTypeList;
+        static void init (Context c) {}
+        static void stop (Context c) {}
+        template <typename ThisContext>
+        static void command_loaded (ThisContext c) {}
+        AMBRO_ALWAYS_INLINE static bool next_step_time (typename TimerInstance::HandlerContext c, TimeType *next_time) { return false; }
+        AMBRO_ALWAYS_INLINE static TimeType pulse_start (typename TimerInstance::HandlerContext c) { return 0; }
+        AMBRO_ALWAYS_INLINE static void step_off (typename TimerInstance::HandlerContext c) { Stepper::stepOff(c); }
+        AMBRO_ALWAYS_INLINE static void set_next (typename TimerInstance::HandlerContext c, TimeType start_time, TimeType next_time) { TimerInstance::setNext(c, next_time); }
+        AMBRO_ALWAYS_INLINE static bool pulse_end (typename TimerInstance::HandlerContext c) { return false; }
+        static void sync_pos (Context c) {}
+        struct Object {};
+    };
+    
+public:
+    using EventLoopFastEvents = typename PrecomputeFeature::EventLoopFastEvents;
+    
     static void init (Context c)
     {
         auto *o = Object::self(c);
         
         TimerInstance::init(c);
+        PrecomputeFeature::init(c);
 #ifdef AMBROLIB_ASSERTIONS
         o->m_running = false;
 #endif
@@ -179,6 +497,7 @@ public:
 #endif
         o->m_consumer_id = TypeListIndex<typename ConsumersList::List, IsEqualFunc<TheConsumer>>::value;
         o->m_current_command = first_command;
+        PrecomputeFeature::command_loaded(c);
         Stepper::setDir(c, o->m_current_command->dir_x.bitsValue() & ((typename DirStepFixedType::IntType)1 << step_bits));
         o->m_notdecel = (o->m_current_command->dir_x.bitsValue() & ((typename DirStepFixedType::IntType)1 << (step_bits + 1)));
         StepFixedType x = StepFixedType::importBits(o->m_current_command->dir_x.bitsValue() & (((typename DirStepFixedType::IntType)1 << step_bits) - 1));
@@ -214,6 +533,7 @@ public:
         o->debugAccess(c);
         
         TimerInstance::unset(c);
+        PrecomputeFeature::stop(c);
 #ifdef AMBROLIB_ASSERTIONS
         o->m_running = false;
 #endif
@@ -225,6 +545,7 @@ public:
         o->debugAccess(c);
         AMBRO_ASSERT(!o->m_running)
         
+        PrecomputeFeature::sync_pos(c);
         *dir = (o->m_current_command->dir_x.bitsValue() & ((typename DirStepFixedType::IntType)1 << step_bits));
         if (!o->m_notend) {
             return StepFixedType::importBits(0);
@@ -275,9 +596,14 @@ private:
     
     static bool timer_handler (typename TimerInstance::HandlerContext c)
     {
+        AMBRO_PROFILE_SCOPE(c, PROFILE_AXIS_STEPPER_TIMER);
         auto *o = Object::self(c);
         AMBRO_ASSERT(o->m_running)
         
+        if (PrecomputeFeature::pulse_end(c)) {
+            return true;
+        }
+        
         Command *current_command = o->m_current_command;
         if (AMBRO_LIKELY(!o->m_notend)) {
             IndexElemTuple<typename ConsumersList::List, CallbackHelper> dummy;
@@ -290,6 +616,7 @@ private:
             }
             
             o->m_current_command = current_command;
+            PrecomputeFeature::command_loaded(c);
             Stepper::setDir(c, current_command->dir_x.bitsValue() & ((typename DirStepFixedType::IntType)1 << step_bits));
             o->m_notdecel = (current_command->dir_x.bitsValue() & ((typename DirStepFixedType::IntType)1 << (step_bits + 1)));
             StepFixedType x = StepFixedType::importBits(current_command->dir_x.bitsValue() & (((typename DirStepFixedType::IntType)1 << step_bits) - 1));
@@ -333,6 +660,14 @@ private:
         }
         
         Stepper::stepOn(c);
+        TimeType pulse_start = PrecomputeFeature::pulse_start(c);
+        
+        TimeType next_time;
+        if (PrecomputeFeature::next_step_time(c, &next_time)) {
+            PrecomputeFeature::step_off(c);
+            PrecomputeFeature::set_next(c, pulse_start, next_time);
+            return true;
+        }
         
         o->m_discriminant.m_bits.m_int += current_command->a_mul.m_bits.m_int;
         AMBRO_ASSERT(o->m_discriminant.bitsValue() >= 0)
@@ -344,9 +679,8 @@ private:
         auto t_mul = TimeMulFixedType::importBits(TMulStored::retrieve(current_command->t_mul_stored));
         TimeFixedType t = FixedResMultiply(t_mul, t_frac);
         
-        Stepper::stepOff(c);
+        PrecomputeFeature::step_off(c);
         
-        TimeType next_time;
         if (AMBRO_LIKELY(!o->m_notdecel)) {
             if (AMBRO_LIKELY(o->m_pos == o->m_x)) {
                 o->m_time += t_mul.template bitsTo<time_bits>().bitsValue();
@@ -364,7 +698,7 @@ private:
             next_time = (o->m_time - t.bitsValue());
         }
         
-        TimerInstance::setNext(c, next_time);
+        PrecomputeFeature::set_next(c, pulse_start, next_time);
         return true;
     }
     
@@ -372,7 +706,8 @@ private:
     
 public:
     struct Object : public ObjBase<AxisStepper, ParentObject, MakeTypeList<
-        TimerInstance
+        TimerInstance,
+        PrecomputeFeature
     >>,
         public DebugObject<Context, void>
     {
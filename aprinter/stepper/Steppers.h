@@ -25,6 +25,9 @@
 #ifndef AMBROLIB_STEPPERS_H
 #define AMBROLIB_STEPPERS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <aprinter/meta/TypeList.h>
 #include <aprinter/meta/Tuple.h>
 #include <aprinter/meta/TupleGet.h>
@@ -43,7 +46,12 @@
 #include <aprinter/meta/TypeListFold.h>
 #include <aprinter/meta/WrapValue.h>
 #include <aprinter/meta/TupleForEach.h>
+#include <aprinter/meta/StructIf.h>
+#include <aprinter/meta/BoundedInt.h>
 #include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Lock.h>
+#include <aprinter/base/Likely.h>
+#include <aprinter/system/InterruptLock.h>
 
 #include <aprinter/BeginNamespace.h>
 
@@ -55,7 +63,17 @@ struct StepperDef {
     static const bool InvertDir = TInvertDir;
 };
 
-template <typename Context, typename ParentObject, typename StepperDefsList>
+struct SteppersNoTraceParams {
+    static bool const Enabled = false;
+};
+
+template <int TBufferSizeExp>
+struct SteppersTraceParams {
+    static bool const Enabled = true;
+    static int const BufferSizeExp = TBufferSizeExp;
+};
+
+template <typename Context, typename ParentObject, typename StepperDefsList, typename TraceParams>
 class Steppers {
 public:
     struct Object;
@@ -67,7 +85,106 @@ private:
     static int const NumSteppers = TypeListLength<StepperDefsList>::value;
     using MaskType = typename ChooseInt<NumSteppers, false>::Type;
     
+    AMBRO_STRUCT_IF(TraceFeature, TraceParams::Enabled) {
+        struct Object;
+        using Clock = typename Context::Clock;
+        using TimeType = typename Clock::TimeType;
+        using SizeType = BoundedInt<TraceParams::BufferSizeExp, false>;
+        static_assert(NumSteppers <= 128, "");
+        
+        struct Entry {
+            TimeType time;
+            uint8_t stepper_dir;
+        };
+        
+        static void init (Context c)
+        {
+            auto *o = Object::self(c);
+            o->m_start = SizeType::import(0);
+            o->m_end = SizeType::import(0);
+            o->m_overruns = 0;
+            for (int i = 0; i < NumSteppers; i++) {
+                o->m_dir[i] = false;
+            }
+        }
+        
+        // Called from the main context as well as from the interrupts of other
+        // steppers; each stepper has a byte of its own, so no lock is needed.
+        template <typename ThisContext>
+        static void record_dir (ThisContext c, uint8_t stepper_index, bool dir)
+        {
+            auto *o = Object::self(c);
+            o->m_dir[stepper_index] = dir;
+        }
+        
+        // Called from the stepper interrupt only. The reader never modifies
+        // m_end, so no lock is needed here.
+        template <typename ThisContext>
+        static void record_step (ThisContext c, uint8_t stepper_index)
+        {
+            auto *o = Object::self(c);
+            SizeType end = o->m_end;
+            SizeType new_end = BoundedModuloInc(end);
+            if (AMBRO_UNLIKELY(new_end == o->m_start)) {
+                o->m_overruns++;
+                return;
+            }
+            Entry *entry = &o->m_buffer[end.value()];
+            entry->time = Clock::getTime(c);
+            entry->stepper_dir = stepper_index | (o->m_dir[stepper_index] ? 0x80 : 0);
+            asm volatile ("" ::: "memory");
+            o->m_end = new_end;
+        }
+        
+        static bool read (Context c, Entry *out_entry)
+        {
+            auto *o = Object::self(c);
+            SizeType end;
+            AMBRO_LOCK_T(AtomicTempLock(), c, lock_c) {
+                end = o->m_end;
+            }
+            if (o->m_start == end) {
+                return false;
+            }
+            *out_entry = o->m_buffer[o->m_start.value()];
+            AMBRO_LOCK_T(AtomicTempLock(), c, lock_c) {
+                o->m_start = BoundedModuloInc(o->m_start);
+            }
+            return true;
+        }
+        
+        static uint32_t getOverruns (Context c)
+        {
+            auto *o = Object::self(c);
+            uint32_t overruns;
+            AMBRO_LOCK_T(AtomicTempLock(), c, lock_c) {
+                overruns = o->m_overruns;
+            }
+            return overruns;
+        }
+        
+        struct Object : public ObjBase<TraceFeature, typename Steppers::Object, EmptyTypeList> {
+            SizeType m_start;
+            SizeType m_end;
+            uint32_t m_overruns;
+            bool m_dir[NumSteppers];
+            Entry m_buffer[(size_t)SizeType::maxIntValue() + 1];
+        };
+    } AMBRO_STRUCT_ELSE(TraceFeature) {
+        static void init (Context c) {}
+        template <typename ThisContext>
+        static void record_dir (ThisContext c, uint8_t stepper_index, bool dir) {}
+        template <typename ThisContext>
+        static void record_step (ThisContext c, uint8_t stepper_index) {}
+        struct Object {};
+    };
+    
 public:
+    // Available only with SteppersTraceParams.
+    // Each entry has the stepper index in the low 7 bits of stepper_dir
+    // and the (non-inverted) direction in the top bit.
+    using Trace = TraceFeature;
+    
     template <int StepperIndex>
     class Stepper {
         friend Steppers;
@@ -137,6 +254,7 @@ public:
         {
             auto *s = Steppers::Object::self(c);
             s->debugAccess(c);
+            TraceFeature::record_dir(c, StepperIndex, dir);
             Context::Pins::template set<typename ThisDef::DirPin>(c, maybe_invert_dir(dir));
         }
         
@@ -145,6 +263,7 @@ public:
         {
             auto *s = Steppers::Object::self(c);
             s->debugAccess(c);
+            TraceFeature::record_step(c, StepperIndex);
             Context::Pins::template set<typename ThisDef::StepPin>(c, true);
         }
         
@@ -179,7 +298,7 @@ public:
         
         static void deinit (Context c)
         {
-            Context::Pins::template set<ThisDef::EnablePin>(c, true);
+            Context::Pins::template set<typename ThisDef::EnablePin>(c, true);
         }
     };
     
@@ -187,6 +306,7 @@ public:
     {
         auto *o = Object::self(c);
         o->mask = 0;
+        TraceFeature::init(c);
         SteppersTuple dummy;
         TupleForEachForward(&dummy, Foreach_init(), c);
         o->debugInit(c);
@@ -204,7 +324,9 @@ private:
     using SteppersTuple = IndexElemTuple<StepperDefsList, Stepper>;
     
 public:
-    struct Object : public ObjBase<Steppers, ParentObject, EmptyTypeList>,
+    struct Object : public ObjBase<Steppers, ParentObject, MakeTypeList<
+        TraceFeature
+    >>,
         public DebugObject<Context, void>
     {
         MaskType mask;
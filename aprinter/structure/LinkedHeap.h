@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_LINKED_HEAP
+#define AMBROLIB_LINKED_HEAP
+
+#include <stddef.h>
+
+#include <aprinter/base/Assert.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/**
+ * Intrusive binary min-heap. The heap is a complete binary tree whose nodes
+ * are linked with pointers, so there is no capacity limit and no storage
+ * besides the node embedded in each entry. Entry number k (counting from 1
+ * in level order) has children 2k and 2k+1, so the path to any position is
+ * given by the bits of k; this is how the last position is found when
+ * inserting and removing. Insertion and removal of any entry are O(log n),
+ * and the minimum entry is always the root.
+ *
+ * Compare::lessThan(a, b) must be a strict weak ordering of the entries
+ * currently in the heap. Entries with equal keys come out in no particular
+ * order.
+ */
+template <class Entry, class Accessor, class Compare>
+class LinkedHeapWithAccessor;
+
+template <class Entry>
+class LinkedHeapNode {
+    template <class, class, class>
+    friend class LinkedHeapWithAccessor;
+    Entry *parent;
+    Entry *link[2];
+};
+
+template <class Entry, class Accessor, class Compare>
+class LinkedHeapWithAccessor {
+public:
+    void init ();
+    bool isEmpty () const;
+    Entry * first () const;
+    void insert (Entry *e);
+    void remove (Entry *e);
+    
+private:
+    static LinkedHeapNode<Entry> * ac (Entry *e);
+    Entry * find_position (size_t pos) const;
+    void swap_with_parent (Entry *e);
+    void sift_up (Entry *e);
+    void sift_down (Entry *e);
+    
+public:
+    Entry *m_root;
+    size_t m_count;
+};
+
+template <class Entry, LinkedHeapNode<Entry> Entry::*NodeMember>
+struct LinkedHeapAccessor {
+    static LinkedHeapNode<Entry> * access (Entry *e)
+    {
+        return &(e->*NodeMember);
+    }
+};
+
+template <class Entry, LinkedHeapNode<Entry> Entry::*NodeMember, class Compare>
+class LinkedHeap : public LinkedHeapWithAccessor<Entry, LinkedHeapAccessor<Entry, NodeMember>, Compare> {};
+
+template <class Entry, class Accessor, class Compare>
+LinkedHeapNode<Entry> * LinkedHeapWithAccessor<Entry, Accessor, Compare>::ac (Entry *e)
+{
+    return Accessor::access(e);
+}
+
+template <class Entry, class Accessor, class Compare>
+void LinkedHeapWithAccessor<Entry, Accessor, Compare>::init ()
+{
+    m_root = NULL;
+    m_count = 0;
+}
+
+template <class Entry, class Accessor, class Compare>
+bool LinkedHeapWithAccessor<Entry, Accessor, Compare>::isEmpty () const
+{
+    return (m_root == NULL);
+}
+
+template <class Entry, class Accessor, class Compare>
+Entry * LinkedHeapWithAccessor<Entry, Accessor, Compare>::first () const
+{
+    return m_root;
+}
+
+template <class Entry, class Accessor, class Compare>
+void LinkedHeapWithAccessor<Entry, Accessor, Compare>::insert (Entry *e)
+{
+    ac(e)->link[0] = NULL;
+    ac(e)->link[1] = NULL;
+    m_count++;
+    if (m_count == 1) {
+        ac(e)->parent = NULL;
+        m_root = e;
+        return;
+    }
+    Entry *parent = find_position(m_count / 2);
+    ac(parent)->link[m_count % 2] = e;
+    ac(e)->parent = parent;
+    sift_up(e);
+}
+
+template <class Entry, class Accessor, class Compare>
+void LinkedHeapWithAccessor<Entry, Accessor, Compare>::remove (Entry *e)
+{
+    AMBRO_ASSERT(m_count > 0)
+    
+    Entry *last = find_position(m_count);
+    m_count--;
+    
+    if (last == m_root) {
+        AMBRO_ASSERT(e == m_root)
+        m_root = NULL;
+        return;
+    }
+    ac(ac(last)->parent)->link[ac(ac(last)->parent)->link[1] == last] = NULL;
+    if (last == e) {
+        return;
+    }
+    
+    ac(last)->parent = ac(e)->parent;
+    ac(last)->link[0] = ac(e)->link[0];
+    ac(last)->link[1] = ac(e)->link[1];
+    if (ac(e)->parent) {
+        ac(ac(e)->parent)->link[ac(ac(e)->parent)->link[1] == e] = last;
+    } else {
+        m_root = last;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (ac(last)->link[i]) {
+            ac(ac(last)->link[i])->parent = last;
+        }
+    }
+    
+    if (ac(last)->parent && Compare::lessThan(last, ac(last)->parent)) {
+        sift_up(last);
+    } else {
+        sift_down(last);
+    }
+}
+
+template <class Entry, class Accessor, class Compare>
+Entry * LinkedHeapWithAccessor<Entry, Accessor, Compare>::find_position (size_t pos) const
+{
+    AMBRO_ASSERT(pos >= 1)
+    AMBRO_ASSERT(pos <= m_count)
+    
+    int bit = 0;
+    while ((pos >> bit) > 1) {
+        bit++;
+    }
+    Entry *e = m_root;
+    while (bit > 0) {
+        bit--;
+        e = ac(e)->link[(pos >> bit) & 1];
+    }
+    return e;
+}
+
+template <class Entry, class Accessor, class Compare>
+void LinkedHeapWithAccessor<Entry, Accessor, Compare>::swap_with_parent (Entry *e)
+{
+    Entry *p = ac(e)->parent;
+    AMBRO_ASSERT(p)
+    
+    int side = (ac(p)->link[1] == e);
+    Entry *sibling = ac(p)->link[!side];
+    Entry *child0 = ac(e)->link[0];
+    Entry *child1 = ac(e)->link[1];
+    Entry *grandparent = ac(p)->parent;
+    
+    ac(e)->parent = grandparent;
+    if (grandparent) {
+        ac(grandparent)->link[ac(grandparent)->link[1] == p] = e;
+    } else {
+        m_root = e;
+    }
+    ac(e)->link[side] = p;
+    ac(e)->link[!side] = sibling;
+    if (sibling) {
+        ac(sibling)->parent = e;
+    }
+    ac(p)->parent = e;
+    ac(p)->link[0] = child0;
+    ac(p)->link[1] = child1;
+    if (child0) {
+        ac(child0)->parent = p;
+    }
+    if (child1) {
+        ac(child1)->parent = p;
+    }
+}
+
+template <class Entry, class Accessor, class Compare>
+void LinkedHeapWithAccessor<Entry, Accessor, Compare>::sift_up (Entry *e)
+{
+    while (ac(e)->parent && Compare::lessThan(e, ac(e)->parent)) {
+        swap_with_parent(e);
+    }
+}
+
+template <class Entry, class Accessor, class Compare>
+void LinkedHeapWithAccessor<Entry, Accessor, Compare>::sift_down (Entry *e)
+{
+    while (1) {
+        Entry *child = ac(e)->link[0];
+        if (!child) {
+            break;
+        }
+        if (ac(e)->link[1] && Compare::lessThan(ac(e)->link[1], child)) {
+            child = ac(e)->link[1];
+        }
+        if (!Compare::lessThan(child, e)) {
+            break;
+        }
+        swap_with_parent(child);
+    }
+}
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -27,7 +27,6 @@
 
 #include <stdint.h>
 #include <stddef.h>
-#include <string.h>
 
 #include <aprinter/meta/BoundedInt.h>
 #include <aprinter/meta/MakeTypeList.h>
@@ -100,6 +99,26 @@ public:
         return (o->m_recv_buffer + o->m_recv_start.value());
     }
     
+    static RecvSizeType recvGetChunkLen (Context c, RecvSizeType rem_length)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        if (o->m_recv_start.value() > 0 && rem_length > BoundedModuloNegative(o->m_recv_start)) {
+            rem_length = BoundedModuloNegative(o->m_recv_start);
+        }
+        return rem_length;
+    }
+    
+    // Received data beyond recvGetChunkLen continues here.
+    static char * recvGetWrapPtr (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return o->m_recv_buffer;
+    }
+    
     static void recvConsume (Context c, RecvSizeType amount)
     {
         auto *o = Object::self(c);
@@ -201,7 +220,6 @@ private:
                 bytes = amount.value();
             }
             udi_cdc_read_buf(o->m_recv_buffer + o->m_recv_end.value(), bytes);
-            memcpy(o->m_recv_buffer + ((size_t)RecvSizeType::maxIntValue() + 1) + o->m_recv_end.value(), o->m_recv_buffer + o->m_recv_end.value(), bytes);
             o->m_recv_end = BoundedModuloAdd(o->m_recv_end, RecvSizeType::import(bytes));
             o->m_recv_force = true;
         }
@@ -247,7 +265,7 @@ public:
         RecvSizeType m_recv_start;
         RecvSizeType m_recv_end;
         bool m_recv_force;
-        char m_recv_buffer[2 * ((size_t)RecvSizeType::maxIntValue() + 1)];
+        char m_recv_buffer[(size_t)RecvSizeType::maxIntValue() + 1];
         SendSizeType m_send_start;
         SendSizeType m_send_end;
         char m_send_buffer[(size_t)SendSizeType::maxIntValue() + 1];
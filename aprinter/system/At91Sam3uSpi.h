@@ -36,7 +36,8 @@ using At91Sam3uSpiDevice = At91SamSpiDevice<
     SPI_IRQn, 
     At91Sam3uPin<At91Sam3uPioA, 15>,
     At91Sam3uPin<At91Sam3uPioA, 14>,
-    At91Sam3uPin<At91Sam3uPioA, 13>
+    At91Sam3uPin<At91Sam3uPioA, 13>,
+    At91SamSpiNoDmaParams
 >;
 
 template <typename Context, typename ParentObject, typename Handler, int CommandBufferBits>
@@ -36,7 +36,14 @@ using At91Sam3xSpiDevice = At91SamSpiDevice<
     SPI0_IRQn, 
     At91Sam3xPin<At91Sam3xPioA, 27>,
     At91Sam3xPin<At91Sam3xPioA, 26>,
-    At91Sam3xPin<At91Sam3xPioA, 25>
+    At91Sam3xPin<At91Sam3xPioA, 25>,
+    At91SamSpiDmacParams<
+        0, // TxChannel
+        1, // RxChannel
+        1, // TxPerId (SPI0_TX)
+        2, // RxPerId (SPI0_RX)
+        16 // MinLength
+    >
 >;
 
 template <typename Context, typename ParentObject, typename Handler, int CommandBufferBits>
@@ -48,6 +55,12 @@ __attribute__((used)) \
 void SPI0_Handler (void) \
 { \
     thespi::spi_irq(MakeInterruptContext(context)); \
+} \
+extern "C" \
+__attribute__((used)) \
+void DMAC_Handler (void) \
+{ \
+    thespi::dma_irq(MakeInterruptContext(context)); \
 }
 
 #include <aprinter/EndNamespace.h>
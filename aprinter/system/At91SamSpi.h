@@ -32,6 +32,7 @@
 #include <aprinter/meta/Object.h>
 #include <aprinter/meta/BoundedInt.h>
 #include <aprinter/meta/MakeTypeList.h>
+#include <aprinter/meta/StructIf.h>
 #include <aprinter/base/DebugObject.h>
 #include <aprinter/base/Assert.h>
 #include <aprinter/base/Lock.h>
@@ -40,13 +41,40 @@
 
 #include <aprinter/BeginNamespace.h>
 
+struct At91SamSpiNoDmaParams {
+    static bool const Enabled = false;
+};
+
+/*
+ * Long buffer reads are done with a pair of DMAC channels, one feeding
+ * the send byte to SPI_TDR and one draining SPI_RDR into the buffer.
+ * The whole read then costs a single interrupt. The PerIds are the
+ * DMAC hardware handshaking interfaces of the SPI.
+ */
+template <
+    int TTxChannel,
+    int TRxChannel,
+    int TTxPerId,
+    int TRxPerId,
+    size_t TMinLength
+>
+struct At91SamSpiDmacParams {
+    static bool const Enabled = true;
+    static int const TxChannel = TTxChannel;
+    static int const RxChannel = TRxChannel;
+    static int const TxPerId = TTxPerId;
+    static int const RxPerId = TRxPerId;
+    static size_t const MinLength = TMinLength;
+};
+
 template <
     uint32_t TSpiAddr,
     int TSpiId,
     enum IRQn TSpiIrq,
     typename TSckPin,
     typename TMosiPin,
-    typename TMisoPin
+    typename TMisoPin,
+    typename TDmaParams
 >
 struct At91SamSpiDevice {
     static Spi * spi () { return (Spi *)TSpiAddr; }
@@ -55,6 +83,7 @@ struct At91SamSpiDevice {
     using SckPin = TSckPin;
     using MosiPin = TMosiPin;
     using MisoPin = TMisoPin;
+    using DmaParams = TDmaParams;
 };
 
 template <typename Context, typename ParentObject, typename Handler, int CommandBufferBits, typename Device>
@@ -91,6 +120,84 @@ class At91SamSpi {
         } u;
     };
     
+    AMBRO_STRUCT_IF(DmaFeature, Device::DmaParams::Enabled) {
+        using DmaParams = typename Device::DmaParams;
+        static_assert(DmaParams::MinLength > 0, "");
+        static_assert(DmaParams::RxChannel > DmaParams::TxChannel, "the receive channel must have priority");
+        
+        static void init (Context c)
+        {
+            pmc_enable_periph_clk(ID_DMAC);
+            DMAC->DMAC_EN = 0;
+            DMAC->DMAC_GCFG = DMAC_GCFG_ARB_CFG_FIXED;
+            DMAC->DMAC_EN = DMAC_EN_ENABLE;
+            DMAC->DMAC_CHDR = (DMAC_CHDR_DIS0 << DmaParams::TxChannel) | (DMAC_CHDR_DIS0 << DmaParams::RxChannel);
+            DMAC->DMAC_EBCIER = DMAC_EBCIER_BTC0 << DmaParams::RxChannel;
+            (void)DMAC->DMAC_EBCISR;
+            NVIC_ClearPendingIRQ(DMAC_IRQn);
+            NVIC_SetPriority(DMAC_IRQn, INTERRUPT_PRIORITY);
+            NVIC_EnableIRQ(DMAC_IRQn);
+        }
+        
+        static void deinit (Context c)
+        {
+            NVIC_DisableIRQ(DMAC_IRQn);
+            DMAC->DMAC_CHDR = (DMAC_CHDR_DIS0 << DmaParams::TxChannel) | (DMAC_CHDR_DIS0 << DmaParams::RxChannel);
+            DMAC->DMAC_EBCIDR = DMAC_EBCIDR_BTC0 << DmaParams::RxChannel;
+            (void)DMAC->DMAC_EBCISR;
+            NVIC_ClearPendingIRQ(DMAC_IRQn);
+            DMAC->DMAC_EN = 0;
+            pmc_disable_periph_clk(ID_DMAC);
+        }
+        
+        template <typename ThisContext>
+        static bool start_command (ThisContext c, Command *cmd)
+        {
+            if (cmd->type != COMMAND_READ_BUFFER || (size_t)(cmd->u.read_buffer.end - cmd->u.read_buffer.cur) < DmaParams::MinLength) {
+                return false;
+            }
+            uint32_t length = cmd->u.read_buffer.end - cmd->u.read_buffer.cur;
+            
+            Device::spi()->SPI_IDR = SPI_IDR_RDRF;
+            (void)Device::spi()->SPI_RDR;
+            
+            auto *rx = &DMAC->DMAC_CH_NUM[DmaParams::RxChannel];
+            rx->DMAC_SADDR = (uint32_t)&Device::spi()->SPI_RDR;
+            rx->DMAC_DADDR = (uint32_t)cmd->u.read_buffer.cur;
+            rx->DMAC_DSCR = 0;
+            rx->DMAC_CTRLA = DMAC_CTRLA_BTSIZE(length) | DMAC_CTRLA_SRC_WIDTH_BYTE | DMAC_CTRLA_DST_WIDTH_BYTE;
+            rx->DMAC_CTRLB = DMAC_CTRLB_SRC_DSCR_FETCH_DISABLE | DMAC_CTRLB_DST_DSCR_FETCH_DISABLE | DMAC_CTRLB_FC_PER2MEM_DMA_FC |
+                             DMAC_CTRLB_SRC_INCR_FIXED | DMAC_CTRLB_DST_INCR_INCREMENTING;
+            rx->DMAC_CFG = DMAC_CFG_SRC_PER(DmaParams::RxPerId) | DMAC_CFG_SRC_H2SEL | DMAC_CFG_SOD | DMAC_CFG_FIFOCFG_ASAP_CFG;
+            
+            auto *tx = &DMAC->DMAC_CH_NUM[DmaParams::TxChannel];
+            tx->DMAC_SADDR = (uint32_t)&cmd->byte;
+            tx->DMAC_DADDR = (uint32_t)&Device::spi()->SPI_TDR;
+            tx->DMAC_DSCR = 0;
+            tx->DMAC_CTRLA = DMAC_CTRLA_BTSIZE(length) | DMAC_CTRLA_SRC_WIDTH_BYTE | DMAC_CTRLA_DST_WIDTH_BYTE;
+            tx->DMAC_CTRLB = DMAC_CTRLB_SRC_DSCR_FETCH_DISABLE | DMAC_CTRLB_DST_DSCR_FETCH_DISABLE | DMAC_CTRLB_FC_MEM2PER_DMA_FC |
+                             DMAC_CTRLB_SRC_INCR_FIXED | DMAC_CTRLB_DST_INCR_FIXED;
+            tx->DMAC_CFG = DMAC_CFG_DST_PER(DmaParams::TxPerId) | DMAC_CFG_DST_H2SEL | DMAC_CFG_SOD | DMAC_CFG_FIFOCFG_ALAP_CFG;
+            
+            DMAC->DMAC_CHER = (DMAC_CHER_ENA0 << DmaParams::RxChannel) | (DMAC_CHER_ENA0 << DmaParams::TxChannel);
+            return true;
+        }
+        
+        static void dma_irq (InterruptContext<Context> c)
+        {
+            uint32_t status = DMAC->DMAC_EBCISR;
+            if (status & (DMAC_EBCISR_BTC0 << DmaParams::RxChannel)) {
+                complete_command(c);
+            }
+        }
+    } AMBRO_STRUCT_ELSE(DmaFeature) {
+        static void init (Context c) {}
+        static void deinit (Context c) {}
+        template <typename ThisContext>
+        static bool start_command (ThisContext c, Command *cmd) { return false; }
+        static void dma_irq (InterruptContext<Context> c) {}
+    };
+    
 public:
     struct Object;
     using CommandSizeType = BoundedInt<CommandBufferBits, false>;
@@ -115,6 +222,7 @@ public:
         NVIC_SetPriority(Device::SpiIrq, INTERRUPT_PRIORITY);
         NVIC_EnableIRQ(Device::SpiIrq);
         Device::spi()->SPI_CR = SPI_CR_SPIEN;
+        DmaFeature::init(c);
         
         o->debugInit(c);
     }
@@ -124,6 +232,7 @@ public:
         auto *o = Object::self(c);
         o->debugDeinit(c);
         
+        DmaFeature::deinit(c);
         NVIC_DisableIRQ(Device::SpiIrq);
         Device::spi()->SPI_CR = SPI_CR_SPIDIS;
         (void)Device::spi()->SPI_RDR;
@@ -271,19 +380,43 @@ public:
                 }
             } break;
         }
+        complete_command(c);
+    }
+    
+    static void dma_irq (InterruptContext<Context> c)
+    {
+        DmaFeature::dma_irq(c);
+    }
+    
+    using EventLoopFastEvents = MakeTypeList<FastEvent>;
+    
+private:
+    template <typename ThisContext>
+    static void start_command (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_current = &o->m_buffer[o->m_start.value()];
+        if (DmaFeature::start_command(c, o->m_current)) {
+            return;
+        }
+        Device::spi()->SPI_TDR = o->m_current->byte;
+        Device::spi()->SPI_IER = SPI_IER_RDRF;
+    }
+    
+    static void complete_command (InterruptContext<Context> c)
+    {
+        auto *o = Object::self(c);
+        
         Context::EventLoop::template triggerFastEvent<FastEvent>(c);
         o->m_start = BoundedModuloInc(o->m_start);
         if (AMBRO_LIKELY(o->m_start != o->m_end)) {
-            o->m_current = &o->m_buffer[o->m_start.value()];
-            Device::spi()->SPI_TDR = o->m_current->byte;
+            start_command(c);
         } else {
             Device::spi()->SPI_IDR = SPI_IDR_RDRF;
         }
     }
     
-    using EventLoopFastEvents = MakeTypeList<FastEvent>;
-    
-private:
     static void event_handler (Context c)
     {
         auto *o = Object::self(c);
@@ -320,9 +453,7 @@ private:
             o->m_end = BoundedModuloInc(o->m_end);
         }
         if (was_idle) {
-            o->m_current = &o->m_buffer[o->m_start.value()];
-            Device::spi()->SPI_TDR = o->m_current->byte;
-            Device::spi()->SPI_IER = SPI_IER_RDRF;
+            start_command(c);
         }
     }
     
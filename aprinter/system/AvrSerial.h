@@ -128,6 +128,26 @@ public:
         return (o->m_recv_buffer + o->m_recv_start.value());
     }
     
+    static RecvSizeType recvGetChunkLen (Context c, RecvSizeType rem_length)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        if (o->m_recv_start.value() > 0 && rem_length > BoundedModuloNegative(o->m_recv_start)) {
+            rem_length = BoundedModuloNegative(o->m_recv_start);
+        }
+        return rem_length;
+    }
+    
+    // Received data beyond recvGetChunkLen continues here.
+    static char * recvGetWrapPtr (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return o->m_recv_buffer;
+    }
+    
     static void recvConsume (Context c, RecvSizeType amount)
     {
         auto *o = Object::self(c);
@@ -264,7 +284,6 @@ public:
         if (new_end != o->m_recv_start) {
             char ch = UDR0;
             o->m_recv_buffer[o->m_recv_end.value()] = ch;
-            o->m_recv_buffer[o->m_recv_end.value() + (sizeof(o->m_recv_buffer) / 2)] = ch;
             o->m_recv_end = new_end;
         } else {
             o->m_recv_overrun = true;
@@ -328,7 +347,7 @@ public:
         RecvSizeType m_recv_start;
         RecvSizeType m_recv_end;
         bool m_recv_overrun;
-        char m_recv_buffer[2 * ((size_t)RecvSizeType::maxIntValue() + 1)];
+        char m_recv_buffer[(size_t)RecvSizeType::maxIntValue() + 1];
         SendSizeType m_send_start;
         SendSizeType m_send_end;
         SendSizeType m_send_event;
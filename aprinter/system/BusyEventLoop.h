@@ -78,6 +78,12 @@ public:
 #ifdef EVENTLOOP_BENCHMARK
         o->m_bench_time = 0;
 #endif
+#ifdef EVENTLOOP_CPU_LOAD
+        o->m_load_idle = false;
+        o->m_load_last_time = o->m_now;
+        o->m_load_busy_time = 0;
+        o->m_load_idle_time = 0;
+#endif
         
         o->debugInit(c);
     }
@@ -104,6 +110,7 @@ public:
                 if (!Delay::extra(c)->m_fast_events[Delay::extra(c)->m_fast_event_pos].not_triggered) {
                     Delay::extra(c)->m_fast_events[Delay::extra(c)->m_fast_event_pos].not_triggered = true;
                     sei();
+                    load_leave_idle(c, o->m_now);
                     bench_start_measuring(c);
                     Delay::extra(c)->m_fast_events[Delay::extra(c)->m_fast_event_pos].handler(c);
                     c.check();
@@ -121,6 +128,7 @@ public:
                 if ((TimeType)(now - ev->m_time) < UINT32_C(0x80000000)) {
                     o->m_queued_event_list.remove(ev);
                     QueuedEventList::markRemoved(ev);
+                    load_leave_idle(c, now);
                     bench_start_measuring(c);
                     ev->m_handler(ev, c);
                     c.check();
@@ -133,6 +141,7 @@ public:
                     goto again;
                 }
             }
+            load_enter_idle(c, now);
         }
     }
     
@@ -150,6 +159,25 @@ public:
     }
 #endif
     
+#ifdef EVENTLOOP_CPU_LOAD
+    static void resetLoadTimes (Context c)
+    {
+        auto *o = Object::self(c);
+        o->m_load_last_time = Clock::getTime(c);
+        o->m_load_busy_time = 0;
+        o->m_load_idle_time = 0;
+    }
+    
+    // Time spent running handlers (busy) and polling for events (idle)
+    // since init or resetLoadTimes(), in clock ticks.
+    static void getLoadTimes (Context c, uint64_t *out_busy, uint64_t *out_idle)
+    {
+        auto *o = Object::self(c);
+        *out_busy = o->m_load_busy_time + (TimeType)(Clock::getTime(c) - o->m_load_last_time);
+        *out_idle = o->m_load_idle_time;
+    }
+#endif
+    
 #ifdef AMBROLIB_SUPPORT_QUIT
     static void quit (Context c)
     {
@@ -217,6 +245,30 @@ private:
 #endif
     }
     
+    static void load_enter_idle (Context c, TimeType now)
+    {
+#ifdef EVENTLOOP_CPU_LOAD
+        auto *o = Object::self(c);
+        if (!o->m_load_idle) {
+            o->m_load_idle = true;
+            o->m_load_busy_time += (TimeType)(now - o->m_load_last_time);
+            o->m_load_last_time = now;
+        }
+#endif
+    }
+    
+    static void load_leave_idle (Context c, TimeType now)
+    {
+#ifdef EVENTLOOP_CPU_LOAD
+        auto *o = Object::self(c);
+        if (o->m_load_idle) {
+            o->m_load_idle = false;
+            o->m_load_idle_time += (TimeType)(now - o->m_load_last_time);
+            o->m_load_last_time = now;
+        }
+#endif
+    }
+    
 public:
     struct Object : public ObjBase<BusyEventLoop, ParentObject, EmptyTypeList>,
         public DebugObject<Context, void>
@@ -229,6 +281,12 @@ public:
 #ifdef EVENTLOOP_BENCHMARK
         TimeType m_bench_time;
         TimeType m_bench_enter_time;
+#endif
+#ifdef EVENTLOOP_CPU_LOAD
+        bool m_load_idle;
+        TimeType m_load_last_time;
+        uint64_t m_load_busy_time;
+        uint64_t m_load_idle_time;
 #endif
     };
 };
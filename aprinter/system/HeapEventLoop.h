@@ -0,0 +1,549 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_HEAP_EVENT_LOOP_H
+#define AMBROLIB_HEAP_EVENT_LOOP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <aprinter/meta/Object.h>
+#include <aprinter/meta/MakeTypeList.h>
+#include <aprinter/meta/WrapFunction.h>
+#include <aprinter/meta/StructIf.h>
+#include <aprinter/structure/DoubleEndedList.h>
+#include <aprinter/structure/LinkedHeap.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/base/Lock.h>
+#include <aprinter/base/Likely.h>
+#include <aprinter/system/InterruptLock.h>
+#include <aprinter/system/BusyEventLoop.h>
+
+#include <aprinter/BeginNamespace.h>
+
+template <typename>
+class HeapEventLoopQueuedEvent;
+
+struct HeapEventLoopNoSleepParams {
+    static bool const SleepEnabled = false;
+};
+
+/**
+ * Makes the loop sleep (WFI) while no event is due, until an interrupt
+ * arrives. Before sleeping, the given interrupt timer is set to fire
+ * when the earliest timed event is due.
+ */
+template <
+    template<typename, typename, typename> class TWakeupTimerService
+>
+struct HeapEventLoopSleepParams {
+    static bool const SleepEnabled = true;
+    template<typename X, typename Y, typename Z> using WakeupTimerService = TWakeupTimerService<X, Y, Z>;
+};
+
+/**
+ * Drop-in replacement for BusyEventLoop, with the same interface for
+ * queued and fast events. It is used together with BusyEventLoopExtra.
+ * 
+ * BusyEventLoop keeps all queued events in one list and scans it from the
+ * head after every handler. Here, events scheduled for a time are kept in
+ * a LinkedHeap ordered by time, so the next due event is found in O(1)
+ * and (re)scheduling costs O(log n). Events scheduled for the current time
+ * (appendNowNotAlready, prependNowNotAlready) go to a separate list and are
+ * dispatched before the timed events, without touching the heap.
+ * 
+ * With HeapEventLoopSleepParams, the loop sleeps when it is idle instead of
+ * polling the clock. With EVENTLOOP_CPU_LOAD defined, the time spent idle
+ * is accounted, see getLoadTimes(). A sleeping loop counts only the time
+ * spent in WFI as idle, so interrupt handlers always count as busy. A
+ * polling loop cannot tell them apart from polling.
+ */
+template <typename TContext, typename ParentObject, typename ExtraDelay, typename Params>
+class HeapEventLoop {
+public:
+    struct Object;
+    using Context = TContext;
+    typedef typename Context::Clock Clock;
+    typedef typename Clock::TimeType TimeType;
+    typedef HeapEventLoopQueuedEvent<HeapEventLoop> QueuedEvent;
+    using FastHandlerType = void (*) (Context);
+    
+public:
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+#ifdef AMBROLIB_SUPPORT_QUIT
+        o->m_quitting = false;
+#endif
+        o->m_now = Clock::getTime(c);
+        o->m_now_event_list.init();
+        o->m_timed_event_heap.init();
+        Delay::extra(c)->m_fast_event_pos = 0;
+        for (typename Delay::Extra::FastEventSizeType i = 0; i < Delay::Extra::NumFastEvents; i++) {
+            Delay::extra(c)->m_fast_events[i].not_triggered = true;
+        }
+#ifdef EVENTLOOP_BENCHMARK
+        o->m_bench_time = 0;
+#endif
+#ifdef EVENTLOOP_CPU_LOAD
+        o->m_load_idle = false;
+        o->m_load_last_time = o->m_now;
+        o->m_load_busy_time = 0;
+        o->m_load_idle_time = 0;
+#endif
+        SleepFeature::init(c);
+        
+        o->debugInit(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugDeinit(c);
+        AMBRO_ASSERT(o->m_now_event_list.isEmpty())
+        AMBRO_ASSERT(o->m_timed_event_heap.isEmpty())
+        
+        SleepFeature::deinit(c);
+    }
+    
+    static void run (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        while (1) {
+            for (typename Delay::Extra::FastEventSizeType i = 0; i < Delay::Extra::NumFastEvents; i++) {
+                Delay::extra(c)->m_fast_event_pos++;
+                if (AMBRO_UNLIKELY(Delay::extra(c)->m_fast_event_pos == Delay::Extra::NumFastEvents)) {
+                    Delay::extra(c)->m_fast_event_pos = 0;
+                }
+                cli();
+                if (!Delay::extra(c)->m_fast_events[Delay::extra(c)->m_fast_event_pos].not_triggered) {
+                    Delay::extra(c)->m_fast_events[Delay::extra(c)->m_fast_event_pos].not_triggered = true;
+                    sei();
+                    load_leave_idle(c, o->m_now);
+                    bench_start_measuring(c);
+                    Delay::extra(c)->m_fast_events[Delay::extra(c)->m_fast_event_pos].handler(c);
+                    c.check();
+                    bench_stop_measuring(c);
+                    break;
+                }
+                sei();
+            }
+            
+            while (1) {
+                TimeType now = Clock::getTime(c);
+                o->m_now = now;
+                QueuedEvent *ev = o->m_now_event_list.first();
+                if (ev) {
+                    AMBRO_ASSERT(ev->m_state == QueuedEvent::STATE_NOW)
+                    o->m_now_event_list.removeFirst();
+                } else {
+                    ev = o->m_timed_event_heap.first();
+                    if (!ev || (TimeType)(now - ev->m_time) >= UINT32_C(0x80000000)) {
+                        load_enter_idle(c, now);
+                        SleepFeature::sleep(c, ev);
+                        break;
+                    }
+                    AMBRO_ASSERT(ev->m_state == QueuedEvent::STATE_TIMED)
+                    o->m_timed_event_heap.remove(ev);
+                }
+                ev->m_state = QueuedEvent::STATE_IDLE;
+                load_leave_idle(c, now);
+                bench_start_measuring(c);
+                ev->m_handler(ev, c);
+                c.check();
+                bench_stop_measuring(c);
+#ifdef AMBROLIB_SUPPORT_QUIT
+                if (o->m_quitting) {
+                    return;
+                }
+#endif
+            }
+        }
+    }
+    
+#ifdef EVENTLOOP_BENCHMARK
+    static void resetBenchTime (Context c)
+    {
+        auto *o = Object::self(c);
+        o->m_bench_time = 0;
+    }
+    
+    static TimeType getBenchTime (Context c)
+    {
+        auto *o = Object::self(c);
+        return o->m_bench_time;
+    }
+#endif
+    
+#ifdef EVENTLOOP_CPU_LOAD
+    static void resetLoadTimes (Context c)
+    {
+        auto *o = Object::self(c);
+        o->m_load_last_time = Clock::getTime(c);
+        o->m_load_busy_time = 0;
+        o->m_load_idle_time = 0;
+    }
+    
+    // Time spent running handlers (busy) and waiting for events (idle)
+    // since init or resetLoadTimes(), in clock ticks.
+    static void getLoadTimes (Context c, uint64_t *out_busy, uint64_t *out_idle)
+    {
+        auto *o = Object::self(c);
+        *out_busy = o->m_load_busy_time + (TimeType)(Clock::getTime(c) - o->m_load_last_time);
+        *out_idle = o->m_load_idle_time;
+    }
+#endif
+    
+#ifdef AMBROLIB_SUPPORT_QUIT
+    static void quit (Context c)
+    {
+        auto *o = Object::self(c);
+        o->m_quitting = true;
+    }
+#endif
+    
+    template <typename Id>
+    struct FastEventSpec {};
+    
+    template <typename EventSpec>
+    static void initFastEvent (Context c, FastHandlerType handler)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        Delay::extra(c)->m_fast_events[Delay::Extra::template get_event_index<EventSpec>()].handler = handler;
+    }
+    
+    template <typename EventSpec>
+    static void resetFastEvent (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        Delay::extra(c)->m_fast_events[Delay::Extra::template get_event_index<EventSpec>()].not_triggered = true;
+    }
+    
+    template <typename EventSpec, typename ThisContext>
+    static void triggerFastEvent (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            Delay::extra(c)->m_fast_events[Delay::Extra::template get_event_index<EventSpec>()].not_triggered = false;
+        }
+    }
+    
+private:
+    template <typename>
+    friend class HeapEventLoopQueuedEvent;
+    
+    struct TimeCompare {
+        static bool lessThan (QueuedEvent *e1, QueuedEvent *e2)
+        {
+            return (TimeType)(e1->m_time - e2->m_time) >= UINT32_C(0x80000000);
+        }
+    };
+    
+    typedef DoubleEndedList<QueuedEvent, &QueuedEvent::m_list_node> NowEventList;
+    typedef LinkedHeap<QueuedEvent, &QueuedEvent::m_heap_node, TimeCompare> TimedEventHeap;
+    
+    struct Delay {
+        using Extra = typename ExtraDelay::Type;
+        static typename Extra::Object * extra (Context c) { return Extra::Object::self(c); }
+    };
+    
+    static void bench_start_measuring (Context c)
+    {
+#ifdef EVENTLOOP_BENCHMARK
+        auto *o = Object::self(c);
+        o->m_bench_enter_time = Clock::getTime(c);
+#endif
+    }
+    
+    static void bench_stop_measuring (Context c)
+    {
+#ifdef EVENTLOOP_BENCHMARK
+        auto *o = Object::self(c);
+        o->m_bench_time += (TimeType)(Clock::getTime(c) - o->m_bench_enter_time);
+#endif
+    }
+    
+    static void load_enter_idle (Context c, TimeType now)
+    {
+#ifdef EVENTLOOP_CPU_LOAD
+        auto *o = Object::self(c);
+        if (!Params::SleepEnabled && !o->m_load_idle) {
+            o->m_load_idle = true;
+            o->m_load_busy_time += (TimeType)(now - o->m_load_last_time);
+            o->m_load_last_time = now;
+        }
+#endif
+    }
+    
+    static void load_leave_idle (Context c, TimeType now)
+    {
+#ifdef EVENTLOOP_CPU_LOAD
+        auto *o = Object::self(c);
+        if (o->m_load_idle) {
+            o->m_load_idle = false;
+            o->m_load_idle_time += (TimeType)(now - o->m_load_last_time);
+            o->m_load_last_time = now;
+        }
+#endif
+    }
+    
+    static void load_add_sleep (Context c, TimeType start, TimeType end)
+    {
+#ifdef EVENTLOOP_CPU_LOAD
+        auto *o = Object::self(c);
+        o->m_load_busy_time += (TimeType)(start - o->m_load_last_time);
+        o->m_load_idle_time += (TimeType)(end - start);
+        o->m_load_last_time = end;
+#endif
+    }
+    
+    AMBRO_STRUCT_IF(SleepFeature, Params::SleepEnabled) {
+        struct Object;
+        struct WakeupTimerHandler;
+        using WakeupTimer = typename Params::template WakeupTimerService<Context, Object, WakeupTimerHandler>;
+        
+        static void init (Context c)
+        {
+            auto *o = Object::self(c);
+            WakeupTimer::init(c);
+            o->m_timer_armed = false;
+        }
+        
+        static void deinit (Context c)
+        {
+            WakeupTimer::deinit(c);
+        }
+        
+        static void sleep (Context c, QueuedEvent *next_ev)
+        {
+            auto *o = Object::self(c);
+            auto *lo = HeapEventLoop::Object::self(c);
+            
+            // The timer is only reprogrammed if the earliest event changed
+            // or the timer has fired since.
+            if (!next_ev) {
+                if (o->m_timer_armed) {
+                    WakeupTimer::unset(c);
+                    o->m_timer_armed = false;
+                }
+            } else if (!o->m_timer_armed || next_ev->m_time != o->m_timer_time) {
+                WakeupTimer::unset(c);
+                o->m_timer_armed = true;
+                o->m_timer_time = next_ev->m_time;
+                WakeupTimer::setFirst(c, next_ev->m_time);
+            }
+            // A fast event triggered or the timer firing after the check wakes
+            // us up right away, because its interrupt is pending while
+            // interrupts are disabled. The handler only runs after sei(),
+            // outside of the time counted as idle.
+            cli();
+            if (!fast_event_pending(c) && (!next_ev || o->m_timer_armed)) {
+                TimeType sleep_start = Clock::getTime(c);
+                wait_for_interrupt();
+                load_add_sleep(c, sleep_start, Clock::getTime(c));
+            }
+            sei();
+            lo->m_now = Clock::getTime(c);
+        }
+        
+        static bool fast_event_pending (Context c)
+        {
+            for (typename Delay::Extra::FastEventSizeType i = 0; i < Delay::Extra::NumFastEvents; i++) {
+                if (!Delay::extra(c)->m_fast_events[i].not_triggered) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        
+        static bool wakeup_timer_handler (typename WakeupTimer::HandlerContext c)
+        {
+            auto *o = Object::self(c);
+            o->m_timer_armed = false;
+            return false;
+        }
+        
+        struct WakeupTimerHandler : public AMBRO_WFUNC_TD(&SleepFeature::wakeup_timer_handler) {};
+        
+        struct Object : public ObjBase<SleepFeature, typename HeapEventLoop::Object, MakeTypeList<
+            WakeupTimer
+        >> {
+            bool m_timer_armed;
+            TimeType m_timer_time;
+        };
+    } AMBRO_STRUCT_ELSE(SleepFeature) {
+        static void init (Context c) {}
+        static void deinit (Context c) {}
+        static void sleep (Context c, QueuedEvent *next_ev) {}
+        using WakeupTimer = void;
+        struct Object {};
+    };
+    
+public:
+    using GetWakeupTimer = typename SleepFeature::WakeupTimer;
+    
+    struct Object : public ObjBase<HeapEventLoop, ParentObject, MakeTypeList<
+        SleepFeature
+    >>,
+        public DebugObject<Context, void>
+    {
+#ifdef AMBROLIB_SUPPORT_QUIT
+        bool m_quitting;
+#endif
+        TimeType m_now;
+        NowEventList m_now_event_list;
+        TimedEventHeap m_timed_event_heap;
+#ifdef EVENTLOOP_BENCHMARK
+        TimeType m_bench_time;
+        TimeType m_bench_enter_time;
+#endif
+#ifdef EVENTLOOP_CPU_LOAD
+        bool m_load_idle;
+        TimeType m_load_last_time;
+        uint64_t m_load_busy_time;
+        uint64_t m_load_idle_time;
+#endif
+    };
+};
+
+template <typename Loop>
+class HeapEventLoopQueuedEvent
+: private DebugObject<typename Loop::Context, HeapEventLoopQueuedEvent<Loop>>
+{
+public:
+    typedef typename Loop::Context Context;
+    typedef typename Loop::TimeType TimeType;
+    typedef void (*HandlerType) (HeapEventLoopQueuedEvent *, Context);
+    
+    void init (Context c, HandlerType handler)
+    {
+        m_handler = handler;
+        m_state = STATE_IDLE;
+        
+        this->debugInit(c);
+    }
+    
+    void deinit (Context c)
+    {
+        this->debugDeinit(c);
+        
+        remove(c);
+    }
+    
+    void appendAt (Context c, TimeType time)
+    {
+        this->debugAccess(c);
+        auto *lo = Loop::Object::self(c);
+        
+        remove(c);
+        m_time = time;
+        lo->m_timed_event_heap.insert(this);
+        m_state = STATE_TIMED;
+    }
+    
+    void appendAfterPrevious (Context c, TimeType after_time)
+    {
+        this->debugAccess(c);
+        auto *lo = Loop::Object::self(c);
+        AMBRO_ASSERT(m_state == STATE_IDLE)
+        
+        m_time += after_time;
+        lo->m_timed_event_heap.insert(this);
+        m_state = STATE_TIMED;
+    }
+    
+    void appendNowNotAlready (Context c)
+    {
+        this->debugAccess(c);
+        auto *lo = Loop::Object::self(c);
+        AMBRO_ASSERT(m_state == STATE_IDLE)
+        
+        lo->m_now_event_list.append(this);
+        m_state = STATE_NOW;
+        m_time = lo->m_now;
+    }
+    
+    void prependNowNotAlready (Context c)
+    {
+        this->debugAccess(c);
+        auto *lo = Loop::Object::self(c);
+        AMBRO_ASSERT(m_state == STATE_IDLE)
+        
+        lo->m_now_event_list.prepend(this);
+        m_state = STATE_NOW;
+        m_time = lo->m_now;
+    }
+    
+    void unset (Context c)
+    {
+        this->debugAccess(c);
+        
+        remove(c);
+    }
+    
+    bool isSet (Context c)
+    {
+        this->debugAccess(c);
+        
+        return (m_state != STATE_IDLE);
+    }
+    
+private:
+    friend Loop;
+    
+    enum {STATE_IDLE, STATE_NOW, STATE_TIMED};
+    
+    void remove (Context c)
+    {
+        auto *lo = Loop::Object::self(c);
+        
+        if (m_state == STATE_NOW) {
+            lo->m_now_event_list.remove(this);
+        } else if (m_state == STATE_TIMED) {
+            lo->m_timed_event_heap.remove(this);
+        }
+        m_state = STATE_IDLE;
+    }
+    
+    HandlerType m_handler;
+    TimeType m_time;
+    uint8_t m_state;
+    union {
+        DoubleEndedListNode<HeapEventLoopQueuedEvent> m_list_node;
+        LinkedHeapNode<HeapEventLoopQueuedEvent> m_heap_node;
+    };
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_LINUX_ADC_H
+#define AMBROLIB_LINUX_ADC_H
+
+#include <stdint.h>
+
+#include <aprinter/meta/TypeListIndex.h>
+#include <aprinter/meta/IsEqualFunc.h>
+#include <aprinter/meta/TypeListLength.h>
+#include <aprinter/meta/Object.h>
+#include <aprinter/meta/FixedPoint.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Lock.h>
+#include <aprinter/system/InterruptLock.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/*
+ * Stub ADC. Each pin reads back a value which can be set with setValue();
+ * initially all pins read InitialValue (as a fraction of full scale).
+ */
+template <typename Context, typename ParentObject, typename ParamsPinsList, typename InitialValue>
+class LinuxAdc {
+    static const int NumPins = TypeListLength<ParamsPinsList>::value;
+    
+public:
+    struct Object;
+    using FixedType = FixedPoint<16, false, -16>;
+    
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        for (int i = 0; i < NumPins; i++) {
+            o->m_values[i] = FixedType::importFpSaturatedRound(InitialValue::value()).bitsValue();
+        }
+        
+        o->debugInit(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugDeinit(c);
+    }
+    
+    template <typename Pin, typename ThisContext>
+    static FixedType getValue (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        static const int PinIndex = TypeListIndex<ParamsPinsList, IsEqualFunc<Pin>>::value;
+        
+        uint16_t value;
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            value = o->m_values[PinIndex];
+        }
+        
+        return FixedType::importBits(value);
+    }
+    
+    template <typename Pin, typename ThisContext>
+    static void setValue (ThisContext c, FixedType value)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        static const int PinIndex = TypeListIndex<ParamsPinsList, IsEqualFunc<Pin>>::value;
+        
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            o->m_values[PinIndex] = value.bitsValue();
+        }
+    }
+    
+public:
+    struct Object : public ObjBase<LinuxAdc, ParentObject, EmptyTypeList>,
+        public DebugObject<Context, void>
+    {
+        uint16_t m_values[NumPins > 0 ? NumPins : 1];
+    };
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_LINUX_CLOCK_H
+#define AMBROLIB_LINUX_CLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <aprinter/meta/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/base/Lock.h>
+#include <aprinter/system/InterruptLock.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/*
+ * Simulated clock for running the firmware on a PC.
+ * 
+ * Time is a virtual timeline. It only advances when code running in
+ * normal (non-interrupt) context with interrupts enabled reads the clock.
+ * Each such read advances the time by PollTicks, and additionally by the
+ * host time elapsed since the previous read multiplied by CpuSlowdown
+ * (the factor by which the simulated MCU is slower than the host).
+ * With CpuSlowdown=0 the timeline is fully deterministic.
+ * 
+ * Interrupt timers register themselves with the clock, and before the time
+ * is advanced, all timers which expire in the advanced interval are fired in
+ * time order, with the clock reading exactly the expiration time in the handler.
+ */
+template <int TPrescaleDivide, uint32_t TPollTicks, typename TCpuSlowdown>
+struct LinuxClockParams {
+    static const int PrescaleDivide = TPrescaleDivide;
+    static const uint32_t PollTicks = TPollTicks;
+    using CpuSlowdown = TCpuSlowdown;
+};
+
+template <typename Context, typename TimeType>
+struct LinuxClockTimerNode {
+    void (*irq) (Context c);
+    LinuxClockTimerNode *next;
+    TimeType time;
+    bool armed;
+};
+
+template <typename, typename, typename>
+class LinuxClockInterruptTimer;
+
+template <typename Context, typename ParentObject, typename Params>
+class LinuxClock {
+    static_assert(Params::PrescaleDivide >= 1, "");
+    static_assert(Params::PollTicks >= 1, "");
+    
+    template <typename, typename, typename>
+    friend class LinuxClockInterruptTimer;
+    
+public:
+    struct Object;
+    using TimeType = uint32_t;
+    
+    static constexpr TimeType prescale_divide = Params::PrescaleDivide;
+    static constexpr double time_unit = (double)prescale_divide / F_CPU;
+    static constexpr double time_freq = (double)F_CPU / prescale_divide;
+    
+private:
+    using TimerNode = LinuxClockTimerNode<Context, TimeType>;
+    
+public:
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_time = 0;
+        o->m_in_irq = false;
+        o->m_timers = NULL;
+        o->m_host_last = host_time_ns();
+        
+        o->debugInit(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugDeinit(c);
+        AMBRO_ASSERT(!o->m_timers)
+    }
+    
+    template <typename ThisContext>
+    static TimeType getTime (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        if (GetContextType<ThisContext>::value == CONTEXT_NORMAL && interrupts_enabled() && !o->m_in_irq) {
+            advance(c);
+        }
+        return o->m_time;
+    }
+    
+    // Returns the current time without advancing it or dispatching timers.
+    template <typename ThisContext>
+    static TimeType peekTime (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return o->m_time;
+    }
+    
+private:
+    static uint64_t host_time_ns ()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+    }
+    
+    static void advance (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        TimeType delta = Params::PollTicks;
+        if (Params::CpuSlowdown::value() > 0.0) {
+            uint64_t host_now = host_time_ns();
+            delta += (TimeType)((host_now - o->m_host_last) * (Params::CpuSlowdown::value() * time_freq / 1e9));
+            o->m_host_last = host_now;
+        }
+        
+        o->m_in_irq = true;
+        while (1) {
+            TimerNode *first = NULL;
+            TimeType first_rel = 0;
+            for (TimerNode *node = o->m_timers; node; node = node->next) {
+                if (!node->armed) {
+                    continue;
+                }
+                TimeType rel = node->time - o->m_time;
+                if (rel >= UINT32_C(0x80000000)) {
+                    rel = 0;
+                }
+                if (rel <= delta && (!first || rel < first_rel)) {
+                    first = node;
+                    first_rel = rel;
+                }
+            }
+            if (!first) {
+                break;
+            }
+            o->m_time += first_rel;
+            delta -= first_rel;
+            first->irq(c);
+        }
+        o->m_in_irq = false;
+        
+        o->m_time += delta;
+        
+        if (Params::CpuSlowdown::value() > 0.0) {
+            o->m_host_last = host_time_ns();
+        }
+    }
+    
+    static void register_timer (Context c, TimerNode *node)
+    {
+        auto *o = Object::self(c);
+        
+        node->armed = false;
+        node->next = o->m_timers;
+        o->m_timers = node;
+    }
+    
+    static void unregister_timer (Context c, TimerNode *node)
+    {
+        auto *o = Object::self(c);
+        
+        TimerNode **ptr = &o->m_timers;
+        while (*ptr != node) {
+            AMBRO_ASSERT(*ptr)
+            ptr = &(*ptr)->next;
+        }
+        *ptr = node->next;
+    }
+    
+public:
+    struct Object : public ObjBase<LinuxClock, ParentObject, EmptyTypeList>,
+        public DebugObject<Context, void>
+    {
+        TimeType m_time;
+        bool m_in_irq;
+        TimerNode *m_timers;
+        uint64_t m_host_last;
+    };
+};
+
+template <typename Context, typename ParentObject, typename Handler>
+class LinuxClockInterruptTimer {
+public:
+    struct Object;
+    using Clock = typename Context::Clock;
+    using TimeType = typename Clock::TimeType;
+    using HandlerContext = InterruptContext<Context>;
+    
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_node.irq = LinuxClockInterruptTimer::irq_handler;
+        Clock::register_timer(c, &o->m_node);
+        
+        o->debugInit(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugDeinit(c);
+        
+        Clock::unregister_timer(c, &o->m_node);
+    }
+    
+    template <typename ThisContext>
+    static void setFirst (ThisContext c, TimeType time)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(!o->m_node.armed)
+        
+        AMBRO_LOCK_T(AtomicTempLock(), c, lock_c) {
+            o->m_node.time = time;
+            o->m_node.armed = true;
+        }
+    }
+    
+    static void setNext (HandlerContext c, TimeType time)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(o->m_node.armed)
+        
+        o->m_node.time = time;
+    }
+    
+    template <typename ThisContext>
+    static void unset (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            o->m_node.armed = false;
+        }
+    }
+    
+private:
+    static void irq_handler (Context c)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(o->m_node.armed)
+        
+        if (!Handler::call(MakeInterruptContext(c))) {
+            o->m_node.armed = false;
+            return;
+        }
+        // Like the clearance logic of the hardware timers, a compare value
+        // which is not in the future fires on the next tick.
+        TimeType now = Clock::peekTime(c);
+        if ((TimeType)(o->m_node.time - now - 1) >= UINT32_C(0x80000000)) {
+            o->m_node.time = now + 1;
+        }
+    }
+    
+public:
+    struct Object : public ObjBase<LinuxClockInterruptTimer, ParentObject, EmptyTypeList>,
+        public DebugObject<Context, void>
+    {
+        LinuxClockTimerNode<Context, TimeType> m_node;
+    };
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_LINUX_PINS_H
+#define AMBROLIB_LINUX_PINS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <aprinter/meta/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Lock.h>
+#include <aprinter/system/InterruptLock.h>
+
+#include <aprinter/BeginNamespace.h>
+
+static int const LinuxPinsNumPins = 64;
+
+template <int TNumber>
+struct LinuxPin {
+    static_assert(TNumber >= 0 && TNumber < LinuxPinsNumPins, "");
+    static const int Number = TNumber;
+};
+
+template <bool TPullUp>
+struct LinuxPinInputMode {
+    static bool const PullUp = TPullUp;
+};
+
+using LinuxPinInputModeNormal = LinuxPinInputMode<false>;
+using LinuxPinInputModePullUp = LinuxPinInputMode<true>;
+
+/*
+ * Simulated pins. Output levels are stored and every level change is
+ * counted per pin. Optionally, edges are written to a trace file as
+ * "<time> <pin> <level>" lines, timestamped with the simulated clock.
+ */
+template <typename Context, typename ParentObject>
+class LinuxPins {
+public:
+    struct Object;
+    
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        for (int i = 0; i < LinuxPinsNumPins; i++) {
+            o->m_level[i] = false;
+            o->m_rising_edges[i] = 0;
+        }
+        o->m_trace_file = NULL;
+        
+        o->debugInit(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugDeinit(c);
+    }
+    
+    template <typename Pin, typename Mode = LinuxPinInputModeNormal, typename ThisContext>
+    static void setInput (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        o->m_level[Pin::Number] = Mode::PullUp;
+    }
+    
+    template <typename Pin, typename ThisContext>
+    static void setOutput (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+    }
+    
+    template <typename Pin, typename ThisContext>
+    static bool get (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return o->m_level[Pin::Number];
+    }
+    
+    template <typename Pin, typename ThisContext>
+    static void set (ThisContext c, bool x)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        if (x == o->m_level[Pin::Number]) {
+            return;
+        }
+        o->m_level[Pin::Number] = x;
+        if (x) {
+            o->m_rising_edges[Pin::Number]++;
+        }
+        if (o->m_trace_file) {
+            fprintf(o->m_trace_file, "%lu %d %d\n", (unsigned long)Context::Clock::peekTime(c), Pin::Number, (int)x);
+        }
+    }
+    
+    template <typename Pin>
+    static void emergencySet (bool x)
+    {
+    }
+    
+    template <typename Pin, typename ThisContext>
+    static uint32_t getRisingEdges (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return o->m_rising_edges[Pin::Number];
+    }
+    
+    static void setTraceFile (Context c, FILE *trace_file)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        o->m_trace_file = trace_file;
+    }
+    
+public:
+    struct Object : public ObjBase<LinuxPins, ParentObject, EmptyTypeList>,
+        public DebugObject<Context, void>
+    {
+        bool m_level[LinuxPinsNumPins];
+        uint32_t m_rising_edges[LinuxPinsNumPins];
+        FILE *m_trace_file;
+    };
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
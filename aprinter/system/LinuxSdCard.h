@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_LINUX_SD_CARD_H
+#define AMBROLIB_LINUX_SD_CARD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <aprinter/meta/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/*
+ * Simulated SD card in SPI mode, backed by an image file, to be used as
+ * the device of LinuxSpi. It understands the commands SpiSdCard uses and
+ * presents itself as an SDHC card, with the capacity of the image rounded
+ * down to a multiple of 512KiB (the unit of the CSD size field). With no
+ * image, the card never answers, as if the slot were empty. Writes go to
+ * the image, unless it could only be opened for reading, when they are
+ * rejected. After each written block, the card is busy for a while.
+ */
+template <typename Context, typename ParentObject>
+class LinuxSdCard {
+public:
+    struct Object;
+    
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_image = NULL;
+        o->m_capacity_blocks = 0;
+        reset(c);
+        
+        o->debugInit(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugDeinit(c);
+        
+        if (o->m_image) {
+            fclose(o->m_image);
+        }
+    }
+    
+    static bool openImage (Context c, char const *path)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(!o->m_image)
+        
+        bool writable = true;
+        FILE *f = fopen(path, "r+b");
+        if (!f) {
+            writable = false;
+            f = fopen(path, "rb");
+        }
+        if (!f) {
+            return false;
+        }
+        if (fseek(f, 0, SEEK_END) < 0) {
+            fclose(f);
+            return false;
+        }
+        long size = ftell(f);
+        uint32_t blocks = (size < 0) ? 0 : (size / (512 * SizeUnitBlocks) * SizeUnitBlocks);
+        if (blocks == 0) {
+            fclose(f);
+            return false;
+        }
+        o->m_image = f;
+        o->m_writable = writable;
+        o->m_capacity_blocks = blocks;
+        reset(c);
+        return true;
+    }
+    
+    template <typename ThisContext>
+    static uint8_t exchange (ThisContext c, uint8_t in)
+    {
+        auto *o = Object::self(c);
+        
+        if (!o->m_image) {
+            return 0xff;
+        }
+        if (o->m_write_state != WRITE_NONE || o->m_busy > 0) {
+            return write_exchange(c, in);
+        }
+        if (o->m_out_pos == o->m_out_len && o->m_streaming) {
+            out_clear(c);
+            queue_block(c, o->m_stream_block);
+            o->m_stream_block++;
+        }
+        uint8_t out = 0xff;
+        if (o->m_out_pos < o->m_out_len) {
+            out = o->m_out[o->m_out_pos++];
+        }
+        if (o->m_cmd_len > 0 || (in & 0xc0) == 0x40) {
+            o->m_cmd[o->m_cmd_len++] = in;
+            if (o->m_cmd_len == 6) {
+                o->m_cmd_len = 0;
+                handle_command(c);
+            }
+        }
+        return out;
+    }
+    
+private:
+    static uint32_t const SizeUnitBlocks = 1024;
+    static size_t const OutBufferSize = 544;
+    
+    enum {WRITE_NONE, WRITE_TOKEN, WRITE_DATA, WRITE_CRC};
+    
+    static void reset (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_cmd_len = 0;
+        o->m_app_cmd = false;
+        o->m_streaming = false;
+        o->m_write_state = WRITE_NONE;
+        o->m_busy = 0;
+        o->m_nac = 0;
+        out_clear(c);
+    }
+    
+    // Receives the data of WRITE_BLOCK or WRITE_MULTIPLE_BLOCK. The card
+    // holds the line low while busy, which takes longer than one poll of
+    // SpiSdCard now and then.
+    template <typename ThisContext>
+    static uint8_t write_exchange (ThisContext c, uint8_t in)
+    {
+        auto *o = Object::self(c);
+        
+        uint8_t out = 0xff;
+        if (o->m_out_pos < o->m_out_len) {
+            out = o->m_out[o->m_out_pos++];
+        } else if (o->m_busy > 0) {
+            o->m_busy--;
+            out = 0x00;
+        }
+        switch (o->m_write_state) {
+            case WRITE_TOKEN: {
+                if (o->m_out_pos < o->m_out_len || o->m_busy > 0) {
+                    break;
+                }
+                if (in == (o->m_write_multiple ? 0xfc : 0xfe)) {
+                    o->m_write_state = WRITE_DATA;
+                    o->m_write_pos = 0;
+                } else if (in == 0xfd && o->m_write_multiple) {
+                    out_clear(c);
+                    out_push(c, 0xff);
+                    o->m_busy = write_busy_time(c);
+                    o->m_write_state = WRITE_NONE;
+                }
+            } break;
+            case WRITE_DATA: {
+                o->m_write_data[o->m_write_pos++] = in;
+                if (o->m_write_pos == 512) {
+                    o->m_write_state = WRITE_CRC;
+                    o->m_write_pos = 0;
+                }
+            } break;
+            case WRITE_CRC: {
+                if (++o->m_write_pos < 2) {
+                    break;
+                }
+                bool ok = o->m_writable && o->m_write_block < o->m_capacity_blocks &&
+                          fseek(o->m_image, (long)o->m_write_block * 512, SEEK_SET) == 0 &&
+                          fwrite(o->m_write_data, 1, 512, o->m_image) == 512 && fflush(o->m_image) == 0;
+                out_clear(c);
+                out_push(c, ok ? 0x05 : 0x0d);
+                o->m_busy = write_busy_time(c);
+                o->m_write_block++;
+                o->m_write_state = (ok && o->m_write_multiple) ? WRITE_TOKEN : WRITE_NONE;
+            } break;
+        }
+        return out;
+    }
+    
+    template <typename ThisContext>
+    static uint16_t write_busy_time (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        o->m_nac = (o->m_nac + 3) % 8;
+        return (o->m_nac == 0) ? 700 : (10 * o->m_nac);
+    }
+    
+    template <typename ThisContext>
+    static void out_clear (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_out_pos = 0;
+        o->m_out_len = 0;
+    }
+    
+    template <typename ThisContext>
+    static void out_push (ThisContext c, uint8_t byte)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT_FORCE(o->m_out_len < OutBufferSize)
+        
+        o->m_out[o->m_out_len++] = byte;
+    }
+    
+    template <typename ThisContext>
+    static void out_r1 (ThisContext c, uint8_t r1)
+    {
+        out_push(c, 0xff);
+        out_push(c, r1);
+    }
+    
+    // A data block after an access time which varies from block to block.
+    template <typename ThisContext>
+    static void queue_block (ThisContext c, uint32_t block)
+    {
+        auto *o = Object::self(c);
+        
+        if (block >= o->m_capacity_blocks) {
+            out_push(c, 0xff);
+            out_push(c, 0x08);
+            o->m_streaming = false;
+            return;
+        }
+        o->m_nac = (o->m_nac + 3) % 8;
+        for (int i = 0; i <= o->m_nac; i++) {
+            out_push(c, 0xff);
+        }
+        out_push(c, 0xfe);
+        uint8_t *data = o->m_out + o->m_out_len;
+        memset(data, 0, 512);
+        if (fseek(o->m_image, (long)block * 512, SEEK_SET) == 0) {
+            size_t res = fread(data, 1, 512, o->m_image);
+            (void)res;
+        }
+        o->m_out_len += 512;
+        out_push(c, 0);
+        out_push(c, 0);
+    }
+    
+    template <typename ThisContext>
+    static void handle_command (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        
+        uint8_t cmd = o->m_cmd[0] & 0x3f;
+        uint32_t arg = ((uint32_t)o->m_cmd[1] << 24) | ((uint32_t)o->m_cmd[2] << 16) | ((uint32_t)o->m_cmd[3] << 8) | o->m_cmd[4];
+        
+        if (o->m_streaming) {
+            // Only STOP_TRANSMISSION is heard while sending data. The byte
+            // after it is a leftover, and the card is busy for a while.
+            if (cmd == 12) {
+                o->m_streaming = false;
+                out_clear(c);
+                out_push(c, 0x5a);
+                out_push(c, 0x00);
+                for (int i = 0; i < 4; i++) {
+                    out_push(c, 0x00);
+                }
+            }
+            return;
+        }
+        
+        out_clear(c);
+        bool app_cmd = o->m_app_cmd;
+        o->m_app_cmd = false;
+        switch (cmd) {
+            case 0: {
+                out_r1(c, 0x01);
+            } break;
+            case 8: {
+                out_r1(c, 0x01);
+                out_push(c, 0x00);
+                out_push(c, 0x00);
+                out_push(c, arg >> 8);
+                out_push(c, arg);
+            } break;
+            case 9: {
+                uint32_t c_size = o->m_capacity_blocks / SizeUnitBlocks - 1;
+                uint8_t csd[16] = {0x40, 0x0e, 0x00, 0x32, 0x5b, 0x59, 0x00, (uint8_t)((c_size >> 16) & 0x3f), (uint8_t)(c_size >> 8), (uint8_t)c_size, 0x7f, 0x80, 0x0a, 0x40, 0x00, 0x01};
+                out_r1(c, 0x00);
+                out_push(c, 0xff);
+                out_push(c, 0xfe);
+                for (int i = 0; i < 16; i++) {
+                    out_push(c, csd[i]);
+                }
+                out_push(c, 0);
+                out_push(c, 0);
+            } break;
+            case 16: {
+                out_r1(c, (arg == 512) ? 0x00 : 0x40);
+            } break;
+            case 17:
+            case 18: {
+                if (arg >= o->m_capacity_blocks) {
+                    out_r1(c, 0x20);
+                    break;
+                }
+                out_r1(c, 0x00);
+                if (cmd == 17) {
+                    queue_block(c, arg);
+                } else {
+                    o->m_streaming = true;
+                    o->m_stream_block = arg;
+                }
+            } break;
+            case 23: {
+                out_r1(c, app_cmd ? 0x00 : 0x04);
+            } break;
+            case 24:
+            case 25: {
+                if (arg >= o->m_capacity_blocks) {
+                    out_r1(c, 0x20);
+                    break;
+                }
+                out_r1(c, 0x00);
+                o->m_write_state = WRITE_TOKEN;
+                o->m_write_multiple = (cmd == 25);
+                o->m_write_block = arg;
+            } break;
+            case 41: {
+                out_r1(c, app_cmd ? 0x00 : 0x04);
+            } break;
+            case 55: {
+                out_r1(c, 0x00);
+                o->m_app_cmd = true;
+            } break;
+            case 58: {
+                out_r1(c, 0x00);
+                out_push(c, 0xc0);
+                out_push(c, 0xff);
+                out_push(c, 0x80);
+                out_push(c, 0x00);
+            } break;
+            default: {
+                out_r1(c, 0x04);
+            } break;
+        }
+    }
+    
+public:
+    struct Object : public ObjBase<LinuxSdCard, ParentObject, EmptyTypeList>,
+        public DebugObject<Context, void>
+    {
+        FILE *m_image;
+        bool m_writable;
+        uint32_t m_capacity_blocks;
+        uint8_t m_cmd[6];
+        uint8_t m_cmd_len;
+        bool m_app_cmd;
+        bool m_streaming;
+        uint32_t m_stream_block;
+        int m_nac;
+        uint8_t m_write_state;
+        bool m_write_multiple;
+        uint32_t m_write_block;
+        size_t m_write_pos;
+        uint16_t m_busy;
+        uint8_t m_write_data[512];
+        size_t m_out_pos;
+        size_t m_out_len;
+        uint8_t m_out[OutBufferSize];
+    };
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
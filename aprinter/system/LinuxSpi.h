@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_LINUX_SPI_H
+#define AMBROLIB_LINUX_SPI_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <aprinter/meta/Object.h>
+#include <aprinter/meta/BoundedInt.h>
+#include <aprinter/meta/MakeTypeList.h>
+#include <aprinter/meta/WrapFunction.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/base/Lock.h>
+#include <aprinter/system/InterruptLock.h>
+#include <aprinter/system/LinuxClock.h>
+
+#include <aprinter/BeginNamespace.h>
+
+template <
+    typename TByteTime,
+    typename TMaxLatency,
+    typename TDevice
+>
+struct LinuxSpiParams {
+    using ByteTime = TByteTime;
+    using MaxLatency = TMaxLatency;
+    using Device = TDevice;
+};
+
+/*
+ * Simulated SPI master, with the same command interface as the hardware
+ * SPI drivers. The bytes of a command are exchanged with Device when the
+ * command starts, and it completes ByteTime per byte later, in interrupt
+ * context, plus a pseudo-random extra latency of up to MaxLatency. The
+ * latency shakes out code which assumes commands complete promptly.
+ */
+template <typename Context, typename ParentObject, typename Handler, int CommandBufferBits, typename Params>
+class LinuxSpi {
+public:
+    struct Object;
+    
+private:
+    using FastEvent = typename Context::EventLoop::template FastEventSpec<LinuxSpi>;
+    using Clock = typename Context::Clock;
+    using TimeType = typename Clock::TimeType;
+    using Device = typename Params::Device;
+    struct TimerHandler;
+    using Timer = LinuxClockInterruptTimer<Context, Object, TimerHandler>;
+    
+    static TimeType const ByteTicks = Params::ByteTime::value() * Clock::time_freq;
+    static TimeType const MaxLatencyTicks = Params::MaxLatency::value() * Clock::time_freq;
+    
+    enum {
+        COMMAND_READ_BUFFER,
+        COMMAND_READ_UNTIL_DIFFERENT,
+        COMMAND_WRITE_BUFFER,
+        COMMAND_WRITE_BYTE
+    };
+    
+    struct Command {
+        uint8_t type;
+        uint8_t byte;
+        union {
+            struct {
+                uint8_t *data;
+                size_t length;
+            } read_buffer;
+            struct {
+                uint8_t *data;
+                uint8_t target_byte;
+                uint8_t max_extra_length;
+            } read_until_different;
+            struct {
+                uint8_t const *data;
+                size_t length;
+            } write_buffer;
+            struct {
+                size_t count;
+            } write_byte;
+        } u;
+    };
+    
+public:
+    using CommandSizeType = BoundedInt<CommandBufferBits, false>;
+    
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        Context::EventLoop::template initFastEvent<FastEvent>(c, LinuxSpi::event_handler);
+        Timer::init(c);
+        o->m_start = CommandSizeType::import(0);
+        o->m_end = CommandSizeType::import(0);
+        o->m_random = 1;
+        
+        o->debugInit(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugDeinit(c);
+        
+        Timer::deinit(c);
+        Context::EventLoop::template resetFastEvent<FastEvent>(c);
+    }
+    
+    static void cmdReadBuffer (Context c, uint8_t *data, size_t length, uint8_t send_byte)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(!is_full(c))
+        AMBRO_ASSERT(length > 0)
+        
+        Command *cmd = &o->m_buffer[o->m_end.value()];
+        cmd->type = COMMAND_READ_BUFFER;
+        cmd->byte = send_byte;
+        cmd->u.read_buffer.data = data;
+        cmd->u.read_buffer.length = length;
+        write_command(c);
+    }
+    
+    static void cmdReadUntilDifferent (Context c, uint8_t target_byte, uint8_t max_extra_length, uint8_t send_byte, uint8_t *data)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(!is_full(c))
+        
+        Command *cmd = &o->m_buffer[o->m_end.value()];
+        cmd->type = COMMAND_READ_UNTIL_DIFFERENT;
+        cmd->byte = send_byte;
+        cmd->u.read_until_different.data = data;
+        cmd->u.read_until_different.target_byte = target_byte;
+        cmd->u.read_until_different.max_extra_length = max_extra_length;
+        write_command(c);
+    }
+    
+    static void cmdWriteBuffer (Context c, uint8_t first_byte, uint8_t const *data, size_t length)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(!is_full(c))
+        
+        Command *cmd = &o->m_buffer[o->m_end.value()];
+        cmd->type = COMMAND_WRITE_BUFFER;
+        cmd->byte = first_byte;
+        cmd->u.write_buffer.data = data;
+        cmd->u.write_buffer.length = length;
+        write_command(c);
+    }
+    
+    static void cmdWriteByte (Context c, uint8_t byte, size_t extra_count)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        AMBRO_ASSERT(!is_full(c))
+        
+        Command *cmd = &o->m_buffer[o->m_end.value()];
+        cmd->type = COMMAND_WRITE_BYTE;
+        cmd->byte = byte;
+        cmd->u.write_byte.count = extra_count;
+        write_command(c);
+    }
+    
+    static CommandSizeType getEndIndex (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return o->m_end;
+    }
+    
+    static bool indexReached (Context c, CommandSizeType index)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        CommandSizeType start = get_start(c);
+        return (BoundedModuloSubtract(o->m_end, start) <= BoundedModuloSubtract(o->m_end, index));
+    }
+    
+    static bool endReached (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        CommandSizeType start = get_start(c);
+        return (start == o->m_end);
+    }
+    
+    static void unsetEvent (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        Context::EventLoop::template resetFastEvent<FastEvent>(c);
+    }
+    
+    using EventLoopFastEvents = MakeTypeList<FastEvent>;
+    
+private:
+    static void event_handler (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return Handler::call(c);
+    }
+    
+    static CommandSizeType get_start (Context c)
+    {
+        auto *o = Object::self(c);
+        CommandSizeType start;
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            start = o->m_start;
+        }
+        return start;
+    }
+    
+    static bool is_full (Context c)
+    {
+        auto *o = Object::self(c);
+        CommandSizeType start = get_start(c);
+        return (BoundedModuloSubtract(o->m_end, start) == CommandSizeType::maxValue());
+    }
+    
+    static void write_command (Context c)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(!is_full(c))
+        
+        bool was_idle;
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            was_idle = (o->m_start == o->m_end);
+            o->m_end = BoundedModuloInc(o->m_end);
+        }
+        if (was_idle) {
+            TimeType duration = exchange_command(c);
+            Timer::setFirst(c, Clock::getTime(c) + duration);
+        }
+    }
+    
+    // Exchanges the bytes of the current command and returns how long that takes.
+    template <typename ThisContext>
+    static TimeType exchange_command (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        
+        Command *cmd = &o->m_buffer[o->m_start.value()];
+        size_t bytes = 0;
+        switch (cmd->type) {
+            case COMMAND_READ_BUFFER: {
+                for (size_t i = 0; i < cmd->u.read_buffer.length; i++) {
+                    cmd->u.read_buffer.data[i] = Device::exchange(c, cmd->byte);
+                }
+                bytes = cmd->u.read_buffer.length;
+            } break;
+            case COMMAND_READ_UNTIL_DIFFERENT: {
+                uint8_t byte;
+                do {
+                    byte = Device::exchange(c, cmd->byte);
+                    bytes++;
+                } while (byte == cmd->u.read_until_different.target_byte && bytes <= cmd->u.read_until_different.max_extra_length);
+                *cmd->u.read_until_different.data = byte;
+            } break;
+            case COMMAND_WRITE_BUFFER: {
+                Device::exchange(c, cmd->byte);
+                for (size_t i = 0; i < cmd->u.write_buffer.length; i++) {
+                    Device::exchange(c, cmd->u.write_buffer.data[i]);
+                }
+                bytes = 1 + cmd->u.write_buffer.length;
+            } break;
+            case COMMAND_WRITE_BYTE: {
+                for (size_t i = 0; i <= cmd->u.write_byte.count; i++) {
+                    Device::exchange(c, cmd->byte);
+                }
+                bytes = 1 + cmd->u.write_byte.count;
+            } break;
+        }
+        
+        // A small LCG keeps the latencies reproducible from run to run.
+        o->m_random = o->m_random * UINT32_C(1103515245) + 12345;
+        TimeType latency = (o->m_random >> 8) % (MaxLatencyTicks + 1);
+        return bytes * ByteTicks + latency;
+    }
+    
+    static bool timer_handler (InterruptContext<Context> c)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(o->m_start != o->m_end)
+        
+        Context::EventLoop::template triggerFastEvent<FastEvent>(c);
+        o->m_start = BoundedModuloInc(o->m_start);
+        if (o->m_start == o->m_end) {
+            return false;
+        }
+        TimeType duration = exchange_command(c);
+        Timer::setNext(c, Clock::peekTime(c) + duration);
+        return true;
+    }
+    
+    struct TimerHandler : public AMBRO_WFUNC_TD(&LinuxSpi::timer_handler) {};
+    
+public:
+    struct Object : public ObjBase<LinuxSpi, ParentObject, MakeTypeList<
+        Timer
+    >>,
+        public DebugObject<Context, void>
+    {
+        CommandSizeType m_start;
+        CommandSizeType m_end;
+        uint32_t m_random;
+        Command m_buffer[(size_t)CommandSizeType::maxIntValue() + 1];
+    };
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
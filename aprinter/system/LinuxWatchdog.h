@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_LINUX_WATCHDOG_H
+#define AMBROLIB_LINUX_WATCHDOG_H
+
+#include <stdint.h>
+
+#include <aprinter/meta/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+
+#include <aprinter/BeginNamespace.h>
+
+template <uint32_t TTimeoutMs>
+struct LinuxWatchdogParams {
+    static const uint32_t TimeoutMs = TTimeoutMs;
+};
+
+/*
+ * Simulated watchdog. It checks, in simulated time, that it is reset
+ * at least every WatchdogTime, and counts the violations.
+ */
+template <typename Context, typename ParentObject, typename TParams>
+class LinuxWatchdog {
+public:
+    using Params = TParams;
+    
+private:
+    static_assert(Params::TimeoutMs > 0, "");
+    
+    using Clock = typename Context::Clock;
+    using TimeType = typename Clock::TimeType;
+    
+public:
+    struct Object;
+    static constexpr double WatchdogTime = Params::TimeoutMs / 1000.0;
+    
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_last_reset = Clock::peekTime(c);
+        o->m_expired_count = 0;
+        
+        o->debugInit(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugDeinit(c);
+    }
+    
+    template <typename ThisContext>
+    static void reset (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        TimeType now = Clock::peekTime(c);
+        if ((TimeType)(now - o->m_last_reset) > timeout_ticks) {
+            o->m_expired_count++;
+        }
+        o->m_last_reset = now;
+    }
+    
+    static uint32_t getExpiredCount (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return o->m_expired_count;
+    }
+    
+private:
+    static constexpr TimeType timeout_ticks = WatchdogTime * Clock::time_freq;
+    
+public:
+    struct Object : public ObjBase<LinuxWatchdog, ParentObject, EmptyTypeList>,
+        public DebugObject<Context, void>
+    {
+        TimeType m_last_reset;
+        uint32_t m_expired_count;
+    };
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
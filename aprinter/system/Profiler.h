@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_PROFILER_H
+#define AMBROLIB_PROFILER_H
+
+#include <stdint.h>
+#if !defined(AMBROLIB_AVR) && !(defined(__arm__) && !defined(__linux__)) && !defined(__x86_64__) && !defined(__i386__)
+#include <time.h>
+#endif
+
+#include <aprinter/base/Lock.h>
+#include <aprinter/base/ProgramMemory.h>
+#include <aprinter/system/InterruptLock.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/*
+ * Per-function execution time statistics, compiled in with -DAPRINTER_PROFILING.
+ * A function is measured by putting AMBRO_PROFILE_SCOPE(c, point) at its top.
+ * Times are in CPU cycles on ARM microcontrollers (DWT cycle counter) and
+ * x86 hosts (TSC), in clock ticks on AVR, and in nanoseconds of the host's
+ * monotonic clock on other hosts. Every source is kept to its low 32 bits
+ * and times are differences modulo 2^32, so a single measurement must be
+ * shorter than 2^32 units (about a second of TSC cycles on a GHz host).
+ */
+
+enum {
+    PROFILE_PLANNER_PLAN,
+    PROFILE_PLANNER_STEPPER_EVENT,
+    PROFILE_AXIS_STEPPER_TIMER,
+    PROFILE_GCODE_EXTEND,
+    PROFILE_HEATER_CONTROL,
+    PROFILE_SDCARD_READ,
+    PROFILE_NUM_POINTS
+};
+
+#ifdef APRINTER_PROFILING
+
+struct ProfileStats {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+};
+
+template <typename Dummy = void>
+class ProfilerImpl {
+public:
+    static void init ()
+    {
+#if defined(__arm__) && !defined(__linux__)
+        // Enable the DWT unit (DEMCR.TRCENA), then its cycle counter.
+        *(volatile uint32_t *)0xE000EDFC |= UINT32_C(1) << 24;
+        *(volatile uint32_t *)0xE0001004 = 0;
+        *(volatile uint32_t *)0xE0001000 |= 1;
+#endif
+        for (int i = 0; i < PROFILE_NUM_POINTS; i++) {
+            s_stats[i] = ProfileStats();
+        }
+    }
+    
+    template <typename ThisContext>
+    static uint32_t now (ThisContext c)
+    {
+#if defined(AMBROLIB_AVR)
+        // Reading the AVR clock has no side effects. The simulated host
+        // clock is never used, since reading it moves time forward.
+        return ThisContext::Clock::getTime(c);
+#elif defined(__arm__) && !defined(__linux__)
+        return *(volatile uint32_t *)0xE0001004;
+#elif defined(__x86_64__) || defined(__i386__)
+        return (uint32_t)__builtin_ia32_rdtsc();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint32_t)ts.tv_sec * UINT32_C(1000000000) + (uint32_t)ts.tv_nsec;
+#endif
+    }
+    
+    template <typename ThisContext>
+    static void record (ThisContext c, uint8_t point, uint32_t start)
+    {
+        uint32_t time = now(c) - start;
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            ProfileStats *st = &s_stats[point];
+            if (st->count == 0 || time < st->min) {
+                st->min = time;
+            }
+            if (time > st->max) {
+                st->max = time;
+            }
+            st->count++;
+            st->total += time;
+        }
+    }
+    
+    template <typename ThisContext>
+    static void reset (ThisContext c)
+    {
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            for (int i = 0; i < PROFILE_NUM_POINTS; i++) {
+                s_stats[i] = ProfileStats();
+            }
+        }
+    }
+    
+    template <typename ThisContext>
+    static ProfileStats getStats (ThisContext c, uint8_t point)
+    {
+        ProfileStats st;
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            st = s_stats[point];
+        }
+        return st;
+    }
+    
+    static AMBRO_PGM_P getName (uint8_t point)
+    {
+        switch (point) {
+            case PROFILE_PLANNER_PLAN: return AMBRO_PSTR("plan");
+            case PROFILE_PLANNER_STEPPER_EVENT: return AMBRO_PSTR("stepper_event");
+            case PROFILE_AXIS_STEPPER_TIMER: return AMBRO_PSTR("axis_timer");
+            case PROFILE_GCODE_EXTEND: return AMBRO_PSTR("gcode_extend");
+            case PROFILE_HEATER_CONTROL: return AMBRO_PSTR("heater_control");
+            default: return AMBRO_PSTR("sd_read");
+        }
+    }
+    
+private:
+    static ProfileStats s_stats[PROFILE_NUM_POINTS];
+};
+
+template <typename Dummy>
+ProfileStats ProfilerImpl<Dummy>::s_stats[PROFILE_NUM_POINTS];
+
+using Profiler = ProfilerImpl<>;
+
+template <typename ThisContext>
+class ProfileScope {
+public:
+    ProfileScope (ThisContext c, uint8_t point)
+    : m_c(c), m_point(point), m_start(Profiler::now(c))
+    {
+    }
+    
+    ~ProfileScope ()
+    {
+        Profiler::record(m_c, m_point, m_start);
+    }
+    
+private:
+    ThisContext m_c;
+    uint8_t m_point;
+    uint32_t m_start;
+};
+
+#define AMBRO_PROFILE_SCOPE(c, point) APrinter::ProfileScope<decltype(c)> ambro_profile_scope((c), (point))
+
+#else
+
+#define AMBRO_PROFILE_SCOPE(c, point)
+
+#endif
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -27,7 +27,6 @@
 
 #include <stdint.h>
 #include <stddef.h>
-#include <string.h>
 
 #define OLD_CPLUSPLUS __cplusplus
 #undef __cplusplus
@@ -50,7 +49,15 @@ struct TeensyUsbSerialParams {};
 template <typename Context, typename ParentObject, int RecvBufferBits, int SendBufferBits, typename Params, typename RecvHandler, typename SendHandler>
 class TeensyUsbSerial {
 private:
-    using RecvFastEvent = typename Context::EventLoop::template FastEventSpec<TeensyUsbSerial>;
+    using Loop = typename Context::EventLoop;
+    using Clock = typename Context::Clock;
+    using TimeType = typename Clock::TimeType;
+    using RecvFastEvent = typename Loop::template FastEventSpec<TeensyUsbSerial>;
+    
+    // The host delivers data once per USB frame at most, so while nothing
+    // is arriving the USB stack is only polled this often, and the event
+    // loop can sleep in between.
+    static const TimeType PollIntervalTicks = 0.001 * Clock::time_freq;
     
 public:
     struct Object;
@@ -62,6 +69,7 @@ public:
         auto *o = Object::self(c);
         
         Context::EventLoop::template initFastEvent<RecvFastEvent>(c, TeensyUsbSerial::recv_event_handler);
+        o->m_poll_event.init(c, TeensyUsbSerial::poll_event_handler);
         o->m_recv_start = RecvSizeType::import(0);
         o->m_recv_end = RecvSizeType::import(0);
         o->m_recv_force = false;
@@ -79,6 +87,7 @@ public:
         auto *o = Object::self(c);
         o->debugDeinit(c);
         
+        o->m_poll_event.deinit(c);
         Context::EventLoop::template resetFastEvent<RecvFastEvent>(c);
     }
     
@@ -100,6 +109,26 @@ public:
         return (o->m_recv_buffer + o->m_recv_start.value());
     }
     
+    static RecvSizeType recvGetChunkLen (Context c, RecvSizeType rem_length)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        if (o->m_recv_start.value() > 0 && rem_length > BoundedModuloNegative(o->m_recv_start)) {
+            rem_length = BoundedModuloNegative(o->m_recv_start);
+        }
+        return rem_length;
+    }
+    
+    // Received data beyond recvGetChunkLen continues here.
+    static char * recvGetWrapPtr (Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        return o->m_recv_buffer;
+    }
+    
     static void recvConsume (Context c, RecvSizeType amount)
     {
         auto *o = Object::self(c);
@@ -107,6 +136,11 @@ public:
         
         AMBRO_ASSERT(amount <= recv_avail(o->m_recv_start, o->m_recv_end))
         o->m_recv_start = BoundedModuloAdd(o->m_recv_start, amount);
+        
+        // Reception stopped with the buffer full; there is room again.
+        if (!o->m_poll_event.isSet(c)) {
+            Context::EventLoop::template triggerFastEvent<RecvFastEvent>(c);
+        }
     }
     
     static void recvClearOverrun (Context c)
@@ -122,6 +156,7 @@ public:
         o->debugAccess(c);
         
         o->m_recv_force = true;
+        Context::EventLoop::template triggerFastEvent<RecvFastEvent>(c);
     }
     
     static SendSizeType sendQuery (Context c)
@@ -191,7 +226,26 @@ private:
         auto *o = Object::self(c);
         o->debugAccess(c);
         
-        Context::EventLoop::template triggerFastEvent<RecvFastEvent>(c);
+        do_recv(c);
+    }
+    
+    static void poll_event_handler (typename Loop::QueuedEvent *, Context c)
+    {
+        auto *o = Object::self(c);
+        o->debugAccess(c);
+        
+        do_recv(c);
+    }
+    
+    // While data keeps coming, the fast event reads it without delay.
+    // Otherwise the poll event looks again after a frame. With the buffer
+    // full, neither is pending until recvConsume() makes room.
+    static void do_recv (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_poll_event.unset(c);
+        bool received = false;
         RecvSizeType virtual_start = BoundedModuloDec(o->m_recv_start);
         while (o->m_recv_end != virtual_start) {
             RecvSizeType amount = (o->m_recv_end > virtual_start) ? BoundedModuloNegative(o->m_recv_end) : BoundedUnsafeSubtract(virtual_start, o->m_recv_end);
@@ -199,9 +253,16 @@ private:
             if (bytes <= 0) {
                 break;
             }
-            memcpy(o->m_recv_buffer + ((size_t)RecvSizeType::maxIntValue() + 1) + o->m_recv_end.value(), o->m_recv_buffer + o->m_recv_end.value(), bytes);
             o->m_recv_end = BoundedModuloAdd(o->m_recv_end, RecvSizeType::import(bytes));
             o->m_recv_force = true;
+            received = true;
+        }
+        if (o->m_recv_end != virtual_start) {
+            if (received) {
+                Context::EventLoop::template triggerFastEvent<RecvFastEvent>(c);
+            } else {
+                o->m_poll_event.appendAt(c, Clock::getTime(c) + PollIntervalTicks);
+            }
         }
         if (o->m_recv_force) {
             o->m_recv_force = false;
@@ -213,10 +274,11 @@ public:
     struct Object : public ObjBase<TeensyUsbSerial, ParentObject, EmptyTypeList>,
         public DebugObject<Context, void>
     {
+        typename Loop::QueuedEvent m_poll_event;
         RecvSizeType m_recv_start;
         RecvSizeType m_recv_end;
         bool m_recv_force;
-        char m_recv_buffer[2 * ((size_t)RecvSizeType::maxIntValue() + 1)];
+        char m_recv_buffer[(size_t)RecvSizeType::maxIntValue() + 1];
         SendSizeType m_send_start;
         SendSizeType m_send_end;
         char m_send_buffer[(size_t)SendSizeType::maxIntValue() + 1];
@@ -3,6 +3,7 @@
 from __future__ import print_function
 from __future__ import with_statement
 import struct
+import decimal
 
 class GcodeSyntaxError(Exception):
     pass
@@ -77,16 +78,89 @@ def encode_line(line):
     packet = packet_header + packet_index + packet_payload
     return packet
 
+# X, Y and Z in micrometers, E in 0.1 micrometers, F in mm/min.
+DefaultDeltaResolution = 'X3,Y3,Z3,E4,F0'
+
+class DeltaEncoder(object):
+    # Encodes G1 commands as delta packets where possible, see encoding.txt.
+    # Other lines are encoded by encode_line().
+
+    def __init__(self, resolution=DefaultDeltaResolution):
+        self._slots = []
+        for elem in resolution.split(','):
+            if not (len(elem) == 2 and _letter_ok(elem[0]) and elem[1] in '01234567'):
+                raise ValueError('invalid resolution: {}'.format(elem))
+            if elem[0] in [letter for (letter, digits) in self._slots]:
+                raise ValueError('duplicate resolution letter: {}'.format(elem[0]))
+            self._slots.append((elem[0], int(elem[1])))
+        if len(self._slots) > 6:
+            raise ValueError('too many resolution letters')
+        self._values = [0] * len(self._slots)
+        self._config_written = False
+        self._feedrate = None
+
+    def encode_line(self, line):
+        comment_index = line.find(';')
+        parts = (line[:comment_index] if comment_index >= 0 else line).split()
+        if len(parts) == 0 or parts[0][0] != 'G':
+            return encode_line(line)
+        try:
+            cmd_number = int(parts[0][1:])
+        except ValueError:
+            return encode_line(line)
+        if cmd_number not in (0, 1):
+            return encode_line(line)
+        letters = [letter for (letter, digits) in self._slots]
+        values = {}
+        delta_ok = (cmd_number == 1)
+        for part in parts[1:]:
+            if part[0] not in letters or part[0] in values:
+                delta_ok = False
+                continue
+            value = _quantize(part[1:], self._slots[letters.index(part[0])][1])
+            if value is None:
+                delta_ok = False
+            values[part[0]] = value
+        if not delta_ok:
+            if any(part[0] == 'F' for part in parts[1:]):
+                self._feedrate = None
+            return encode_line(line)
+        packet = ''
+        if not self._config_written:
+            packet += chr((8 << 4) + len(self._slots))
+            for (letter, digits) in self._slots:
+                packet += chr((digits << 5) + (ord(letter) - ord('A')))
+            self._config_written = True
+        if 'F' in values:
+            if values['F'] == self._feedrate:
+                del values['F']
+            else:
+                self._feedrate = values['F']
+        mask = 0
+        payload = ''
+        for (i, letter) in enumerate(letters):
+            if letter not in values:
+                continue
+            mask |= 1 << i
+            delta = (values[letter] - self._values[i] + 2**31) % 2**32 - 2**31
+            payload += _varint((delta << 1) ^ (-1 if delta < 0 else 0))
+            self._values[i] = values[letter]
+        return packet + chr(0x40 + mask) + payload
+
 EncodeFileErrors = (IOError, GcodeSyntaxError)
 
-def encode_file(input_file_name, output_file_name):
+def encode_file(input_file_name, output_file_name, delta_resolution=None):
     line_num = 0
+    if delta_resolution is not None:
+        encode_func = DeltaEncoder(delta_resolution).encode_line
+    else:
+        encode_func = encode_line
     with open(input_file_name, "r") as input_file:
         with open(output_file_name, "w") as output_file:
             for line in input_file:
                 line_num += 1
                 try:
-                    encoded_data = encode_line(line)
+                    encoded_data = encode_func(line)
                 except GcodeSyntaxError as e:
                     e.args = ('line {}: {}'.format(line_num, e.args[0]),)
                     raise
@@ -102,13 +176,42 @@ _SmallCommands = {
 def _letter_ok(ch):
     return (ord(ch) >= ord('A') and ord(ch) <= ord('Z'))
 
+_QuantizeContext = decimal.Context(prec=1000, Emax=999999999, Emin=-999999999)
+
+def _quantize(text, digits):
+    # Returns the value in units of 10^-digits, rounded half away from zero,
+    # or None if it is not a finite number or not in the int32 range.
+    try:
+        value = decimal.Decimal(text)
+    except decimal.InvalidOperation:
+        return None
+    if not value.is_finite():
+        return None
+    if value.is_zero():
+        return 0
+    if value.adjusted() + digits > 10:
+        return None
+    result = int(value.scaleb(digits, context=_QuantizeContext).quantize(decimal.Decimal(1), rounding=decimal.ROUND_HALF_UP, context=_QuantizeContext))
+    if abs(result) > 2**31 - 1:
+        return None
+    return result
+
+def _varint(value):
+    data = ''
+    while value >= 0x80:
+        data += chr((value & 0x7F) | 0x80)
+        value >>= 7
+    return data + chr(value)
+
 def main():
     import argparse
     parser = argparse.ArgumentParser(description='G-code packet for APrinter firmware.')
     parser.add_argument('--input', required=True)
     parser.add_argument('--output', required=True)
+    parser.add_argument('--delta', action='store_true', help='Encode G1 as delta packets.')
+    parser.add_argument('--resolution', default=DefaultDeltaResolution, help='Delta resolution, e.g. {}.'.format(DefaultDeltaResolution))
     args = parser.parse_args()
-    encode_file(args.input, args.output)
+    encode_file(args.input, args.output, args.resolution if args.delta else None)
 
 if __name__ == '__main__':
     main()
@@ -0,0 +1,208 @@
+#!/usr/bin/env python2.7
+
+# Streams a g-code file to the firmware in the framed binary mode (M940),
+# see "Framed serial mode" in README.md. The g-code is packed like by
+# aprinter_encode.py, whole packets are put into frames, and up to the
+# window of frames are sent ahead of the acknowledgements, so that the
+# speed is not limited by the round trip time of the serial link.
+#
+# Example: aprinter_stream.py --port /dev/ttyACM0 --baud 250000 --input file.gcode --delta
+# With the host build: aprinter_stream.py --command './build/aprinter-host 200' --input file.gcode
+
+from __future__ import print_function
+from __future__ import division
+import sys
+import os
+import argparse
+import binascii
+import collections
+import select
+import struct
+import subprocess
+import termios
+import time
+import tty
+import aprinter_encode
+
+FRAME_SYNC = 0xA5
+EOF_PACKET = chr(0xE0)
+
+class StreamError (Exception):
+    pass
+
+def make_frame (seq, payload):
+    body = struct.pack('<BB', seq, len(payload)) + payload
+    return chr(FRAME_SYNC) + body + struct.pack('<H', binascii.crc_hqx(body, 0xFFFF))
+
+def packets (input_file, encode_func):
+    for line_num, line in enumerate(input_file, 1):
+        try:
+            packet = encode_func(line)
+        except aprinter_encode.GcodeSyntaxError as e:
+            raise StreamError('line {}: {}'.format(line_num, e.args[0]))
+        if packet == EOF_PACKET:
+            break
+        if len(packet) > 0:
+            yield packet
+    yield EOF_PACKET
+
+def payloads (packet_iter, max_payload):
+    # Packets must not cross frames. The EOF packet is sent on its own,
+    # so that everything before it is acknowledged in the usual way.
+    payload = ''
+    for packet in packet_iter:
+        if len(packet) > max_payload:
+            raise StreamError('a packet of {} bytes does not fit into a frame'.format(len(packet)))
+        if len(payload) + len(packet) > max_payload or (packet == EOF_PACKET and len(payload) > 0):
+            yield payload
+            payload = ''
+        payload += packet
+    yield payload
+
+class Link (object):
+    def __init__ (self, args):
+        self.proc = None
+        if args.command is not None:
+            self.proc = subprocess.Popen(args.command, shell=True, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+            self.read_fd = self.proc.stdout.fileno()
+            self.write_fd = self.proc.stdin.fileno()
+        else:
+            fd = os.open(args.port, os.O_RDWR | os.O_NOCTTY)
+            tty.setraw(fd)
+            if args.baud is not None:
+                attrs = termios.tcgetattr(fd)
+                speed = getattr(termios, 'B{}'.format(args.baud), None)
+                if speed is None:
+                    raise StreamError('unsupported baud rate {}'.format(args.baud))
+                attrs[4] = attrs[5] = speed
+                termios.tcsetattr(fd, termios.TCSANOW, attrs)
+            self.read_fd = self.write_fd = fd
+        self.line_buffer = ''
+
+    def write (self, data):
+        while len(data) > 0:
+            data = data[os.write(self.write_fd, data):]
+
+    def read_lines (self, timeout):
+        # Returns the complete lines received within the timeout.
+        ready, _, _ = select.select([self.read_fd], [], [], timeout)
+        if not ready:
+            return []
+        data = os.read(self.read_fd, 4096)
+        if len(data) == 0:
+            raise StreamError('connection closed')
+        self.line_buffer += data
+        lines = self.line_buffer.split('\n')
+        self.line_buffer = lines.pop()
+        return [line.rstrip('\r') for line in lines]
+
+    def close (self):
+        if self.proc is not None:
+            self.proc.stdin.close()
+            self.proc.wait()
+
+def enter_framed_mode (link):
+    link.write('M940\n')
+    window = None
+    deadline = time.time() + 5.0
+    while time.time() < deadline:
+        for line in link.read_lines(0.1):
+            if line.startswith('Framed '):
+                fields = dict(field.split(':', 1) for field in line.split()[1:])
+                window, max_payload = int(fields['W']), int(fields['L'])
+            elif line == 'ok':
+                if window is None:
+                    raise StreamError('the firmware does not support the framed mode')
+                return window, max_payload
+            else:
+                print(line)
+    raise StreamError('no reply to M940')
+
+def stream (link, payload_iter, window, timeout):
+    # Go-back-N: frames are sent in order and all unacknowledged ones are
+    # sent again after "rs", or if no acknowledgement came for too long.
+    unacked = collections.deque()
+    next_seq = 0
+    frames = 0
+    resent = 0
+    done = False
+    last_progress = time.time()
+    while not done or len(unacked) > 0:
+        while not done and len(unacked) < window:
+            try:
+                payload = next(payload_iter)
+            except StopIteration:
+                done = True
+                break
+            frame = make_frame(next_seq, payload)
+            link.write(frame)
+            unacked.append((next_seq, frame))
+            next_seq = (next_seq + 1) % 256
+            frames += 1
+        resend = False
+        for line in link.read_lines(0.5):
+            words = line.split()
+            if len(words) == 2 and words[0] in ('ack', 'rs') and words[1].isdigit():
+                seq = int(words[1])
+                if words[0] == 'rs':
+                    seq = (seq - 1) % 256
+                # Everything up to seq is done, if seq is outstanding at all.
+                count = 0
+                for i, (frame_seq, _) in enumerate(unacked):
+                    if frame_seq == seq:
+                        count = i + 1
+                        break
+                for _ in range(count):
+                    unacked.popleft()
+                if count > 0:
+                    last_progress = time.time()
+                if words[0] == 'rs':
+                    resend = True
+            else:
+                print(line)
+        if len(unacked) > 0 and time.time() - last_progress > timeout:
+            resend = True
+        if resend and len(unacked) > 0:
+            for _, frame in unacked:
+                link.write(frame)
+            resent += len(unacked)
+            last_progress = time.time()
+    return frames, resent
+
+def main ():
+    parser = argparse.ArgumentParser(description='Stream g-code to APrinter in the framed binary mode.')
+    parser.add_argument('--port', help='Serial port device.')
+    parser.add_argument('--baud', type=int, help='Baud rate (default: leave as is).')
+    parser.add_argument('--command', help='Talk to the stdin and stdout of this command instead, e.g. the host build.')
+    parser.add_argument('--input', required=True, help='G-code file.')
+    parser.add_argument('--delta', action='store_true', help='Encode G1 as delta packets.')
+    parser.add_argument('--resolution', default=aprinter_encode.DefaultDeltaResolution, help='Delta resolution, e.g. {}.'.format(aprinter_encode.DefaultDeltaResolution))
+    parser.add_argument('--timeout', type=float, default=10.0, help='Seconds without an acknowledgement before sending again.')
+    args = parser.parse_args()
+    if (args.port is None) == (args.command is None):
+        print('ERROR: give either --port or --command', file=sys.stderr)
+        return 1
+
+    if args.delta:
+        encode_func = aprinter_encode.DeltaEncoder(args.resolution).encode_line
+    else:
+        encode_func = aprinter_encode.encode_line
+    link = None
+    try:
+        link = Link(args)
+        window, max_payload = enter_framed_mode(link)
+        with open(args.input, 'r') as input_file:
+            start_time = time.time()
+            frames, resent = stream(link, payloads(packets(input_file, encode_func), max_payload), window, args.timeout)
+        total_time = time.time() - start_time
+        print('Sent {} frames in {:.3f} seconds (window {}, {} sent again).'.format(frames, total_time, window, resent), file=sys.stderr)
+    except (StreamError, IOError, OSError, ValueError) as e:
+        print('ERROR: {}'.format(e), file=sys.stderr)
+        return 1
+    finally:
+        if link is not None:
+            link.close()
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -108,3 +108,11 @@ target_stm32f4() {
 }
 
 #####################################################################################
+
+TARGETS+=( "host" )
+target_host() {
+    PLATFORM=host
+    F_CPU=96000000
+}
+
+#####################################################################################
@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Packs a g-code file for BinaryGcodeParser, like aprinter_encode.py but
+ * much faster. The input is memory-mapped and cut into line-aligned chunks,
+ * which are encoded in parallel and written out in order as they complete.
+ * The output is byte-identical to that of aprinter_encode.py.
+ * With --delta, G1 commands are written as delta packets, whose encoding
+ * depends on the lines before. Chunks are still encoded in parallel from a
+ * fresh delta state. Then, in order, the start of each chunk is encoded
+ * again from the state the previous chunk ended with, until the two states
+ * agree, and the rest of the parallel output is kept. The output is then
+ * byte-identical to that of aprinter_encode.py --delta too.
+ *
+ * Build from the top directory:
+ *   g++ -std=c++11 -O2 -pthread -I. host_stuff/aprinter_encode.cpp -o aprinter_encode
+ * Usage:
+ *   aprinter_encode --input file.gcode --output file.packed [--threads N] [--delta [--resolution X3,Y3,Z3,E4,F0]]
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <thread>
+#include <vector>
+
+#include <aprinter/printer/BinaryGcodeEncoder.h>
+
+using namespace APrinter;
+
+static size_t const ChunkSize = 4 * 1024 * 1024;
+
+static char const *delta_resolution = NULL;
+
+struct Chunk {
+    char const *start;
+    char const *end;
+    std::vector<uint8_t> output;
+    uint64_t num_lines;
+    char const *error;
+    BinaryGcodeDeltaEncoder delta_encoder;
+};
+
+static int encode_line (BinaryGcodeDeltaEncoder *delta_encoder, char const *line, size_t length, uint8_t *out, char const **out_error)
+{
+    return delta_resolution ?
+        delta_encoder->encodeLine(line, length, out, out_error) :
+        BinaryGcodeEncoder::encodeLine(line, length, out, out_error);
+}
+
+static void encode_chunk (Chunk *chunk)
+{
+    chunk->output.clear();
+    chunk->output.reserve((chunk->end - chunk->start) / 2);
+    chunk->num_lines = 0;
+    chunk->error = NULL;
+    
+    if (delta_resolution && !chunk->delta_encoder.init(delta_resolution, &chunk->error)) {
+        return;
+    }
+    
+    uint8_t packet[BinaryGcodeFormat::MaxPacketSize];
+    char const *pos = chunk->start;
+    while (pos != chunk->end) {
+        char const *newline = (char const *)memchr(pos, '\n', chunk->end - pos);
+        char const *line_end = newline ? newline + 1 : chunk->end;
+        chunk->num_lines++;
+        int length = encode_line(&chunk->delta_encoder, pos, line_end - pos, packet, &chunk->error);
+        if (length < 0) {
+            return;
+        }
+        chunk->output.insert(chunk->output.end(), packet, packet + length);
+        pos = line_end;
+    }
+}
+
+// Redoes the output of a chunk encoded by encode_chunk() as if encoding had
+// continued from *encoder, and leaves *encoder at the end state. Only the
+// lines up to where the carried over and the fresh state agree are encoded
+// again; errors do not depend on the state.
+static void continue_chunk (Chunk *chunk, BinaryGcodeDeltaEncoder *encoder)
+{
+    BinaryGcodeDeltaEncoder fresh;
+    char const *error;
+    fresh.init(delta_resolution, &error);
+    
+    std::vector<uint8_t> output;
+    size_t fresh_length = 0;
+    uint8_t packet[BinaryGcodeFormat::MaxPacketSize];
+    char const *pos = chunk->start;
+    while (!encoder->sameState(fresh)) {
+        if (pos == chunk->end) {
+            chunk->output.swap(output);
+            return;
+        }
+        char const *newline = (char const *)memchr(pos, '\n', chunk->end - pos);
+        char const *line_end = newline ? newline + 1 : chunk->end;
+        int length = encoder->encodeLine(pos, line_end - pos, packet, &error);
+        if (length < 0) {
+            chunk->output.swap(output);
+            return;
+        }
+        output.insert(output.end(), packet, packet + length);
+        fresh_length += fresh.encodeLine(pos, line_end - pos, packet, &error);
+        pos = line_end;
+    }
+    output.insert(output.end(), chunk->output.begin() + fresh_length, chunk->output.end());
+    chunk->output.swap(output);
+    *encoder = chunk->delta_encoder;
+}
+
+static void usage (char const *prog)
+{
+    fprintf(stderr, "Usage: %s --input FILE --output FILE [--threads N] [--delta [--resolution SPEC]]\n", prog);
+    exit(2);
+}
+
+int main (int argc, char *argv[])
+{
+    char const *input_path = NULL;
+    char const *output_path = NULL;
+    int num_threads = std::thread::hardware_concurrency();
+    bool delta = false;
+    char const *resolution = BinaryGcodeDeltaEncoder::DefaultResolution;
+    BinaryGcodeDeltaEncoder delta_encoder;
+    
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && !strcmp(argv[i], "--input")) {
+            input_path = argv[++i];
+        } else if (i + 1 < argc && !strcmp(argv[i], "--output")) {
+            output_path = argv[++i];
+        } else if (i + 1 < argc && !strcmp(argv[i], "--threads")) {
+            num_threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--delta")) {
+            delta = true;
+        } else if (i + 1 < argc && !strcmp(argv[i], "--resolution")) {
+            resolution = argv[++i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (!input_path || !output_path) {
+        usage(argv[0]);
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if (delta) {
+        char const *error;
+        if (!delta_encoder.init(resolution, &error)) {
+            fprintf(stderr, "--resolution: %s\n", error);
+            return 1;
+        }
+        delta_resolution = resolution;
+    }
+    
+    int fd = open(input_path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", input_path, strerror(errno));
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", input_path, strerror(errno));
+        return 1;
+    }
+    size_t size = st.st_size;
+    char const *data = NULL;
+    if (size > 0) {
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "%s: %s\n", input_path, strerror(errno));
+            return 1;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        data = (char const *)map;
+    }
+    
+    FILE *out = fopen(output_path, "wb");
+    if (!out) {
+        fprintf(stderr, "%s: %s\n", output_path, strerror(errno));
+        return 1;
+    }
+    
+    std::vector<Chunk> chunks(num_threads);
+    std::vector<std::thread> threads;
+    char const *pos = data;
+    char const *end = data + size;
+    uint64_t lines_before = 0;
+    
+    while (pos != end) {
+        int num_chunks = 0;
+        while (num_chunks < num_threads && pos != end) {
+            char const *chunk_end = end;
+            if ((size_t)(end - pos) > ChunkSize) {
+                char const *newline = (char const *)memchr(pos + ChunkSize, '\n', end - (pos + ChunkSize));
+                if (newline) {
+                    chunk_end = newline + 1;
+                }
+            }
+            chunks[num_chunks].start = pos;
+            chunks[num_chunks].end = chunk_end;
+            num_chunks++;
+            pos = chunk_end;
+        }
+        
+        threads.clear();
+        for (int i = 1; i < num_chunks; i++) {
+            threads.push_back(std::thread(encode_chunk, &chunks[i]));
+        }
+        encode_chunk(&chunks[0]);
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        
+        for (int i = 0; i < num_chunks; i++) {
+            Chunk *chunk = &chunks[i];
+            if (delta_resolution) {
+                continue_chunk(chunk, &delta_encoder);
+            }
+            if (fwrite(chunk->output.data(), 1, chunk->output.size(), out) != chunk->output.size()) {
+                fprintf(stderr, "%s: write failed\n", output_path);
+                return 1;
+            }
+            if (chunk->error) {
+                fprintf(stderr, "line %llu: %s\n", (unsigned long long)(lines_before + chunk->num_lines), chunk->error);
+                return 1;
+            }
+            lines_before += chunk->num_lines;
+        }
+    }
+    
+    uint8_t eof = BinaryGcodeFormat::EofPacket;
+    if (fwrite(&eof, 1, 1, out) != 1 || fclose(out) != 0) {
+        fprintf(stderr, "%s: write failed\n", output_path);
+        return 1;
+    }
+    
+    return 0;
+}
@@ -0,0 +1,98 @@
+#!/usr/bin/env python2.7
+
+# Decodes a log written to the SD card with M928, printing one line per
+# record with the time in seconds since the first record, the number of
+# records dropped before it, the step underrun count and the temperature
+# and target of each heater (0 when off).
+#
+# Log format: 512-byte blocks of little-endian records, none crossing a
+# block; a zero type byte pads the rest of a block. The first record is
+# the header: 'H', version, number of heaters, data record size, clock
+# frequency (float), then one name character per heater. Data records:
+# 'D', 0, dropped (uint16), clock time (uint32), underruns (uint32), then
+# temperature and target (floats) per heater.
+#
+# Example: decode_sd_log.py LOG.BIN
+
+from __future__ import print_function
+from __future__ import division
+import sys
+import argparse
+import struct
+
+BLOCK_SIZE = 512
+VERSION = 1
+
+class LogError (Exception):
+    pass
+
+def parse_header (record):
+    version, num_heaters, record_size, freq = struct.unpack_from('<BBBf', record, 1)
+    if version != VERSION:
+        raise LogError('unsupported version {}'.format(version))
+    if record_size != 12 + 8 * num_heaters:
+        raise LogError('bad record size {}'.format(record_size))
+    names = [chr(x) for x in bytearray(record[8:8 + num_heaters])]
+    return {'record_size': record_size, 'freq': freq, 'names': names}
+
+def records (data):
+    header = None
+    for block_start in range(0, len(data), BLOCK_SIZE):
+        block = data[block_start:block_start + BLOCK_SIZE]
+        pos = 0
+        while pos < len(block) and block[pos:pos + 1] != b'\x00':
+            kind = block[pos:pos + 1]
+            if kind == b'H':
+                if pos + 8 > len(block):
+                    raise LogError('truncated header')
+                size = 8 + bytearray(block)[pos + 2]
+            elif kind == b'D':
+                if header is None:
+                    raise LogError('data record before the header')
+                size = header['record_size']
+            else:
+                raise LogError('bad record type at offset {}'.format(block_start + pos))
+            if pos + size > len(block):
+                raise LogError('truncated record at offset {}'.format(block_start + pos))
+            record = block[pos:pos + size]
+            if kind == b'H':
+                header = parse_header(record)
+            yield header, kind, record
+            pos += size
+
+def main ():
+    parser = argparse.ArgumentParser(description='Decode a log written with M928.')
+    parser.add_argument('log', help='Log file copied from the SD card.')
+    args = parser.parse_args()
+
+    with open(args.log, 'rb') as f:
+        data = f.read()
+    last_time = None
+    elapsed = 0
+    try:
+        for header, kind, record in records(data):
+            if kind == b'H':
+                last_time = None
+                columns = ['time', 'dropped', 'underruns']
+                for name in header['names']:
+                    columns += [name, name + '_target']
+                print(' '.join(columns))
+                continue
+            dropped, time, underruns = struct.unpack_from('<HII', record, 2)
+            # The clock wraps around, so add up the differences.
+            if last_time is None:
+                elapsed = 0
+            else:
+                elapsed += (time - last_time) & 0xFFFFFFFF
+            last_time = time
+            values = struct.unpack_from('<{}f'.format(2 * len(header['names'])), record, 12)
+            fields = ['{:.3f}'.format(elapsed / header['freq']), str(dropped), str(underruns)]
+            fields += ['{:.2f}'.format(v) for v in values]
+            print(' '.join(fields))
+    except LogError as e:
+        print('ERROR: {}'.format(e), file=sys.stderr)
+        return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
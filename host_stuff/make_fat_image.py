@@ -0,0 +1,166 @@
+#!/usr/bin/env python2.7
+
+# Creates an SD card image with a FAT32 file system holding the given
+# files in its root directory, for trying out SD printing in the host
+# build. Names are converted to upper case 8.3 names. By default there is
+# an MBR with a single partition; --no-mbr puts the file system at block 0.
+# With --fragment, the clusters of the files are interleaved, so that
+# reading them has to follow the cluster chains. The FSInfo sector holds
+# the free cluster count and the first free cluster as the allocation
+# hint. The boot sector and FSInfo have backup copies, as mkfs makes them.
+#
+# Example: make_fat_image.py --output sd.img print.gcode
+
+from __future__ import print_function
+from __future__ import division
+import sys
+import os
+import argparse
+import struct
+
+BLOCK_SIZE = 512
+PARTITION_START = 2048
+RESERVED_BLOCKS = 32
+NUM_FATS = 2
+ROOT_CLUSTER = 2
+DIR_ENTRY_SIZE = 32
+END_OF_CHAIN = 0x0FFFFFFF
+FSINFO_BLOCK = 1
+BACKUP_BOOT_BLOCK = 6
+
+def short_name (path):
+    base = os.path.basename(path).upper()
+    if '.' in base:
+        name, ext = base.rsplit('.', 1)
+    else:
+        name, ext = base, ''
+    if len(name) == 0 or len(name) > 8 or len(ext) > 3 or ' ' in base or '.' in name:
+        raise ValueError('{} does not have an 8.3 name'.format(path))
+    return (name.ljust(8) + ext.ljust(3)).encode('ascii')
+
+def make_image (files, size, cluster_blocks, mbr, fragment):
+    total_blocks = size // BLOCK_SIZE
+    base = PARTITION_START if mbr else 0
+    fs_blocks = total_blocks - base
+
+    # The FAT must have an entry for every cluster, plus the two reserved ones.
+    fat_size = 1
+    while True:
+        data_blocks = fs_blocks - RESERVED_BLOCKS - NUM_FATS * fat_size
+        num_clusters = data_blocks // cluster_blocks
+        if (num_clusters + 2) * 4 <= fat_size * BLOCK_SIZE:
+            break
+        fat_size += 1
+    data_start = base + RESERVED_BLOCKS + NUM_FATS * fat_size
+    cluster_bytes = cluster_blocks * BLOCK_SIZE
+
+    fat = [0] * (num_clusters + 2)
+    fat[0] = 0x0FFFFFF8
+    fat[1] = END_OF_CHAIN
+
+    # Assign clusters to files, after the first cluster of the root directory.
+    contents = [open(path, 'rb').read() for path in files]
+    counts = [max(1, (len(data) + cluster_bytes - 1) // cluster_bytes) for data in contents]
+    root_count = ((1 + len(files)) * DIR_ENTRY_SIZE + cluster_bytes - 1) // cluster_bytes
+    chains = [[] for _ in files]
+    root_chain = [ROOT_CLUSTER]
+    next_cluster = ROOT_CLUSTER + 1
+    if fragment:
+        remaining = list(counts)
+        while any(remaining):
+            for i in range(len(files)):
+                if remaining[i] > 0:
+                    chains[i].append(next_cluster)
+                    # Leave a free cluster in between, so no two are adjacent.
+                    next_cluster += 2
+                    remaining[i] -= 1
+    else:
+        root_chain += list(range(next_cluster, next_cluster + root_count - 1))
+        next_cluster += root_count - 1
+        for i in range(len(files)):
+            chains[i] = list(range(next_cluster, next_cluster + counts[i]))
+            next_cluster += counts[i]
+    # With fragmentation, the rest of the root directory comes after the files.
+    while len(root_chain) < root_count:
+        root_chain.append(next_cluster)
+        next_cluster += 1
+    if next_cluster > num_clusters + 2:
+        raise ValueError('files do not fit into the image')
+
+    image = bytearray(total_blocks * BLOCK_SIZE)
+
+    def write_chain (chain, data):
+        for j, cluster in enumerate(chain):
+            fat[cluster] = chain[j + 1] if j + 1 < len(chain) else END_OF_CHAIN
+            chunk = data[j * cluster_bytes:(j + 1) * cluster_bytes]
+            offset = (data_start + (cluster - 2) * cluster_blocks) * BLOCK_SIZE
+            image[offset:offset + len(chunk)] = chunk
+
+    entries = bytearray()
+    entries += b'APRINTER   ' + struct.pack('<B', 0x08) + bytearray(20)
+    for path, data, chain in zip(files, contents, chains):
+        write_chain(chain, data)
+        first = chain[0] if len(data) > 0 else 0
+        entries += short_name(path) + struct.pack('<BBBHHHHHHHI',
+            0x20, 0, 0, 0, 0, 0, first >> 16, 0, 0, first & 0xFFFF, len(data))
+    write_chain(root_chain, entries)
+
+    fat_bytes = struct.pack('<{}I'.format(len(fat)), *fat)
+    for i in range(NUM_FATS):
+        offset = (base + RESERVED_BLOCKS + i * fat_size) * BLOCK_SIZE
+        image[offset:offset + len(fat_bytes)] = fat_bytes
+
+    boot = bytearray(BLOCK_SIZE)
+    boot[0:3] = b'\xEB\x58\x90'
+    boot[3:11] = b'APRINTER'
+    struct.pack_into('<HBHBHHBHHHII', boot, 11,
+        BLOCK_SIZE, cluster_blocks, RESERVED_BLOCKS, NUM_FATS, 0, 0, 0xF8, 0, 63, 255, base, fs_blocks)
+    struct.pack_into('<IHHIHH', boot, 36, fat_size, 0, 0, ROOT_CLUSTER, FSINFO_BLOCK, BACKUP_BOOT_BLOCK)
+    struct.pack_into('<BBBI', boot, 64, 0x80, 0, 0x29, 0x12345678)
+    boot[71:82] = b'NO NAME    '
+    boot[82:90] = b'FAT32   '
+    boot[510:512] = b'\x55\xAA'
+
+    free_count = fat.count(0)
+    first_free = fat.index(0) if free_count > 0 else 0xFFFFFFFF
+    fsinfo = bytearray(BLOCK_SIZE)
+    struct.pack_into('<I', fsinfo, 0, 0x41615252)
+    struct.pack_into('<III', fsinfo, 484, 0x61417272, free_count, first_free)
+    struct.pack_into('<I', fsinfo, 508, 0xAA550000)
+
+    for start in (base, base + BACKUP_BOOT_BLOCK):
+        image[start * BLOCK_SIZE:(start + 1) * BLOCK_SIZE] = boot
+        image[(start + FSINFO_BLOCK) * BLOCK_SIZE:(start + FSINFO_BLOCK + 1) * BLOCK_SIZE] = fsinfo
+
+    if mbr:
+        # The CHS fields are not used by anyone; LBA only.
+        entry = struct.pack('<B3sB3sII', 0, b'\xFE\xFF\xFF', 0x0C, b'\xFE\xFF\xFF', base, fs_blocks)
+        image[446:446 + 16] = entry
+        image[510:512] = b'\x55\xAA'
+
+    return image
+
+def main ():
+    parser = argparse.ArgumentParser(description='Create a FAT32 SD card image.')
+    parser.add_argument('--output', required=True, help='Image file to write.')
+    parser.add_argument('--size', type=int, default=64, help='Image size in MiB.')
+    parser.add_argument('--cluster-blocks', type=int, default=8, help='Blocks per cluster (power of two).')
+    parser.add_argument('--no-mbr', action='store_true', help='No partition table, file system at block 0.')
+    parser.add_argument('--fragment', action='store_true', help='Interleave the clusters of the files.')
+    parser.add_argument('files', nargs='*', help='Files to put into the root directory.')
+    args = parser.parse_args()
+
+    if args.cluster_blocks not in (1, 2, 4, 8, 16, 32, 64, 128):
+        print('--cluster-blocks must be a power of two up to 128', file=sys.stderr)
+        return 1
+    try:
+        image = make_image(args.files, args.size * 1024 * 1024, args.cluster_blocks, not args.no_mbr, args.fragment)
+    except ValueError as e:
+        print('ERROR: {}'.format(e), file=sys.stderr)
+        return 1
+    with open(args.output, 'wb') as f:
+        f.write(image)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,263 @@
+#!/usr/bin/env python2.7
+
+# Analyzes a step trace recorded by the Steppers trace feature (see
+# aprinter-host.cpp). Per axis, it rebuilds position, velocity and
+# acceleration from the step times, and reports peak values, the shortest
+# step interval and the largest jump between consecutive step intervals.
+# Given the G-code that was run, it also checks the net displacement of
+# each axis and that no axis moved faster than it was commanded to.
+# G2/G3 arcs are taken to be in the XY plane, like the firmware does.
+#
+# Trace format: "# freq F" and "# axis INDEX NAME STEPS_PER_UNIT" header
+# lines, then one "TIME INDEX DIR" line per step, and "# overruns N".
+
+from __future__ import print_function
+from __future__ import division
+import sys
+import argparse
+import math
+
+class Axis (object):
+    def __init__ (self, index, name, steps_per_unit):
+        self.index = index
+        self.name = name
+        self.steps_per_unit = steps_per_unit
+        self.times = []
+        self.dirs = []
+
+def read_trace (path):
+    freq = None
+    axes = {}
+    overruns = 0
+    time_hi = 0
+    last_time = None
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) == 0:
+                continue
+            if fields[0] == '#':
+                if fields[1] == 'freq':
+                    freq = float(fields[2])
+                elif fields[1] == 'axis':
+                    index = int(fields[2])
+                    axes[index] = Axis(index, fields[3], float(fields[4]))
+                elif fields[1] == 'overruns':
+                    overruns = int(fields[2])
+                continue
+            time = int(fields[0])
+            # The firmware clock is 32-bit; entries are in time order.
+            if last_time is not None and time + time_hi < last_time - 2**31:
+                time_hi += 2**32
+            time += time_hi
+            last_time = time
+            axes[int(fields[1])].times.append(time)
+            axes[int(fields[1])].dirs.append(int(fields[2]))
+    if freq is None:
+        raise ValueError('trace has no freq header')
+    return (freq, [axes[i] for i in sorted(axes)], overruns)
+
+def analyze_axis (axis, freq, window, stop_time):
+    res = {
+        'steps_pos': 0, 'steps_neg': 0, 'reversals': 0,
+        'min_interval': None, 'peak_rate': 0.0, 'peak_velocity': 0.0, 'peak_accel': 0.0,
+        'max_jump': 0.0, 'max_jump_time': None,
+    }
+    stop_ticks = stop_time * freq
+    prev_v = None
+    run_start = 0
+    for i in range(len(axis.times)):
+        if axis.dirs[i]:
+            res['steps_pos'] += 1
+        else:
+            res['steps_neg'] += 1
+        if i == 0:
+            continue
+        dt = axis.times[i] - axis.times[i - 1]
+        # A direction change or a long pause starts a new run; velocity
+        # and acceleration are only computed within runs.
+        if axis.dirs[i] != axis.dirs[i - 1] or dt > stop_ticks:
+            if axis.dirs[i] != axis.dirs[i - 1]:
+                res['reversals'] += 1
+            run_start = i
+            prev_v = None
+            continue
+        if res['min_interval'] is None or dt < res['min_interval']:
+            res['min_interval'] = dt
+        if i - run_start >= 2:
+            prev_dt = axis.times[i - 1] - axis.times[i - 2]
+            if dt > 0 and prev_dt > 0:
+                jump = abs(dt - prev_dt) / min(dt, prev_dt)
+                if jump > res['max_jump']:
+                    res['max_jump'] = jump
+                    res['max_jump_time'] = axis.times[i] / freq
+        if i - run_start < window:
+            continue
+        span = axis.times[i] - axis.times[i - window]
+        if span <= 0:
+            continue
+        rate = window * freq / span
+        v = rate / axis.steps_per_unit
+        t = (axis.times[i] + axis.times[i - window]) / (2 * freq)
+        res['peak_rate'] = max(res['peak_rate'], rate)
+        res['peak_velocity'] = max(res['peak_velocity'], v)
+        if prev_v is not None and i - prev_v[2] >= window:
+            if t > prev_v[0]:
+                res['peak_accel'] = max(res['peak_accel'], abs(v - prev_v[1]) / (t - prev_v[0]))
+            prev_v = (t, v, i)
+        elif prev_v is None:
+            prev_v = (t, v, i)
+    return res
+
+def arc_peak (a0, sweep, phase):
+    # Largest |cos(a - phase)| for a from a0 to a0 + sweep.
+    lo, hi = sorted((a0, a0 + sweep))
+    if phase + math.ceil((lo - phase) / math.pi) * math.pi <= hi:
+        return 1.0
+    return max(abs(math.cos(lo - phase)), abs(math.cos(hi - phase)))
+
+def arc_geometry (params, clockwise, dx, dy):
+    # Returns the radius, start angle and signed sweep of an arc in the XY
+    # plane, the same way the firmware does for G2/G3.
+    if 'R' in params:
+        r = params['R']
+        d2 = dx * dx + dy * dy
+        if not d2 > 0.0:
+            raise ValueError('arc with R needs distinct end points')
+        h = math.sqrt(max(0.0, 4.0 * r * r / d2 - 1.0))
+        if clockwise != (r < 0.0):
+            h = -h
+        i = 0.5 * (dx - dy * h)
+        j = 0.5 * (dy + dx * h)
+    else:
+        i = params.get('I', 0.0) or 0.0
+        j = params.get('J', 0.0) or 0.0
+    if i == 0.0 and j == 0.0:
+        raise ValueError('arc without a center')
+    ex = dx - i
+    ey = dy - j
+    sweep = math.atan2(j * ex - i * ey, -i * ex - j * ey)
+    # Equal start and end points make a full circle.
+    if clockwise and sweep >= -1e-6:
+        sweep -= 2 * math.pi
+    elif not clockwise and sweep <= 1e-6:
+        sweep += 2 * math.pi
+    return (math.hypot(i, j), math.atan2(-j, -i), sweep)
+
+def read_gcode (path, axis_names):
+    pos = dict((name, 0.0) for name in axis_names)
+    start = None
+    relative = False
+    e_relative = False
+    feedrate = None
+    max_speed = dict((name, 0.0) for name in axis_names)
+    with open(path) as f:
+        for line in f:
+            line = line.split(';')[0].strip()
+            if len(line) == 0:
+                continue
+            words = line.upper().split()
+            cmd = words[0]
+            params = {}
+            for word in words[1:]:
+                params[word[0]] = float(word[1:]) if len(word) > 1 else None
+            if cmd == 'G90':
+                relative = False
+                e_relative = False
+            elif cmd == 'G91':
+                relative = True
+                e_relative = True
+            elif cmd == 'M82':
+                e_relative = False
+            elif cmd == 'M83':
+                e_relative = True
+            elif cmd == 'G28':
+                raise ValueError('G28 is not supported, set the position with G92 instead')
+            elif cmd == 'G92':
+                if start is not None:
+                    raise ValueError('G92 is only supported before the first move')
+                for name in axis_names:
+                    if name in params:
+                        pos[name] = params[name]
+            elif cmd in ('G0', 'G1', 'G2', 'G3'):
+                if start is None:
+                    start = dict(pos)
+                if 'F' in params:
+                    feedrate = params['F'] / 60.0
+                new_pos = dict(pos)
+                for name in axis_names:
+                    if name in params:
+                        rel = e_relative if name == 'E' else relative
+                        new_pos[name] = pos[name] + params[name] if rel else params[name]
+                delta = dict((name, new_pos[name] - pos[name]) for name in axis_names)
+                # Per axis, the largest share of the path length which that axis
+                # takes at any point; for arcs, X and Y follow the tangent.
+                share = dict((name, abs(delta[name])) for name in axis_names)
+                plane_length = math.hypot(delta['X'], delta['Y'])
+                if cmd in ('G2', 'G3'):
+                    r, a0, sweep = arc_geometry(params, cmd == 'G2', delta['X'], delta['Y'])
+                    plane_length = r * abs(sweep)
+                    share['X'] = plane_length * arc_peak(a0, sweep, math.pi / 2)
+                    share['Y'] = plane_length * arc_peak(a0, sweep, 0.0)
+                others = [name for name in axis_names if name not in ('X', 'Y', 'E')]
+                distance = math.sqrt(plane_length**2 + sum(delta[name]**2 for name in others))
+                if distance == 0.0:
+                    distance = abs(delta.get('E', 0.0))
+                if feedrate is not None and distance > 0.0:
+                    for name in axis_names:
+                        max_speed[name] = max(max_speed[name], feedrate * share[name] / distance)
+                pos = new_pos
+    if start is None:
+        start = dict(pos)
+    return (dict((name, pos[name] - start[name]) for name in axis_names), max_speed)
+
+def main ():
+    parser = argparse.ArgumentParser(description='Analyze an APrinter step trace.')
+    parser.add_argument('trace', help='Step trace file.')
+    parser.add_argument('--gcode', help='G-code which was run, to check against.')
+    parser.add_argument('--max-rate', type=float, help='Step rate (steps/s) to report saturation against.')
+    parser.add_argument('--window', type=int, default=16, help='Steps per velocity sample.')
+    parser.add_argument('--stop-time', type=float, default=0.05, help='Step interval (s) considered a stop.')
+    parser.add_argument('--tolerance', type=float, default=0.02, help='Relative tolerance for speed checks.')
+    args = parser.parse_args()
+
+    freq, axes, overruns = read_trace(args.trace)
+    ok = True
+    if overruns > 0:
+        print('ERROR: {} steps were lost to trace buffer overruns'.format(overruns))
+        ok = False
+
+    expected = None
+    if args.gcode is not None:
+        expected, max_speed = read_gcode(args.gcode, [axis.name for axis in axes])
+
+    for axis in axes:
+        res = analyze_axis(axis, freq, args.window, args.stop_time)
+        net = res['steps_pos'] - res['steps_neg']
+        print('{}: steps +{} -{} net {} ({:.4f} units) reversals {}'.format(
+            axis.name, res['steps_pos'], res['steps_neg'], net, net / axis.steps_per_unit, res['reversals']))
+        if res['min_interval'] is not None:
+            print('  min interval {} ticks ({:.2f} us), peak rate {:.0f} steps/s'.format(
+                res['min_interval'], res['min_interval'] * 1e6 / freq, res['peak_rate']))
+            print('  peak velocity {:.3f} units/s, peak accel {:.1f} units/s^2'.format(
+                res['peak_velocity'], res['peak_accel']))
+            if res['max_jump_time'] is not None:
+                print('  max step interval jump {:.1f}% at t={:.6f}s'.format(100 * res['max_jump'], res['max_jump_time']))
+        if args.max_rate is not None and res['peak_rate'] > args.max_rate * (1 - args.tolerance):
+            print('  WARNING: step rate saturates at {:.0f} of max {:.0f} steps/s'.format(res['peak_rate'], args.max_rate))
+        if expected is not None:
+            want = int(round(expected[axis.name] * axis.steps_per_unit))
+            if abs(net - want) > 1:
+                print('  ERROR: net steps {} but G-code commands {}'.format(net, want))
+                ok = False
+            # The first step of each stepper command may be off by a fraction
+            # of an interval, so a window may be short by up to one step.
+            limit = max_speed[axis.name] * (1 + args.tolerance + 1 / args.window)
+            if res['peak_velocity'] > limit:
+                print('  ERROR: peak velocity {:.3f} exceeds commanded {:.3f} units/s'.format(res['peak_velocity'], max_speed[axis.name]))
+                ok = False
+
+    return 0 if ok else 1
+
+if __name__ == '__main__':
+    sys.exit(main())
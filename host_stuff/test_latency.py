@@ -1,8 +1,14 @@
 #!/usr/bin/python2.7 -B
 
+# Measures how many commands per second go through the serial port, sending
+# one command at a time ("single"), and keeping as many commands in flight
+# as fit into the receive buffer, as reported by M941 ("credits").
+
 from __future__ import print_function
 import sys
 import argparse
+import collections
+import subprocess
 import time
 import littlevent.close
 import littlevent.error
@@ -15,32 +21,50 @@ class Program (littlevent.close.Obj):
         littlevent.close.Obj.__init__ (self)
         try:
             parser = argparse.ArgumentParser(description='Test 3D printer serial port latency.')
-            parser.add_argument('--port', required=True, help='Serial port device.')
-            parser.add_argument('--baud', type=int, required=True, help='Baud rate.')
+            parser.add_argument('--port', help='Serial port device.')
+            parser.add_argument('--baud', type=int, help='Baud rate.')
+            parser.add_argument('--command', help='Talk to the stdin and stdout of this command instead, e.g. the host build.')
             parser.add_argument('--count', type=int, default=5000, help='Number of commands.')
+            parser.add_argument('--mode', choices=['single', 'credits', 'both'], default='both', help='How to send the commands.')
             args = parser.parse_args()
-            print(args.port)
-            print(args.baud)
+            if (args.port is None) == (args.command is None):
+                raise littlevent.error.Error('give either --port and --baud, or --command')
             
             self.loop = self.add(littlevent.loop.Loop())
-            self.serial = self.add(littlevent.serial.Serial(self.loop, args.port, args.baud, self._error_handler))
-            self.serial.read_io().read_set_handler(self._read_handler)
-            self.serial.write_io().write_set_handler(self._write_handler)
+            if args.command is not None:
+                print(args.command)
+                self.proc = subprocess.Popen(args.command, shell=True, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+                self.add(self._close_command)
+                self.read_io = self.add(littlevent.fd_io.FileDescriptor(self.loop, self.proc.stdout.fileno(), False, self._error_handler))
+                self.write_io = self.add(littlevent.fd_io.FileDescriptor(self.loop, self.proc.stdin.fileno(), False, self._error_handler))
+            else:
+                print(args.port)
+                print(args.baud)
+                self.serial = self.add(littlevent.serial.Serial(self.loop, args.port, args.baud, self._error_handler))
+                self.read_io = self.serial.read_io()
+                self.write_io = self.serial.write_io()
+            self.read_io.read_set_handler(self._read_handler)
+            self.write_io.write_set_handler(self._write_handler)
             
             self.want_count = args.count
-            self.done_count = 0
+            self.phases = ['single', 'credits'] if args.mode == 'both' else [args.mode]
             self.writing = False
-            self.start_time = time.time()
+            self.write_queue = ''
             self.frame = ''
+            self.results = []
             
             self._read()
-            self._write()
-            
+            self._start_phase()
+        
         except littlevent.error.Error as e:
             self.close()
             print('ERROR: {}'.format(e))
             sys.exit(1)
     
+    def _close_command (self):
+        self.proc.stdin.close()
+        self.proc.wait()
+    
     def _error_handler (self, returned_events):
         print('ERROR: unexpected event.')
         self._quit()
@@ -60,43 +84,111 @@ class Program (littlevent.close.Obj):
             data = data[(newline_pos + 1):]
             if len(response) > 0 and response[-1] == '\r':
                 response = response[:-1]
-            if response != 'ok':
-                print('Unknown line received: >{}<'.format(response))
-            else:
-                if self.writing:
+            if self.state == 'configuring':
+                # Wait for the reply to M941.
+                if response.startswith('Credits '):
+                    fields = dict(field.split(':', 1) for field in response.split()[1:])
+                    self.capacity = int(fields['B'])
+                elif response.startswith('ok'):
+                    if self.capacity is None:
+                        print('ERROR: no credits reported, M941 not supported?')
+                        return self._quit()
+                    self.state = 'running'
+                    self.start_time = time.time()
+                    self._send_more()
+                else:
+                    print('Unknown line received: >{}<'.format(response))
+            elif self.state == 'restoring':
+                if response.startswith('ok'):
+                    return self._next_phase()
+            elif response == 'ok' or (self.phase == 'credits' and response.startswith('ok ')):
+                if self.phase == 'single' and self.writing:
                     print('ERROR: early response')
                     return self._quit()
                 self.done_count += 1
+                if self.phase == 'credits':
+                    self.in_flight -= self.in_flight_lengths.popleft()
                 if self.done_count >= self.want_count:
                     return self._finished()
-                self._write()
-        
+                self._send_more()
+            else:
+                print('Unknown line received: >{}<'.format(response))
+    
     def _write_handler (self, err):
         assert self.writing
         if err is not None:
             print('ERROR: write error: {}'.format(err))
             return self._quit()
         self.writing = False
+        if len(self.write_queue) > 0:
+            self._flush()
     
     def _read (self):
-        self.serial.read_io().read_start(512)
+        self.read_io.read_start(512)
     
-    def _write (self):
-        assert not self.writing
-        msg = 'G1\n'
-        self.serial.write_io().write_start(msg)
+    def _write (self, msg):
+        self.write_queue += msg
+        if not self.writing:
+            self._flush()
+    
+    def _flush (self):
+        self.write_io.write_start(self.write_queue)
+        self.write_queue = ''
         self.writing = True
     
+    def _send_more (self):
+        msg = 'G1\n'
+        if self.phase == 'single':
+            self.sent_count += 1
+            return self._write(msg)
+        # Keep at most the receive buffer capacity of unanswered bytes.
+        batch = ''
+        while self.sent_count < self.want_count and self.in_flight + len(msg) <= self.capacity:
+            batch += msg
+            self.in_flight += len(msg)
+            self.in_flight_lengths.append(len(msg))
+            self.sent_count += 1
+        if len(batch) > 0:
+            self._write(batch)
+    
+    def _start_phase (self):
+        self.phase = self.phases.pop(0)
+        self.done_count = 0
+        self.sent_count = 0
+        if self.phase == 'single':
+            self.state = 'running'
+            self.start_time = time.time()
+            self._send_more()
+        else:
+            self.state = 'configuring'
+            self.capacity = None
+            self.in_flight = 0
+            self.in_flight_lengths = collections.deque()
+            self._write('M941\n')
+    
+    def _next_phase (self):
+        if len(self.phases) > 0:
+            return self._start_phase()
+        if len(self.results) == 2:
+            print('Credits are {:.2f} times faster.'.format(self.results[1] / self.results[0]))
+        self.loop.quit(0)
+    
     def _quit (self):
         print('Quitting.')
         self.loop.quit(1)
     
     def _finished (self):
         total_time = time.time() - self.start_time
-        print('Done {} requests in {} seconds.'.format(self.done_count, total_time))
-        print('Average request time is {} seconds.'.format(total_time / self.done_count))
-        self.loop.quit(0)
-    
+        rate = self.done_count / total_time
+        self.results.append(rate)
+        print('{}: done {} requests in {} seconds.'.format(self.phase, self.done_count, total_time))
+        print('{}: average request time is {} seconds, {:.1f} commands per second.'.format(self.phase, total_time / self.done_count, rate))
+        if self.phase == 'credits':
+            self.state = 'restoring'
+            self._write('M941 S0\n')
+        else:
+            self._next_phase()
+
 p = Program()
 ret = p.loop.run()
 p.close()
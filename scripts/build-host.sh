@@ -0,0 +1,79 @@
+#!/usr/bin/env bash
+# 
+# Simple build script crafted for the APrinter project to support multiple 
+# architecture targets and build actions using an elegant commandline.
+# 
+# Copyright (c) 2014 Bernard `Guyzmo` Pratz
+# All rights reserved.
+# 
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+# 
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+# DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+# 
+#####################################################################################
+# Host (Linux simulation)
+
+configure_host() {
+    HOST_CXX=${CUSTOM_HOST_CXX:-g++}
+
+    FLAGS_CXX=(
+        -std=c++11 -O2
+        -DF_CPU=${F_CPU}
+        -D__STDC_LIMIT_MACROS -D__STDC_FORMAT_MACROS -D__STDC_CONSTANT_MACROS
+        -I.
+    )
+
+    if [ -n "${HOST_ASSERTIONS}" ]; then
+        FLAGS_CXX+=( -DAMBROLIB_ASSERTIONS )
+    else
+        FLAGS_CXX+=( -DNDEBUG )
+    fi
+
+    CXX_SOURCES=(
+        ${SOURCE}
+        "aprinter/platform/linux/linux_support.cpp"
+    )
+
+    # define target functions
+    INSTALL=install_host
+    RUNBUILD=build_host
+    UPLOAD=upload_host
+    CHECK=check_depends_host
+}
+
+check_depends_host() {
+    echo -n "   Checking depends: "
+    check_build_tool "${HOST_CXX}" || fail "Missing host C++ compiler"
+    echo "Ok"
+}
+
+install_host() {
+    echo "   [!] Nothing to install for host builds"
+}
+
+build_host() {
+    echo "  Compiling for host"
+    ${CHECK}
+    create_build_dir
+
+    ( $V ; "${HOST_CXX}" "${FLAGS_CXX[@]}" ${CXXFLAGS} "${CXX_SOURCES[@]}" -o "${TARGET}" -lm ${LDFLAGS} )
+}
+
+upload_host() {
+    echo "  Host target is not uploadable; run ${TARGET} directly"
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures how fast ArcSplitter produces chord end points, compared with
+ * computing sin and cos for each point as the first version of it did.
+ * The firmware's FpType is float or double, and both are measured. The
+ * arcs are of the kind a slicer emits: a mix of radii and angles, with the
+ * firmware's default chord tolerance, so that most arcs have tens to
+ * hundreds of chords.
+ *
+ * Build and run from the top directory:
+ *   g++ -std=c++11 -O2 -I. tests/arc_splitter_benchmark.cpp \
+ *       -o arc_splitter_benchmark && ./arc_splitter_benchmark
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+
+#include <aprinter/meta/WrapDouble.h>
+#include <aprinter/math/FloatTools.h>
+#include <aprinter/printer/ArcSplitter.h>
+
+using namespace APrinter;
+
+using ChordTolerance = AMBRO_WRAP_DOUBLE(0.01);
+using MinSegmentLength = AMBRO_WRAP_DOUBLE(0.2);
+using Params = ArcSplitterParams<ChordTolerance, MinSegmentLength>;
+
+static int const NumArcs = 200000;
+
+// The same interface as ArcSplitter, with sin and cos for every point.
+template <typename Params, typename FpType>
+class NaiveArcSplitter {
+public:
+    void start (FpType x, FpType y, FpType angle)
+    {
+        FpType radius = FloatSqrt(x * x + y * y);
+        FpType abs_angle = FloatAbs(angle);
+        FpType fpcount = FloatMin(
+            abs_angle * FloatSqrt(radius * (FpType)(1.0 / (8.0 * Params::ChordTolerance::value()))),
+            abs_angle * radius * (FpType)(1.0 / Params::MinSegmentLength::value())
+        );
+        m_count = 1 + (uint32_t)fpcount;
+        m_pos = 1;
+        m_x = x;
+        m_y = y;
+        m_angle = angle;
+    }
+    
+    bool pull (FpType *out_frac, FpType *out_x, FpType *out_y)
+    {
+        if (m_pos == m_count) {
+            return false;
+        }
+        FpType frac = (FpType)m_pos / m_count;
+        FpType a = frac * m_angle;
+        FpType cos_a = FloatCos(a);
+        FpType sin_a = FloatSin(a);
+        *out_frac = frac;
+        *out_x = m_x * cos_a - m_y * sin_a;
+        *out_y = m_x * sin_a + m_y * cos_a;
+        m_pos++;
+        return true;
+    }
+    
+private:
+    uint32_t m_count;
+    uint32_t m_pos;
+    FpType m_x;
+    FpType m_y;
+    FpType m_angle;
+};
+
+struct TestArc {
+    double x;
+    double y;
+    double angle;
+};
+
+static TestArc arcs[NumArcs];
+
+static double now ()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_arcs ()
+{
+    uint32_t seed = 1;
+    for (int i = 0; i < NumArcs; i++) {
+        seed = seed * 1103515245 + 12345;
+        double radius = 1.0 + (seed >> 8) % 5000 / 100.0;
+        seed = seed * 1103515245 + 12345;
+        double start = (seed >> 8) % 6283 / 1000.0;
+        seed = seed * 1103515245 + 12345;
+        double angle = ((seed >> 8) % 6283 + 1) / 1000.0;
+        if (seed & 1) {
+            angle = -angle;
+        }
+        arcs[i].x = radius * cos(start);
+        arcs[i].y = radius * sin(start);
+        arcs[i].angle = angle;
+    }
+}
+
+template <typename Splitter, typename FpType>
+static void run (char const *name)
+{
+    Splitter splitter;
+    uint64_t points = 0;
+    FpType sum = 0.0f;
+    double start_time = now();
+    for (int i = 0; i < NumArcs; i++) {
+        splitter.start(arcs[i].x, arcs[i].y, arcs[i].angle);
+        FpType frac;
+        FpType x;
+        FpType y;
+        while (splitter.pull(&frac, &x, &y)) {
+            sum += x + y;
+            points++;
+        }
+    }
+    double seconds = now() - start_time;
+    printf("%-24s %12llu %10.3f %12.1f   (checksum %g)\n", name, (unsigned long long)points, seconds, points / seconds / 1e6, (double)sum);
+}
+
+int main ()
+{
+    make_arcs();
+    printf("%-24s %12s %10s %12s\n", "", "points", "seconds", "Mpoints/s");
+    run<NaiveArcSplitter<Params, float>, float>("float, sin/cos");
+    run<ArcSplitter<Params, float>, float>("float, ArcSplitter");
+    run<NaiveArcSplitter<Params, double>, double>("double, sin/cos");
+    run<ArcSplitter<Params, double>, double>("double, ArcSplitter");
+    return 0;
+}
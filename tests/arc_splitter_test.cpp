@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tests the accumulated error of ArcSplitter, which finds the points of an
+ * arc by rotating the previous point. Arcs of about a million chords are
+ * split with float and double, and each point is compared with the exact
+ * point (computed in long double), both with the periodic correction of
+ * ArcSplitter and with the correction turned off (practically, by a huge
+ * interval). The error with the correction must stay within a few times
+ * the error of computing each point with sin and cos in FpType. The chords
+ * of ordinary arcs must also stay within the chord tolerance, with no more
+ * chords than the minimum segment length allows.
+ *
+ * Build and run from the top directory:
+ *   g++ -std=c++11 -O2 -I. tests/arc_splitter_test.cpp -o arc_splitter_test && ./arc_splitter_test
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <aprinter/meta/WrapDouble.h>
+#include <aprinter/printer/ArcSplitter.h>
+
+using namespace APrinter;
+
+static int failures = 0;
+
+using FineTolerance = AMBRO_WRAP_DOUBLE(4.9e-10);
+using MultiTurnTolerance = AMBRO_WRAP_DOUBLE(1e-3);
+using NormalTolerance = AMBRO_WRAP_DOUBLE(0.01);
+using NoMinSegmentLength = AMBRO_WRAP_DOUBLE(1e-12);
+using NormalMinSegmentLength = AMBRO_WRAP_DOUBLE(0.2);
+
+template <typename Tolerance, int CorrectionInterval>
+using TestParams = ArcSplitterParams<Tolerance, NoMinSegmentLength, CorrectionInterval>;
+
+struct ArcErrors {
+    uint32_t count;
+    long double split_error;
+    long double naive_error;
+};
+
+// Returns the largest distance of the points from the exact arc, relative
+// to the radius, for ArcSplitter and for sin/cos of each point in FpType.
+template <typename FpType, typename Params>
+static ArcErrors measure (double radius, double start_angle, double angle)
+{
+    FpType x0 = radius * cos(start_angle);
+    FpType y0 = radius * sin(start_angle);
+    
+    ArcSplitter<Params, FpType> splitter;
+    splitter.start(x0, y0, angle);
+    uint32_t count = 1;
+    FpType frac;
+    FpType x;
+    FpType y;
+    while (splitter.pull(&frac, &x, &y)) {
+        count++;
+    }
+    
+    ArcErrors res = {count, 0.0L, 0.0L};
+    splitter.start(x0, y0, angle);
+    for (uint32_t k = 1; splitter.pull(&frac, &x, &y); k++) {
+        long double a = start_angle + (long double)angle * k / count;
+        long double ref_x = radius * cosl(a);
+        long double ref_y = radius * sinl(a);
+        res.split_error = fmaxl(res.split_error, hypotl(x - ref_x, y - ref_y));
+        FpType naive_a = (FpType)((FpType)k / count) * (FpType)angle;
+        FpType naive_x = x0 * (FpType)cos(naive_a) - y0 * (FpType)sin(naive_a);
+        FpType naive_y = x0 * (FpType)sin(naive_a) + y0 * (FpType)cos(naive_a);
+        res.naive_error = fmaxl(res.naive_error, hypotl(naive_x - ref_x, naive_y - ref_y));
+    }
+    res.split_error /= radius;
+    res.naive_error /= radius;
+    return res;
+}
+
+template <typename FpType, typename Tolerance>
+static void test_accumulated_error (char const *name, double radius, double start_angle, double angle, long double slack)
+{
+    ArcErrors corrected = measure<FpType, TestParams<Tolerance, 16>>(radius, start_angle, angle);
+    ArcErrors uncorrected = measure<FpType, TestParams<Tolerance, 65535>>(radius, start_angle, angle);
+    long double bound = 4.0L * corrected.naive_error + slack;
+    bool ok = (corrected.count >= 1000000 && corrected.split_error <= bound);
+    printf("%s %s: %lu chords, relative error %.3Lg (sin/cos per point %.3Lg, without correction %.3Lg)\n",
+           ok ? "ok  " : "FAIL", name, (unsigned long)corrected.count,
+           corrected.split_error, corrected.naive_error, uncorrected.split_error);
+    if (!ok) {
+        failures++;
+    }
+}
+
+template <typename FpType>
+static void test_chord_tolerance (char const *name, double radius, double angle)
+{
+    using Params = ArcSplitterParams<NormalTolerance, NormalMinSegmentLength>;
+    ArcSplitter<Params, FpType> splitter;
+    splitter.start(radius, 0.0f, angle);
+    FpType frac;
+    FpType x;
+    FpType y;
+    FpType prev_x = radius;
+    FpType prev_y = 0.0f;
+    double max_sagitta = 0.0;
+    uint32_t count = 1;
+    while (true) {
+        bool more = splitter.pull(&frac, &x, &y);
+        if (!more) {
+            x = radius * cos(angle);
+            y = radius * sin(angle);
+        }
+        double mid_x = 0.5 * ((double)prev_x + x);
+        double mid_y = 0.5 * ((double)prev_y + y);
+        max_sagitta = fmax(max_sagitta, radius - hypot(mid_x, mid_y));
+        if (!more) {
+            break;
+        }
+        prev_x = x;
+        prev_y = y;
+        count++;
+    }
+    double limit = NormalTolerance::value() * 1.001;
+    double max_count = 1.0 + fabs(angle) * radius / NormalMinSegmentLength::value();
+    bool ok = (max_sagitta <= limit && count <= max_count);
+    printf("%s %s: %lu chords, largest distance from the arc %.4g\n", ok ? "ok  " : "FAIL", name, (unsigned long)count, max_sagitta);
+    if (!ok) {
+        failures++;
+    }
+}
+
+int main ()
+{
+    test_accumulated_error<float, FineTolerance>("float, one circle, r=100", 100.0, 0.3, 2.0 * M_PI, 1e-6L);
+    test_accumulated_error<float, FineTolerance>("float, one circle clockwise, r=100", 100.0, 2.0, -2.0 * M_PI, 1e-6L);
+    test_accumulated_error<float, MultiTurnTolerance>("float, 5000 turns, r=10", 10.0, 0.0, 5000.0 * 2.0 * M_PI, 1e-6L);
+    test_accumulated_error<double, FineTolerance>("double, one circle, r=100", 100.0, 0.3, 2.0 * M_PI, 1e-14L);
+    test_accumulated_error<double, FineTolerance>("double, one circle clockwise, r=100", 100.0, 2.0, -2.0 * M_PI, 1e-14L);
+    test_accumulated_error<double, MultiTurnTolerance>("double, 5000 turns, r=10", 10.0, 0.0, 5000.0 * 2.0 * M_PI, 1e-14L);
+    
+    test_chord_tolerance<float>("float, half circle, r=50", 50.0, M_PI);
+    test_chord_tolerance<float>("float, quarter circle, r=0.5", 0.5, -0.5 * M_PI);
+    test_chord_tolerance<double>("double, full circle, r=200", 200.0, 2.0 * M_PI);
+    
+    if (failures > 0) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
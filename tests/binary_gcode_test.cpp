@@ -0,0 +1,404 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tests BinaryGcodeEncoder. Encodings of a set of lines are compared with
+ * those produced by aprinter_encode.py, then lines are encoded and decoded
+ * again with BinaryGcodeParser, checking that the command and parameters
+ * come back as written. The packets are also decoded as one stream, fed to
+ * the parser a byte at a time, up to the EOF packet. The same is done for
+ * BinaryGcodeDeltaEncoder, where parameters must come back within the
+ * configured resolution.
+ *
+ * Build and run from the top directory:
+ *   g++ -std=c++11 -O2 -I. tests/binary_gcode_test.cpp -o binary_gcode_test && ./binary_gcode_test
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <aprinter/platform/linux/linux_support.h>
+
+#define AMBROLIB_ABORT_ACTION { ::abort(); }
+
+#include <aprinter/meta/MakeTypeList.h>
+#include <aprinter/meta/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/printer/BinaryGcodeParser.h>
+#include <aprinter/printer/BinaryGcodeEncoder.h>
+
+using namespace APrinter;
+
+bool linux_interrupts_disabled;
+
+struct MyContext;
+struct Program;
+
+using MyDebugObjectGroup = DebugObjectGroup<MyContext, Program>;
+using MyParser = BinaryGcodeParser<MyContext, Program, BinaryGcodeParserParams<BinaryGcodeFormat::MaxParts>, uint16_t>;
+
+struct MyContext {
+    using DebugGroup = MyDebugObjectGroup;
+};
+
+struct Program : public ObjBase<void, void, MakeTypeList<
+    MyDebugObjectGroup,
+    MyParser
+>> {
+    static Program * self (MyContext c);
+};
+
+Program p;
+
+Program * Program::self (MyContext c) { return &p; }
+
+// Produced by aprinter_encode.py.
+static struct {
+    char const *line;
+    char const *hex;
+} const reference_packets[] = {
+    {"G1 X10.5 Y-3.25 E0.1234 F3000", "243738246500002841000050c024b9fc3db80b0000"},
+    {"G0 Z5", "117905000000"},
+    {"G92 E0", "316400000000"},
+    {"M104 S210", "f1606872d2000000"},
+    {"G28 X Y", "f2301cb7b8"},
+    {"M2047", "f067ff"},
+    {"T0", "f09800"},
+    {"G1 X4294967296", "21970000000001000000"},
+    {"M105 ; temp", "f06069"},
+    {"G1 Xinf Y-nan Znan", "233738390000807f0000c07f0000c0ff"},
+    {"G1 X-0 Y+5 Z010 E-1", "247778792400000000050000000a000000000080bf"},
+    {"  G1\tX.5 Y5. Z1e3 E1.e-2\r\n", "24373839240000003f0000a04000007a440ad7233c"},
+    {"EOF", "e0"},
+    {"; only comment", ""},
+};
+
+static char const * const roundtrip_lines[] = {
+    "G1 X10.5 Y-3.25 E0.1234 F3000",
+    "G1 X0.001 Y123456.789 Z-0.3 E1e-5",
+    "G0 X1 Y2 Z3",
+    "G92 X0 Y0 Z0 E0",
+    "M104 S210 T1",
+    "M106 S255",
+    "G28 X Y Z",
+    "M84",
+    "M2047 A1 B2.5 C D4294967295",
+    "G1 A1 B2 C3 D4 E5 F6 G7 H8 I9 J10 K11 L12 M13 N14",
+    "T3",
+};
+
+// Produced by aprinter_encode.py --delta, in this order.
+static struct {
+    char const *line;
+    char const *hex;
+} const delta_reference_packets[] = {
+    {"G1 X10.5 Y-3.25 E0.1234 F3000", "8577787984055b88a401e332a413f02e"},
+    {"G1 X10.501 E0.12345 F3000", "490202"},
+    {"G1 X-0.0005 Y2147483.647 F1800", "538ba4019dcdffff0fdf12"},
+    {"G0 X1 F1800", "1277650100000008070000"},
+    {"G1 F1800", "5000"},
+    {"G1 Z0.3 A5", "2239609a99993e05000000"},
+    {"M105", "f06069"},
+};
+
+static char const * const delta_lines[] = {
+    "G92 X0 Y0 Z0 E0",
+    "G1 Z0.3 F7800",
+    "G1 X80.0 Y50.0 F1800",
+    "G1 X79.963 Y51.499 E0.05012",
+    "G1 X79.85 Y52.995 E0.10003 F1800",
+    "G1 X-120.0005 Y-0.0001 E1000.12345",
+    "G1 E995 F2400.4",
+    "G0 X0 Y0 F9000",
+    "G1 X1 F2400",
+    "M104 S210",
+    "G1 X1e2 Y.5 E+3",
+    "G1",
+};
+
+static int failures;
+
+static void fail (char const *line, char const *what)
+{
+    printf("FAIL: \"%s\": %s\n", line, what);
+    failures++;
+}
+
+static int encode (char const *line, uint8_t *out)
+{
+    char const *error = NULL;
+    int length = BinaryGcodeEncoder::encodeLine(line, strlen(line), out, &error);
+    if (length < 0) {
+        fail(line, error);
+    }
+    return length;
+}
+
+static void test_reference (char const *line, char const *hex)
+{
+    uint8_t packet[BinaryGcodeFormat::MaxPacketSize];
+    int length = encode(line, packet);
+    if (length < 0) {
+        return;
+    }
+    char packet_hex[2 * BinaryGcodeFormat::MaxPacketSize + 1];
+    for (int i = 0; i < length; i++) {
+        sprintf(packet_hex + 2 * i, "%02x", packet[i]);
+    }
+    packet_hex[2 * length] = '\0';
+    if (strcmp(packet_hex, hex)) {
+        fail(line, "encoding differs from aprinter_encode.py");
+    }
+}
+
+static void test_roundtrip (MyContext c, char const *line)
+{
+    uint8_t packet[BinaryGcodeFormat::MaxPacketSize];
+    int length = encode(line, packet);
+    if (length <= 0) {
+        return;
+    }
+    
+    MyParser::startCommand(c, (char *)packet, 0);
+    if (!MyParser::extendCommand(c, length) || MyParser::getNumParts(c) < 0) {
+        fail(line, "parser rejected the packet");
+        return;
+    }
+    if (MyParser::getLength(c) != length) {
+        fail(line, "parser consumed a different length");
+    }
+    
+    char const *pos = line;
+    char *end;
+    if (MyParser::getCmdCode(c) != *pos || MyParser::getCmdNumber(c) != strtoul(pos + 1, &end, 10)) {
+        fail(line, "command differs");
+    }
+    pos = end;
+    
+    int num_parts = 0;
+    while (*pos == ' ') {
+        pos++;
+        if (num_parts >= MyParser::getNumParts(c)) {
+            fail(line, "too few parameters");
+            return;
+        }
+        MyParser::PartRef part = MyParser::getPart(c, num_parts++);
+        if (MyParser::getPartCode(c, part) != *pos) {
+            fail(line, "parameter letter differs");
+        }
+        pos++;
+        if (*pos == ' ' || *pos == '\0') {
+            continue;
+        }
+        float value = strtod(pos, &end);
+        bool is_integer = true;
+        for (char const *p = pos; p != end; p++) {
+            is_integer &= (*p >= '0' && *p <= '9');
+        }
+        if (MyParser::getPartFpValue<float>(c, part) != value) {
+            fail(line, "parameter value differs");
+        }
+        if (is_integer && MyParser::getPartUint32Value(c, part) != strtoul(pos, NULL, 10)) {
+            fail(line, "integer parameter value differs");
+        }
+        pos = end;
+    }
+    if (num_parts != MyParser::getNumParts(c)) {
+        fail(line, "too many parameters");
+    }
+}
+
+static void test_stream (MyContext c)
+{
+    static uint8_t buffer[sizeof(roundtrip_lines) / sizeof(roundtrip_lines[0]) * BinaryGcodeFormat::MaxPacketSize + 1];
+    size_t size = 0;
+    for (char const *line : roundtrip_lines) {
+        size += encode(line, buffer + size);
+    }
+    buffer[size++] = BinaryGcodeFormat::EofPacket;
+    
+    size_t offset = 0;
+    for (char const *line : roundtrip_lines) {
+        MyParser::startCommand(c, (char *)buffer + offset, 0);
+        uint16_t avail = 0;
+        while (!MyParser::extendCommand(c, avail)) {
+            avail++;
+        }
+        if (MyParser::getNumParts(c) < 0) {
+            fail(line, "parser rejected the packet in stream");
+            return;
+        }
+        offset += MyParser::getLength(c);
+    }
+    MyParser::startCommand(c, (char *)buffer + offset, 0);
+    if (!MyParser::extendCommand(c, size - offset) || MyParser::getNumParts(c) != MyParser::ERROR_EOF) {
+        fail("(stream)", "EOF packet not found at the end");
+    }
+}
+
+static int delta_encode (BinaryGcodeDeltaEncoder *encoder, char const *line, uint8_t *out)
+{
+    char const *error = NULL;
+    int length = encoder->encodeLine(line, strlen(line), out, &error);
+    if (length < 0) {
+        fail(line, error);
+    }
+    return length;
+}
+
+static void test_delta_reference ()
+{
+    BinaryGcodeDeltaEncoder encoder;
+    char const *error;
+    if (!encoder.init(BinaryGcodeDeltaEncoder::DefaultResolution, &error)) {
+        fail("(delta)", error);
+        return;
+    }
+    for (auto const &ref : delta_reference_packets) {
+        uint8_t packet[BinaryGcodeFormat::MaxPacketSize];
+        int length = delta_encode(&encoder, ref.line, packet);
+        if (length < 0) {
+            continue;
+        }
+        char packet_hex[2 * BinaryGcodeFormat::MaxPacketSize + 1];
+        for (int i = 0; i < length; i++) {
+            sprintf(packet_hex + 2 * i, "%02x", packet[i]);
+        }
+        packet_hex[2 * length] = '\0';
+        if (strcmp(packet_hex, ref.hex)) {
+            fail(ref.line, "delta encoding differs from aprinter_encode.py");
+        }
+    }
+}
+
+static double delta_resolution (char code)
+{
+    switch (code) {
+        case 'X': case 'Y': case 'Z': return 1e-3;
+        case 'E': return 1e-4;
+        case 'F': return 1.0;
+        default: return 0.0;
+    }
+}
+
+static void test_delta_stream (MyContext c)
+{
+    BinaryGcodeDeltaEncoder encoder;
+    char const *error;
+    if (!encoder.init(BinaryGcodeDeltaEncoder::DefaultResolution, &error)) {
+        fail("(delta)", error);
+        return;
+    }
+    static uint8_t buffer[sizeof(delta_lines) / sizeof(delta_lines[0]) * BinaryGcodeFormat::MaxPacketSize + 1];
+    size_t size = 0;
+    for (char const *line : delta_lines) {
+        size += delta_encode(&encoder, line, buffer + size);
+    }
+    buffer[size++] = BinaryGcodeFormat::EofPacket;
+    
+    MyParser::init(c);
+    size_t offset = 0;
+    double feedrate = -1.0;
+    for (char const *line : delta_lines) {
+        MyParser::startCommand(c, (char *)buffer + offset, 0);
+        uint16_t avail = 0;
+        while (!MyParser::extendCommand(c, avail)) {
+            avail++;
+        }
+        if (MyParser::getNumParts(c) < 0) {
+            fail(line, "parser rejected the delta packet in stream");
+            return;
+        }
+        offset += MyParser::getLength(c);
+        
+        char *end;
+        if (MyParser::getCmdCode(c) != line[0] || MyParser::getCmdNumber(c) != strtoul(line + 1, &end, 10)) {
+            fail(line, "command differs");
+        }
+        
+        int line_parts = 0;
+        bool have_feedrate = false;
+        for (char const *pos = strchr(line, ' '); pos; pos = strchr(pos + 1, ' ')) {
+            char code = pos[1];
+            double value = strtod(pos + 2, NULL);
+            line_parts++;
+            if (code == 'F') {
+                have_feedrate = (value == feedrate);
+                feedrate = value;
+            }
+            bool found = false;
+            for (int i = 0; i < MyParser::getNumParts(c); i++) {
+                MyParser::PartRef part = MyParser::getPart(c, i);
+                if (MyParser::getPartCode(c, part) == code) {
+                    found = true;
+                    double error = fabs(MyParser::getPartFpValue<double>(c, part) - value);
+                    if (error > delta_resolution(code) / 2 * 1.0001) {
+                        fail(line, "delta parameter value differs");
+                    }
+                }
+            }
+            if (!found && !(code == 'F' && have_feedrate)) {
+                fail(line, "delta parameter missing");
+            }
+        }
+        if (MyParser::getNumParts(c) > line_parts) {
+            fail(line, "too many delta parameters");
+        }
+    }
+    MyParser::startCommand(c, (char *)buffer + offset, 0);
+    if (!MyParser::extendCommand(c, size - offset) || MyParser::getNumParts(c) != MyParser::ERROR_EOF) {
+        fail("(delta stream)", "EOF packet not found at the end");
+    }
+    MyParser::deinit(c);
+}
+
+int main ()
+{
+    MyContext c;
+    MyDebugObjectGroup::init(c);
+    MyParser::init(c);
+    
+    for (auto const &ref : reference_packets) {
+        test_reference(ref.line, ref.hex);
+    }
+    for (char const *line : roundtrip_lines) {
+        test_roundtrip(c, line);
+    }
+    test_stream(c);
+    
+    MyParser::deinit(c);
+    
+    test_delta_reference();
+    test_delta_stream(c);
+    
+    if (failures > 0) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compares BusyEventLoop and HeapEventLoop dispatching a number of periodic
+ * timed events, plus a fast event and an event scheduled for "now", as the
+ * printer does with its timers, observers and planner. The clock is virtual
+ * and advances by one tick per read, so both loops see the same schedule and
+ * only the dispatch overhead is measured. Lateness is the difference between
+ * the time an event was scheduled for and the time its handler ran.
+ *
+ * Build and run from the top directory:
+ *   g++ -std=c++11 -O2 -DNDEBUG -I. \
+ *       tests/event_loop_benchmark.cpp aprinter/platform/linux/linux_support.cpp \
+ *       -o event_loop_benchmark && ./event_loop_benchmark
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <aprinter/platform/linux/linux_support.h>
+
+#define AMBROLIB_ABORT_ACTION { ::abort(); }
+#define AMBROLIB_SUPPORT_QUIT
+
+#include <aprinter/meta/MakeTypeList.h>
+#include <aprinter/meta/WrapType.h>
+#include <aprinter/meta/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/system/BusyEventLoop.h>
+#include <aprinter/system/HeapEventLoop.h>
+
+using namespace APrinter;
+
+template <typename Context, typename ParentObject, typename ExtraDelay>
+using HeapNoSleepEventLoop = HeapEventLoop<Context, ParentObject, ExtraDelay, HeapEventLoopNoSleepParams>;
+
+static uint32_t const NumDispatches = 2000000;
+
+template <template <typename, typename, typename> class LoopTemplate, int NumEvents>
+class LoopBench {
+    struct Context;
+    struct Program;
+    struct ExtraDelay;
+    
+    struct Clock {
+        using TimeType = uint32_t;
+        
+        static TimeType getTime (Context c)
+        {
+            return ++Program::self(c)->m_time;
+        }
+    };
+    
+    using DebugGroup = DebugObjectGroup<Context, Program>;
+    using Loop = LoopTemplate<Context, Program, ExtraDelay>;
+    using FastEvent = typename Loop::template FastEventSpec<LoopBench>;
+    using LoopExtra = BusyEventLoopExtra<Program, Loop, MakeTypeList<FastEvent>>;
+    using QueuedEvent = typename Loop::QueuedEvent;
+    
+    struct Context {
+        using DebugGroup = typename LoopBench::DebugGroup;
+        using Clock = typename LoopBench::Clock;
+        using EventLoop = Loop;
+        
+        void check () const {}
+    };
+    
+    struct ExtraDelay : public WrapType<LoopExtra> {};
+    
+    struct Program : public ObjBase<void, void, MakeTypeList<
+        DebugGroup,
+        Loop,
+        LoopExtra
+    >> {
+        static Program * self (Context c)
+        {
+            static Program p;
+            return &p;
+        }
+        
+        uint32_t m_time;
+        uint32_t m_dispatches;
+        uint32_t m_fast_dispatches;
+        uint64_t m_total_lateness;
+        uint32_t m_max_lateness;
+        uint32_t m_periods[NumEvents];
+        uint32_t m_due_times[NumEvents];
+        uint32_t m_now_due_time;
+        QueuedEvent m_events[NumEvents];
+        QueuedEvent m_now_event;
+    };
+    
+    static uint32_t period (int i)
+    {
+        // Keeps about one dispatch per six ticks for any number of events.
+        return 4 * NumEvents + (37 * i) % (4 * NumEvents);
+    }
+    
+    static void count_dispatch (Context c, uint32_t due_time)
+    {
+        auto *o = Program::self(c);
+        uint32_t lateness = o->m_time - due_time;
+        o->m_total_lateness += lateness;
+        if (lateness > o->m_max_lateness) {
+            o->m_max_lateness = lateness;
+        }
+        if (++o->m_dispatches == NumDispatches) {
+            Loop::quit(c);
+        }
+    }
+    
+    static void event_handler (QueuedEvent *ev, Context c)
+    {
+        auto *o = Program::self(c);
+        int i = ev - o->m_events;
+        count_dispatch(c, o->m_due_times[i]);
+        o->m_due_times[i] += o->m_periods[i];
+        ev->appendAfterPrevious(c, o->m_periods[i]);
+        if (i % 8 == 0) {
+            Loop::template triggerFastEvent<FastEvent>(c);
+        }
+    }
+    
+    static void fast_event_handler (Context c)
+    {
+        auto *o = Program::self(c);
+        o->m_fast_dispatches++;
+        if (!o->m_now_event.isSet(c)) {
+            o->m_now_due_time = o->m_time;
+            o->m_now_event.prependNowNotAlready(c);
+        }
+    }
+    
+    static void now_event_handler (QueuedEvent *ev, Context c)
+    {
+        auto *o = Program::self(c);
+        count_dispatch(c, o->m_now_due_time);
+    }
+    
+public:
+    static void run (char const *name)
+    {
+        Context c;
+        auto *o = Program::self(c);
+        o->m_time = 0;
+        o->m_dispatches = 0;
+        o->m_fast_dispatches = 0;
+        o->m_total_lateness = 0;
+        o->m_max_lateness = 0;
+        
+        DebugGroup::init(c);
+        Loop::init(c);
+        Loop::template initFastEvent<FastEvent>(c, LoopBench::fast_event_handler);
+        o->m_now_event.init(c, LoopBench::now_event_handler);
+        for (int i = 0; i < NumEvents; i++) {
+            o->m_periods[i] = period(i);
+            o->m_events[i].init(c, LoopBench::event_handler);
+            o->m_due_times[i] = 100 + 13 * i;
+            o->m_events[i].appendAt(c, o->m_due_times[i]);
+        }
+        
+        struct timespec start_ts;
+        clock_gettime(CLOCK_MONOTONIC, &start_ts);
+        Loop::run(c);
+        struct timespec end_ts;
+        clock_gettime(CLOCK_MONOTONIC, &end_ts);
+        
+        double ns = (end_ts.tv_sec - start_ts.tv_sec) * 1e9 + (end_ts.tv_nsec - start_ts.tv_nsec);
+        printf("%-6s %6d %14.1f %14.3f %12.3f %12lu %10lu\n",
+               name, NumEvents, ns / o->m_dispatches, ns / o->m_time,
+               (double)o->m_total_lateness / o->m_dispatches, (unsigned long)o->m_max_lateness,
+               (unsigned long)o->m_fast_dispatches);
+        
+        o->m_now_event.deinit(c);
+        for (int i = 0; i < NumEvents; i++) {
+            o->m_events[i].deinit(c);
+        }
+        Loop::deinit(c);
+        DebugGroup::deinit(c);
+    }
+};
+
+int main ()
+{
+    printf("loop   events  ns/dispatch    ns/tick  avg lateness  max lateness  fast events\n");
+    LoopBench<BusyEventLoop, 8>::run("busy");
+    LoopBench<HeapNoSleepEventLoop, 8>::run("heap");
+    LoopBench<BusyEventLoop, 32>::run("busy");
+    LoopBench<HeapNoSleepEventLoop, 32>::run("heap");
+    LoopBench<BusyEventLoop, 64>::run("busy");
+    LoopBench<HeapNoSleepEventLoop, 64>::run("heap");
+    LoopBench<BusyEventLoop, 128>::run("busy");
+    LoopBench<HeapNoSleepEventLoop, 128>::run("heap");
+    
+    return 0;
+}
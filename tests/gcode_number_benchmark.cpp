@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures how fast the numbers in a g-code file are converted, with the
+ * C library (StrToFloat, strtoul) as the firmware used to, and with
+ * ParseDecimal falling back to the C library like GcodeParser does now.
+ * The file is split into parts and the values are terminated in place
+ * beforehand, as the parser does, so only the conversion is timed. Both
+ * ways must give exactly the same values. Without a file, about 100 MB of
+ * G1 moves are made up.
+ *
+ * Build and run from the top directory:
+ *   g++ -std=c++11 -O2 -I. tests/gcode_number_benchmark.cpp \
+ *       -o gcode_number_benchmark && ./gcode_number_benchmark [file.gcode]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <aprinter/math/FloatTools.h>
+#include <aprinter/math/ParseDecimal.h>
+
+using namespace APrinter;
+
+static size_t const GeneratedSize = 100 * 1000 * 1000;
+
+static char *text;
+static size_t text_size;
+static char const **values;
+static size_t num_values;
+static char const **cmd_numbers;
+static size_t num_cmd_numbers;
+
+static uint32_t rand_state = 1;
+
+static uint32_t next_rand ()
+{
+    rand_state = rand_state * UINT32_C(1103515245) + 12345;
+    return rand_state >> 8;
+}
+
+static void generate ()
+{
+    text = (char *)malloc(GeneratedSize + 128);
+    text_size = 0;
+    uint32_t e = 0;
+    while (text_size < GeneratedSize) {
+        uint32_t x = next_rand() % 200000;
+        uint32_t y = next_rand() % 200000;
+        e += next_rand() % 5000;
+        text_size += sprintf(text + text_size, "G1 X%u.%03u Y-%u.%03u E%u.%05u F%u\n",
+                             x / 1000, x % 1000, y / 1000, y % 1000, e / 100000, e % 100000, 1200 + 600 * (next_rand() % 8));
+    }
+}
+
+static bool load (char const *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    text_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    text = (char *)malloc(text_size + 1);
+    bool ok = (fread(text, 1, text_size, f) == text_size);
+    fclose(f);
+    return ok;
+}
+
+static bool is_code (char ch)
+{
+    return ((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z'));
+}
+
+// Splits the text into parts like the file parser, terminating the values.
+static void split ()
+{
+    values = (char const **)malloc((text_size / 2 + 1) * sizeof(values[0]));
+    cmd_numbers = (char const **)malloc((text_size / 2 + 1) * sizeof(cmd_numbers[0]));
+    num_values = 0;
+    num_cmd_numbers = 0;
+    text[text_size] = '\0';
+    char *line = text;
+    while (*line) {
+        char *line_end = strchr(line, '\n');
+        char *next_line = line_end ? (line_end + 1) : (line + strlen(line));
+        if (line_end) {
+            *line_end = '\0';
+        }
+        char *comment = strchr(line, ';');
+        if (comment) {
+            *comment = '\0';
+        }
+        bool first = true;
+        for (char *part = strtok(line, " \t\r"); part; part = strtok(NULL, " \t\r")) {
+            if (!is_code(part[0])) {
+                continue;
+            }
+            if (first) {
+                cmd_numbers[num_cmd_numbers++] = part + 1;
+            } else {
+                values[num_values++] = part + 1;
+            }
+            first = false;
+        }
+        line = next_line;
+    }
+}
+
+static double now ()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template <typename T>
+static T convert_libc (char const *str)
+{
+    return StrToFloat<T>(str, NULL);
+}
+
+template <typename T>
+static T convert_fast (char const *str)
+{
+    T value;
+    if (ParseDecimalFp<T>(str, &value)) {
+        return value;
+    }
+    return StrToFloat<T>(str, NULL);
+}
+
+static uint16_t convert_uint_libc (char const *str)
+{
+    return strtoul(str, NULL, 10);
+}
+
+static uint16_t convert_uint_fast (char const *str)
+{
+    uint16_t value;
+    if (ParseDecimalUint<uint16_t>(str, &value)) {
+        return value;
+    }
+    return strtoul(str, NULL, 10);
+}
+
+template <typename T, T (*Convert) (char const *)>
+static double time_convert (char const **strs, size_t count, T *out)
+{
+    double start = now();
+    for (size_t i = 0; i < count; i++) {
+        out[i] = Convert(strs[i]);
+    }
+    return now() - start;
+}
+
+static void report (char const *name, double seconds, size_t count)
+{
+    printf("%-14s %10.3f %14.1f %12.1f\n", name, seconds, count / seconds / 1e6, text_size / seconds / 1e6);
+}
+
+template <typename T>
+static bool bench_fp (char const *name_libc, char const *name_fast)
+{
+    T *a = (T *)malloc(num_values * sizeof(T));
+    T *b = (T *)malloc(num_values * sizeof(T));
+    report(name_libc, time_convert<T, convert_libc<T>>(values, num_values, a), num_values);
+    report(name_fast, time_convert<T, convert_fast<T>>(values, num_values, b), num_values);
+    
+    size_t fallbacks = 0;
+    size_t mismatches = 0;
+    for (size_t i = 0; i < num_values; i++) {
+        T value;
+        if (!ParseDecimalFp<T>(values[i], &value)) {
+            fallbacks++;
+        }
+        if (memcmp(&a[i], &b[i], sizeof(T))) {
+            if (mismatches++ < 10) {
+                printf("MISMATCH %s: %.17g %.17g\n", values[i], (double)a[i], (double)b[i]);
+            }
+        }
+    }
+    printf("%zu values, %zu through the C library\n", num_values, fallbacks);
+    free(a);
+    free(b);
+    return (mismatches == 0);
+}
+
+static bool bench_uint ()
+{
+    uint16_t *a = (uint16_t *)malloc(num_cmd_numbers * sizeof(uint16_t));
+    uint16_t *b = (uint16_t *)malloc(num_cmd_numbers * sizeof(uint16_t));
+    report("strtoul", time_convert<uint16_t, convert_uint_libc>(cmd_numbers, num_cmd_numbers, a), num_cmd_numbers);
+    report("decimal uint", time_convert<uint16_t, convert_uint_fast>(cmd_numbers, num_cmd_numbers, b), num_cmd_numbers);
+    bool ok = !memcmp(a, b, num_cmd_numbers * sizeof(uint16_t));
+    printf("%zu command numbers\n", num_cmd_numbers);
+    free(a);
+    free(b);
+    return ok;
+}
+
+int main (int argc, char *argv[])
+{
+    if (argc > 1) {
+        if (!load(argv[1])) {
+            fprintf(stderr, "Cannot read %s\n", argv[1]);
+            return 1;
+        }
+    } else {
+        generate();
+    }
+    split();
+    printf("%.1f MB of g-code\n", text_size / 1e6);
+    
+    printf("converter         seconds  Mvalues/s  MB/s of g-code\n");
+    bool ok = bench_fp<float>("strtof", "decimal float");
+    ok = bench_fp<double>("strtod", "decimal double") && ok;
+    ok = bench_uint() && ok;
+    
+    if (!ok) {
+        printf("FAILED: the converters differ\n");
+        return 1;
+    }
+    return 0;
+}
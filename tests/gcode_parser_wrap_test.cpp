@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tests that GcodeParser and BinaryGcodeParser give the same result for a
+ * command wherever the wraparound of a ring buffer falls within it. Each
+ * command is placed at every offset of a ring buffer and fed to the parser
+ * a byte at a time, so that parameter values, the checksum after '*' and
+ * the varints of delta packets are split at every position. The result is
+ * compared with that of parsing the command from contiguous memory. A text
+ * part of MaxPartLength characters must be accepted at every offset, and
+ * one longer must be rejected at every offset.
+ *
+ * Build and run from the top directory:
+ *   g++ -std=c++11 -O2 -I. tests/gcode_parser_wrap_test.cpp -o gcode_parser_wrap_test && ./gcode_parser_wrap_test
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <aprinter/platform/linux/linux_support.h>
+
+#define AMBROLIB_ABORT_ACTION { ::abort(); }
+
+#include <aprinter/meta/MakeTypeList.h>
+#include <aprinter/meta/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/printer/GcodeParser.h>
+#include <aprinter/printer/BinaryGcodeParser.h>
+#include <aprinter/printer/BinaryGcodeEncoder.h>
+
+using namespace APrinter;
+
+bool linux_interrupts_disabled;
+
+struct MyContext;
+struct Program;
+
+using MyDebugObjectGroup = DebugObjectGroup<MyContext, Program>;
+using MyTextParser = GcodeParser<MyContext, Program, GcodeParserParams<8>, uint8_t, GcodeParserTypeSerial>;
+using MyBinaryParser = BinaryGcodeParser<MyContext, Program, BinaryGcodeParserParams<BinaryGcodeFormat::MaxParts>, uint8_t>;
+
+struct MyContext {
+    using DebugGroup = MyDebugObjectGroup;
+};
+
+struct Program : public ObjBase<void, void, MakeTypeList<
+    MyDebugObjectGroup,
+    MyTextParser,
+    MyBinaryParser
+>> {
+    static Program * self (MyContext c);
+};
+
+Program p;
+
+Program * Program::self (MyContext c) { return &p; }
+
+static int const RingSize = 128;
+
+static int failures;
+
+static void fail (char const *what, int offset, char const *reason)
+{
+    printf("FAIL: \"%s\" at offset %d: %s\n", what, offset, reason);
+    failures++;
+}
+
+// The outcome of parsing one command, in a form that can be compared.
+struct Result {
+    int num_parts;
+    int length;
+    char cmd_code;
+    int cmd_number;
+    char text[256];
+};
+
+template <typename Parser>
+static void put_header (MyContext c, Result *r)
+{
+    r->num_parts = Parser::getNumParts(c);
+    r->length = Parser::getLength(c);
+    r->cmd_code = 0;
+    r->cmd_number = 0;
+    r->text[0] = '\0';
+    if (r->num_parts >= 0) {
+        r->cmd_code = Parser::getCmdCode(c);
+        r->cmd_number = Parser::getCmdNumber(c);
+    }
+}
+
+static void get_text_result (MyContext c, Result *r)
+{
+    put_header<MyTextParser>(c, r);
+    if (r->num_parts < 0) {
+        return;
+    }
+    MyTextParser::Command *cmd = MyTextParser::getCmd(c);
+    size_t pos = 0;
+    if (cmd->have_line_number) {
+        pos += sprintf(r->text + pos, "N%lu", (unsigned long)cmd->line_number);
+    }
+    for (int i = 0; i < r->num_parts; i++) {
+        MyTextParser::PartRef part = MyTextParser::getPart(c, i);
+        pos += snprintf(r->text + pos, sizeof(r->text) - pos, " %c%s", MyTextParser::getPartCode(c, part), MyTextParser::getPartStringValue(c, part));
+    }
+}
+
+static void get_binary_result (MyContext c, Result *r)
+{
+    put_header<MyBinaryParser>(c, r);
+    if (r->num_parts < 0) {
+        return;
+    }
+    size_t pos = 0;
+    for (int i = 0; i < r->num_parts; i++) {
+        MyBinaryParser::PartRef part = MyBinaryParser::getPart(c, i);
+        pos += snprintf(r->text + pos, sizeof(r->text) - pos, " %c%.9g/%lu", MyBinaryParser::getPartCode(c, part),
+                        MyBinaryParser::getPartFpValue<double>(c, part), (unsigned long)MyBinaryParser::getPartUint32Value(c, part));
+    }
+}
+
+static bool same_result (Result const *a, Result const *b)
+{
+    return (a->num_parts == b->num_parts && a->length == b->length && a->cmd_code == b->cmd_code &&
+            a->cmd_number == b->cmd_number && !strcmp(a->text, b->text));
+}
+
+// Parses the commands in data, placed in the ring buffer at offset, one
+// after another, feeding each to the parser a byte at a time.
+template <typename Parser, typename GetResult>
+static int parse_ring (MyContext c, uint8_t const *data, int size, int offset, Result *results, int max_results, GetResult get_result)
+{
+    static char ring[RingSize];
+    for (int i = 0; i < size; i++) {
+        ring[(offset + i) % RingSize] = data[i];
+    }
+    
+    Parser::init(c);
+    int num_results = 0;
+    int done = 0;
+    while (done < size && num_results < max_results) {
+        int start = (offset + done) % RingSize;
+        Parser::startCommand(c, ring + start, 0, RingSize - start, ring);
+        int avail = 0;
+        while (!Parser::extendCommand(c, avail)) {
+            if (done + avail == size) {
+                Parser::deinit(c);
+                return -1;
+            }
+            avail++;
+        }
+        get_result(c, &results[num_results]);
+        done += Parser::getLength(c);
+        num_results++;
+    }
+    Parser::deinit(c);
+    return num_results;
+}
+
+template <typename Parser, typename GetResult>
+static void test_wrap (MyContext c, char const *what, uint8_t const *data, int size, int max_results, GetResult get_result, int expect_num_parts)
+{
+    static Result expected[16];
+    static Result results[16];
+    
+    // Parsed from offset zero, the commands do not cross the wrap.
+    int num_expected = parse_ring<Parser>(c, data, size, 0, expected, max_results, get_result);
+    if (num_expected != max_results) {
+        fail(what, 0, "commands not parsed");
+        return;
+    }
+    if (expected[num_expected - 1].num_parts != expect_num_parts) {
+        fail(what, 0, "unexpected result");
+        return;
+    }
+    
+    for (int offset = 1; offset < RingSize; offset++) {
+        int num_results = parse_ring<Parser>(c, data, size, offset, results, max_results, get_result);
+        if (num_results != num_expected) {
+            fail(what, offset, "commands not parsed");
+            continue;
+        }
+        for (int i = 0; i < num_results; i++) {
+            if (!same_result(&results[i], &expected[i])) {
+                fail(what, offset, "result differs");
+                break;
+            }
+        }
+    }
+}
+
+static void test_text (MyContext c, char const *what, char const *line, int expect_num_parts)
+{
+    test_wrap<MyTextParser>(c, what, (uint8_t const *)line, strlen(line), 1, get_text_result, expect_num_parts);
+}
+
+static void test_text_checksum (MyContext c)
+{
+    char line[64] = "N7 G1 X10.5 Y-3.25 E0.1234 F3000";
+    uint8_t checksum = 0;
+    for (char const *p = line; *p; p++) {
+        checksum ^= (uint8_t)*p;
+    }
+    size_t length = strlen(line);
+    sprintf(line + length, "*%d\n", checksum);
+    test_text(c, "checksum", line, 4);
+    
+    sprintf(line + length, "*%d\n", (uint8_t)(checksum ^ 1));
+    test_text(c, "bad checksum", line, MyTextParser::ERROR_CHECKSUM);
+}
+
+static void test_text_part_length (MyContext c)
+{
+    char line[64] = "M28 F";
+    size_t length = strlen(line);
+    memset(line + length, 'A', MyTextParser::MaxPartLength);
+    strcpy(line + length + MyTextParser::MaxPartLength, "\n");
+    test_text(c, "longest part", line, 1);
+    
+    memset(line + length, 'A', MyTextParser::MaxPartLength + 1);
+    strcpy(line + length + MyTextParser::MaxPartLength + 1, "\n");
+    test_text(c, "too long part", line, MyTextParser::ERROR_INVALID_PART);
+}
+
+static void test_binary (MyContext c)
+{
+    static char const * const lines[] = {
+        "G1 X10.5 Y-3.25 E0.1234 F3000",
+        "M104 S210 T1",
+        "M2047 A1 B2.5 C D4294967295",
+    };
+    uint8_t data[3 * BinaryGcodeFormat::MaxPacketSize];
+    int size = 0;
+    for (char const *line : lines) {
+        char const *error;
+        size += BinaryGcodeEncoder::encodeLine(line, strlen(line), data + size, &error);
+    }
+    test_wrap<MyBinaryParser>(c, "binary", data, size, 3, get_binary_result, 4);
+}
+
+static void test_binary_delta (MyContext c)
+{
+    // Large steps, so that the varints take several bytes.
+    static char const * const lines[] = {
+        "G1 X10.5 Y-3.25 E0.1234 F3000",
+        "G1 X-120.0005 Y2147.483 E1000.12345",
+        "G1 X0.001 Y-0.001 Z5 E1000.12346 F1800",
+        "G1 X80 Y50",
+    };
+    BinaryGcodeDeltaEncoder encoder;
+    char const *error;
+    encoder.init(BinaryGcodeDeltaEncoder::DefaultResolution, &error);
+    uint8_t data[4 * BinaryGcodeFormat::MaxPacketSize];
+    int size = 0;
+    for (char const *line : lines) {
+        size += encoder.encodeLine(line, strlen(line), data + size, &error);
+    }
+    test_wrap<MyBinaryParser>(c, "binary delta", data, size, 4, get_binary_result, 2);
+}
+
+int main ()
+{
+    MyContext c;
+    MyDebugObjectGroup::init(c);
+    
+    test_text(c, "values", "G1 X10.5 Y-3.25 E0.1234 F3000\n", 4);
+    test_text_checksum(c);
+    test_text_part_length(c);
+    test_binary(c);
+    test_binary_delta(c);
+    
+    if (failures > 0) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
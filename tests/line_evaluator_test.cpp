@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tests the LineEvaluator of the Delta, HalfDelta and Identity transforms,
+ * which find the physical positions of the split points of a straight move
+ * incrementally. Random moves within reach of the geometries of the delta
+ * and half delta example configurations are split into segments of about
+ * 0.1, 1 and 4 mm, and each point is compared with virtToPhys of the
+ * interpolated virtual position, in the same FpType. The largest difference
+ * must be within the tolerance for FpType; for Identity, there must be no
+ * difference at all. The moves include ones close to the edge of reach, where
+ * the rods are nearly horizontal and the extrapolation alone is far off.
+ *
+ * Build and run from the top directory:
+ *   g++ -std=c++11 -O2 -I. tests/line_evaluator_test.cpp -o line_evaluator_test && ./line_evaluator_test
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <aprinter/meta/WrapDouble.h>
+#include <aprinter/printer/transform/DeltaTransform.h>
+#include <aprinter/printer/transform/HalfDeltaTransform.h>
+#include <aprinter/printer/transform/IdentityTransform.h>
+
+using namespace APrinter;
+
+static int failures = 0;
+
+using MinSplitLength = AMBRO_WRAP_DOUBLE(0.1);
+using MaxSplitLength = AMBRO_WRAP_DOUBLE(4.0);
+using TheSplitterParams = DistanceSplitterParams<MinSplitLength, MaxSplitLength>;
+
+// As in aprinter-rampsfd-delta.cpp.
+using DeltaDiagonalRod = AMBRO_WRAP_DOUBLE(214.0);
+using DeltaRadius = AMBRO_WRAP_DOUBLE(105.6);
+using DeltaTower1X = AMBRO_WRAP_DOUBLE(DeltaRadius::value() * -0.8660254037844386);
+using DeltaTower1Y = AMBRO_WRAP_DOUBLE(DeltaRadius::value() * -0.5);
+using DeltaTower2X = AMBRO_WRAP_DOUBLE(DeltaRadius::value() * 0.8660254037844386);
+using DeltaTower2Y = AMBRO_WRAP_DOUBLE(DeltaRadius::value() * -0.5);
+using DeltaTower3X = AMBRO_WRAP_DOUBLE(DeltaRadius::value() * 0.0);
+using DeltaTower3Y = AMBRO_WRAP_DOUBLE(DeltaRadius::value() * 1.0);
+
+// As in aprinter-ramps13-halfdelta.cpp.
+using HalfDeltaDiagonalRod = AMBRO_WRAP_DOUBLE(150.0);
+using HalfDeltaTower1X = AMBRO_WRAP_DOUBLE(-100.0);
+using HalfDeltaTower2X = AMBRO_WRAP_DOUBLE(100.0);
+
+template <typename FpType>
+using TheDeltaTransform = DeltaTransform<DeltaTransformParams<DeltaDiagonalRod, DeltaTower1X, DeltaTower1Y, DeltaTower2X, DeltaTower2Y, DeltaTower3X, DeltaTower3Y, TheSplitterParams>, FpType>;
+
+template <typename FpType>
+using TheHalfDeltaTransform = HalfDeltaTransform<HalfDeltaTransformParams<HalfDeltaDiagonalRod, HalfDeltaTower1X, HalfDeltaTower2X, TheSplitterParams>, FpType>;
+
+template <typename FpType>
+using TheIdentityTransform = IdentityTransform<IdentityTransformParams<3, TheSplitterParams>, FpType>;
+
+template <typename FpType>
+struct ArraySrc {
+    FpType const *m_arr;
+    template <int Index>
+    FpType get () { return m_arr[Index]; }
+};
+
+template <typename FpType>
+struct ArrayDst {
+    FpType *m_arr;
+    template <int Index>
+    void set (FpType x) { m_arr[Index] = x; }
+};
+
+struct Delta {
+    static int const NumAxes = 3;
+    
+    template <typename FpType>
+    using Transform = TheDeltaTransform<FpType>;
+    
+    // The horizontal distance to a tower is largest at one of the ends of
+    // a move, so a move is within reach if both ends are.
+    static double reach_margin (double const *p)
+    {
+        double towers[3][2] = {
+            {DeltaTower1X::value(), DeltaTower1Y::value()},
+            {DeltaTower2X::value(), DeltaTower2Y::value()},
+            {DeltaTower3X::value(), DeltaTower3Y::value()}
+        };
+        double margin = INFINITY;
+        for (int i = 0; i < 3; i++) {
+            margin = fmin(margin, DeltaDiagonalRod::value() - hypot(towers[i][0] - p[0], towers[i][1] - p[1]));
+        }
+        return margin;
+    }
+    
+    static void random_point (uint32_t *seed, double *p)
+    {
+        for (int i = 0; i < 3; i++) {
+            *seed = *seed * 1103515245 + 12345;
+            double r = (double)(*seed >> 8) / (1 << 24);
+            p[i] = (i < 2) ? (r * 320.0 - 160.0) : (r * 200.0);
+        }
+    }
+};
+
+struct HalfDelta {
+    static int const NumAxes = 2;
+    
+    template <typename FpType>
+    using Transform = TheHalfDeltaTransform<FpType>;
+    
+    static double reach_margin (double const *p)
+    {
+        return HalfDeltaDiagonalRod::value() - fmax(fabs(HalfDeltaTower1X::value() - p[0]), fabs(HalfDeltaTower2X::value() - p[0]));
+    }
+    
+    static void random_point (uint32_t *seed, double *p)
+    {
+        for (int i = 0; i < 2; i++) {
+            *seed = *seed * 1103515245 + 12345;
+            double r = (double)(*seed >> 8) / (1 << 24);
+            p[i] = (i < 1) ? (r * 100.0 - 50.0) : (r * 200.0);
+        }
+    }
+};
+
+struct Identity {
+    static int const NumAxes = 3;
+    
+    template <typename FpType>
+    using Transform = TheIdentityTransform<FpType>;
+    
+    static double reach_margin (double const *p)
+    {
+        return INFINITY;
+    }
+    
+    static void random_point (uint32_t *seed, double *p)
+    {
+        Delta::random_point(seed, p);
+    }
+};
+
+// Returns the largest difference between LineEvaluator and virtToPhys over
+// the split points of a move from old_pos to end_pos.
+template <typename Geometry, typename FpType>
+static double compare_move (double const *old_pos, double const *end_pos, double segment_length, uint32_t *num_points)
+{
+    static int const NumAxes = Geometry::NumAxes;
+    using Transform = typename Geometry::template Transform<FpType>;
+    
+    FpType old_virt[NumAxes];
+    FpType delta_virt[NumAxes];
+    double distance2 = 0.0;
+    for (int i = 0; i < NumAxes; i++) {
+        old_virt[i] = old_pos[i];
+        delta_virt[i] = (FpType)end_pos[i] - old_virt[i];
+        distance2 += (double)delta_virt[i] * delta_virt[i];
+    }
+    uint32_t count = 1 + (uint32_t)(sqrt(distance2) / segment_length);
+    
+    typename Transform::LineEvaluator line;
+    line.start(ArraySrc<FpType>{old_virt}, ArraySrc<FpType>{delta_virt});
+    double max_diff = 0.0;
+    for (uint32_t k = 1; k < count; k++) {
+        FpType frac = (FpType)k / count;
+        FpType virt[NumAxes];
+        for (int i = 0; i < NumAxes; i++) {
+            virt[i] = old_virt[i] + frac * delta_virt[i];
+        }
+        FpType exact[NumAxes];
+        Transform::virtToPhys(ArraySrc<FpType>{virt}, ArrayDst<FpType>{exact});
+        FpType incremental[NumAxes];
+        line.evaluate(frac, ArrayDst<FpType>{incremental});
+        for (int i = 0; i < NumAxes; i++) {
+            max_diff = fmax(max_diff, fabs((double)incremental[i] - exact[i]));
+            if (isnan(incremental[i])) {
+                max_diff = INFINITY;
+            }
+        }
+    }
+    *num_points += count - 1;
+    return max_diff;
+}
+
+template <typename Geometry, typename FpType>
+static void test_line_evaluator (char const *name, double segment_length, double tolerance)
+{
+    double const min_margin = 0.5;
+    double max_diff = 0.0;
+    uint32_t num_moves = 0;
+    uint32_t num_points = 0;
+    uint32_t seed = 1;
+    double old_pos[Geometry::NumAxes];
+    double end_pos[Geometry::NumAxes];
+    do {
+        Geometry::random_point(&seed, old_pos);
+    } while (Geometry::reach_margin(old_pos) < min_margin);
+    while (num_moves < 20000) {
+        Geometry::random_point(&seed, end_pos);
+        if (Geometry::reach_margin(end_pos) < min_margin) {
+            continue;
+        }
+        max_diff = fmax(max_diff, compare_move<Geometry, FpType>(old_pos, end_pos, segment_length, &num_points));
+        for (int i = 0; i < Geometry::NumAxes; i++) {
+            old_pos[i] = end_pos[i];
+        }
+        num_moves++;
+    }
+    bool ok = (max_diff <= tolerance);
+    printf("%s %s, %g mm segments: %lu points, largest difference %.3g mm\n", ok ? "ok  " : "FAIL", name, segment_length, (unsigned long)num_points, max_diff);
+    if (!ok) {
+        failures++;
+    }
+}
+
+template <typename Geometry>
+static void test_geometry (char const *name, double float_tolerance, double double_tolerance)
+{
+    double const segment_lengths[] = {0.1, 1.0, 4.0};
+    for (double segment_length : segment_lengths) {
+        char full_name[64];
+        snprintf(full_name, sizeof(full_name), "%s, float", name);
+        test_line_evaluator<Geometry, float>(full_name, segment_length, float_tolerance);
+        snprintf(full_name, sizeof(full_name), "%s, double", name);
+        test_line_evaluator<Geometry, double>(full_name, segment_length, double_tolerance);
+    }
+}
+
+int main ()
+{
+    test_geometry<Delta>("delta", 1e-3, 1e-4);
+    test_geometry<HalfDelta>("half delta", 1e-3, 1e-4);
+    test_geometry<Identity>("identity", 0.0, 0.0);
+    
+    if (failures > 0) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
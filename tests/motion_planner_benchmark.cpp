@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures the time spent in MotionPlanner::plan() as a function of the
+ * lookahead depth, running the planner and steppers on the host platform.
+ * Two paths are planned: a zigzag, where every junction limits the speed,
+ * and a straight line of short segments, where the backward pass has to
+ * cover the whole braking distance.
+ *
+ * Build and run from the top directory:
+ *   g++ -std=c++11 -O2 -DF_CPU=96000000 -DNDEBUG -I. \
+ *       tests/motion_planner_benchmark.cpp aprinter/platform/linux/linux_support.cpp \
+ *       -o motion_planner_benchmark && ./motion_planner_benchmark
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <aprinter/platform/linux/linux_support.h>
+
+#define AMBROLIB_ABORT_ACTION { ::abort(); }
+#define AMBROLIB_SUPPORT_QUIT
+#define MOTIONPLANNER_BENCHMARK
+
+#include <aprinter/meta/MakeTypeList.h>
+#include <aprinter/meta/JoinTypeLists.h>
+#include <aprinter/meta/TupleGet.h>
+#include <aprinter/meta/WrapDouble.h>
+#include <aprinter/meta/WrapFunction.h>
+#include <aprinter/meta/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/system/BusyEventLoop.h>
+#include <aprinter/system/LinuxClock.h>
+#include <aprinter/system/LinuxPins.h>
+#include <aprinter/stepper/Steppers.h>
+#include <aprinter/stepper/AxisStepper.h>
+#include <aprinter/printer/MotionPlanner.h>
+
+using namespace APrinter;
+
+static int const NumSegments = 400;
+static int const SegmentSteps = 20;
+static double const MaxSpeed = 2e4; // steps/s
+static double const MaxAccel = 5e5; // steps/s^2
+
+using CorneringDistance = AMBRO_WRAP_DOUBLE(40.0);
+using DistanceFactor = AMBRO_WRAP_DOUBLE(0.01);
+
+struct MyContext;
+struct Program;
+
+static void bench_done (MyContext c);
+
+template <typename Context, typename ParentObject, int LookaheadBufferSize, bool Zigzag>
+class PlannerBench {
+public:
+    struct Object;
+    
+private:
+    using Clock = typename Context::Clock;
+    
+    struct PullHandler;
+    struct FinishedHandler;
+    struct AbortedHandler;
+    struct UnderrunCallback;
+    template <int AxisIndex> struct PrestepCallback;
+    template <int AxisIndex> struct ConsumersList;
+    
+    using TheSteppers = Steppers<Context, Object, MakeTypeList<
+        StepperDef<LinuxPin<0>, LinuxPin<1>, LinuxPin<2>, false>,
+        StepperDef<LinuxPin<3>, LinuxPin<4>, LinuxPin<5>, false>
+    >, SteppersNoTraceParams>;
+    
+    template <int AxisIndex>
+    using TheAxisStepper = AxisStepper<Context, Object, AxisStepperParams<LinuxClockInterruptTimer, AxisStepperDuePrecisionParams, AxisStepperNoPrecomputeParams>, typename TheSteppers::template Stepper<AxisIndex>, ConsumersList<AxisIndex>>;
+    
+    template <int AxisIndex>
+    using PlannerAxis = MotionPlannerAxisSpec<TheAxisStepper<AxisIndex>, 32, DistanceFactor, CorneringDistance, PrestepCallback<AxisIndex>, MotionPlannerNoAdvanceParams>;
+    
+    static int const CommitCount = (LookaheadBufferSize / 3 > 1) ? LookaheadBufferSize / 3 : 1;
+    
+    using ThePlanner = MotionPlanner<Context, Object, MakeTypeList<PlannerAxis<0>, PlannerAxis<1>>, CommitCount + 22, LookaheadBufferSize, CommitCount, double, PullHandler, FinishedHandler, AbortedHandler, UnderrunCallback>;
+    
+public:
+    using EventLoopFastEvents = typename ThePlanner::EventLoopFastEvents;
+    
+    static void start (Context c)
+    {
+        auto *o = Object::self(c);
+        o->m_pulled = 0;
+        o->m_underruns = 0;
+        TheSteppers::init(c);
+        TheAxisStepper<0>::init(c);
+        TheAxisStepper<1>::init(c);
+        ThePlanner::init(c, false);
+    }
+    
+    static void stop (Context c)
+    {
+        ThePlanner::deinit(c);
+        TheAxisStepper<1>::deinit(c);
+        TheAxisStepper<0>::deinit(c);
+        TheSteppers::deinit(c);
+    }
+    
+private:
+    template <int AxisIndex>
+    static void write_axis (Context c, bool dir, int steps)
+    {
+        auto *axis = TupleGetElem<AxisIndex>(&ThePlanner::getBuffer(c)->axes);
+        axis->dir = dir;
+        axis->x = decltype(axis->x)::importBits(steps);
+        axis->max_v_rec = Clock::time_freq / MaxSpeed;
+        axis->max_a_rec = (Clock::time_freq * Clock::time_freq) / MaxAccel;
+    }
+    
+    static void pull_handler (Context c)
+    {
+        auto *o = Object::self(c);
+        if (o->m_pulled == NumSegments) {
+            ThePlanner::waitFinished(c);
+            return;
+        }
+        int y_steps = Zigzag ? SegmentSteps : SegmentSteps / 2;
+        bool y_dir = Zigzag ? (o->m_pulled % 2) : true;
+        write_axis<0>(c, true, SegmentSteps);
+        write_axis<1>(c, y_dir, y_steps);
+        ThePlanner::getBuffer(c)->rel_max_v_rec = FloatSqrt((double)SegmentSteps * SegmentSteps + (double)y_steps * y_steps) * (Clock::time_freq / MaxSpeed);
+        o->m_pulled++;
+        ThePlanner::axesCommandDone(c);
+    }
+    
+    static void finished_handler (Context c)
+    {
+        auto *o = Object::self(c);
+        uint32_t plans = ThePlanner::getBenchPlans(c);
+        double plan_us = ThePlanner::getBenchTime(c) * Clock::time_unit * 1e6;
+        printf("%-8s %9d %7lu %13.3f %16.2f %10lu\n",
+               Zigzag ? "zigzag" : "line", LookaheadBufferSize, (unsigned long)plans,
+               plan_us / plans, (double)ThePlanner::getBenchPushes(c) / plans, (unsigned long)o->m_underruns);
+        bench_done(c);
+    }
+    
+    static void aborted_handler (Context c)
+    {
+    }
+    
+    static void underrun_callback (Context c)
+    {
+        auto *o = Object::self(c);
+        o->m_underruns++;
+    }
+    
+    template <int AxisIndex>
+    static bool prestep_callback (typename ThePlanner::template Axis<AxisIndex>::StepperCommandCallbackContext c)
+    {
+        return false;
+    }
+    
+    struct PullHandler : public AMBRO_WFUNC_TD(&PlannerBench::pull_handler) {};
+    struct FinishedHandler : public AMBRO_WFUNC_TD(&PlannerBench::finished_handler) {};
+    struct AbortedHandler : public AMBRO_WFUNC_TD(&PlannerBench::aborted_handler) {};
+    struct UnderrunCallback : public AMBRO_WFUNC_TD(&PlannerBench::underrun_callback) {};
+    template <int AxisIndex> struct PrestepCallback : public AMBRO_WFUNC_TD(&PlannerBench::template prestep_callback<AxisIndex>) {};
+    template <int AxisIndex> struct ConsumersList {
+        using List = MakeTypeList<typename ThePlanner::template TheAxisStepperConsumer<AxisIndex>>;
+    };
+    
+public:
+    struct Object : public ObjBase<PlannerBench, ParentObject, MakeTypeList<
+        TheSteppers,
+        TheAxisStepper<0>,
+        TheAxisStepper<1>,
+        ThePlanner
+    >> {
+        int m_pulled;
+        uint32_t m_underruns;
+    };
+};
+
+// Virtual time follows host time, so plan() durations are real.
+using ClockCpuSlowdown = AMBRO_WRAP_DOUBLE(1.0);
+using ClockParams = LinuxClockParams<1, 1, ClockCpuSlowdown>;
+
+struct MyLoopExtraDelay;
+
+using MyDebugObjectGroup = DebugObjectGroup<MyContext, Program>;
+using MyClock = LinuxClock<MyContext, Program, ClockParams>;
+using MyLoop = BusyEventLoop<MyContext, Program, MyLoopExtraDelay>;
+using MyPins = LinuxPins<MyContext, Program>;
+
+using Bench1 = PlannerBench<MyContext, Program, 8, true>;
+using Bench2 = PlannerBench<MyContext, Program, 16, true>;
+using Bench3 = PlannerBench<MyContext, Program, 32, true>;
+using Bench4 = PlannerBench<MyContext, Program, 64, true>;
+using Bench5 = PlannerBench<MyContext, Program, 8, false>;
+using Bench6 = PlannerBench<MyContext, Program, 16, false>;
+using Bench7 = PlannerBench<MyContext, Program, 32, false>;
+using Bench8 = PlannerBench<MyContext, Program, 64, false>;
+
+struct MyContext {
+    using DebugGroup = MyDebugObjectGroup;
+    using Clock = MyClock;
+    using EventLoop = MyLoop;
+    using Pins = MyPins;
+    
+    void check () const;
+};
+
+using MyLoopExtra = BusyEventLoopExtra<Program, MyLoop, JoinTypeLists<
+    typename Bench1::EventLoopFastEvents,
+    typename Bench2::EventLoopFastEvents,
+    typename Bench3::EventLoopFastEvents,
+    typename Bench4::EventLoopFastEvents,
+    typename Bench5::EventLoopFastEvents,
+    typename Bench6::EventLoopFastEvents,
+    typename Bench7::EventLoopFastEvents,
+    typename Bench8::EventLoopFastEvents
+>>;
+struct MyLoopExtraDelay : public WrapType<MyLoopExtra> {};
+
+struct Program : public ObjBase<void, void, MakeTypeList<
+    MyDebugObjectGroup,
+    MyClock,
+    MyLoop,
+    MyPins,
+    Bench1, Bench2, Bench3, Bench4, Bench5, Bench6, Bench7, Bench8,
+    MyLoopExtra
+>> {
+    static Program * self (MyContext c);
+};
+
+Program p;
+
+Program * Program::self (MyContext c) { return &p; }
+void MyContext::check () const {}
+
+struct BenchFuncs {
+    void (*start) (MyContext c);
+    void (*stop) (MyContext c);
+};
+
+static BenchFuncs const benches[] = {
+    {Bench1::start, Bench1::stop}, {Bench2::start, Bench2::stop},
+    {Bench3::start, Bench3::stop}, {Bench4::start, Bench4::stop},
+    {Bench5::start, Bench5::stop}, {Bench6::start, Bench6::stop},
+    {Bench7::start, Bench7::stop}, {Bench8::start, Bench8::stop},
+};
+static int const num_benches = sizeof(benches) / sizeof(benches[0]);
+
+static int current_bench;
+static MyLoop::QueuedEvent next_event;
+
+static void bench_done (MyContext c)
+{
+    next_event.prependNowNotAlready(c);
+}
+
+static void next_event_handler (MyLoop::QueuedEvent *, MyContext c)
+{
+    benches[current_bench].stop(c);
+    if (++current_bench == num_benches) {
+        MyLoop::quit(c);
+        return;
+    }
+    benches[current_bench].start(c);
+}
+
+int main ()
+{
+    MyContext c;
+    
+    MyDebugObjectGroup::init(c);
+    MyClock::init(c);
+    MyLoop::init(c);
+    MyPins::init(c);
+    next_event.init(c, next_event_handler);
+    
+    printf("path     lookahead   plans  plan time(us)  pushes per plan  underruns\n");
+    current_bench = 0;
+    benches[current_bench].start(c);
+    
+    MyLoop::run(c);
+    
+    return 0;
+}
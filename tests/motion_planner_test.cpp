@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2013 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Runs MotionPlanner and the steppers on the host platform with the
+ * deterministic simulated clock, records the time of every step from the
+ * prestep callback, and checks the motion derived from the step times.
+ * The peak acceleration of a long move, fitted to the step times over
+ * windows of steps, must come within a few percent of MaxAccel. The upper
+ * bound only leaves room for the quantization of step times.
+ * With pressure advance on the second axis, a short move that starts and
+ * stops it abruptly must keep its step rate within MaxSpeed, and its net
+ * steps must come out exact.
+ *
+ * Build and run from the top directory:
+ *   g++ -std=c++11 -O2 -DF_CPU=96000000 -I. \
+ *       tests/motion_planner_test.cpp aprinter/platform/linux/linux_support.cpp \
+ *       -o motion_planner_test && ./motion_planner_test
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <aprinter/platform/linux/linux_support.h>
+
+#define AMBROLIB_ABORT_ACTION { ::abort(); }
+#define AMBROLIB_SUPPORT_QUIT
+
+#include <aprinter/meta/MakeTypeList.h>
+#include <aprinter/meta/JoinTypeLists.h>
+#include <aprinter/meta/If.h>
+#include <aprinter/meta/TupleGet.h>
+#include <aprinter/meta/WrapDouble.h>
+#include <aprinter/meta/WrapFunction.h>
+#include <aprinter/meta/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/system/BusyEventLoop.h>
+#include <aprinter/system/LinuxClock.h>
+#include <aprinter/system/LinuxPins.h>
+#include <aprinter/stepper/Steppers.h>
+#include <aprinter/stepper/AxisStepper.h>
+#include <aprinter/printer/MotionPlanner.h>
+
+using namespace APrinter;
+
+static int const NumAxes = 2;
+static int const MaxSteps = 100000;
+static double const MaxSpeed = 2e4; // steps/s
+static double const MaxAccel = 5e5; // steps/s^2
+
+using CorneringDistance = AMBRO_WRAP_DOUBLE(40.0);
+using DistanceFactor = AMBRO_WRAP_DOUBLE(0.01);
+
+struct MyContext;
+struct Program;
+
+static void test_done (MyContext c);
+
+static int failures = 0;
+
+// Steps of each axis, along with a speed limit for the move in steps/s
+// of the total distance.
+struct TestMove {
+    int steps[NumAxes];
+    double speed;
+};
+
+// Step times of an axis, in clock ticks, and its net steps.
+struct StepRecord {
+    uint32_t count;
+    int32_t net;
+    uint32_t times[MaxSteps];
+};
+
+static StepRecord records[NumAxes];
+
+// Largest acceleration in steps/s^2, from least-squares fits of the step
+// number as a quadratic function of time over windows of Window steps.
+// Single step times jitter by the resolution of the stepper's timing,
+// which a fit averages out better than differences of velocities.
+static double peak_accel (StepRecord const *rec, double time_freq)
+{
+    int const Window = 128;
+    double peak = 0.0;
+    for (uint32_t i = 0; i + Window <= rec->count; i += 4) {
+        double t_mid = rec->times[i + Window / 2];
+        double s[5] = {0.0, 0.0, 0.0, 0.0, 0.0};
+        double r[3] = {0.0, 0.0, 0.0};
+        for (int k = 0; k < Window; k++) {
+            double t = (double)rec->times[i + k] - t_mid;
+            double p = 1.0;
+            for (int j = 0; j < 5; j++) {
+                if (j < 3) {
+                    r[j] += k * p;
+                }
+                s[j] += p;
+                p *= t;
+            }
+        }
+        // Cramer's rule for the coefficient of t^2.
+        double det = s[0] * (s[2] * s[4] - s[3] * s[3]) - s[1] * (s[1] * s[4] - s[2] * s[3]) + s[2] * (s[1] * s[3] - s[2] * s[2]);
+        double det2 = s[0] * (s[2] * r[2] - s[3] * r[1]) - s[1] * (s[1] * r[2] - s[3] * r[0]) + s[2] * (s[1] * r[1] - s[2] * r[0]);
+        peak = fmax(peak, fabs(2.0 * det2 / det));
+    }
+    return peak * time_freq * time_freq;
+}
+
+// Largest step rate in steps/s, over windows of Window steps.
+static double peak_rate (StepRecord const *rec, double time_freq)
+{
+    int const Window = 16;
+    double peak = 0.0;
+    for (uint32_t i = 0; i + Window < rec->count; i++) {
+        peak = fmax(peak, Window / (double)(rec->times[i + Window] - rec->times[i]));
+    }
+    return peak * time_freq;
+}
+
+template <typename Context, typename ParentObject, typename Case>
+class PlannerTest {
+public:
+    struct Object;
+    
+private:
+    using Clock = typename Context::Clock;
+    
+    struct PullHandler;
+    struct FinishedHandler;
+    struct AbortedHandler;
+    struct UnderrunCallback;
+    template <int AxisIndex> struct PrestepCallback;
+    template <int AxisIndex> struct ConsumersList;
+    
+    template <int AxisIndex>
+    using TheStepperDef = StepperDef<LinuxPin<3 * AxisIndex>, LinuxPin<3 * AxisIndex + 1>, LinuxPin<3 * AxisIndex + 2>, false>;
+    
+    using TheSteppers = Steppers<Context, Object, MakeTypeList<TheStepperDef<0>, TheStepperDef<1>>, SteppersNoTraceParams>;
+    
+    template <int AxisIndex>
+    using TheAxisStepper = AxisStepper<Context, Object, AxisStepperParams<LinuxClockInterruptTimer, AxisStepperDuePrecisionParams, AxisStepperNoPrecomputeParams>, typename TheSteppers::template Stepper<AxisIndex>, ConsumersList<AxisIndex>>;
+    
+    template <int AxisIndex>
+    using PlannerAxis = MotionPlannerAxisSpec<TheAxisStepper<AxisIndex>, 32, DistanceFactor, CorneringDistance, PrestepCallback<AxisIndex>, typename Case::template AdvanceParams<AxisIndex>>;
+    
+    using ThePlanner = MotionPlanner<Context, Object, MakeTypeList<PlannerAxis<0>, PlannerAxis<1>>, 30, 16, 5, double, PullHandler, FinishedHandler, AbortedHandler, UnderrunCallback>;
+    
+public:
+    using EventLoopFastEvents = typename ThePlanner::EventLoopFastEvents;
+    
+    static void start (Context c)
+    {
+        auto *o = Object::self(c);
+        o->m_pulled = 0;
+        for (int i = 0; i < NumAxes; i++) {
+            records[i].count = 0;
+            records[i].net = 0;
+        }
+        TheSteppers::init(c);
+        TheAxisStepper<0>::init(c);
+        TheAxisStepper<1>::init(c);
+        ThePlanner::init(c, true);
+    }
+    
+    static void stop (Context c)
+    {
+        ThePlanner::deinit(c);
+        TheAxisStepper<1>::deinit(c);
+        TheAxisStepper<0>::deinit(c);
+        TheSteppers::deinit(c);
+    }
+    
+private:
+    template <int AxisIndex>
+    static void write_axis (Context c, int steps)
+    {
+        auto *axis = TupleGetElem<AxisIndex>(&ThePlanner::getBuffer(c)->axes);
+        axis->dir = (steps >= 0);
+        axis->x = decltype(axis->x)::importBits(abs(steps));
+        axis->max_v_rec = Clock::time_freq / MaxSpeed;
+        axis->max_a_rec = (Clock::time_freq * Clock::time_freq) / MaxAccel;
+    }
+    
+    static void pull_handler (Context c)
+    {
+        auto *o = Object::self(c);
+        if (o->m_pulled == Case::NumMoves) {
+            ThePlanner::waitFinished(c);
+            return;
+        }
+        TestMove const *move = &Case::moves[o->m_pulled];
+        write_axis<0>(c, move->steps[0]);
+        write_axis<1>(c, move->steps[1]);
+        double distance = hypot(move->steps[0], move->steps[1]);
+        ThePlanner::getBuffer(c)->rel_max_v_rec = distance * (Clock::time_freq / move->speed);
+        o->m_pulled++;
+        ThePlanner::axesCommandDone(c);
+    }
+    
+    static void finished_handler (Context c)
+    {
+        Case::check(Clock::time_freq);
+        test_done(c);
+    }
+    
+    static void aborted_handler (Context c)
+    {
+    }
+    
+    static void underrun_callback (Context c)
+    {
+    }
+    
+    template <int AxisIndex>
+    static bool prestep_callback (typename ThePlanner::template Axis<AxisIndex>::StepperCommandCallbackContext c)
+    {
+        StepRecord *rec = &records[AxisIndex];
+        rec->net += Context::Pins::template get<typename TheStepperDef<AxisIndex>::DirPin>(c) ? 1 : -1;
+        if (rec->count < MaxSteps) {
+            rec->times[rec->count++] = Clock::getTime(c);
+        }
+        return false;
+    }
+    
+    struct PullHandler : public AMBRO_WFUNC_TD(&PlannerTest::pull_handler) {};
+    struct FinishedHandler : public AMBRO_WFUNC_TD(&PlannerTest::finished_handler) {};
+    struct AbortedHandler : public AMBRO_WFUNC_TD(&PlannerTest::aborted_handler) {};
+    struct UnderrunCallback : public AMBRO_WFUNC_TD(&PlannerTest::underrun_callback) {};
+    template <int AxisIndex> struct PrestepCallback : public AMBRO_WFUNC_TD(&PlannerTest::template prestep_callback<AxisIndex>) {};
+    template <int AxisIndex> struct ConsumersList {
+        using List = MakeTypeList<typename ThePlanner::template TheAxisStepperConsumer<AxisIndex>>;
+    };
+    
+public:
+    struct Object : public ObjBase<PlannerTest, ParentObject, MakeTypeList<
+        TheSteppers,
+        TheAxisStepper<0>,
+        TheAxisStepper<1>,
+        ThePlanner
+    >> {
+        int m_pulled;
+    };
+};
+
+static TestMove const long_move[] = {
+    {{4000, 0}, MaxSpeed}
+};
+
+struct AccelCase {
+    template <int AxisIndex>
+    using AdvanceParams = MotionPlannerNoAdvanceParams;
+    static int const NumMoves = 1;
+    static constexpr TestMove const *moves = long_move;
+    
+    static void check (double time_freq)
+    {
+        double peak = peak_accel(&records[0], time_freq);
+        bool ok = (records[0].count == 4000 && peak <= 1.03 * MaxAccel && peak >= 0.95 * MaxAccel);
+        printf("%s accel: %lu steps, peak acceleration %.4g of MaxAccel\n", ok ? "ok  " : "FAIL",
+               (unsigned long)records[0].count, peak / MaxAccel);
+        if (!ok) {
+            failures++;
+        }
+    }
+};
+
+// A short move of the extruder along with X between moves of X alone.
+// Without a limit the advance would drive the extruder at almost twice
+// MaxSpeed here.
+static TestMove const advance_moves[] = {
+    {{2000, 0}, MaxSpeed},
+    {{400, 300}, MaxSpeed},
+    {{2000, 0}, MaxSpeed}
+};
+
+using AdvanceTime = AMBRO_WRAP_DOUBLE(0.05);
+
+struct AdvanceCase {
+    template <int AxisIndex>
+    using AdvanceParams = If<(AxisIndex == 1), MotionPlannerAdvanceParams<AdvanceTime>, MotionPlannerNoAdvanceParams>;
+    static int const NumMoves = 3;
+    static constexpr TestMove const *moves = advance_moves;
+    
+    static void check (double time_freq)
+    {
+        double peak = peak_rate(&records[1], time_freq);
+        bool ok = (records[1].net == 300 && peak <= 1.03 * MaxSpeed);
+        printf("%s advance: %ld net extruder steps, peak rate %.4g of MaxSpeed\n", ok ? "ok  " : "FAIL",
+               (long)records[1].net, peak / MaxSpeed);
+        if (!ok) {
+            failures++;
+        }
+    }
+};
+
+using ClockCpuSlowdown = AMBRO_WRAP_DOUBLE(0.0);
+using ClockParams = LinuxClockParams<32, 30, ClockCpuSlowdown>;
+
+struct MyLoopExtraDelay;
+
+using MyDebugObjectGroup = DebugObjectGroup<MyContext, Program>;
+using MyClock = LinuxClock<MyContext, Program, ClockParams>;
+using MyLoop = BusyEventLoop<MyContext, Program, MyLoopExtraDelay>;
+using MyPins = LinuxPins<MyContext, Program>;
+
+using Test1 = PlannerTest<MyContext, Program, AccelCase>;
+using Test2 = PlannerTest<MyContext, Program, AdvanceCase>;
+
+struct MyContext {
+    using DebugGroup = MyDebugObjectGroup;
+    using Clock = MyClock;
+    using EventLoop = MyLoop;
+    using Pins = MyPins;
+    
+    void check () const;
+};
+
+using MyLoopExtra = BusyEventLoopExtra<Program, MyLoop, JoinTypeLists<
+    typename Test1::EventLoopFastEvents,
+    typename Test2::EventLoopFastEvents
+>>;
+struct MyLoopExtraDelay : public WrapType<MyLoopExtra> {};
+
+struct Program : public ObjBase<void, void, MakeTypeList<
+    MyDebugObjectGroup,
+    MyClock,
+    MyLoop,
+    MyPins,
+    Test1, Test2,
+    MyLoopExtra
+>> {
+    static Program * self (MyContext c);
+};
+
+Program p;
+
+Program * Program::self (MyContext c) { return &p; }
+void MyContext::check () const {}
+
+struct TestFuncs {
+    void (*start) (MyContext c);
+    void (*stop) (MyContext c);
+};
+
+static TestFuncs const tests[] = {
+    {Test1::start, Test1::stop}, {Test2::start, Test2::stop},
+};
+static int const num_tests = sizeof(tests) / sizeof(tests[0]);
+
+static int current_test;
+static MyLoop::QueuedEvent next_event;
+
+static void test_done (MyContext c)
+{
+    next_event.prependNowNotAlready(c);
+}
+
+static void next_event_handler (MyLoop::QueuedEvent *, MyContext c)
+{
+    tests[current_test].stop(c);
+    if (++current_test == num_tests) {
+        MyLoop::quit(c);
+        return;
+    }
+    tests[current_test].start(c);
+}
+
+int main ()
+{
+    MyContext c;
+    
+    MyDebugObjectGroup::init(c);
+    MyClock::init(c);
+    MyLoop::init(c);
+    MyPins::init(c);
+    next_event.init(c, next_event_handler);
+    
+    current_test = 0;
+    tests[current_test].start(c);
+    
+    MyLoop::run(c);
+    
+    if (failures > 0) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}